@@ -88,7 +88,7 @@ void notification_function(NotificationType notification_type, const ModuleInter
     // Show an input value
     float exttemp = 0;
     interface.inputs.get_value(i_externaltemp_ix, exttemp);
-    if (interface.inputs.get_module_variable(i_externaltemp_ix).is_event())
+    if (interface.inputs.is_event(i_externaltemp_ix))
       printf("Incoming input EVENT, exttemp is %f\n", exttemp); 
     else
       printf("Incoming timer-based input, exttemp is %f\n", exttemp);
@@ -96,7 +96,7 @@ void notification_function(NotificationType notification_type, const ModuleInter
   else if (notification_type == ntNewSettings) {
     // New settings
     target = interface.settings.get_float(s_target_ix);
-    if (interface.settings.get_module_variable(s_target_ix).is_event()) {
+    if (interface.settings.is_event(s_target_ix)) {
       printf("Incoming setting EVENT, target = %g\n", target);
     } else
       printf("Incoming timer-based setting, target = %g\n", target);
@@ -0,0 +1,548 @@
+#pragma once
+
+// A local time-series store for the outputs of all modules, kept by a POSIX master in a directory.
+// It is added to the master as an external transfer, and samples all outputs after each transfer cycle.
+//
+// Each sample is added to min/max/mean rollups in four tiers with buckets of 1 minute, 10 minutes,
+// 1 hour and 1 day. Each tier is stored in segment files of MI_HISTORY_SEGMENT_BUCKETS buckets
+// (1 day for the 1 minute tier), which are memory-mapped while being written and never changed after
+// their time span has passed. Segments older than the retention time of the tier are deleted.
+// A segment is columnar, with the buckets of each series stored together, so that a query for one
+// series reads a contiguous range without scanning. The files are sparse, so series that are not
+// used do not take space on disk.
+//
+// The raw samples are also kept for a shorter time (2 days by default), compressed with the encoding
+// in MITimeSeriesCodec.h. Each series fills a block of MI_HISTORY_RAW_BLOCK_SIZE bytes in memory,
+// which is appended to a file for each day when it is full or MI_HISTORY_RAW_FLUSH_S has passed.
+//
+// The series (like "aaTemp") are listed in series.txt, one per line, in the order they were first
+// seen. A series keeps its position in the segments also if the module or output is removed.
+//
+// query returns a time range of a series at the finest resolution that gives at most the requested
+// number of points and is still kept for the start of the range.
+
+#include <MI/MITransferBase.h>
+#include <MI/MITimeSeriesCodec.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <math.h>
+
+#if defined(_WIN32) || defined(WIN32)
+  #error "MIHistoryStore is only supported on POSIX platforms"
+#endif
+
+#ifndef MI_HISTORY_MAX_SERIES
+  #define MI_HISTORY_MAX_SERIES 1024
+#endif
+#ifndef MI_HISTORY_SEGMENT_BUCKETS
+  #define MI_HISTORY_SEGMENT_BUCKETS 1440
+#endif
+#ifndef MI_HISTORY_RAW_BLOCK_SIZE
+  #define MI_HISTORY_RAW_BLOCK_SIZE 256
+#endif
+#ifndef MI_HISTORY_RAW_FLUSH_S
+  #define MI_HISTORY_RAW_FLUSH_S 600
+#endif
+#define MI_HISTORY_RAW_FILE_SPAN 86400
+#define MI_HISTORY_MAGIC 0x5448494D // "MIHT"
+#define MI_HISTORY_VERSION 1
+#define MI_HISTORY_NAME_LENGTH (MVAR_PREFIX_LENGTH + MVAR_MAX_NAME_LENGTH + 1)
+#define MI_HISTORY_HEADER_SIZE 64
+
+enum MIHistoryTier { mhTier1m, mhTier10m, mhTier1h, mhTier1d, mhTierCount, mhTierRaw = 0xFE, mhTierAuto = 0xFF };
+
+// A bucket of a tier, with the rollup of the samples within it
+struct MIHistoryBucket {
+  float min, max, mean;
+  uint32_t count;     // 0 if there are no samples in the bucket
+};
+
+// A point returned from a query, for the bucket starting at time (UTC), or a raw sample with count 1
+struct MIHistoryPoint {
+  uint32_t time;
+  float min, max, mean;
+  uint32_t count;
+};
+
+class MIHistoryStore : public MITransferBase {
+protected:
+  struct SegmentHeader {
+    uint32_t magic, version;
+    uint32_t step_s, start;    // Bucket length and start time (UTC) of the segment
+    uint32_t bucket_count, max_series;
+  };
+
+  // The segment of a tier being written
+  struct Segment {
+    int fd = -1;
+    uint8_t *data = NULL;
+    uint32_t size = 0, start = 0, max_series = 0;
+  };
+
+  // Header of a block of raw samples in a raw file, followed by length bytes of encoded samples
+  struct RawBlockHeader {
+    uint16_t series;
+    uint8_t type, reserved;
+    uint16_t count, length;
+    uint32_t first_time, last_time;
+  };
+
+  // The block of raw samples of a series being filled, with the header before the data as in the file
+  struct RawBlock {
+    RawBlockHeader header;
+    uint8_t data[MI_HISTORY_RAW_BLOCK_SIZE];
+    MITimeSeriesEncoder encoder;
+    RawBlock(const uint16_t series, const ModuleVariableType type) : encoder(data, sizeof data, type) {
+      memset(&header, 0, sizeof header);
+      header.series = series;
+      header.type = (uint8_t) type;
+    }
+  };
+
+  // The series of the outputs of a module, found again when its outputs contract changes
+  struct ModuleSeries {
+    uint32_t outputs_id = 0;
+    uint16_t *series = NULL;
+    ~ModuleSeries() { if (series) delete[] series; }
+  };
+
+  // Configuration
+  char directory[128];
+  uint16_t max_series;
+  uint32_t retention_s[mhTierCount] = { 7 * 86400ul, 90 * 86400ul, 2 * 365 * 86400ul, 0 }; // 0 to keep forever
+  uint32_t raw_retention_s = 2 * 86400ul;
+
+  // State
+  bool started = false;
+  char (*names)[MI_HISTORY_NAME_LENGTH] = NULL; // Name of each series
+  uint16_t series_count = 0;
+  uint32_t dropped_series = 0, write_errors = 0;
+  Segment segments[mhTierCount];
+  ModuleSeries *module_series = NULL;
+  mi_module_ix_t module_series_count = 0;
+  RawBlock **raw_blocks = NULL;   // The block being filled for each series, NULL if none
+  uint32_t raw_file_start = 0, last_raw_check = 0;
+
+  static uint32_t get_segment_span(const uint8_t tier) { return get_step(tier) * MI_HISTORY_SEGMENT_BUCKETS; }
+
+  void get_segment_path(const uint8_t tier, const uint32_t start, char *path, const uint16_t size) const {
+    snprintf(path, size, "%s/%s_%u.seg", directory, get_tier_name(tier), start);
+  }
+
+  void close_segment(Segment &s) {
+    if (s.data) { msync(s.data, s.size, MS_ASYNC); munmap(s.data, s.size); }
+    if (s.fd >= 0) close(s.fd);
+    s.fd = -1;
+    s.data = NULL;
+    s.size = s.start = s.max_series = 0;
+  }
+
+  // Map the segment of a tier starting at the given time, creating it if not present
+  bool open_segment(const uint8_t tier, const uint32_t start) {
+    Segment &s = segments[tier];
+    close_segment(s);
+    char path[160];
+    get_segment_path(tier, start, path, sizeof path);
+    s.fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (s.fd < 0) return false;
+    SegmentHeader h;
+    struct stat st;
+    if (fstat(s.fd, &st) == 0 && st.st_size >= (off_t) sizeof h && pread(s.fd, &h, sizeof h, 0) == (ssize_t) sizeof h) {
+      if (h.magic != MI_HISTORY_MAGIC || h.version != MI_HISTORY_VERSION || h.step_s != get_step(tier) ||
+          h.start != start || h.bucket_count != MI_HISTORY_SEGMENT_BUCKETS || h.max_series > 0xFFFF) {
+        close_segment(s); return false;
+      }
+      // A file cut short, like by a full disk, is extended with empty buckets, as mapping past its end gives SIGBUS
+      off_t size = (off_t) MI_HISTORY_HEADER_SIZE + (off_t) h.max_series * MI_HISTORY_SEGMENT_BUCKETS * sizeof(MIHistoryBucket);
+      if (st.st_size < size && ftruncate(s.fd, size) != 0) { close_segment(s); return false; }
+    } else { // New segment, sized for the current max number of series
+      h.magic = MI_HISTORY_MAGIC;
+      h.version = MI_HISTORY_VERSION;
+      h.step_s = get_step(tier);
+      h.start = start;
+      h.bucket_count = MI_HISTORY_SEGMENT_BUCKETS;
+      h.max_series = max_series;
+      uint32_t size = MI_HISTORY_HEADER_SIZE + (uint32_t) h.max_series * MI_HISTORY_SEGMENT_BUCKETS * sizeof(MIHistoryBucket);
+      if (ftruncate(s.fd, size) != 0 || pwrite(s.fd, &h, sizeof h, 0) != (ssize_t) sizeof h) { close_segment(s); return false; }
+      apply_retention(tier, start);
+    }
+    s.size = MI_HISTORY_HEADER_SIZE + h.max_series * MI_HISTORY_SEGMENT_BUCKETS * sizeof(MIHistoryBucket);
+    void *p = mmap(NULL, s.size, PROT_READ | PROT_WRITE, MAP_SHARED, s.fd, 0);
+    if (p == MAP_FAILED) { s.data = NULL; close_segment(s); return false; }
+    s.data = (uint8_t*) p;
+    s.start = start;
+    s.max_series = h.max_series;
+    return true;
+  }
+
+  // Delete the files of a tier that have passed the retention time
+  void apply_retention(const uint8_t tier, const uint32_t now) {
+    uint32_t retention = tier == mhTierRaw ? raw_retention_s : retention_s[tier];
+    uint32_t span = tier == mhTierRaw ? MI_HISTORY_RAW_FILE_SPAN : get_segment_span(tier);
+    if (retention == 0 || now < retention) return;
+    DIR *dir = opendir(directory);
+    if (dir == NULL) return;
+    char prefix[8], path[sizeof directory + 256];
+    snprintf(prefix, sizeof prefix, "%s_", get_tier_name(tier));
+    uint8_t len = (uint8_t) strlen(prefix);
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+      if (strncmp(e->d_name, prefix, len) != 0) continue;
+      uint32_t start = (uint32_t) strtoul(&e->d_name[len], NULL, 10);
+      if (start + span <= now - retention) {
+        snprintf(path, sizeof path, "%s/%s", directory, e->d_name);
+        unlink(path);
+      }
+    }
+    closedir(dir);
+  }
+
+  void set_name(const uint16_t series, const char *name) {
+    size_t len = strnlen(name, MI_HISTORY_NAME_LENGTH - 1);
+    memcpy(names[series], name, len);
+    names[series][len] = 0;
+  }
+
+  // Find or add a series, returning max_series if there is no room for it
+  uint16_t get_series(const char *name) {
+    for (uint16_t i = 0; i < series_count; i++) if (strcmp(names[i], name) == 0) return i;
+    if (series_count >= max_series) { dropped_series++; return max_series; }
+    char path[160];
+    snprintf(path, sizeof path, "%s/series.txt", directory);
+    FILE *f = fopen(path, "a");
+    if (f == NULL) return max_series;
+    fprintf(f, "%s\n", name);
+    fclose(f);
+    set_name(series_count, name);
+    return series_count++;
+  }
+
+  bool load_series() {
+    char path[160], line[64];
+    snprintf(path, sizeof path, "%s/series.txt", directory);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return true; // A new store
+    while (series_count < max_series && fgets(line, sizeof line, f)) {
+      line[strcspn(line, "\r\n")] = 0;
+      set_name(series_count++, line);
+    }
+    fclose(f);
+    return true;
+  }
+
+  void deallocate_module_series() {
+    if (module_series) delete[] module_series;
+    module_series = NULL;
+    module_series_count = 0;
+  }
+
+  // Get the series of each output of a module
+  const uint16_t *get_module_series(const mi_module_ix_t ix) {
+    if (module_series_count != interfaces.num_interfaces) {
+      deallocate_module_series();
+      module_series = new ModuleSeries[interfaces.num_interfaces ? interfaces.num_interfaces : 1];
+      if (module_series == NULL) { mvs_out_of_memory = true; return NULL; }
+      module_series_count = interfaces.num_interfaces;
+    }
+    ModuleSeries &ms = module_series[ix];
+    const ModuleInterface &mi = *interfaces[ix];
+    if (ms.series == NULL || ms.outputs_id != mi.outputs.get_contract_id()) {
+      if (ms.series) delete[] ms.series;
+      ms.series = new uint16_t[mi.outputs.get_num_variables() + 1];
+      if (ms.series == NULL) { mvs_out_of_memory = true; return NULL; }
+      ms.outputs_id = mi.outputs.get_contract_id();
+      char name[MI_HISTORY_NAME_LENGTH];
+      for (uint8_t i = 0; i < mi.outputs.get_num_variables(); i++) {
+        mi.outputs.get_prefixed_name(i, mi.get_prefix(), name, sizeof name);
+        ms.series[i] = get_series(name);
+      }
+    }
+    return ms.series;
+  }
+
+  void add_to_bucket(const uint8_t tier, const uint16_t series, const uint32_t utc, const float value) {
+    uint32_t start = utc - utc % get_segment_span(tier);
+    Segment &s = segments[tier];
+    if (s.data == NULL || s.start != start) {
+      if (!open_segment(tier, start)) return;
+    }
+    if (series >= s.max_series) return; // Added after the segment was created with a lower max
+    MIHistoryBucket &b = ((MIHistoryBucket*) (s.data + MI_HISTORY_HEADER_SIZE))
+      [(uint32_t) series * MI_HISTORY_SEGMENT_BUCKETS + (utc - start) / get_step(tier)];
+    if (b.count == 0) b.min = b.max = b.mean = value;
+    else {
+      if (value < b.min) b.min = value;
+      if (value > b.max) b.max = value;
+      b.mean += (value - b.mean) / (float) (b.count + 1);
+    }
+    b.count++;
+  }
+
+  void get_raw_path(const uint32_t start, char *path, const uint16_t size) const {
+    snprintf(path, size, "%s/raw_%u.blk", directory, start);
+  }
+
+  // Append the block of a series to the raw file of its day, and start a new block
+  void write_raw_block(const uint16_t series) {
+    RawBlock *b = raw_blocks[series];
+    if (b == NULL) return;
+    raw_blocks[series] = NULL;
+    b->header.count = b->encoder.get_count();
+    b->header.length = b->encoder.get_length();
+    uint32_t start = b->header.first_time - b->header.first_time % MI_HISTORY_RAW_FILE_SPAN;
+    char path[160];
+    get_raw_path(start, path, sizeof path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd >= 0) {
+      ssize_t length = (ssize_t) (sizeof(RawBlockHeader) + b->header.length);
+      if (write(fd, &b->header, (size_t) length) != length) write_errors++;
+      close(fd);
+    }
+    delete b;
+    if (start != raw_file_start) {
+      raw_file_start = start;
+      apply_retention(mhTierRaw, start);
+    }
+  }
+
+  void add_raw(const uint16_t series, const uint32_t utc, const uint32_t raw, const ModuleVariableType type) {
+    RawBlock *b = raw_blocks[series];
+    if (b && (b->header.type != type || utc < b->header.last_time ||
+              utc / MI_HISTORY_RAW_FILE_SPAN != b->header.first_time / MI_HISTORY_RAW_FILE_SPAN)) {
+      write_raw_block(series); // Each block has one type, increasing times and is within one file
+      b = NULL;
+    }
+    if (b && !b->encoder.add(utc, raw)) { write_raw_block(series); b = NULL; } // Full
+    if (b == NULL) {
+      b = raw_blocks[series] = new RawBlock(series, type);
+      if (b == NULL) { mvs_out_of_memory = true; return; }
+      b->header.first_time = utc;
+      b->encoder.add(utc, raw);
+    }
+    b->header.last_time = utc;
+  }
+
+  // Write the blocks that have not been written for a while, also for series no longer sampled
+  void write_old_raw_blocks(const uint32_t utc) {
+    for (uint16_t i = 0; i < series_count; i++)
+      if (raw_blocks[i] && utc - raw_blocks[i]->header.first_time >= MI_HISTORY_RAW_FLUSH_S) write_raw_block(i);
+  }
+
+  void add_series_sample(const uint16_t series, const uint32_t utc, const uint32_t raw, const ModuleVariableType type) {
+    float value = ModuleVariable::get_as_float(type, &raw);
+    if (value == -999.25f || !isfinite(value)) return; // Marker for missing value
+    add_raw(series, utc, raw, type);
+    for (uint8_t t = 0; t < mhTierCount; t++) add_to_bucket(t, series, utc, value);
+  }
+
+  static void decode_raw(const RawBlockHeader &h, const uint8_t *data, const uint32_t from, const uint32_t to,
+                         MIHistoryPoint *points, uint16_t &count, const uint16_t max_points) {
+    MITimeSeriesDecoder decoder(data, h.length, (ModuleVariableType) h.type, h.count);
+    uint32_t time, raw;
+    while (count < max_points && decoder.next(time, raw)) {
+      if (time < from || time > to) continue;
+      MIHistoryPoint &p = points[count++];
+      p.time = time;
+      p.min = p.max = p.mean = ModuleVariable::get_as_float((ModuleVariableType) h.type, &raw);
+      p.count = 1;
+    }
+  }
+
+  uint16_t query_raw(const uint16_t series, const uint32_t from, const uint32_t to, MIHistoryPoint *points,
+                     const uint16_t max_points) const {
+    uint16_t count = 0;
+    RawBlockHeader h;
+    uint8_t data[MI_HISTORY_RAW_BLOCK_SIZE];
+    char path[160];
+    for (uint32_t start = from - from % MI_HISTORY_RAW_FILE_SPAN; start <= to && count < max_points; start += MI_HISTORY_RAW_FILE_SPAN) {
+      get_raw_path(start, path, sizeof path);
+      int fd = open(path, O_RDONLY);
+      if (fd < 0) continue;
+      for (off_t pos = 0; count < max_points && pread(fd, &h, sizeof h, pos) == (ssize_t) sizeof h; pos += sizeof h + h.length) {
+        if (h.length > MI_HISTORY_RAW_BLOCK_SIZE) break; // Not a valid block
+        if (h.series != series || h.last_time < from || h.first_time > to) continue;
+        if (pread(fd, data, h.length, pos + sizeof h) != (ssize_t) h.length) break;
+        decode_raw(h, data, from, to, points, count, max_points);
+      }
+      close(fd);
+      if (start > UINT32_MAX - MI_HISTORY_RAW_FILE_SPAN) break;
+    }
+    const RawBlock *b = raw_blocks[series]; // Samples not written yet
+    if (b && b->header.last_time >= from && b->header.first_time <= to) {
+      h = b->header;
+      h.count = b->encoder.get_count();
+      h.length = b->encoder.get_length();
+      decode_raw(h, b->data, from, to, points, count, max_points);
+    }
+    return count;
+  }
+
+public:
+  MIHistoryStore(ModuleInterfaceSet &module_interface_set, const char *directory_path,
+                 const uint16_t max_series_count = MI_HISTORY_MAX_SERIES) :
+    MITransferBase(module_interface_set), max_series(max_series_count) {
+    strncpy(directory, directory_path, sizeof directory - 1);
+    directory[sizeof directory - 1] = 0;
+  }
+
+  ~MIHistoryStore() { stop(); }
+
+  // Create the directory if needed and read the list of series. Returns false if the directory cannot be used.
+  bool begin() {
+    stop();
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) return false;
+    names = new char[max_series ? max_series : 1][MI_HISTORY_NAME_LENGTH];
+    raw_blocks = new RawBlock*[max_series ? max_series : 1];
+    if (names == NULL || raw_blocks == NULL) { mvs_out_of_memory = true; return false; }
+    memset(raw_blocks, 0, (max_series ? max_series : 1) * sizeof(RawBlock*));
+    started = load_series();
+    return started;
+  }
+
+  void stop() {
+    for (uint8_t t = 0; t < mhTierCount; t++) close_segment(segments[t]);
+    deallocate_module_series();
+    if (raw_blocks) {
+      for (uint16_t i = 0; i < series_count; i++) write_raw_block(i);
+      delete[] raw_blocks;
+    }
+    if (names) delete[] names;
+    names = NULL;
+    raw_blocks = NULL;
+    series_count = 0;
+    started = false;
+  }
+
+  // Set how long a tier (or mhTierRaw) is kept, in seconds, 0 to keep it forever. Whole files are deleted.
+  void set_retention(const uint8_t tier, const uint32_t seconds) {
+    if (tier < mhTierCount) retention_s[tier] = seconds;
+    else if (tier == mhTierRaw) raw_retention_s = seconds;
+  }
+  uint32_t get_retention(const uint8_t tier) const { return tier < mhTierCount ? retention_s[tier] : (tier == mhTierRaw ? raw_retention_s : 0); }
+
+  // Bucket length of a tier in seconds
+  static uint32_t get_step(const uint8_t tier) {
+    static const uint32_t steps[mhTierCount] = { 60, 600, 3600, 86400 };
+    return tier < mhTierCount ? steps[tier] : 0;
+  }
+  uint16_t get_series_count() const { return series_count; }
+  const char *get_series_name(const uint16_t series) const { return series < series_count ? names[series] : NULL; }
+  uint32_t get_dropped_series() const { return dropped_series; } // Series not stored because max_series was reached
+  uint32_t get_write_errors() const { return write_errors; }      // Blocks of raw samples that could not be written
+
+  // Write the raw blocks being filled, and schedule writing of the mapped segments to disk
+  void flush() {
+    if (raw_blocks) for (uint16_t i = 0; i < series_count; i++) write_raw_block(i);
+    for (uint8_t t = 0; t < mhTierCount; t++) if (segments[t].data) msync(segments[t].data, segments[t].size, MS_ASYNC);
+  }
+
+  // Add a sample of a series, also usable for values that are not module outputs
+  void add_sample(const char *name, const uint32_t utc, const float value) {
+    if (!started || utc == 0) return;
+    uint16_t series = get_series(name);
+    uint32_t raw;
+    memcpy(&raw, &value, 4);
+    if (series < max_series) add_series_sample(series, utc, raw, mvtFloat32);
+  }
+
+  // Select the finest tier that gives at most max_points points and is kept back to the start of the range
+  uint8_t select_tier(const uint32_t from, const uint32_t to, const uint16_t max_points) const {
+    uint32_t now = miTime::Get();
+    for (uint8_t t = 0; t < mhTierCount; t++) {
+      if ((to - from) / get_step(t) + 1 > max_points) continue;
+      if (retention_s[t] == 0 || now < retention_s[t] || from >= now - retention_s[t]) return t;
+    }
+    return mhTierCount - 1;
+  }
+
+  // Get the buckets with samples of a series within [from, to] (UTC), at most max_points of them.
+  // The tier is selected automatically unless given, and raw samples are only returned if asked for
+  // with mhTierRaw. Returns the number of points.
+  uint16_t query(const char *name, const uint32_t from, const uint32_t to, MIHistoryPoint *points,
+                 const uint16_t max_points, uint8_t &tier) const {
+    if (!started || to < from || max_points == 0) return 0;
+    uint16_t series = 0;
+    while (series < series_count && strcmp(names[series], name) != 0) series++;
+    if (series == series_count) return 0;
+    if (tier == mhTierRaw) return query_raw(series, from, to, points, max_points);
+    if (tier >= mhTierCount) tier = select_tier(from, to, max_points);
+    uint32_t step = get_step(tier), span = get_segment_span(tier), count = 0;
+    MIHistoryBucket buckets[64];
+    char path[160];
+    for (uint32_t start = from - from % span; start <= to && count < max_points; start += span) {
+      get_segment_path(tier, start, path, sizeof path);
+      int fd = open(path, O_RDONLY);
+      if (fd < 0) continue; // No samples in this segment
+      SegmentHeader h;
+      if (pread(fd, &h, sizeof h, 0) == (ssize_t) sizeof h && h.magic == MI_HISTORY_MAGIC && series < h.max_series) {
+        uint32_t first = from > start ? (from - start) / step : 0, last = (to - start) / step;
+        if (last >= MI_HISTORY_SEGMENT_BUCKETS) last = MI_HISTORY_SEGMENT_BUCKETS - 1;
+        off_t column = MI_HISTORY_HEADER_SIZE + (off_t) series * MI_HISTORY_SEGMENT_BUCKETS * sizeof(MIHistoryBucket);
+        for (uint32_t b = first; b <= last && count < max_points; b += 64) { // Read the column in blocks
+          uint32_t n = last + 1 - b < 64 ? last + 1 - b : 64;
+          ssize_t got = pread(fd, buckets, n * sizeof(MIHistoryBucket), column + (off_t) b * sizeof(MIHistoryBucket));
+          if (got != (ssize_t) (n * sizeof(MIHistoryBucket))) break;
+          for (uint32_t i = 0; i < n && count < max_points; i++) {
+            if (buckets[i].count == 0) continue;
+            MIHistoryPoint &p = points[count++];
+            p.time = start + (b + i) * step;
+            p.min = buckets[i].min;
+            p.max = buckets[i].max;
+            p.mean = buckets[i].mean;
+            p.count = buckets[i].count;
+          }
+        }
+      }
+      close(fd);
+      if (start > UINT32_MAX - span) break;
+    }
+    return (uint16_t) count;
+  }
+
+  static const char *get_tier_name(const uint8_t tier) {
+    static const char *names[mhTierCount] = { "1m", "10m", "1h", "1d" };
+    return tier < mhTierCount ? names[tier] : (tier == mhTierRaw ? "raw" : "");
+  }
+
+  // Samples are taken in put_values, so there is nothing else to do
+  void update() {}
+  void get_settings() {}
+  void put_settings() {
+    #ifdef MASTER_MULTI_TRANSFER
+    // Clear the changed-bit of this transfer for settings changed by the modules or other transfers
+    for (mi_module_ix_t i = 0; i < interfaces.num_interfaces; i++) {
+      ModuleVariableSet &settings = interfaces[i]->settings;
+      for (uint8_t j = 0; j < settings.get_num_variables(); j++) clear_mv_changed(settings.get_module_variable(j), transfer_ix);
+    }
+    #endif
+  }
+  void get_values() {}
+
+  // Add a sample of each output of each module after each transfer cycle
+  void put_values() {
+    uint32_t utc = miTime::Get();
+    if (!started || utc == 0) return; // Samples need a synchronized clock
+    for (mi_module_ix_t i = 0; i < interfaces.num_interfaces; i++) {
+      const ModuleVariableSet &outputs = interfaces[i]->outputs;
+      if (!outputs.got_contract() || !outputs.is_updated()) continue;
+      const uint16_t *series = get_module_series(i);
+      if (series == NULL) continue;
+      for (uint8_t j = 0; j < outputs.get_num_variables(); j++) {
+        if (series[j] >= max_series) continue;
+        const ModuleVariable &mv = outputs.get_module_variable(j);
+        uint32_t raw = 0;
+        memcpy(&raw, mv.get_value_pointer(), mv.get_size());
+        add_series_sample(series[j], utc, raw, mv.get_type());
+      }
+    }
+    if (utc - last_raw_check >= 60) {
+      last_raw_check = utc;
+      write_old_raw_blocks(utc);
+    }
+  }
+};
+
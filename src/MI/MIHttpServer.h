@@ -0,0 +1,838 @@
+#pragma once
+
+// A small HTTP server running inside a POSIX master, serving the current values of all modules as JSON
+// directly from the ModuleInterfaceSet, and accepting setting changes. It is added to the master as an
+// external transfer, and all work is done without blocking in its update function, in the master thread.
+//
+//   GET  /values    Outputs and status of the modules, and status of the master (like get_currentvalues.php)
+//   GET  /settings  Settings (like get_settings.php)
+//   GET  /inputs    Inputs, named like "bb.aaTemp" with the prefix of the receiving module first
+//   GET  /status    Status of the modules and the master
+//   POST /settings  Set settings from a JSON object like {"aaSetpoint":21.5}, flagged as changed and as events
+//   GET  /events    A server-sent events stream of changed settings and outputs, see below
+//   GET  /history   Stored time series from a MIHistoryStore set with set_history (not on Windows), see below
+//
+// The server listens on 127.0.0.1 unless another address is set with set_bind_address. Requests are only
+// accepted if the Host header is localhost, 127.0.0.1, the bind address or a host set with set_allowed_hosts,
+// so that a web page cannot reach the server by letting its own host name resolve to this address (DNS
+// rebinding). POST /settings requires the header "Authorization: Bearer <token>" if a token is set with
+// set_token, and otherwise "Content-Type: application/json", which a web page from another origin cannot
+// send without a CORS preflight. No CORS headers are sent unless an origin is set with set_cors_origin,
+// and then only GET is allowed from that origin.
+//
+// The GET requests return a flat JSON object with prefixed names. They can be filtered with the
+// query parameters modules=aa,bb (module prefixes, or the master prefix) and fields=aaTemp,aaUptime.
+//
+// The /events stream starts with a "values" event with all settings and outputs. After that, a "values"
+// event with the settings and outputs that have changed is sent after each transfer cycle, and an "events"
+// event is sent as soon as a setting or output is flagged as an event. The data of each is a JSON object
+// like for /values. If a client does not keep up, events are dropped when its queue is full, and a
+// "dropped" event with the number of dropped events is sent before the next event that is queued.
+//
+// /history takes the parameters fields=aaTemp,bbHum (required), from and to (UTC, default the last day),
+// points (max points per series) and tier (auto, raw, 1m, 10m, 1h or 1d). The JSON reply has an object
+// for each series with the tier and the arrays time, min, max, mean and count, or time and value for the
+// raw tier. With format=binary, the reply is the series after each other, each with name length (1 byte),
+// name, tier (1 byte, 0-3 for 1m-1d, 0xFE for raw), point count (2 bytes) and data length (2 bytes),
+// little-endian, followed by the data encoded as in MITimeSeriesCodec.h: for each point the time and then
+// min, max and mean (only the value for the raw tier), each column as mvtFloat32 with its own state.
+
+#include <MI/ModuleInterfaceHttpTransfer.h>
+
+#if defined(_WIN32) || defined(WIN32)
+  #include <winsock2.h>
+  #include <ws2tcpip.h>
+  typedef SOCKET mi_socket_t;
+  #define MI_INVALID_SOCKET INVALID_SOCKET
+  #define mi_close_socket closesocket
+  #define MI_WOULD_BLOCK (WSAGetLastError() == WSAEWOULDBLOCK)
+  #define MI_SEND_FLAGS 0
+#else
+  #include <MI/MIHistoryStore.h>
+  #define MI_HTTP_HISTORY
+  #include <sys/socket.h>
+  #include <netinet/in.h>
+  #include <arpa/inet.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <errno.h>
+  typedef int mi_socket_t;
+  #define MI_INVALID_SOCKET (-1)
+  #define mi_close_socket close
+  #define MI_WOULD_BLOCK (errno == EAGAIN || errno == EWOULDBLOCK)
+  #define MI_SEND_FLAGS MSG_NOSIGNAL // Do not let a closed connection kill the master with SIGPIPE
+#endif
+
+#ifndef MI_HTTP_MAX_CONNECTIONS
+  #define MI_HTTP_MAX_CONNECTIONS 8
+#endif
+// Max length of a request including headers and body
+#ifndef MI_HTTP_MAX_REQUEST_LENGTH
+  #define MI_HTTP_MAX_REQUEST_LENGTH 4096
+#endif
+// A connection is closed if the request is not complete or the response is not sent within this time
+#ifndef MI_HTTP_TIMEOUT_MS
+  #define MI_HTTP_TIMEOUT_MS 5000
+#endif
+// Max bytes waiting to be sent to an /events client before events to it are dropped
+#ifndef MI_HTTP_EVENT_QUEUE_LENGTH
+  #define MI_HTTP_EVENT_QUEUE_LENGTH 65536
+#endif
+// Max points per series returned from /history, and the buffer size for the binary encoding of each
+#ifndef MI_HTTP_HISTORY_MAX_POINTS
+  #define MI_HTTP_HISTORY_MAX_POINTS 1440
+#endif
+#ifndef MI_HTTP_HISTORY_BUFFER_SIZE
+  #define MI_HTTP_HISTORY_BUFFER_SIZE 32768
+#endif
+// A comment is sent to /events clients after this time without events, to keep the connection open
+#ifndef MI_HTTP_KEEPALIVE_MS
+  #define MI_HTTP_KEEPALIVE_MS 15000
+#endif
+
+class MIHttpServer : public MITransferBase {
+protected:
+  struct Connection {
+    mi_socket_t socket = MI_INVALID_SOCKET;
+    char *request = NULL;       // Request being received, or NULL when sending the response
+    uint16_t request_length = 0;
+    String response;
+    uint32_t sent = 0, start = 0;
+    bool streaming = false;       // An /events connection, kept open
+    String modules, fields;       // Filters of an /events connection
+    uint32_t dropped = 0, last_queued = 0;
+  };
+
+  // The last values sent to /events clients, for each module, to find the changes
+  struct StreamState {
+    uint32_t settings_id = 0, outputs_id = 0;
+    uint32_t *last = NULL;        // Settings followed by outputs
+    bool all_settings = true, all_outputs = true; // Send all values as changes, for a new module or contract
+    ~StreamState() { if (last) delete[] last; }
+  };
+
+  // Configuration
+  uint16_t port;
+  char bind_address[16] = "127.0.0.1";
+  char token[65] = "";            // Required for POST /settings if not empty
+  char allowed_hosts[128] = "";   // Comma separated host names accepted in addition to the local ones
+  char cors_origin[64] = "";      // Origin allowed to read GET replies, like "*", none if empty
+
+  // State
+  mi_socket_t listen_socket = MI_INVALID_SOCKET;
+  Connection connections[MI_HTTP_MAX_CONNECTIONS];
+  StreamState *stream_states = NULL;
+  mi_module_ix_t stream_state_count = 0;
+  uint8_t stream_count = 0;       // Number of /events clients
+  uint32_t events_dropped = 0;
+  #ifdef MI_HTTP_HISTORY
+  MIHistoryStore *history = NULL;
+  #endif
+
+  // The parsed request being handled
+  struct Request {
+    const char *method, *path, *modules, *fields, *body;
+    uint16_t body_length;
+    char *query;                  // Parameters split into zero terminated strings, for get_parameter
+    const char *query_end;
+  };
+
+  static bool set_nonblocking(mi_socket_t s) {
+    #if defined(_WIN32) || defined(WIN32)
+    u_long mode = 1;
+    return ioctlsocket(s, FIONBIO, &mode) == 0;
+    #else
+    int flags = fcntl(s, F_GETFL, 0);
+    return flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+    #endif
+  }
+
+  void close_connection(Connection &c) {
+    if (c.socket != MI_INVALID_SOCKET) mi_close_socket(c.socket);
+    c.socket = MI_INVALID_SOCKET;
+    if (c.request) { delete[] c.request; c.request = NULL; }
+    c.request_length = 0;
+    c.response = "";
+    c.sent = 0;
+    if (c.streaming) {
+      c.streaming = false;
+      c.modules = c.fields = "";
+      c.dropped = 0;
+      if (--stream_count == 0) deallocate_stream_states();
+    }
+  }
+
+  // Return whether a comma separated list contains a word, with an empty list containing everything
+  static bool list_contains(const char *list, const char *word, uint8_t word_length = 0) {
+    if (list == NULL || *list == 0) return true;
+    if (word_length == 0) word_length = (uint8_t) strlen(word);
+    for (const char *p = list; *p; ) {
+      const char *end = strchr(p, ',');
+      uint16_t len = end ? (uint16_t) (end - p) : (uint16_t) strlen(p);
+      if (len == word_length && strncmp(p, word, len) == 0) return true;
+      if (!end) break;
+      p = end + 1;
+    }
+    return false;
+  }
+
+  // Decode a query parameter value in place, returning it if present.
+  // The parameters of the query have been split into zero terminated strings ending at query_end.
+  static const char *get_parameter(char *query, const char *query_end, const char *name) {
+    uint8_t len = (uint8_t) strlen(name);
+    for (char *p = query; p < query_end; p += strlen(p) + 1) {
+      if (strncmp(p, name, len) != 0 || p[len] != '=') continue;
+      char *value = &p[len + 1], *out = value;
+      for (char *in = value; *in; in++, out++) { // URL decoding
+        if (*in == '%' && in[1] && in[2]) { char hex[3] = { in[1], in[2], 0 }; *out = (char) strtol(hex, NULL, 16); in += 2; }
+        else *out = *in == '+' ? ' ' : *in;
+      }
+      *out = 0;
+      return value;
+    }
+    return NULL;
+  }
+
+  // Append the members of a JSON object to a flat JSON object text, skipping those not asked for.
+  // A name prefix can be added, used for the inputs.
+  static void append_members(DynamicJsonDocument &doc, const Request &request, String &out, const char *name_prefix = NULL) {
+    JsonObject obj = doc.as<JsonObject>();
+    char value[32], name[MVAR_PREFIX_LENGTH + 1 + MVAR_MAX_NAME_LENGTH + MVAR_PREFIX_LENGTH + 1];
+    for (JsonPair kv : obj) {
+      snprintf(name, sizeof name, "%s%s%s", name_prefix ? name_prefix : "", name_prefix ? "." : "", kv.key().c_str());
+      if (!list_contains(request.fields, name)) continue;
+      serializeJson(kv.value(), value, sizeof value);
+      if (out.length() > 1) out += ',';
+      out += '"';
+      out += name;
+      out += "\":";
+      out += value;
+    }
+  }
+
+  void add_variables(const ModuleVariableSet &set, const char *prefix, DynamicJsonDocument &doc) {
+    char prefixed_name[MVAR_MAX_NAME_LENGTH + MVAR_PREFIX_LENGTH + 1];
+    for (uint8_t i = 0; i < set.get_num_variables(); i++) {
+      set.get_prefixed_name(i, prefix, prefixed_name, sizeof prefixed_name);
+      mv_to_json(set.get_module_variable(i), doc, prefixed_name);
+    }
+  }
+
+  // Build the JSON reply to a GET request
+  void get_json(const Request &request, String &out) {
+    bool values = strcmp(request.path, "/values") == 0, settings = strcmp(request.path, "/settings") == 0,
+      inputs = strcmp(request.path, "/inputs") == 0;
+    out = "{";
+    DynamicJsonDocument doc(MI_MAX_JSON_SIZE);
+    for (mi_module_ix_t i = 0; i < interfaces.num_interfaces; i++) {
+      ModuleInterface *mi = interfaces[i];
+      if (!list_contains(request.modules, mi->get_prefix())) continue;
+      doc.to<JsonObject>(); // An empty object, as mv_to_json needs one
+      if (settings) {
+        if (mi->settings.got_contract() && mi->settings.is_updated()) add_variables(mi->settings, mi->get_prefix(), doc);
+      } else if (inputs) {
+        if (mi->inputs.got_contract()) add_variables(mi->inputs, mi->get_prefix(), doc);
+      } else if (values) add_json_values(mi, doc); // Outputs and status
+      else add_module_status(mi, doc);
+      append_members(doc, request, out, inputs ? mi->get_prefix() : NULL);
+    }
+    if ((values || !(settings || inputs)) && list_contains(request.modules, interfaces.get_prefix())) {
+      doc.to<JsonObject>(); // An empty object, as mv_to_json needs one
+      add_master_status(interfaces, doc, last_scan_times);
+      append_members(doc, request, out);
+    }
+    if (settings) { // UTC is included as from get_settings.php
+      if (out.length() > 1) out += ',';
+      out += "\"UTC\":";
+      out += std::to_string((uint32_t) miTime::Get());
+    }
+    out += "}";
+  }
+
+  // Write a value as JSON, like mv_to_json, returning false for values that are not sent
+  static bool value_to_text(const ModuleVariable &mv, char *text, const uint8_t maxlen) {
+    if (mv.get_type() == mvtBoolean) { strcpy(text, mv.get_bool() ? "1" : "0"); return true; }
+    if (mv.get_type() != mvtFloat32) return mv.get_value_as_text(text, maxlen);
+    float f = mv.get_float();
+    if (f == -999.25f || !isfinite(f)) return false; // Marker for missing value, like in mv_to_json
+    snprintf(text, maxlen, "%.7g", f);
+    return true;
+  }
+
+  // Add "name":value for each variable that has changed since the last sent values, or that is an event
+  // if events_only is set, or for all variables if last is NULL. The last sent values are updated.
+  static void add_changes(const ModuleVariableSet &set, const char *prefix, uint32_t *last, const bool events_only,
+                          const bool all, String &out) {
+    char name[MVAR_MAX_NAME_LENGTH + MVAR_PREFIX_LENGTH + 1], value[24];
+    for (uint8_t i = 0; i < set.get_num_variables(); i++) {
+      const ModuleVariable &mv = set.get_module_variable(i);
+      uint32_t v = 0;
+      memcpy(&v, mv.get_value_pointer(), mv.get_size());
+      if (events_only ? !mv.is_event() : (last && !all && v == last[i])) continue;
+      if (last) last[i] = v;
+      if (!value_to_text(mv, value, sizeof value)) continue;
+      set.get_prefixed_name(i, prefix, name, sizeof name);
+      if (out.length() > 0) out += ',';
+      out += '"'; out += name; out += "\":"; out += value;
+    }
+  }
+
+  void deallocate_stream_states() {
+    if (stream_states) delete[] stream_states;
+    stream_states = NULL;
+    stream_state_count = 0;
+  }
+
+  // Add the changes or events of all modules since the last time
+  void get_stream_changes(const bool events_only, String &out) {
+    if (stream_state_count != interfaces.num_interfaces) {
+      deallocate_stream_states();
+      if (interfaces.num_interfaces == 0) return;
+      stream_states = new StreamState[interfaces.num_interfaces];
+      if (stream_states == NULL) { mvs_out_of_memory = true; return; }
+      stream_state_count = interfaces.num_interfaces;
+    }
+    for (mi_module_ix_t i = 0; i < stream_state_count; i++) {
+      const ModuleInterface &mi = *interfaces[i];
+      StreamState &s = stream_states[i];
+      if (s.last == NULL || s.settings_id != mi.settings.get_contract_id() || s.outputs_id != mi.outputs.get_contract_id()) {
+        if (s.last) delete[] s.last;
+        s.settings_id = mi.settings.get_contract_id();
+        s.outputs_id = mi.outputs.get_contract_id();
+        s.last = new uint32_t[mi.settings.get_num_variables() + mi.outputs.get_num_variables() + 1];
+        if (s.last == NULL) { mvs_out_of_memory = true; continue; }
+        s.all_settings = s.all_outputs = true;
+      }
+      // Values not sent yet are sent with the next changes, not as events
+      if (mi.settings.got_contract() && mi.settings.is_updated() && !(events_only && (s.all_settings || !mi.settings.get_event_count()))) {
+        add_changes(mi.settings, mi.get_prefix(), s.last, events_only, s.all_settings, out);
+        if (!events_only) s.all_settings = false;
+      }
+      if (mi.outputs.got_contract() && mi.outputs.is_updated() && !(events_only && (s.all_outputs || !mi.outputs.get_event_count()))) {
+        add_changes(mi.outputs, mi.get_prefix(), &s.last[mi.settings.get_num_variables()], events_only, s.all_outputs, out);
+        if (!events_only) s.all_outputs = false;
+      }
+    }
+  }
+
+  // Return the entries ("name":value) of a list that pass the filters of a client
+  static void filter_entries(const Connection &c, const String &entries, String &out) {
+    out = "";
+    for (size_t pos = 0; pos < entries.length(); ) {
+      size_t end = entries.find(',', pos), name_end = entries.find('"', pos + 1);
+      if (end == String::npos) end = entries.length();
+      const char *name = entries.c_str() + pos + 1;
+      uint8_t name_length = (uint8_t) (name_end - pos - 1);
+      if (list_contains(c.modules.c_str(), name, MVAR_PREFIX_LENGTH) && list_contains(c.fields.c_str(), name, name_length)) {
+        if (out.length() > 0) out += ',';
+        out.append(entries, pos, end - pos);
+      }
+      pos = end + 1;
+    }
+  }
+
+  // Queue an event to a client, or drop it if the client is not keeping up
+  void queue_event(Connection &c, const char *type, const String &data) {
+    uint32_t pending = (uint32_t) (c.response.length() - c.sent), length = (uint32_t) (strlen(type) + data.length() + 20);
+    if (pending + length > MI_HTTP_EVENT_QUEUE_LENGTH) { c.dropped++; events_dropped++; return; }
+    if (c.sent > 0) { c.response.erase(0, c.sent); c.sent = 0; }
+    if (c.dropped) {
+      c.response += "event: dropped\ndata: {\"count\":"; c.response += std::to_string(c.dropped); c.response += "}\n\n";
+      c.dropped = 0;
+    }
+    c.response += "event: "; c.response += type; c.response += "\ndata: {"; c.response += data; c.response += "}\n\n";
+    c.last_queued = millis();
+  }
+
+  // Send changes to all /events clients
+  void push_changes(const bool events_only) {
+    if (stream_count == 0) return;
+    String entries, filtered;
+    get_stream_changes(events_only, entries);
+    if (entries.length() == 0) return;
+    for (uint8_t i = 0; i < MI_HTTP_MAX_CONNECTIONS; i++) {
+      Connection &c = connections[i];
+      if (!c.streaming) continue;
+      if (c.modules.length() == 0 && c.fields.length() == 0) queue_event(c, events_only ? "events" : "values", entries);
+      else {
+        filter_entries(c, entries, filtered);
+        if (filtered.length() > 0) queue_event(c, events_only ? "events" : "values", filtered);
+      }
+    }
+  }
+
+  // Start an /events stream with all current values
+  void start_stream(Connection &c, const Request &request) {
+    if (stream_count++ == 0) { String discarded; get_stream_changes(false, discarded); } // Start from the current values
+    c.streaming = true;
+    c.start = 0; // No timeout
+    c.modules = request.modules ? request.modules : "";
+    c.fields = request.fields ? request.fields : "";
+    c.response = "HTTP/1.1 200 OK\r\n"
+      "Content-Type: text/event-stream\r\n";
+    add_cors_headers(c.response);
+    c.response += "Cache-Control: no-cache\r\n"
+      "Connection: keep-alive\r\n\r\n";
+    c.sent = 0;
+    String entries, filtered;
+    for (mi_module_ix_t i = 0; i < interfaces.num_interfaces; i++) {
+      const ModuleInterface &mi = *interfaces[i];
+      if (mi.settings.got_contract() && mi.settings.is_updated()) add_changes(mi.settings, mi.get_prefix(), NULL, false, true, entries);
+      if (mi.outputs.got_contract() && mi.outputs.is_updated()) add_changes(mi.outputs, mi.get_prefix(), NULL, false, true, entries);
+    }
+    filter_entries(c, entries, filtered);
+    queue_event(c, "values", filtered);
+  }
+
+  // Find a header in the request, returning a pointer to the value or NULL. Names are case insensitive.
+  static const char *find_header(const char *request, const char *header_end, const char *name) {
+    uint8_t len = (uint8_t) strlen(name);
+    for (const char *line = strstr(request, "\r\n"); line && line < header_end; line = strstr(line + 2, "\r\n")) {
+      const char *n = line + 2;
+      if (!mi_compare_ignorecase(n, name, len) || n[len] != ':') continue;
+      const char *value = &n[len + 1];
+      while (*value == ' ' || *value == '\t') value++;
+      return value;
+    }
+    return NULL;
+  }
+
+  // Whether the Host header (without the port) is one of the local names, the bind address or an allowed host.
+  // A request without Host is accepted, as browsers always send it.
+  bool is_allowed_host(const char *request, const char *header_end) const {
+    const char *host = find_header(request, header_end, "Host");
+    if (host == NULL) return true;
+    uint8_t len = 0;
+    if (*host == '[') { while (host[len] != 0 && host[len] != ']' && host[len] != '\r') len++; if (host[len] == ']') len++; }
+    else while (host[len] != 0 && host[len] != ':' && host[len] != '\r') len++;
+    if (is_host(host, len, "localhost") || is_host(host, len, "127.0.0.1") || is_host(host, len, "[::1]")) return true;
+    if (strcmp(bind_address, "0.0.0.0") != 0 && is_host(host, len, bind_address)) return true;
+    return allowed_hosts[0] != 0 && list_contains(allowed_hosts, host, len);
+  }
+  static bool is_host(const char *host, const uint8_t len, const char *name) {
+    return strlen(name) == len && mi_compare_ignorecase(host, name, len);
+  }
+
+  // Whether a request may change settings, as described at the top
+  bool may_set_settings(const char *request, const char *header_end) const {
+    if (token[0]) {
+      const char *auth = find_header(request, header_end, "Authorization");
+      if (auth == NULL || strncmp(auth, "Bearer ", 7) != 0) return false;
+      auth += 7;
+      uint8_t diff = 0, len = (uint8_t) strlen(token), i = 0;
+      for (; i < len && auth[i] != '\r'; i++) diff |= (uint8_t) (auth[i] ^ token[i]); // Same time for all mismatches
+      return diff == 0 && i == len && auth[i] == '\r';
+    }
+    const char *content_type = find_header(request, header_end, "Content-Type");
+    return content_type && strncmp(content_type, "application/json", 16) == 0;
+  }
+
+  // Set settings from a JSON object, flagging them as changed and as events to be sent to the modules at once
+  bool set_settings(const Request &request, String &out) {
+    DynamicJsonDocument doc(JSON_OBJECT_SIZE(255) + request.body_length + 1);
+    if (deserializeJson(doc, request.body, request.body_length)) return false;
+    JsonObject values = doc.as<JsonObject>();
+    uint16_t updated = 0, unknown = 0;
+    char prefixed_name[MVAR_MAX_NAME_LENGTH + MVAR_PREFIX_LENGTH + 1];
+    for (JsonPair kv : values) {
+      const char *name = kv.key().c_str();
+      mi_module_ix_t m = interfaces.find_interface_by_prefix(name);
+      uint8_t ix = NO_VARIABLE;
+      if (m != NO_MODULE && interfaces[m]->settings.got_contract()) {
+        ModuleVariableSet &settings = interfaces[m]->settings;
+        for (uint8_t i = 0; i < settings.get_num_variables() && ix == NO_VARIABLE; i++) {
+          settings.get_prefixed_name(i, interfaces[m]->get_prefix(), prefixed_name, sizeof prefixed_name);
+          if (strcmp(prefixed_name, name) == 0) ix = i;
+        }
+      }
+      if (ix == NO_VARIABLE) { unknown++; continue; }
+      ModuleVariableSet &settings = interfaces[m]->settings;
+      ModuleVariable &mv = settings.get_module_variable(ix), mv_new(mv);
+      json_to_mv(mv_new, values, name);
+      settings.set_value(ix, mv_new.get_value_pointer(), mv_new.get_size());
+      settings.set_changed(ix);
+      settings.set_event(ix);
+      #ifdef MASTER_MULTI_TRANSFER
+      mv.set_change_bits(); // Let the other transfers get the change, like a change coming from the module
+      clear_mv_changed(mv, transfer_ix);
+      #endif
+      updated++;
+    }
+    out = "{\"updated\":"; out += std::to_string(updated);
+    out += ",\"unknown\":"; out += std::to_string(unknown); out += "}";
+    return true;
+  }
+
+  // Let the configured origin read GET replies, if any
+  void add_cors_headers(String &response) const {
+    if (cors_origin[0] == 0) return;
+    response += "Access-Control-Allow-Origin: "; response += cors_origin;
+    response += "\r\nAccess-Control-Allow-Methods: GET, OPTIONS\r\n";
+  }
+
+  // Set the response, with CORS headers only if cors is set (for GET)
+  void set_response(Connection &c, const uint16_t code, const char *status, const String &body,
+                    const char *content_type = "application/json", const bool cors = true) const {
+    c.response = "HTTP/1.1 "; c.response += std::to_string(code); c.response += ' '; c.response += status;
+    c.response += "\r\nContent-Type: "; c.response += content_type;
+    c.response += "\r\n";
+    if (cors) add_cors_headers(c.response);
+    c.response += "Cache-Control: no-cache\r\n"
+      "Connection: close\r\n"
+      "Content-Length: ";
+    c.response += std::to_string((uint32_t) body.length());
+    c.response += "\r\n\r\n";
+    c.response += body;
+    c.sent = 0;
+  }
+
+  #ifdef MI_HTTP_HISTORY
+  static void append_float_array(String &out, const char *name, const MIHistoryPoint *points, const uint16_t count,
+                                 float MIHistoryPoint::*member) {
+    char value[20];
+    out += ",\""; out += name; out += "\":[";
+    for (uint16_t i = 0; i < count; i++) {
+      snprintf(value, sizeof value, i ? ",%.7g" : "%.7g", (double) (points[i].*member));
+      out += value;
+    }
+    out += ']';
+  }
+
+  static void append_json_series(String &out, const char *name, const uint8_t tier, const MIHistoryPoint *points,
+                                 const uint16_t count) {
+    if (out.length() > 1) out += ',';
+    out += '"'; out += name; out += "\":{\"tier\":\""; out += MIHistoryStore::get_tier_name(tier);
+    out += "\",\"time\":[";
+    for (uint16_t i = 0; i < count; i++) { if (i) out += ','; out += std::to_string(points[i].time); }
+    out += ']';
+    if (tier == mhTierRaw) append_float_array(out, "value", points, count, &MIHistoryPoint::mean);
+    else {
+      append_float_array(out, "min", points, count, &MIHistoryPoint::min);
+      append_float_array(out, "max", points, count, &MIHistoryPoint::max);
+      append_float_array(out, "mean", points, count, &MIHistoryPoint::mean);
+      out += ",\"count\":[";
+      for (uint16_t i = 0; i < count; i++) { if (i) out += ','; out += std::to_string(points[i].count); }
+      out += ']';
+    }
+    out += '}';
+  }
+
+  static void encode_float(MIBitWriter &w, MIValueCodec &codec, const float value) {
+    uint32_t raw;
+    memcpy(&raw, &value, 4);
+    codec.encode(w, raw);
+  }
+
+  // Append a series in the binary format, leaving out the points that do not fit in the buffer
+  static void append_binary_series(String &out, const char *name, const uint8_t tier, const MIHistoryPoint *points,
+                                   const uint16_t count, uint8_t *buffer) {
+    MIBitWriter w(buffer, MI_HTTP_HISTORY_BUFFER_SIZE);
+    MITimestampCodec times;
+    MIValueCodec min, max, mean;
+    uint16_t written = 0;
+    for (; written < count; written++) {
+      uint32_t pos = w.get_bit_pos();
+      times.encode(w, points[written].time);
+      if (tier != mhTierRaw) {
+        encode_float(w, min, points[written].min);
+        encode_float(w, max, points[written].max);
+      }
+      encode_float(w, mean, points[written].mean);
+      if (w.is_overflow()) { w.set_bit_pos(pos); break; }
+    }
+    uint16_t length = w.get_length();
+    uint8_t name_length = (uint8_t) strlen(name);
+    out += (char) name_length;
+    out.append(name, name_length);
+    out += (char) tier;
+    out += (char) (written & 0xFF); out += (char) (written >> 8);
+    out += (char) (length & 0xFF); out += (char) (length >> 8);
+    out.append((const char*) buffer, length);
+  }
+
+  // Build the reply to GET /history, returning false if the parameters are not valid
+  bool get_history(const Request &request, String &out, bool &binary) {
+    if (request.fields == NULL || *request.fields == 0) return false;
+    const char *from_text = get_parameter(request.query, request.query_end, "from"),
+      *to_text = get_parameter(request.query, request.query_end, "to"),
+      *points_text = get_parameter(request.query, request.query_end, "points"),
+      *tier_text = get_parameter(request.query, request.query_end, "tier"),
+      *format_text = get_parameter(request.query, request.query_end, "format");
+    uint32_t to = to_text ? (uint32_t) strtoul(to_text, NULL, 10) : miTime::Get(),
+      from = from_text ? (uint32_t) strtoul(from_text, NULL, 10) : (to > 86400 ? to - 86400 : 0);
+    uint16_t max_points = MI_HTTP_HISTORY_MAX_POINTS;
+    if (points_text) max_points = (uint16_t) MI_min(strtoul(points_text, NULL, 10), (unsigned long) MI_HTTP_HISTORY_MAX_POINTS);
+    uint8_t requested_tier = mhTierAuto;
+    if (tier_text && strcmp(tier_text, "auto") != 0) {
+      for (uint8_t t = 0; t < mhTierCount && requested_tier == mhTierAuto; t++)
+        if (strcmp(tier_text, MIHistoryStore::get_tier_name(t)) == 0) requested_tier = t;
+      if (strcmp(tier_text, MIHistoryStore::get_tier_name(mhTierRaw)) == 0) requested_tier = mhTierRaw;
+      if (requested_tier == mhTierAuto) return false;
+    }
+    binary = format_text && strcmp(format_text, "binary") == 0;
+    if (to < from || max_points == 0 || (format_text && !binary && strcmp(format_text, "json") != 0)) return false;
+
+    MIHistoryPoint *points = new MIHistoryPoint[max_points];
+    uint8_t *buffer = binary ? new uint8_t[MI_HTTP_HISTORY_BUFFER_SIZE] : NULL;
+    if (points == NULL || (binary && buffer == NULL)) {
+      if (points) delete[] points;
+      mvs_out_of_memory = true;
+      return false;
+    }
+    out = binary ? "" : "{";
+    char name[MI_HISTORY_NAME_LENGTH];
+    for (const char *p = request.fields; *p; ) {
+      const char *end = strchr(p, ',');
+      uint16_t len = end ? (uint16_t) (end - p) : (uint16_t) strlen(p);
+      if (len > 0 && len < sizeof name) {
+        memcpy(name, p, len);
+        name[len] = 0;
+        uint8_t tier = requested_tier;
+        uint16_t count = history->query(name, from, to, points, max_points, tier);
+        if (binary) append_binary_series(out, name, tier, points, count, buffer);
+        else append_json_series(out, name, tier, points, count);
+      }
+      if (!end) break;
+      p = end + 1;
+    }
+    if (!binary) out += '}';
+    delete[] points;
+    if (buffer) delete[] buffer;
+    return true;
+  }
+  #endif
+
+  // Handle a request if complete, returning false if more data is needed
+  bool handle_request(Connection &c) {
+    char *header_end = strstr(c.request, "\r\n\r\n");
+    if (header_end == NULL) return false;
+    const char *length_header = find_header(c.request, header_end, "Content-Length");
+    uint16_t body_length = length_header ? (uint16_t) atoi(length_header) : 0;
+    if ((uint32_t) (header_end + 4 - c.request) + body_length > c.request_length) return false;
+
+    if (!is_allowed_host(c.request, header_end)) {
+      set_response(c, 403, "Forbidden", "{\"error\":\"host not allowed\"}", "application/json", false);
+      return true;
+    }
+
+    bool may_set = may_set_settings(c.request, header_end);
+
+    // Split the request line into method, path and query
+    Request request;
+    memset(&request, 0, sizeof request);
+    request.body = header_end + 4;
+    request.body_length = body_length;
+    char *p = strchr(c.request, ' '), *query = NULL;
+    if (p == NULL) { set_response(c, 400, "Bad Request", "{}"); return true; }
+    *p = 0;
+    request.method = c.request;
+    request.path = ++p;
+    p = strpbrk(p, " \r");
+    if (p) *p = 0;
+    query = strchr((char*) request.path, '?');
+    if (query) {
+      *query++ = 0;
+      const char *query_end = query + strlen(query);
+      for (char *a = strchr(query, '&'); a; a = strchr(a + 1, '&')) *a = 0;
+      request.modules = get_parameter(query, query_end, "modules");
+      request.fields = get_parameter(query, query_end, "fields");
+      request.query = query;
+      request.query_end = query_end;
+    }
+
+    String body;
+    bool get = strcmp(request.method, "GET") == 0, post = strcmp(request.method, "POST") == 0;
+    if (strcmp(request.method, "OPTIONS") == 0) set_response(c, 204, "No Content", ""); // CORS preflight, GET only
+    else if (get && (strcmp(request.path, "/values") == 0 || strcmp(request.path, "/settings") == 0
+      || strcmp(request.path, "/inputs") == 0 || strcmp(request.path, "/status") == 0)) {
+      get_json(request, body);
+      set_response(c, 200, "OK", body);
+    }
+    else if (get && strcmp(request.path, "/events") == 0) start_stream(c, request);
+    #ifdef MI_HTTP_HISTORY
+    else if (get && strcmp(request.path, "/history") == 0) {
+      bool binary = false;
+      if (history == NULL) set_response(c, 404, "Not Found", "{\"error\":\"no history\"}");
+      else if (get_history(request, body, binary)) set_response(c, 200, "OK", body, binary ? "application/octet-stream" : "application/json");
+      else set_response(c, 400, "Bad Request", "{\"error\":\"invalid parameters\"}");
+    }
+    #endif
+    else if (post && strcmp(request.path, "/settings") == 0) {
+      if (!may_set) set_response(c, token[0] ? 401 : 415, token[0] ? "Unauthorized" : "Unsupported Media Type",
+                                 "{\"error\":\"not allowed\"}", "application/json", false);
+      else if (set_settings(request, body)) set_response(c, 200, "OK", body, "application/json", false);
+      else set_response(c, 400, "Bad Request", "{\"error\":\"invalid JSON\"}", "application/json", false);
+    }
+    else if (!handle_other_request(c, request)) set_response(c, 404, "Not Found", "{}");
+    return true;
+  }
+
+  // Can be overridden to serve more paths, returning false if the path is unknown
+  virtual bool handle_other_request(Connection &/*c*/, const Request &/*request*/) { return false; }
+
+  void accept_connections() {
+    while (true) {
+      mi_socket_t s = accept(listen_socket, NULL, NULL);
+      if (s == MI_INVALID_SOCKET) return;
+      uint8_t i = 0;
+      while (i < MI_HTTP_MAX_CONNECTIONS && connections[i].socket != MI_INVALID_SOCKET) i++;
+      if (i == MI_HTTP_MAX_CONNECTIONS || !set_nonblocking(s)) {
+        #ifdef DEBUG_PRINT
+        DPRINTLN(F("MIHttpServer: too many connections, refused"));
+        #endif
+        mi_close_socket(s);
+        continue;
+      }
+      Connection &c = connections[i];
+      c.socket = s;
+      c.request = new char[MI_HTTP_MAX_REQUEST_LENGTH + 1];
+      if (c.request == NULL) {
+        mvs_out_of_memory = true;
+        close_connection(c);
+        continue;
+      }
+      c.request_length = 0;
+      c.start = millis();
+    }
+  }
+
+  void receive(Connection &c) {
+    int n = recv(c.socket, &c.request[c.request_length], MI_HTTP_MAX_REQUEST_LENGTH - c.request_length, 0);
+    if (n == 0 || (n < 0 && !MI_WOULD_BLOCK)) { close_connection(c); return; }
+    if (n < 0) return;
+    c.request_length += (uint16_t) n;
+    c.request[c.request_length] = 0;
+    if (handle_request(c)) { delete[] c.request; c.request = NULL; }
+    else if (c.request_length >= MI_HTTP_MAX_REQUEST_LENGTH) {
+      set_response(c, 413, "Payload Too Large", "{}");
+      delete[] c.request;
+      c.request = NULL;
+    }
+  }
+
+  // Send what the socket will take of the response, returning true when all has been sent
+  bool send_response(Connection &c) {
+    while (c.sent < c.response.length()) {
+      int n = send(c.socket, c.response.c_str() + c.sent, (int) (c.response.length() - c.sent), MI_SEND_FLAGS);
+      if (n < 0 && MI_WOULD_BLOCK) return false;
+      if (n <= 0) { close_connection(c); return false; }
+      c.sent += (uint32_t) n;
+    }
+    return true;
+  }
+
+  // Receive requests and send responses on the open connections
+  virtual void update_connection(Connection &c) {
+    if (c.streaming) {
+      char buf[64]; // Nothing more is expected from the client, but reading shows if it has gone
+      int n = recv(c.socket, buf, sizeof buf, 0);
+      if (n == 0 || (n < 0 && !MI_WOULD_BLOCK)) { close_connection(c); return; }
+      if ((uint32_t) (millis() - c.last_queued) > MI_HTTP_KEEPALIVE_MS && c.sent == c.response.length()) {
+        c.response = ": keepalive\n\n";
+        c.sent = 0;
+        c.last_queued = millis();
+      }
+      send_response(c);
+      return;
+    }
+    if (c.request) receive(c);
+    if (c.socket != MI_INVALID_SOCKET && c.request == NULL && !c.streaming && send_response(c)) close_connection(c);
+  }
+
+public:
+  MIHttpServer(ModuleInterfaceSet &module_interface_set, const uint16_t server_port = 8080) :
+    MITransferBase(module_interface_set), port(server_port) { }
+
+  ~MIHttpServer() { stop(); deallocate_stream_states(); }
+
+  void set_port(const uint16_t server_port) { port = server_port; }
+
+  // Listen on this address, like "0.0.0.0" for all addresses. Default is "127.0.0.1", local connections only.
+  void set_bind_address(const char *address) { strncpy(bind_address, address, sizeof bind_address - 1); }
+
+  // Require "Authorization: Bearer <token>" for POST /settings. Recommended when not listening on 127.0.0.1.
+  void set_token(const char *required_token) { strncpy(token, required_token ? required_token : "", sizeof token - 1); }
+
+  // Accept requests for these host names as well, like "mypi,mypi.local,192.168.1.10", when not using 127.0.0.1
+  void set_allowed_hosts(const char *hosts) { strncpy(allowed_hosts, hosts ? hosts : "", sizeof allowed_hosts - 1); }
+
+  // Let web pages from this origin read the GET replies, like "http://dashboard:3000" or "*". Default is none.
+  void set_cors_origin(const char *origin) { strncpy(cors_origin, origin ? origin : "", sizeof cors_origin - 1); }
+
+  #ifdef MI_HTTP_HISTORY
+  // Serve /history from a store that is also added to the master
+  void set_history(MIHistoryStore *history_store) { history = history_store; }
+  #endif
+
+  // Start listening, returning false if the port cannot be used
+  bool begin() {
+    stop();
+    #if defined(_WIN32) || defined(WIN32)
+    WSADATA wsa_data;
+    WSAStartup(MAKEWORD(2, 2), &wsa_data);
+    #endif
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket == MI_INVALID_SOCKET) return false;
+    int reuse = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (const char*) &reuse, sizeof reuse);
+    sockaddr_in address;
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = inet_addr(bind_address);
+    if (bind(listen_socket, (sockaddr*) &address, sizeof address) != 0 || listen(listen_socket, MI_HTTP_MAX_CONNECTIONS) != 0
+      || !set_nonblocking(listen_socket)) {
+      #ifdef DEBUG_PRINT
+      DPRINT(F("MIHttpServer: could not listen on port ")); DPRINTLN(port);
+      #endif
+      stop();
+      return false;
+    }
+    return true;
+  }
+
+  void stop() {
+    for (uint8_t i = 0; i < MI_HTTP_MAX_CONNECTIONS; i++) close_connection(connections[i]);
+    if (listen_socket != MI_INVALID_SOCKET) mi_close_socket(listen_socket);
+    listen_socket = MI_INVALID_SOCKET;
+  }
+
+  bool is_listening() const { return listen_socket != MI_INVALID_SOCKET; }
+
+  uint8_t get_stream_count() const { return stream_count; }
+
+  // Number of events dropped because /events clients did not keep up
+  uint32_t get_events_dropped() const { return events_dropped; }
+
+  // Handle connections, called frequently by the ModuleInterfaceSet
+  void update() {
+    if (listen_socket == MI_INVALID_SOCKET) return;
+    accept_connections();
+    uint32_t now = millis();
+    for (uint8_t i = 0; i < MI_HTTP_MAX_CONNECTIONS; i++) {
+      Connection &c = connections[i];
+      if (c.socket == MI_INVALID_SOCKET) continue;
+      update_connection(c);
+      if (c.socket != MI_INVALID_SOCKET && c.start != 0 && (uint32_t) (now - c.start) > MI_HTTP_TIMEOUT_MS) close_connection(c);
+    }
+  }
+
+  // Values are read on request, so there is nothing to do in the transfer cycle
+  void get_settings() {}
+  void put_settings() {
+    #ifdef MASTER_MULTI_TRANSFER
+    // Clear the changed-bit of this transfer for settings changed by the modules or other transfers
+    for (mi_module_ix_t i = 0; i < interfaces.num_interfaces; i++) {
+      ModuleVariableSet &settings = interfaces[i]->settings;
+      for (uint8_t j = 0; j < settings.get_num_variables(); j++) clear_mv_changed(settings.get_module_variable(j), transfer_ix);
+    }
+    #endif
+  }
+  void get_values() {}
+
+  // Send the changes of the transfer cycle to /events clients
+  void put_values() { push_changes(false); }
+
+  // Send events to /events clients as soon as they are flagged
+  void put_events() { push_changes(true); }
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+// Latency histograms and transfer counters for each module on the master, enabled by defining MI_METRICS.
+// Each histogram uses a fixed number of buckets with exponentially growing width, so that memory use does not
+// depend on the number of samples. Bucket 0 holds samples of 0us, bucket b holds samples in [2^(b-1), 2^b) us.
+// Percentiles are reported as the upper limit of the bucket containing them, so they are accurate within a
+// factor of two, which is enough to see trends and outliers.
+
+#ifndef MI_METRICS_BUCKETS
+  #define MI_METRICS_BUCKETS 24 // Up to 2^23us, about 8s. Longer samples are put in the last bucket.
+#endif
+
+// The latencies measured for each module
+enum MILatencyType {
+  mlContractRTT,  // From a contract request is sent until the contract is received
+  mlSettingsRTT,  // From a settings request is sent until the settings are received
+  mlOutputsRTT,   // From settings are sent until the outputs are received as response
+  mlSendAck,      // From a packet is sent until it is ACKed
+  mlEvent,        // From an output event is received from another module until it is ACKed as an input event
+
+  mlLatencyTypeCount
+};
+
+class MIHistogram {
+  uint32_t buckets[MI_METRICS_BUCKETS];
+  uint32_t count = 0;
+public:
+  MIHistogram() { clear(); }
+  void clear() { memset(buckets, 0, sizeof buckets); count = 0; }
+
+  void add(const uint32_t us) {
+    uint8_t b = 0;
+    while (b < MI_METRICS_BUCKETS - 1 && (us >> b) != 0) b++;
+    buckets[b]++;
+    count++;
+  }
+  void add(const MIHistogram &h) {
+    for (uint8_t b = 0; b < MI_METRICS_BUCKETS; b++) buckets[b] += h.buckets[b];
+    count += h.count;
+  }
+
+  uint32_t get_count() const { return count; }
+  uint32_t get_bucket_count(const uint8_t b) const { return buckets[b]; }
+  static uint32_t get_bucket_limit_us(const uint8_t b) { return (1ul << b) - 1; }
+
+  // Return the upper limit of the bucket containing the given percentile (0-100), 0 if no samples
+  uint32_t get_percentile_us(const uint8_t percent) const {
+    if (count == 0) return 0;
+    uint32_t target = (uint32_t) (((uint64_t) count * percent + 99) / 100), sum = 0;
+    if (target == 0) target = 1;
+    for (uint8_t b = 0; b < MI_METRICS_BUCKETS; b++) {
+      sum += buckets[b];
+      if (sum >= target) return get_bucket_limit_us(b);
+    }
+    return get_bucket_limit_us(MI_METRICS_BUCKETS - 1);
+  }
+};
+
+struct MIMetrics {
+  MIHistogram latency[mlLatencyTypeCount];
+  uint32_t packets_sent = 0,
+           bytes_sent = 0,
+           packets_received = 0,
+           bytes_received = 0,
+           failed_sends = 0,          // Packets not ACKed, to be retried in a later transfer
+           contract_mismatches = 0;   // Status replies saying that the module got a different contract
+
+  // Start times of measurements in progress, in micros()
+  uint32_t request_us = 0,            // When the last request was sent, 0 if no reply expected
+           output_event_us = 0,       // When an output event was received from the module
+           input_event_us = 0;        // When the oldest output event now pending as an input event was received
+  uint8_t expected_cmd = 0;           // The reply expected for the request
+  MILatencyType request_type = mlContractRTT;
+
+  void clear() {
+    for (uint8_t t = 0; t < mlLatencyTypeCount; t++) latency[t].clear();
+    packets_sent = bytes_sent = packets_received = bytes_received = failed_sends = contract_mismatches = 0;
+  }
+  void add(const MIMetrics &m) {
+    for (uint8_t t = 0; t < mlLatencyTypeCount; t++) latency[t].add(m.latency[t]);
+    packets_sent += m.packets_sent;
+    bytes_sent += m.bytes_sent;
+    packets_received += m.packets_received;
+    bytes_received += m.bytes_received;
+    failed_sends += m.failed_sends;
+    contract_mismatches += m.contract_mismatches;
+  }
+  uint32_t get_percentile_us(const MILatencyType type, const uint8_t percent) const {
+    return latency[type].get_percentile_us(percent);
+  }
+  void register_sent(const uint16_t length, const bool acked) {
+    if (acked) { packets_sent++; bytes_sent += length; } else failed_sends++;
+  }
+  void register_received(const uint16_t length) { packets_received++; bytes_received += length; }
+
+  // Start measuring the time until the given command is received
+  void start_request(const uint8_t reply_cmd, const MILatencyType type) {
+    request_us = micros(); if (request_us == 0) request_us = 1;
+    expected_cmd = reply_cmd;
+    request_type = type;
+  }
+  void register_reply(const uint8_t cmd) {
+    if (request_us == 0 || cmd != expected_cmd) return;
+    latency[request_type].add((uint32_t) (micros() - request_us));
+    request_us = 0;
+  }
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+// An append-only pool of variable names, shared by all ModuleVariableSets on the master.
+// Each variable only keeps a 16 bit offset into the pool and a 16 bit hash of the name,
+// instead of a fixed size name buffer. Equal names (for example an input mirroring the output
+// of another module) are stored only once, and MVAR_MAX_NAME_LENGTH can be increased without
+// growing the memory used per variable.
+// Each entry is stored as [hash (2 bytes)][name][0]. The pool is reallocated when growing, so
+// a name pointer returned by get() must not be kept across a call to add().
+// Names of replaced contracts are not removed, so the pool is marked as full when an add fails,
+// and the owner (ModuleInterfaceSet) then rebuilds it from the names in use with compact_name_pool().
+// An open addressing index from the stored hash to the entries lets add find existing names without
+// scanning the pool. If the index cannot be allocated, the pool is scanned instead.
+
+// Value returned by add when the pool is full or out of memory
+#define MI_NO_NAME 0xFFFF
+
+class MINamePool {
+private:
+  char *pool = NULL;
+  uint16_t used = 0, capacity = 0;
+  bool full = false;
+  uint16_t *index = NULL;              // Name offsets, MI_NO_NAME if empty
+  uint16_t index_size = 0, entries = 0; // The index size is a power of two, at least twice the entries
+
+  // Put an entry into the index, which must have room for it
+  void index_entry(const uint16_t offset, const uint16_t hash) {
+    uint16_t pos = hash & (index_size - 1);
+    while (index[pos] != MI_NO_NAME) pos = (pos + 1) & (index_size - 1);
+    index[pos] = offset;
+  }
+
+  // Make room in the index for one more entry, rebuilding it from the pool when growing
+  bool reserve_index() {
+    if (index != NULL && 2u * (entries + 1) <= index_size) return true;
+    uint32_t size = index_size ? 2ul * index_size : 64;
+    while (size < 2ul * (entries + 1)) size *= 2;
+    if (size > 0x8000) return false; // Cannot have more entries than this in a 64 kB pool
+    uint16_t *p = new uint16_t[size];
+    if (p == NULL) return false;
+    if (index) delete[] index;
+    index = p;
+    index_size = (uint16_t) size;
+    for (uint16_t i = 0; i < index_size; i++) index[i] = MI_NO_NAME;
+    for (uint16_t pos = 0; pos < used; pos += 3 + (uint16_t) strlen(&pool[pos + 2])) index_entry(pos + 2, get_hash(pos + 2));
+    return true;
+  }
+
+  bool is_entry(const uint16_t offset, const char *name, const uint8_t len, const uint16_t hash) const {
+    return get_hash(offset) == hash && strncmp(&pool[offset], name, len) == 0 && pool[offset + len] == 0;
+  }
+
+  bool reserve(const uint32_t length) {
+    if (length <= capacity) return true;
+    if (length >= MI_NO_NAME) return false; // Offsets must fit in 16 bits
+    uint32_t new_capacity = capacity ? 2ul * capacity : 128;
+    while (new_capacity < length) new_capacity *= 2;
+    if (new_capacity >= MI_NO_NAME) new_capacity = MI_NO_NAME - 1;
+    char *p = new char[new_capacity];
+    if (p == NULL) return false;
+    if (pool) { memcpy(p, pool, used); delete[] pool; }
+    pool = p;
+    capacity = (uint16_t) new_capacity;
+    return true;
+  }
+
+public:
+  MINamePool() { }
+  ~MINamePool() { clear(); }
+
+  void clear() {
+    if (pool) { delete[] pool; pool = NULL; }
+    if (index) { delete[] index; index = NULL; }
+    used = capacity = index_size = entries = 0;
+    full = false;
+  }
+
+  // Exchange contents with another pool, keeping the address used by the variable sets
+  void swap(MINamePool &other) {
+    char *p = pool; pool = other.pool; other.pool = p;
+    uint16_t u = used; used = other.used; other.used = u;
+    uint16_t c = capacity; capacity = other.capacity; other.capacity = c;
+    bool f = full; full = other.full; other.full = f;
+    uint16_t *i = index; index = other.index; other.index = i;
+    uint16_t n = index_size; index_size = other.index_size; other.index_size = n;
+    n = entries; entries = other.entries; other.entries = n;
+  }
+
+  // Case insensitive hash, so that it can be used for both exact and case insensitive lookups
+  static uint16_t get_hash(const char *name, const uint8_t len) {
+    uint32_t h = 2166136261ul; // FNV-1a
+    for (uint8_t i = 0; i < len && name[i] != 0; i++) {
+      char c = name[i];
+      if (c >= 'A' && c <= 'Z') c = (char) (c + ('a' - 'A'));
+      h ^= (uint8_t) c;
+      h *= 16777619ul;
+    }
+    return (uint16_t) (h ^ (h >> 16));
+  }
+
+  // Return the offset of the name, adding it if not present, or MI_NO_NAME if out of memory
+  uint16_t add(const char *name, const uint8_t len, const uint16_t hash) {
+    // Look for an existing entry with the same name
+    bool indexed = reserve_index();
+    if (indexed) {
+      for (uint16_t pos = hash & (index_size - 1); index[pos] != MI_NO_NAME; pos = (pos + 1) & (index_size - 1))
+        if (is_entry(index[pos], name, len, hash)) return index[pos];
+    } else {
+      for (uint16_t pos = 0; pos < used; pos += 3 + (uint16_t) strlen(&pool[pos + 2]))
+        if (is_entry(pos + 2, name, len, hash)) return pos + 2;
+    }
+
+    // Append a new entry
+    if (!reserve((uint32_t) used + 3 + len)) { full = true; return MI_NO_NAME; }
+    memcpy(&pool[used], &hash, 2);
+    memcpy(&pool[used + 2], name, len);
+    pool[used + 2 + len] = 0;
+    uint16_t offset = used + 2;
+    used += 3 + len;
+    entries++;
+    if (indexed) index_entry(offset, hash);
+    return offset;
+  }
+  uint16_t add(const char *name, const uint8_t len) { return add(name, len, get_hash(name, len)); }
+
+  const char *get(const uint16_t offset) const { return &pool[offset]; }
+  uint16_t get_hash(const uint16_t offset) const { uint16_t h; memcpy(&h, &pool[offset - 2], 2); return h; }
+
+  uint16_t get_used() const { return used; }
+  uint16_t get_capacity() const { return capacity; }
+  bool is_full() const { return full; }
+};
@@ -0,0 +1,200 @@
+#pragma once
+
+// Profiler for the phases of the master transfer cycle, enabled by defining MI_PROFILE.
+// Each phase in a cycle is stored as a start time and duration in microseconds, in a ring buffer
+// holding the most recent cycles. Phases can be nested, like the external transfers within
+// send_to_external. Phases outside a cycle (events handled between cycles) are not recorded.
+// The recorded cycles can be summarized per phase, or written as Chrome trace event JSON
+// for inspection in chrome://tracing or Perfetto.
+
+#ifndef MI_PROFILE_CYCLES
+  #define MI_PROFILE_CYCLES 8       // The number of recent cycles to keep
+#endif
+#ifndef MI_PROFILE_MAX_EVENTS
+  #define MI_PROFILE_MAX_EVENTS 48  // The max number of phases recorded per cycle
+#endif
+#define MI_PROFILE_MAX_DEPTH 4      // The max nesting of phases
+#define MI_PROFILE_NO_TRANSFER 0xFF // Phase not belonging to an external transfer
+
+enum MIPhase {
+  mpTransferSettings,
+  mpUpdateSettings,
+  mpSendSettings,
+  mpTransferOutputsToInputs,
+  mpSendToExternal,
+  mpSendGlobalValues,
+  mpSendInputs,
+  mpBroadcastTime,
+  mpEndBatch,
+  mpUpdateFrequent,
+  mpHandleEvents,
+  mpPublishSnapshot,
+  mpPublishSharedMemory,
+  mpSaveWarmRestart,
+  // Phases of each external transfer
+  mpPutValues,
+  mpPutSettings,
+  mpGetSettings,
+  mpPutEvents,
+  mpUpdateExternal,
+
+  mpPhaseCount
+};
+
+class MIProfiler {
+public:
+  struct Event {
+    uint32_t start_us;    // Relative to the start of the cycle
+    uint32_t duration_us;
+    uint8_t phase;
+    uint8_t transfer_ix;  // Index of external transfer, or MI_PROFILE_NO_TRANSFER
+  };
+  struct Cycle {
+    uint32_t start_us = 0, duration_us = 0;
+    uint8_t event_count = 0;
+    Event events[MI_PROFILE_MAX_EVENTS];
+  };
+
+private:
+  Cycle cycles[MI_PROFILE_CYCLES];
+  uint8_t current = 0;           // The cycle being recorded or last recorded
+  uint8_t cycle_count = 0;       // The number of completed cycles in the buffer
+  uint32_t total_cycles = 0;
+  bool in_cycle = false;
+  uint8_t open[MI_PROFILE_MAX_DEPTH], depth = 0;
+
+public:
+  static const char *get_phase_name(const uint8_t phase) {
+    static const char *names[mpPhaseCount] = {
+      "transfer_settings", "update_settings", "send_settings", "transfer_outputs_to_inputs",
+      "send_to_external", "send_global_values", "send_inputs", "broadcast_time", "end_batch",
+      "update_frequent", "handle_events", "publish_snapshot", "publish_shared_memory",
+      "save_warm_restart",
+      "put_values", "put_settings", "get_settings", "put_events", "update_external"
+    };
+    return phase < mpPhaseCount ? names[phase] : "unknown";
+  }
+
+  void begin_cycle() {
+    if (in_cycle) end_cycle();
+    if (total_cycles > 0) current = (uint8_t) ((current + 1) % MI_PROFILE_CYCLES);
+    Cycle &c = cycles[current];
+    c.start_us = micros();
+    c.duration_us = 0;
+    c.event_count = 0;
+    depth = 0;
+    in_cycle = true;
+  }
+
+  void end_cycle() {
+    if (!in_cycle) return;
+    while (depth > 0) end();
+    cycles[current].duration_us = (uint32_t) (micros() - cycles[current].start_us);
+    in_cycle = false;
+    if (cycle_count < MI_PROFILE_CYCLES) cycle_count++;
+    total_cycles++;
+  }
+
+  void begin(const MIPhase phase, const uint8_t transfer_ix = MI_PROFILE_NO_TRANSFER) {
+    if (!in_cycle || depth >= MI_PROFILE_MAX_DEPTH) { if (in_cycle) depth++; return; }
+    Cycle &c = cycles[current];
+    uint8_t ix = c.event_count < MI_PROFILE_MAX_EVENTS ? c.event_count++ : MI_PROFILE_MAX_EVENTS;
+    open[depth++] = ix;
+    if (ix == MI_PROFILE_MAX_EVENTS) return; // Full, not recorded
+    Event &e = c.events[ix];
+    e.phase = (uint8_t) phase;
+    e.transfer_ix = transfer_ix;
+    e.start_us = (uint32_t) (micros() - c.start_us);
+    e.duration_us = 0;
+  }
+
+  void end() {
+    if (!in_cycle || depth == 0) return;
+    depth--;
+    if (depth >= MI_PROFILE_MAX_DEPTH) return; // Too deep, was not recorded
+    uint8_t ix = open[depth];
+    if (ix >= MI_PROFILE_MAX_EVENTS) return;
+    Cycle &c = cycles[current];
+    c.events[ix].duration_us = (uint32_t) (micros() - c.start_us) - c.events[ix].start_us;
+  }
+
+  // The completed cycles, 0 being the most recent
+  uint8_t get_cycle_count() const { return cycle_count; }
+  uint32_t get_total_cycles() const { return total_cycles; }
+  const Cycle &get_cycle(const uint8_t age) const {
+    uint8_t newest = in_cycle ? (uint8_t) ((current + MI_PROFILE_CYCLES - 1) % MI_PROFILE_CYCLES) : current;
+    return cycles[(newest + MI_PROFILE_CYCLES - age % MI_PROFILE_CYCLES) % MI_PROFILE_CYCLES];
+  }
+
+  // Summarize a phase over the completed cycles. Durations of a phase occurring several times
+  // in a cycle (like update_frequent) are added up for the cycle. Returns false if never recorded.
+  bool get_summary(const MIPhase phase, uint32_t &avg_us, uint32_t &max_us, const uint8_t transfer_ix = MI_PROFILE_NO_TRANSFER) const {
+    uint32_t total = 0;
+    uint8_t count = 0;
+    max_us = 0;
+    for (uint8_t age = 0; age < cycle_count; age++) {
+      const Cycle &c = get_cycle(age);
+      uint32_t sum = 0;
+      bool found = false;
+      for (uint8_t i = 0; i < c.event_count && i < MI_PROFILE_MAX_EVENTS; i++) {
+        const Event &e = c.events[i];
+        if (e.phase == phase && e.transfer_ix == transfer_ix) { sum += e.duration_us; found = true; }
+      }
+      if (!found) continue;
+      total += sum;
+      count++;
+      if (sum > max_us) max_us = sum;
+    }
+    avg_us = count ? total / count : 0;
+    return count > 0;
+  }
+
+  // The average and max duration of the completed cycles
+  void get_cycle_summary(uint32_t &avg_us, uint32_t &max_us) const {
+    uint32_t total = 0;
+    max_us = 0;
+    for (uint8_t age = 0; age < cycle_count; age++) {
+      uint32_t d = get_cycle(age).duration_us;
+      total += d;
+      if (d > max_us) max_us = d;
+    }
+    avg_us = cycle_count ? total / cycle_count : 0;
+  }
+
+  // Write the completed cycles as Chrome trace event JSON, oldest first. Returns the length needed
+  // including the terminating null. If larger than size, the buffer only holds what fitted.
+  uint32_t get_chrome_trace(char *buf, const uint32_t size) const {
+    uint32_t pos = 0, written = 0;
+    char line[128];
+    #define MI_PROFILE_APPEND(s) { uint32_t l = (uint32_t) strlen(s); \
+      if (written == pos && pos + l < size) { memcpy(&buf[pos], s, l); written += l; } pos += l; }
+    MI_PROFILE_APPEND("{\"traceEvents\":[");
+    bool first = true;
+    for (uint8_t age = cycle_count; age > 0; age--) {
+      const Cycle &c = get_cycle(age - 1);
+      snprintf(line, sizeof line, "%s{\"name\":\"cycle\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,\"pid\":1,\"tid\":1}",
+        first ? "" : ",", (unsigned long) c.start_us, (unsigned long) c.duration_us);
+      MI_PROFILE_APPEND(line);
+      first = false;
+      for (uint8_t i = 0; i < c.event_count && i < MI_PROFILE_MAX_EVENTS; i++) {
+        const Event &e = c.events[i];
+        if (e.transfer_ix == MI_PROFILE_NO_TRANSFER)
+          snprintf(line, sizeof line, ",{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,\"pid\":1,\"tid\":1}",
+            get_phase_name(e.phase), (unsigned long) (c.start_us + e.start_us), (unsigned long) e.duration_us);
+        else
+          snprintf(line, sizeof line, ",{\"name\":\"%s %d\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,\"pid\":1,\"tid\":1}",
+            get_phase_name(e.phase), e.transfer_ix, (unsigned long) (c.start_us + e.start_us), (unsigned long) e.duration_us);
+        MI_PROFILE_APPEND(line);
+      }
+    }
+    MI_PROFILE_APPEND("]}");
+    #undef MI_PROFILE_APPEND
+    if (size > 0) buf[written] = 0;
+    return pos + 1;
+  }
+};
+
+// Helpers for marking phases in the code, defined as nothing when not profiling
+#define MI_PROFILE_BEGIN(phase) profiler.begin(phase)
+#define MI_PROFILE_BEGIN_TRANSFER(phase, t) profiler.begin(phase, t)
+#define MI_PROFILE_END() profiler.end()
@@ -0,0 +1,277 @@
+#pragma once
+
+// Layout of the POSIX shared memory segment where a master publishes its live variable table
+// (see ModuleInterfaceSharedMemory.h), and a reader for other processes on the same host.
+// This file does not depend on the rest of the library, so that consumers like loggers and
+// bridges to other systems can include it alone and read values at memory speed.
+//
+// The segment has a fixed size set when it is created by the master, and contains:
+//   MISharedHeader                       Version, sizes, offsets and counters
+//   MISharedModule[max_modules]          Module directory
+//   MISharedVariable[max_variables]      Variable directory, the settings, inputs and outputs of each module
+//   MISharedValue[max_variables]         Values, in the same order as the variable directory
+//
+// The directories are rebuilt when the modules or contracts change, with layout_seq odd while this
+// is done. A reader copies the directories into its own memory and copies them again when layout_seq
+// changes. Each value is protected by its own sequence lock, with seq odd while the value is written.
+// The master increases change_seq once for each publish with changes, after setting the change_seq
+// of each changed value to the new number, so readers can poll change_seq and then look for values
+// that have changed since the last number they saw.
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(_WIN32) || defined(WIN32)
+  #error "The shared memory table is only supported on POSIX platforms"
+#endif
+
+#define MI_SHM_MAGIC 0x4853494D // "MISH"
+#define MI_SHM_VERSION 1
+#define MI_SHM_DEFAULT_NAME "/mi_master"
+#define MI_SHM_MODULE_NAME_LENGTH 12
+#define MI_SHM_NAME_LENGTH 28
+#define MI_SHM_MAX_RETRIES 1000
+
+// The sets of a module, as the kind of each variable
+enum MISharedKind { mskSetting, mskInput, mskOutput };
+#define MI_SHM_KIND_COUNT 3
+
+// Variable types, with the same values as ModuleVariableType
+enum MISharedType { mstUnknown, mstBoolean, mstUint8, mstUint16, mstUint32, mstInt8, mstInt16, mstInt32, mstFloat32 };
+
+// Flags of a value
+#define MI_SHM_UPDATED 0x01 // The value has been received from the module (or set from outside for settings)
+#define MI_SHM_EVENT   0x02 // The last change was flagged as an event
+
+// Flags of a module status
+#define MI_SHM_ACTIVE  0x100 // Combined with the status bits of the module in the low byte
+
+struct MISharedHeader {
+  uint32_t magic, version;
+  uint32_t segment_size, max_modules, max_variables;
+  uint32_t modules_offset, variables_offset, values_offset; // From the start of the segment
+  int32_t writer_pid;
+  char master_prefix[4];
+  std::atomic<uint32_t> open;           // 0 when the master has closed the segment
+  std::atomic<uint32_t> layout_seq;     // Odd while the directories are rebuilt
+  std::atomic<uint32_t> module_count, variable_count;
+  std::atomic<uint32_t> dropped_count;  // Variables not published because max_variables is too low
+  std::atomic<uint32_t> change_seq;     // Increased for each publish with changes
+  std::atomic<uint32_t> publish_count;  // Increased for each publish, also without changes
+  std::atomic<uint32_t> utc;            // Time of the master at the last publish, 0 if not synced
+};
+
+struct MISharedModule {
+  char name[MI_SHM_MODULE_NAME_LENGTH];
+  char prefix[4];
+  uint32_t contract_id[MI_SHM_KIND_COUNT];
+  uint32_t first[MI_SHM_KIND_COUNT];    // Index of the first variable of each set
+  uint8_t count[MI_SHM_KIND_COUNT];
+  uint8_t reserved;
+  std::atomic<uint32_t> status;         // Status bits of the module, and MI_SHM_ACTIVE
+};
+
+struct MISharedVariable {
+  char name[MI_SHM_NAME_LENGTH];        // Name as in the contract, without the prefix of the module
+  uint8_t type, kind;
+  uint16_t module_ix;
+};
+
+struct MISharedValue {
+  std::atomic<uint32_t> seq;            // Odd while the value is written
+  std::atomic<uint32_t> value;          // 4 bytes holding a value of the variable type
+  std::atomic<uint32_t> change_seq;     // The change_seq of the publish where the value last changed
+  std::atomic<uint32_t> flags;          // MI_SHM_UPDATED, MI_SHM_EVENT
+};
+
+inline uint32_t mi_shm_get_segment_size(const uint32_t max_modules, const uint32_t max_variables) {
+  return (uint32_t) (sizeof(MISharedHeader) + max_modules * sizeof(MISharedModule)
+    + max_variables * (sizeof(MISharedVariable) + sizeof(MISharedValue)));
+}
+
+// A value read from the table
+struct MISharedReading {
+  uint32_t raw = 0;         // 4 bytes holding a value of the variable type
+  uint32_t change_seq = 0;
+  uint32_t flags = 0;
+
+  bool     get_bool() const { return (raw & 0xFF) != 0; }
+  uint8_t  get_uint8() const { uint8_t v; memcpy(&v, &raw, 1); return v; }
+  uint16_t get_uint16() const { uint16_t v; memcpy(&v, &raw, 2); return v; }
+  uint32_t get_uint32() const { return raw; }
+  int8_t   get_int8() const { int8_t v; memcpy(&v, &raw, 1); return v; }
+  int16_t  get_int16() const { int16_t v; memcpy(&v, &raw, 2); return v; }
+  int32_t  get_int32() const { int32_t v; memcpy(&v, &raw, 4); return v; }
+  float    get_float() const { float v; memcpy(&v, &raw, 4); return v; }
+  bool     is_updated() const { return (flags & MI_SHM_UPDATED) != 0; }
+  bool     is_event() const { return (flags & MI_SHM_EVENT) != 0; }
+
+  // Value of any type converted to float, convenient for plotting and logging
+  float get_as_float(const uint8_t type) const {
+    switch (type) {
+    case mstBoolean: return get_bool() ? 1.0f : 0.0f;
+    case mstUint8: return (float) get_uint8();
+    case mstInt8: return (float) get_int8();
+    case mstUint16: return (float) get_uint16();
+    case mstInt16: return (float) get_int16();
+    case mstUint32: return (float) get_uint32();
+    case mstInt32: return (float) get_int32();
+    case mstFloat32: return get_float();
+    }
+    return 0;
+  }
+};
+
+// Read-only access to the table of a master from another process
+class MISharedMemoryReader {
+  int fd = -1;
+  uint8_t *segment = NULL;
+  uint32_t segment_size = 0;
+  const MISharedHeader *header = NULL;
+  const MISharedValue *values = NULL;
+
+  // Copy of the directories, valid for layout_seq
+  uint32_t layout_seq = 0, module_count = 0, variable_count = 0;
+  MISharedModule *modules = NULL;
+  MISharedVariable *variables = NULL;
+
+public:
+  MISharedMemoryReader() { }
+  ~MISharedMemoryReader() { close(); }
+
+  // Map the segment of a running master. Returns false if it does not exist or has another version.
+  bool open(const char *name = MI_SHM_DEFAULT_NAME) {
+    close();
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(MISharedHeader)) { close(); return false; }
+    void *p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) { close(); return false; }
+    segment = (uint8_t*) p;
+    segment_size = (uint32_t) st.st_size;
+    header = (const MISharedHeader*) segment;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header->magic != MI_SHM_MAGIC || header->version != MI_SHM_VERSION || header->segment_size > segment_size) {
+      close();
+      return false;
+    }
+    values = (const MISharedValue*) (segment + header->values_offset);
+    modules = new MISharedModule[header->max_modules ? header->max_modules : 1];
+    variables = new MISharedVariable[header->max_variables ? header->max_variables : 1];
+    if (modules == NULL || variables == NULL) { close(); return false; }
+    return true;
+  }
+
+  void close() {
+    if (segment) munmap(segment, segment_size);
+    if (fd >= 0) ::close(fd);
+    if (modules) delete[] modules;
+    if (variables) delete[] variables;
+    fd = -1;
+    segment = NULL;
+    header = NULL;
+    values = NULL;
+    modules = NULL;
+    variables = NULL;
+    layout_seq = module_count = variable_count = segment_size = 0;
+  }
+
+  bool is_open() const { return header != NULL; }
+
+  // Whether the master still has the segment open. A reader should open it again if not,
+  // as a restarted master creates a new segment.
+  bool is_writer_open() const { return header && header->open.load(std::memory_order_acquire) != 0; }
+
+  const MISharedHeader *get_header() const { return header; }
+  uint32_t get_change_seq() const { return header ? header->change_seq.load(std::memory_order_acquire) : 0; }
+  uint32_t get_publish_count() const { return header ? header->publish_count.load(std::memory_order_relaxed) : 0; }
+  uint32_t get_utc() const { return header ? header->utc.load(std::memory_order_relaxed) : 0; }
+
+  // Copy the directories if they have changed since the last call. Must be called before using the
+  // directory functions below, and when read_value returns false. Returns false if no consistent copy
+  // could be made, for example while the master is starting up.
+  bool update_layout() {
+    if (!header) return false;
+    for (uint16_t attempt = 0; attempt < MI_SHM_MAX_RETRIES; attempt++) {
+      uint32_t s = header->layout_seq.load(std::memory_order_acquire);
+      if (s & 1) { usleep(10); continue; } // Being rebuilt
+      if (s == layout_seq && s != 0) return true;
+      uint32_t m = header->module_count.load(std::memory_order_relaxed), v = header->variable_count.load(std::memory_order_relaxed);
+      if (m > header->max_modules || v > header->max_variables) continue;
+      const MISharedModule *shared_modules = (const MISharedModule*) (segment + header->modules_offset);
+      const MISharedVariable *shared_variables = (const MISharedVariable*) (segment + header->variables_offset);
+      for (uint32_t i = 0; i < m; i++) { // The atomic status is copied separately
+        memcpy(modules[i].name, shared_modules[i].name, sizeof modules[i].name);
+        memcpy(modules[i].prefix, shared_modules[i].prefix, sizeof modules[i].prefix);
+        memcpy(modules[i].contract_id, shared_modules[i].contract_id, sizeof modules[i].contract_id);
+        memcpy(modules[i].first, shared_modules[i].first, sizeof modules[i].first);
+        memcpy(modules[i].count, shared_modules[i].count, sizeof modules[i].count);
+      }
+      memcpy((void*) variables, (const void*) shared_variables, v * sizeof(MISharedVariable));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (header->layout_seq.load(std::memory_order_relaxed) != s) continue;
+      layout_seq = s;
+      module_count = m;
+      variable_count = v;
+      return true;
+    }
+    return false;
+  }
+
+  uint32_t get_layout_seq() const { return layout_seq; }
+  uint32_t get_module_count() const { return module_count; }
+  const char *get_module_name(const uint32_t module_ix) const { return modules[module_ix].name; }
+  const char *get_module_prefix(const uint32_t module_ix) const { return modules[module_ix].prefix; }
+  uint32_t get_contract_id(const uint32_t module_ix, const uint8_t kind) const { return modules[module_ix].contract_id[kind]; }
+  uint32_t get_module_status(const uint32_t module_ix) const {
+    return ((const MISharedModule*) (segment + header->modules_offset))[module_ix].status.load(std::memory_order_relaxed);
+  }
+  bool is_module_active(const uint32_t module_ix) const { return (get_module_status(module_ix) & MI_SHM_ACTIVE) != 0; }
+
+  uint32_t get_variable_count() const { return variable_count; }
+  uint32_t get_variable_count(const uint32_t module_ix, const uint8_t kind) const { return modules[module_ix].count[kind]; }
+  uint32_t get_variable_ix(const uint32_t module_ix, const uint8_t kind, const uint8_t ix) const { return modules[module_ix].first[kind] + ix; }
+  const char *get_variable_name(const uint32_t ix) const { return variables[ix].name; }
+  uint8_t get_type(const uint32_t ix) const { return variables[ix].type; }
+  uint8_t get_kind(const uint32_t ix) const { return variables[ix].kind; }
+  uint32_t get_module_ix(const uint32_t ix) const { return variables[ix].module_ix; }
+
+  // Locate a variable by module prefix and name, like "tmTemp". For inputs, the prefix is that of the
+  // receiving module, followed by the name of the input, like "tmaaTemp". Returns false if not found.
+  bool find_variable(const char *prefixed_name, const uint8_t kind, uint32_t &ix) const {
+    for (uint32_t m = 0; m < module_count; m++) {
+      uint8_t len = (uint8_t) strlen(modules[m].prefix);
+      if (len == 0 || strncmp(prefixed_name, modules[m].prefix, len) != 0) continue;
+      for (ix = modules[m].first[kind]; ix < modules[m].first[kind] + modules[m].count[kind]; ix++)
+        if (strcmp(&prefixed_name[len], variables[ix].name) == 0) return true;
+    }
+    return false;
+  }
+
+  // Read a consistent value. Returns false if the layout has changed since update_layout,
+  // or if no consistent value could be read.
+  bool read_value(const uint32_t ix, MISharedReading &reading) const {
+    if (ix >= variable_count) return false;
+    const MISharedValue &v = values[ix];
+    for (uint16_t attempt = 0; attempt < MI_SHM_MAX_RETRIES; attempt++) {
+      uint32_t s = v.seq.load(std::memory_order_acquire);
+      if (s & 1) continue; // Being written
+      reading.raw = v.value.load(std::memory_order_relaxed);
+      reading.change_seq = v.change_seq.load(std::memory_order_relaxed);
+      reading.flags = v.flags.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (v.seq.load(std::memory_order_relaxed) != s) continue;
+      return header->layout_seq.load(std::memory_order_relaxed) == layout_seq;
+    }
+    return false;
+  }
+
+  // Whether a value has changed after the given change_seq, handling wraparound
+  static bool is_newer(const uint32_t change_seq, const uint32_t since) { return (int32_t) (change_seq - since) > 0; }
+};
@@ -0,0 +1,250 @@
+#pragma once
+
+// Compact encoding of time series of module variables, in the style of the Gorilla encoding:
+// - Timestamps are written as delta-of-delta, so regular sampling takes 1 bit per sample.
+// - mvtFloat32 values are XORed with the previous value, writing only the bits that differ.
+// - Integer values are written as zigzag varints of the difference from the previous value.
+// - mvtBoolean values take 1 bit.
+// A sample is a timestamp followed by one or more values, each value column with its own state.
+// The number of samples is not part of the encoding and must be stored by the user.
+//
+// Timestamp encoding, with dod being the difference between the last two timestamp deltas:
+//   First timestamp      32 bits
+//   dod == 0             '0'
+//   dod in [-63,64]      '10' + 7 bits
+//   dod in [-255,256]    '110' + 9 bits
+//   dod in [-2047,2048]  '1110' + 12 bits
+//   Otherwise            '1111' + 32 bits
+// Float encoding, with x being the value XORed with the previous value (0 before the first):
+//   x == 0               '0'
+//   Within the previous leading and trailing zeros  '10' + the bits between them
+//   Otherwise            '11' + 5 bits leading zeros + 5 bits length - 1 + the bits
+
+#include <MI/ModuleVariable.h>
+
+class MIBitWriter {
+  uint8_t *buffer;
+  uint16_t capacity;
+  uint32_t bit_pos = 0;
+  bool overflow = false;
+public:
+  MIBitWriter(uint8_t *buf, const uint16_t buffer_size) : buffer(buf), capacity(buffer_size) { }
+
+  void write(const uint32_t bits, const uint8_t count) {
+    for (int8_t i = (int8_t) count - 1; i >= 0; i--) {
+      uint16_t byte_ix = (uint16_t) (bit_pos >> 3);
+      if (byte_ix >= capacity) { overflow = true; return; }
+      uint8_t mask = (uint8_t) (0x80 >> (bit_pos & 7));
+      if ((bits >> i) & 1) buffer[byte_ix] |= mask;
+      else buffer[byte_ix] &= (uint8_t) ~mask;
+      bit_pos++;
+    }
+  }
+
+  // A varint in groups of 7 bits with a continuation bit first, least significant group first
+  void write_varint(uint32_t value) {
+    do {
+      uint8_t group = (uint8_t) (value & 0x7F);
+      value >>= 7;
+      write((value ? 0x80 : 0) | group, 8);
+    } while (value);
+  }
+
+  uint32_t get_bit_pos() const { return bit_pos; }
+  void set_bit_pos(const uint32_t pos) { bit_pos = pos; overflow = false; } // Roll back a partly written sample
+  uint16_t get_length() const { return (uint16_t) ((bit_pos + 7) >> 3); }
+  bool is_overflow() const { return overflow; }
+};
+
+class MIBitReader {
+  const uint8_t *buffer;
+  uint16_t length;
+  uint32_t bit_pos = 0;
+  bool overflow = false;
+public:
+  MIBitReader(const uint8_t *buf, const uint16_t buffer_length) : buffer(buf), length(buffer_length) { }
+
+  uint32_t read(const uint8_t count) {
+    uint32_t bits = 0;
+    for (uint8_t i = 0; i < count; i++) {
+      uint16_t byte_ix = (uint16_t) (bit_pos >> 3);
+      if (byte_ix >= length) { overflow = true; return 0; }
+      bits = (bits << 1) | ((buffer[byte_ix] >> (7 - (bit_pos & 7))) & 1);
+      bit_pos++;
+    }
+    return bits;
+  }
+
+  uint32_t read_varint() {
+    uint32_t value = 0;
+    for (uint8_t shift = 0; shift < 35 && !overflow; shift += 7) {
+      uint8_t group = (uint8_t) read(8);
+      value |= (uint32_t) (group & 0x7F) << shift;
+      if (!(group & 0x80)) break;
+    }
+    return value;
+  }
+
+  uint32_t get_bit_pos() const { return bit_pos; }
+  bool is_overflow() const { return overflow; }
+};
+
+inline uint32_t mi_zigzag_encode(const int32_t v) { return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31); }
+inline int32_t mi_zigzag_decode(const uint32_t v) { return (int32_t) (v >> 1) ^ -(int32_t) (v & 1); }
+
+// Delta-of-delta encoding of timestamps, in any unit that fits in 32 bits, like UTC seconds or millis
+class MITimestampCodec {
+  uint32_t prev = 0, prev_delta = 0;
+  bool first = true;
+public:
+  void reset() { prev = prev_delta = 0; first = true; }
+
+  void encode(MIBitWriter &w, const uint32_t time) {
+    if (first) { w.write(time, 32); first = false; prev = time; return; }
+    uint32_t delta = time - prev;
+    int32_t dod = (int32_t) (delta - prev_delta);
+    if (dod == 0) w.write(0, 1);
+    else if (dod >= -63 && dod <= 64) { w.write(0b10, 2); w.write((uint32_t) (dod + 63), 7); }
+    else if (dod >= -255 && dod <= 256) { w.write(0b110, 3); w.write((uint32_t) (dod + 255), 9); }
+    else if (dod >= -2047 && dod <= 2048) { w.write(0b1110, 4); w.write((uint32_t) (dod + 2047), 12); }
+    else { w.write(0b1111, 4); w.write((uint32_t) dod, 32); }
+    prev_delta = delta;
+    prev = time;
+  }
+
+  uint32_t decode(MIBitReader &r) {
+    if (first) { first = false; return prev = r.read(32); }
+    int32_t dod;
+    if (r.read(1) == 0) dod = 0;
+    else if (r.read(1) == 0) dod = (int32_t) r.read(7) - 63;
+    else if (r.read(1) == 0) dod = (int32_t) r.read(9) - 255;
+    else if (r.read(1) == 0) dod = (int32_t) r.read(12) - 2047;
+    else dod = (int32_t) r.read(32);
+    prev_delta += (uint32_t) dod;
+    return prev += prev_delta;
+  }
+};
+
+// Encoding of the values of a module variable, given as the raw 4 bytes holding the value
+class MIValueCodec {
+  ModuleVariableType type;
+  uint32_t prev = 0;
+  uint8_t prev_leading = 0xFF, prev_trailing = 0; // No window before the first value
+
+  static uint8_t leading_zeros(uint32_t x) { uint8_t n = 0; while (n < 32 && !(x & 0x80000000ul)) { x <<= 1; n++; } return n; }
+  static uint8_t trailing_zeros(uint32_t x) { uint8_t n = 0; while (n < 32 && !(x & 1)) { x >>= 1; n++; } return n; }
+
+  // Sign or zero extend an integer value to 32 bits
+  int32_t to_int(const uint32_t raw) const {
+    switch (type) {
+    case mvtUint8: return (int32_t) (raw & 0xFF);
+    case mvtInt8: return (int32_t) (int8_t) (raw & 0xFF);
+    case mvtUint16: return (int32_t) (raw & 0xFFFF);
+    case mvtInt16: return (int32_t) (int16_t) (raw & 0xFFFF);
+    default: return (int32_t) raw;
+    }
+  }
+  uint32_t from_int(const int32_t v) const {
+    switch (type) {
+    case mvtUint8: case mvtInt8: return (uint32_t) v & 0xFF;
+    case mvtUint16: case mvtInt16: return (uint32_t) v & 0xFFFF;
+    default: return (uint32_t) v;
+    }
+  }
+
+public:
+  MIValueCodec(const ModuleVariableType t = mvtFloat32) : type(t) { }
+  void reset(const ModuleVariableType t) { type = t; prev = 0; prev_leading = 0xFF; prev_trailing = 0; }
+  ModuleVariableType get_type() const { return type; }
+
+  void encode(MIBitWriter &w, const uint32_t raw) {
+    if (type == mvtBoolean) { w.write((raw & 0xFF) ? 1 : 0, 1); return; }
+    if (type != mvtFloat32) { // Zigzag varint of the difference
+      w.write_varint(mi_zigzag_encode((int32_t) ((uint32_t) to_int(raw) - (uint32_t) to_int(prev))));
+      prev = raw;
+      return;
+    }
+    uint32_t x = raw ^ prev;
+    prev = raw;
+    if (x == 0) { w.write(0, 1); return; }
+    uint8_t leading = leading_zeros(x), trailing = trailing_zeros(x);
+    if (prev_leading != 0xFF && leading >= prev_leading && trailing >= prev_trailing) {
+      w.write(0b10, 2);
+      w.write(x >> prev_trailing, (uint8_t) (32 - prev_leading - prev_trailing));
+      return;
+    }
+    uint8_t length = (uint8_t) (32 - leading - trailing);
+    w.write(0b11, 2);
+    w.write(leading, 5);
+    w.write((uint32_t) (length - 1), 5);
+    w.write(x >> trailing, length);
+    prev_leading = leading;
+    prev_trailing = trailing;
+  }
+
+  uint32_t decode(MIBitReader &r) {
+    if (type == mvtBoolean) return r.read(1);
+    if (type != mvtFloat32) return prev = from_int((int32_t) ((uint32_t) to_int(prev) + (uint32_t) mi_zigzag_decode(r.read_varint())));
+    if (r.read(1) == 0) return prev;
+    if (r.read(1) == 1) {
+      prev_leading = (uint8_t) r.read(5);
+      uint8_t length = (uint8_t) (r.read(5) + 1);
+      prev_trailing = (uint8_t) (32 - prev_leading - length);
+    }
+    uint8_t length = (uint8_t) (32 - prev_leading - prev_trailing);
+    return prev ^= r.read(length) << prev_trailing;
+  }
+};
+
+// Encoding of samples with a timestamp and one value into a buffer, with a sample that does not
+// fit being left out so that the buffer always holds complete samples
+class MITimeSeriesEncoder {
+  MIBitWriter writer;
+  MITimestampCodec times;
+  MIValueCodec values;
+  uint16_t count = 0;
+public:
+  MITimeSeriesEncoder(uint8_t *buffer, const uint16_t buffer_size, const ModuleVariableType type) :
+    writer(buffer, buffer_size), values(type) { }
+
+  // Add a sample with the raw 4 bytes holding the value, returning false if there is no room for it
+  bool add(const uint32_t time, const uint32_t raw) {
+    uint32_t pos = writer.get_bit_pos();
+    MITimestampCodec saved_times = times;
+    MIValueCodec saved_values = values;
+    times.encode(writer, time);
+    values.encode(writer, raw);
+    if (writer.is_overflow()) { writer.set_bit_pos(pos); times = saved_times; values = saved_values; return false; }
+    count++;
+    return true;
+  }
+
+  bool add(const uint32_t time, const ModuleVariable &mv) {
+    uint32_t raw = 0;
+    memcpy(&raw, mv.get_value_pointer(), mv.get_size());
+    return add(time, raw);
+  }
+
+  uint16_t get_count() const { return count; }
+  uint16_t get_length() const { return writer.get_length(); } // Bytes used
+};
+
+class MITimeSeriesDecoder {
+  MIBitReader reader;
+  MITimestampCodec times;
+  MIValueCodec values;
+  uint16_t remaining;
+public:
+  MITimeSeriesDecoder(const uint8_t *buffer, const uint16_t length, const ModuleVariableType type, const uint16_t count) :
+    reader(buffer, length), values(type), remaining(count) { }
+
+  // Get the next sample, with the raw 4 bytes holding the value. Returns false after the last sample.
+  bool next(uint32_t &time, uint32_t &raw) {
+    if (remaining == 0) return false;
+    time = times.decode(reader);
+    raw = values.decode(reader);
+    if (reader.is_overflow()) { remaining = 0; return false; }
+    remaining--;
+    return true;
+  }
+};
@@ -2,6 +2,26 @@
 
 #include <MI/ModuleVariableSet.h>
 
+// Width of module indices on the master, 8 (up to 255 modules) or 16 (up to 65535 modules).
+// Variable indices stay 8 bit, as the contracts and value messages carry them in one byte.
+#ifdef IS_MASTER
+  #ifndef MI_INDEX_BITS
+    #define MI_INDEX_BITS 8
+  #endif
+  #if MI_INDEX_BITS == 16
+    typedef uint16_t mi_module_ix_t;
+  #else
+    typedef uint8_t mi_module_ix_t;
+  #endif
+
+  // The highest index value is reserved to mean "no module"
+  #define NO_MODULE ((mi_module_ix_t)~(mi_module_ix_t)0)
+
+  #ifdef MI_METRICS
+    #include <MI/MIMetrics.h>
+  #endif
+#endif
+
 // Commands for transferring information between modules via some protocol
 enum ModuleCommand {
   mcUnknownCommand,
@@ -24,7 +44,14 @@ enum ModuleCommand {
   mcSetOutputs,
   mcSetStatus,
 
-  mcSetTime               // 13
+  mcSetTime,              // 13
+
+  mcMulti,                // 14, several messages in one packet, each prefixed with a length byte
+
+  mcSetGlobalMap,         // 15, which global value ids to use for which inputs
+  mcSetGlobalValues,      // 16, broadcast of values used as inputs by several modules
+
+  mcFragment              // 17, part of a message too long for one packet
 };
 
 #define MAX_MODULE_NAME_LENGTH 8
@@ -38,6 +65,19 @@ enum ModuleCommand {
 #define MISSING_INPUTS 8             // Tell master that we need inputs
 #define MODIFIED_SETTINGS 16         // Tell master that the settings have been modified in module, and should be retrieved
 #define MISSING_TIME 32              // Tell master that we need a time update (usually only at startup, broadcast should keep it in sync)
+#define MULTI_MESSAGE_SUPPORT 64     // Tell master that we can receive mcMulti and mcFragment packets (always set by modules supporting it)
+#define GLOBAL_VALUES_ACTIVE 128     // Tell master that we have a global value map for the current inputs contract
+
+// Global values are outputs used as inputs by at least this many modules, broadcast instead of sent to each module
+#ifndef MI_GLOBAL_MIN_CONSUMERS
+  #define MI_GLOBAL_MIN_CONSUMERS 2
+#endif
+#define NO_GLOBAL_ID 0xFF
+
+// The number of times a global value map is sent to a module without being confirmed in its status
+#ifndef MI_GLOBAL_MAP_MAX_ATTEMPTS
+  #define MI_GLOBAL_MAP_MAX_ATTEMPTS 3
+#endif
 
 // Notification types for the notification callback function
 enum NotificationType {
@@ -115,6 +155,9 @@ public:
   bool out_of_memory = false;  // If a module has reached an out-of-memory exception (but still can report back)
   ModuleVariableSet *confirmed_settings = NULL; // Configuration parameters received from the module
   ModuleCommand last_incoming_cmd = mcUnknownCommand;  // Cmd in last received packet
+  #ifdef MI_METRICS
+  MIMetrics metrics;           // Latency histograms and transfer counters
+  #endif
   #endif
 
   // Time sync support
@@ -129,6 +172,16 @@ public:
   #endif
   #endif
 
+  // Global values support
+  #ifndef NO_GLOBAL_VALUES
+  #ifndef IS_MASTER
+  // The global value id for each input followed by a received-flag for each input
+  BinaryBuffer input_global_ids;
+  uint32_t global_map_contract_id = 0; // The inputs contract the map was made for, 0 if no map
+  uint8_t global_map_generation = 0;   // Must match the generation of received global values
+  #endif
+  #endif
+
   ModuleInterface() {
     init();
     module_name[0] = 0;
@@ -287,11 +340,20 @@ public:
   }
   const char *get_prefix() const { return module_prefix; }
   bool got_prefix() const { return module_prefix[0] != 0; }
+  void set_name_pool(MINamePool *pool) {
+    settings.set_name_pool(pool);
+    inputs.set_name_pool(pool);
+    outputs.set_name_pool(pool);
+  }
+  bool copy_names_to(MINamePool &pool, const bool use_offsets) {
+    return settings.copy_names_to(pool, use_offsets) && inputs.copy_names_to(pool, use_offsets) &&
+      outputs.copy_names_to(pool, use_offsets);
+  }
   bool got_contract() const { return settings.got_contract() && inputs.got_contract() && outputs.got_contract(); }
   #endif
 
   // Try to parse and handle an incoming message without response, return true if handled
-  bool handle_input_message(const uint8_t *message, const uint8_t length) {
+  bool handle_input_message(const uint8_t *message, const uint16_t length) {
     if (length < 1) return false;
     #ifdef DEBUG_PRINT
       dname(); DPRINT(F("INPUT TYPE ")); DPRINT(message[0]); DPRINT(F(", len ")); DPRINTLN(length);
@@ -318,7 +380,7 @@ public:
         break;
       case mcSetOutputs: {
           // Read outputs from module
-          uint8_t read_length = 0;
+          uint16_t read_length = 0;
           bool ok = outputs.set_values(&message[1], length-1, &read_length);
           if (outputs.is_updated()) notify(ntNewOutputs, this);
 
@@ -337,6 +399,9 @@ public:
            status_bits |= CONTRACT_MISMATCH_INPUTS;
          else {
            status_bits &= ~CONTRACT_MISMATCH_INPUTS; // Clear "missing inputs contract" flag
+           #ifndef NO_GLOBAL_VALUES
+           if (set_local_inputs_received(&message[1], length-1)) break;
+           #endif
            if (inputs.is_updated()) {
              status_bits &= ~MISSING_INPUTS; // Clear "missing inputs" flag
              notify(ntNewInputs, this);
@@ -345,6 +410,10 @@ public:
          }
          break;
       case mcSetTime: set_time(&message[1], length-1); notify(ntNewTime, this); break;
+      #ifndef NO_GLOBAL_VALUES
+      case mcSetGlobalMap: set_global_map(&message[1], length-1); break;
+      case mcSetGlobalValues: set_global_values(&message[1], length-1); break;
+      #endif
       #endif
       default: return false; // Unrecognized message
     }
@@ -378,7 +447,7 @@ public:
   }
 
   // Try to parse it as a request for data, returning the data in response if returning true
-  bool handle_request_message(const uint8_t *message, const uint8_t length, BinaryBuffer &response, uint8_t &response_length) {
+  bool handle_request_message(const uint8_t *message, const uint16_t length, BinaryBuffer &response, uint16_t &response_length) {
     response_length = 0;
     if (length < 1) return false;
     #ifdef DEBUG_PRINT
@@ -498,6 +567,81 @@ public:
   // Get offset in minutes from GMT, including DST and time zone
   int16_t get_time_offset_m() { return time_offset_m; }
   #endif // !NO_TIME_SYNC
+
+  #ifndef NO_GLOBAL_VALUES
+  // Receiving the map from global value ids to inputs from master:
+  // generation(1), inputs contract id(4), count(1), <input ix, global id>
+  void set_global_map(const uint8_t *message, const uint16_t length) {
+    uint32_t contract_id;
+    if (length < 6) return;
+    memcpy(&contract_id, &message[1], 4);
+    uint8_t count = message[5], num_inputs = inputs.get_num_variables();
+    if (contract_id != inputs.get_contract_id() || length < 6 + 2*count || num_inputs == 0) return;
+    if (!input_global_ids.allocate(2 * num_inputs)) {
+      mvs_out_of_memory = true;
+      #ifdef DEBUG_PRINT
+      DPRINTLN(F("MI::set_global_map OUT OF MEMORY"));
+      #endif
+      return;
+    }
+    memset(input_global_ids.get(), NO_GLOBAL_ID, num_inputs);
+    memset(&input_global_ids.get()[num_inputs], 0, num_inputs);
+    for (uint8_t i = 0; i < count; i++) {
+      uint8_t ix = message[6 + 2*i];
+      if (ix < num_inputs) input_global_ids[ix] = message[7 + 2*i];
+    }
+    global_map_contract_id = contract_id;
+    global_map_generation = message[0];
+  }
+
+  // Receiving broadcast global values from master: generation(1), count(1), <global id, size, value>
+  void set_global_values(const uint8_t *message, const uint16_t length) {
+    if (length < 2 || global_map_contract_id == 0) return;
+    if (global_map_contract_id != inputs.get_contract_id() || message[0] != global_map_generation) {
+      global_map_contract_id = 0; // The map is outdated, report this to master in status to get a new one
+      return;
+    }
+    uint8_t num_inputs = inputs.get_num_variables(), count = message[1];
+    const uint8_t *p = &message[2];
+    bool some_set = false;
+    for (uint8_t i = 0; i < count && p + 2 <= message + length && p + 2 + p[1] <= message + length; i++) {
+      for (uint8_t ix = 0; ix < num_inputs; ix++) {
+        if (input_global_ids[ix] != p[0] || inputs.get_size(ix) != p[1]) continue;
+        inputs.set_value(ix, &p[2], p[1]);
+        inputs.set_changed(ix, false); // Normal flow of values shall not set changed-flag
+        input_global_ids[num_inputs + ix] = 1; // Received
+        some_set = true;
+      }
+      p += 2 + p[1];
+    }
+    if (some_set) set_inputs_updated_if_all_received();
+  }
+
+  // Receiving the inputs that are not global values, sent by the master instead of all inputs when the
+  // global value map is active: contract id(4), count(1), <input ix, value>. Returns false for other inputs packets.
+  bool set_local_inputs_received(const uint8_t *message, const uint16_t length) {
+    uint8_t num_inputs = inputs.get_num_variables(), count = message[4];
+    if (global_map_contract_id == 0 || global_map_contract_id != inputs.get_contract_id() || count == 0
+      || count >= num_inputs || (count & 0b10000000) || input_global_ids.length() < 2 * num_inputs) return false;
+    const uint8_t *p = &message[5];
+    for (uint8_t i = 0; i < count && p < message + length && *p < num_inputs; i++) {
+      input_global_ids[num_inputs + *p] = 1; // Received
+      p += 1 + inputs.get_size(*p);
+    }
+    set_inputs_updated_if_all_received();
+    return true;
+  }
+
+  // Inputs are updated when all of them have been received, as global values or in a packet with the others
+  void set_inputs_updated_if_all_received() {
+    uint8_t num_inputs = inputs.get_num_variables();
+    for (uint8_t ix = 0; ix < num_inputs; ix++) if (input_global_ids[num_inputs + ix] == 0) return;
+    memset(&input_global_ids.get()[num_inputs], 0, num_inputs);
+    inputs.set_updated();
+    status_bits &= ~MISSING_INPUTS;
+    notify(ntNewInputs, this);
+  }
+  #endif
   #endif // !IS_MASTER
 
   // Return the uptime in seconds of this module
@@ -533,14 +677,18 @@ friend class ModuleInterfaceSet;
   #ifndef IS_MASTER
 
 
-  void get_status(BinaryBuffer &message, uint8_t start, uint8_t &length) {
+  void get_status(BinaryBuffer &message, uint16_t start, uint16_t &length) {
     // Show in status bits if settings have been changed on module side. This will trigger master to ask for them.
     if (settings.is_updated() && settings.is_changed()) status_bits |= MODIFIED_SETTINGS; else status_bits &= ~MODIFIED_SETTINGS;
     
     if (message.allocate(start + MI_STATUS_LEN)) {
-      uint8_t i = start;
+      uint16_t i = start;
       if (start == 0) message.get()[i++] = mcSetStatus; // Add command only if dedicated packet
-      message.get()[i++] = (uint8_t) status_bits;
+      uint8_t bits = (uint8_t) (status_bits | MULTI_MESSAGE_SUPPORT);
+      #ifndef NO_GLOBAL_VALUES
+      if (global_map_contract_id != 0 && global_map_contract_id == inputs.get_contract_id()) bits |= GLOBAL_VALUES_ACTIVE;
+      #endif
+      message.get()[i++] = bits;
       message.get()[i++] = (uint8_t) mvs_out_of_memory;
       uint32_t uptime_s = get_uptime_s();
       memcpy(&(message.get()[i]), &uptime_s, sizeof uptime_s);
@@ -601,6 +749,7 @@ friend class ModuleInterfaceSet;
       last_alive = millis(); if (last_alive == 0) last_alive = 1;
       comm_failures = 0;
       status_bits = message[0];
+      global_map_pending = false;
       out_of_memory = message[1];
       memcpy(&up_time, &message[2], sizeof up_time);
       if (got_contract() && (status_bits & (CONTRACT_MISMATCH_SETTINGS | CONTRACT_MISMATCH_INPUTS))) {
@@ -610,19 +759,28 @@ friend class ModuleInterfaceSet;
         #endif
         if (status_bits & CONTRACT_MISMATCH_SETTINGS) settings.invalidate_contract();
         if (status_bits & CONTRACT_MISMATCH_INPUTS) inputs.invalidate_contract();
+        #ifdef MI_METRICS
+        metrics.contract_mismatches++;
+        #endif
       }
     }
   }
 
   // These are used by ModuleInterfaceSet to manage inter-module value transfer
 
-  BinaryBuffer input_source_module_ix,
-               input_source_output_ix;
+  TypedBuffer<mi_module_ix_t> input_source_module_ix;
+  BinaryBuffer input_source_output_ix,
+               input_global_id;        // The global value id of each input, NO_GLOBAL_ID if not a global value
+  uint8_t global_map_generation = 0;   // Generation of the global value map last sent to module
+  uint8_t global_map_attempts = 0;     // Number of times this generation has been sent without confirmation
+  bool global_map_pending = false;     // Set when a map is sent, cleared by the next status from the module
   void allocate_source_arrays() {
     if (input_source_module_ix.allocate(inputs.get_num_variables()) &&
-        input_source_output_ix.allocate(inputs.get_num_variables())) {
-      input_source_module_ix.set_all(NO_VARIABLE); // no source
+        input_source_output_ix.allocate(inputs.get_num_variables()) &&
+        input_global_id.allocate(inputs.get_num_variables())) {
+      input_source_module_ix.set_all(NO_MODULE); // no source
       input_source_output_ix.set_all(NO_VARIABLE); // no source
+      input_global_id.set_all(NO_GLOBAL_ID);
     } else {
       mvs_out_of_memory = true;
       #ifdef DEBUG_PRINT
@@ -119,7 +119,7 @@ void decode_json_settings(ModuleInterface &interface, DynamicJsonDocument& root)
 
   char prefixed_name[MVAR_MAX_NAME_LENGTH + MVAR_PREFIX_LENGTH + 1];
   for (int j=0; j<interface.settings.get_num_variables(); j++) {
-    interface.settings.get_module_variable(j).get_prefixed_name(interface.get_prefix(), prefixed_name, sizeof prefixed_name);
+    interface.settings.get_prefixed_name(j, interface.get_prefix(), prefixed_name, sizeof prefixed_name);
     #if defined(MASTER_MULTI_TRANSFER) && defined(DEBUG_PRINT_SETTINGSYNC)
     ModuleVariable &mv = interface.settings.get_module_variable(j);
     bool prev_changed = mv.is_changed();
@@ -324,6 +324,35 @@ uint32_t get_max_request_time(ModuleInterface *interface) {
   return settings_output_time;
 }
 
+#ifdef MI_METRICS
+// Add latency percentiles in microseconds and transfer counters, for a module or for all modules
+void add_metrics(const char *prefix, const MIMetrics &metrics, DynamicJsonDocument &root) {
+  String name;
+  name = prefix; name += F("RttP50"); // Time from settings are sent until outputs are received
+  root[name] = metrics.get_percentile_us(mlOutputsRTT, 50);
+  name = prefix; name += F("RttP95");
+  root[name] = metrics.get_percentile_us(mlOutputsRTT, 95);
+  name = prefix; name += F("RttP99");
+  root[name] = metrics.get_percentile_us(mlOutputsRTT, 99);
+  name = prefix; name += F("AckP99"); // Time from a packet is sent until it is ACKed
+  root[name] = metrics.get_percentile_us(mlSendAck, 99);
+  name = prefix; name += F("EvtP99"); // Time from an output event is received until delivered as input event
+  root[name] = metrics.get_percentile_us(mlEvent, 99);
+  name = prefix; name += F("PktTx");
+  root[name] = metrics.packets_sent;
+  name = prefix; name += F("PktRx");
+  root[name] = metrics.packets_received;
+  name = prefix; name += F("ByteTx");
+  root[name] = metrics.bytes_sent;
+  name = prefix; name += F("ByteRx");
+  root[name] = metrics.bytes_received;
+  name = prefix; name += F("SendFail");
+  root[name] = metrics.failed_sends;
+  name = prefix; name += F("Mismatch");
+  root[name] = metrics.contract_mismatches;
+}
+#endif
+
 void add_module_status(ModuleInterface *interface, DynamicJsonDocument &root) {
   // Add status values
   String name;
@@ -345,6 +374,10 @@ void add_module_status(ModuleInterface *interface, DynamicJsonDocument &root) {
   // Find max time of request of outputs, settings or status
   name = interface->get_prefix(); name += F("ReqTime");
   root[name] = get_max_request_time(interface);
+
+  #ifdef MI_METRICS
+  add_metrics(interface->get_prefix(), interface->metrics, root);
+  #endif
 }
 
 void add_json_values(ModuleInterface *interface, DynamicJsonDocument &root) {
@@ -353,9 +386,10 @@ void add_json_values(ModuleInterface *interface, DynamicJsonDocument &root) {
 
   // Add output values
   char prefixed_name[MVAR_MAX_NAME_LENGTH + MVAR_PREFIX_LENGTH + 1];
-  for (int i=0; i<interface->outputs.get_num_variables(); i++) {
-    interface->outputs.get_module_variable(i).get_prefixed_name(interface->get_prefix(), prefixed_name, sizeof prefixed_name);
-    mv_to_json(interface->outputs.get_module_variable(i), root, prefixed_name);
+  const ModuleVariableSet &outputs = interface->outputs;
+  for (int i=0; i<outputs.get_num_variables(); i++) {
+    outputs.get_prefixed_name(i, interface->get_prefix(), prefixed_name, sizeof prefixed_name);
+    mv_to_json(outputs.get_module_variable(i), root, prefixed_name);
   }
 
   // Add status values
@@ -368,15 +402,16 @@ void add_json_settings(ModuleInterface *interface, DynamicJsonDocument &root) {
 
   // Add output values
   char prefixed_name[MVAR_MAX_NAME_LENGTH + MVAR_PREFIX_LENGTH + 1];
-  for (int i=0; i<interface->settings.get_num_variables(); i++) {
-    if (MITransferBase::is_mv_changed(interface->settings.get_module_variable(i), 0)) {
-      interface->settings.get_module_variable(i).get_prefixed_name(interface->get_prefix(), prefixed_name, sizeof prefixed_name);
+  const ModuleVariableSet &settings = interface->settings;
+  for (int i=0; i<settings.get_num_variables(); i++) {
+    if (MITransferBase::is_mv_changed(settings.get_module_variable(i), 0)) {
+      interface->settings.get_prefixed_name(i, interface->get_prefix(), prefixed_name, sizeof prefixed_name);
       #if defined(MASTER_MULTI_TRANSFER) && defined(DEBUG_PRINT_SETTINGSYNC)
       ModuleVariable &mv = interface->settings.get_module_variable(i);
       bool prev_changed = mv.is_changed();
       uint8_t prev_bits = mv.change_bits;
       #endif
-      mv_to_json(interface->settings.get_module_variable(i), root, prefixed_name);
+      mv_to_json(settings.get_module_variable(i), root, prefixed_name);
       #if defined(MASTER_MULTI_TRANSFER) && defined(DEBUG_PRINT_SETTINGSYNC)
       if (MITransferBase::is_mv_changed(mv, 0)) 
         printf("TO HTML '%s' VAL %ld cbits: %d->%d changed:%d->%d\n", prefixed_name, mv.get_uint32(), 
@@ -418,10 +453,10 @@ void set_scan_columns(DynamicJsonDocument &root,
   }
 }
 
-void FindMaxRequestTime(ModuleInterfaceSet &interfaces, uint32_t &req_time, uint8_t &req_ix) {
+void FindMaxRequestTime(ModuleInterfaceSet &interfaces, uint32_t &req_time, mi_module_ix_t &req_ix) {
   req_time = 0;
-  req_ix = 255;
-  for (uint8_t i=0; i<interfaces.num_interfaces; i++) {
+  req_ix = NO_MODULE;
+  for (mi_module_ix_t i=0; i<interfaces.num_interfaces; i++) {
     uint32_t devicemaxtime = get_max_request_time(interfaces[i]);
     if (devicemaxtime > req_time) {
       req_time = devicemaxtime;
@@ -478,7 +513,7 @@ void add_master_status(ModuleInterfaceSet &interfaces, DynamicJsonDocument &root
 
   // Register the longest request time and the responsible module
   uint32_t req_time = 0;
-  uint8_t req_ix = 255;
+  mi_module_ix_t req_ix = NO_MODULE;
   FindMaxRequestTime(interfaces, req_time, req_ix);
   name = interfaces.get_prefix(); name += F("MaxReqTm"); // Maximum response time across all modules
   root[name] = req_time;
@@ -489,6 +524,13 @@ void add_master_status(ModuleInterfaceSet &interfaces, DynamicJsonDocument &root
   // (Settings and outputs/inputs between modules and between modules and web server)
   name = interfaces.get_prefix(); name += F("TotalTm"); // Total transfer time
   root[name] = interfaces.last_total_usage_ms;
+
+  #ifdef MI_METRICS
+  // Latency percentiles and transfer counters for all modules
+  MIMetrics total;
+  interfaces.get_metrics(total);
+  add_metrics(interfaces.get_prefix(), total, root);
+  #endif
 }
 
 #ifdef MI_SMALLMEM // Little memory, transfer values for each module in separate requests.
@@ -34,6 +34,31 @@
 #define MI_SMALLMEM
 #endif
 
+// Buffer size needed for a single value as text, used when publishing one topic per variable
+#define MIMQTT_VALUE_TEXT_LENGTH 50
+
+// A JSON document that is kept between messages and reused after being cleared. It is only
+// reallocated when a larger capacity is needed, so that JSON mode does not do a large heap
+// allocation for every published or received message.
+class MIJsonDocument {
+#ifdef MIMQTT_USE_JSON
+  DynamicJsonDocument *doc = NULL;
+public:
+  ~MIJsonDocument() { deallocate(); }
+
+  // Return a cleared document with at least the requested capacity, or NULL if out of memory
+  DynamicJsonDocument *reserve(size_t capacity) {
+    if (doc && doc->capacity() >= capacity) { doc->clear(); return doc; }
+    deallocate();
+    doc = new DynamicJsonDocument(capacity);
+    if (doc && doc->capacity() < capacity) deallocate(); // The memory pool could not be allocated
+    return doc;
+  }
+
+  void deallocate() { if (doc) { delete doc; doc = NULL; } }
+#endif
+};
+
 class MIMqttTransfer : public MITransferBase {
 protected:
   // Configuration
@@ -43,6 +68,10 @@ protected:
   // State
   ReconnectingMqttClient client;
 
+  // Buffers kept between messages
+  BinaryBuffer buf, namebuf;
+  MIJsonDocument out_doc, in_doc;
+
   // Debug print related
   #if defined(DEBUG_PRINT) || defined(DEBUG_PRINT_SETTINGUPDATE_MQTT) || defined(DEBUG_PRINT_TIMES)
   uint32_t last_settings_debug_print_ms = 0;
@@ -54,7 +83,7 @@ protected:
     #if defined(DEBUG_PRINT) || defined(DEBUG_PRINT_SETTINGUPDATE_MQTT) || defined(DEBUG_PRINT_TIMES)
     if (some_settings_missing && mi_interval_elapsed(last_settings_debug_print_ms, 10000)) {
       some_settings_missing = false;
-      for (uint8_t module_ix = 0; module_ix < interfaces.get_module_count(); module_ix++) {
+      for (mi_module_ix_t module_ix = 0; module_ix < interfaces.get_module_count(); module_ix++) {
         uint8_t initialized = interfaces[module_ix]->settings.get_initialized_count(),
           total = interfaces[module_ix]->settings.get_num_variables();
         if (initialized < total) {
@@ -62,7 +91,7 @@ protected:
           printf("Still missing %d settings for %s: ", (total - initialized), interfaces[module_ix]->module_name);
           for (uint8_t v = 0; v < total; v++) {
             if (!interfaces[module_ix]->settings.get_module_variable(v).is_initialized()) {
-              printf("%s ", interfaces[module_ix]->settings.get_module_variable(v).name);
+              printf("%s ", interfaces[module_ix]->settings.get_variable_name(v));
             }
           }
           printf("\n");
@@ -75,6 +104,7 @@ protected:
 public:
   MIMqttTransfer(ModuleInterfaceSet &module_interface_set, const uint8_t *broker_address, const uint16_t broker_port = 1883) :
     MITransferBase(module_interface_set) {
+    namebuf.allocate(1 + mi_max(MAX_MODULE_NAME_LENGTH, MVAR_COMPOSITE_NAME_LENGTH));
     if (broker_address) set_broker_address(broker_ip, broker_port);
     client.set_receive_callback(static_read_callback, this);
   }
@@ -107,7 +137,7 @@ public:
   void put_settings() {
     // If any setting has been modified in module, send it to the broker
     uint32_t start = millis();
-    publish_to_mqtt(interfaces, client, true, transfer_ix);
+    publish_to_mqtt(interfaces, client, true, buf, namebuf, out_doc, transfer_ix);
     last_scan_times.last_set_settings_usage_ms = (uint32_t)(millis() - start);
   }
 
@@ -117,7 +147,7 @@ public:
   void put_values() {
     // Send values (outputs) to the broker
     uint32_t start = millis();
-    publish_to_mqtt(interfaces, client, false, transfer_ix);
+    publish_to_mqtt(interfaces, client, false, buf, namebuf, out_doc, transfer_ix);
     last_scan_times.last_set_values_usage_ms = (uint32_t)(millis() - start);
   }
 
@@ -132,60 +162,87 @@ public:
   // Publish changed settings for only one module
   void put_settings(ModuleInterface &mi, bool events_only) {
     // Send values (outputs) to the broker
-    BinaryBuffer buf(MI_MAX_JSON_SIZE), namebuf(1 + mi_max(MAX_MODULE_NAME_LENGTH, MVAR_COMPOSITE_NAME_LENGTH));
-    publish_to_mqtt(mi, client, true, buf, namebuf, transfer_ix, events_only);
+    publish_to_mqtt(mi, client, true, buf, namebuf, out_doc, transfer_ix, events_only);
   }
 
   // Publish outputs for only one module
   void put_values(ModuleInterface &mi, bool events_only) {
     // Send values (outputs) to the broker
-    BinaryBuffer buf(MI_MAX_JSON_SIZE), namebuf(1 + mi_max(MAX_MODULE_NAME_LENGTH, MVAR_COMPOSITE_NAME_LENGTH));
-    publish_to_mqtt(mi, client, false, buf, namebuf, transfer_ix, events_only);
+    publish_to_mqtt(mi, client, false, buf, namebuf, out_doc, transfer_ix, events_only);
   }
 
   void put_events() {
     // Send events to MQTT
-    for (uint8_t m = 0; m < interfaces.get_module_count(); m++) {
+    for (mi_module_ix_t m = 0; m < interfaces.get_module_count(); m++) {
       if (interfaces[m]->outputs.has_events()) put_values(*interfaces[m], true);
       if (interfaces[m]->settings.has_events()) put_settings(*interfaces[m], true);
     }
   }
 
-  static void publish_to_mqtt(ModuleInterfaceSet &interfaces, ReconnectingMqttClient &client, bool settings, uint8_t transfer_ix) {
-    BinaryBuffer buf(MI_MAX_JSON_SIZE), namebuf(1 + mi_max(MAX_MODULE_NAME_LENGTH, MVAR_COMPOSITE_NAME_LENGTH));
-    for (uint8_t m = 0; m < interfaces.get_module_count(); m++) {
-      publish_to_mqtt(*interfaces[m], client, settings, buf, namebuf, transfer_ix, false);
+  // A JSON document kept by the caller can be passed to reuse its memory between calls
+  static void publish_to_mqtt(ModuleInterfaceSet &interfaces, ReconnectingMqttClient &client, bool settings, uint8_t transfer_ix,
+                              MIJsonDocument *doc = NULL) {
+    BinaryBuffer buf, namebuf(1 + mi_max(MAX_MODULE_NAME_LENGTH, MVAR_COMPOSITE_NAME_LENGTH));
+    MIJsonDocument local_doc;
+    publish_to_mqtt(interfaces, client, settings, buf, namebuf, doc ? *doc : local_doc, transfer_ix);
+  }
+
+  static void publish_to_mqtt(ModuleInterfaceSet &interfaces, ReconnectingMqttClient &client, bool settings,
+                              BinaryBuffer &buf, BinaryBuffer &namebuf, MIJsonDocument &doc, uint8_t transfer_ix) {
+    for (mi_module_ix_t m = 0; m < interfaces.get_module_count(); m++) {
+      publish_to_mqtt(*interfaces[m], client, settings, buf, namebuf, doc, transfer_ix, false);
     }
   }
 
   static void publish_to_mqtt(ModuleInterface &mi, ReconnectingMqttClient &client, bool settings, 
-                              BinaryBuffer &buf, BinaryBuffer &namebuf, uint8_t transfer_ix, bool events_only) {
+                              BinaryBuffer &buf, BinaryBuffer &namebuf, uint8_t transfer_ix, bool events_only,
+                              MIJsonDocument *doc = NULL) {
+    MIJsonDocument local_doc;
+    publish_to_mqtt(mi, client, settings, buf, namebuf, doc ? *doc : local_doc, transfer_ix, events_only);
+  }
+
+  #ifdef MIMQTT_USE_JSON
+  // The JSON memory pool needed for publishing a variable set. Names are copied into the document.
+  static size_t get_json_capacity(const ModuleInterface &mi, const ModuleVariableSet &mvs) {
+    size_t capacity = JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(mvs.get_num_variables())
+                      + strlen(mi.module_name) + strlen(mi.module_prefix) + 2;
+    for (uint8_t i = 0; i < mvs.get_num_variables(); i++)
+      capacity += strlen(mvs.get_variable_name(i)) + 1;
+    return capacity;
+  }
+  #endif
+
+  static void publish_to_mqtt(ModuleInterface &mi, ReconnectingMqttClient &client, bool settings, 
+                              BinaryBuffer &buf, BinaryBuffer &namebuf, MIJsonDocument &doc,
+                              uint8_t transfer_ix, bool events_only) {
     // Scan for changes and events
     ModuleVariableSet &mvs = settings ? mi.settings : mi.outputs;
-    bool some_events = false, some_changes = false;
-    for (uint8_t i = 0; i < mvs.get_num_variables(); i++) {
-      const ModuleVariable &v = mvs.get_module_variable(i);
-      if (v.is_event()) some_events = true;
-      if (v.is_changed()) some_changes = true;
-    }
-    if (events_only && !some_events) return;
-    if (!some_changes) return;
+    const ModuleVariableSet &const_mvs = mvs; // Read-only access keeps the flag counts valid
+    if (events_only && !mvs.has_events()) return;
+    if (!mvs.is_changed()) return;
 
     #ifdef MIMQTT_USE_JSON
-    // Build JSON text
-    DynamicJsonDocument root(MI_MAX_JSON_SIZE * 2);
+    // Build JSON text in the reused document, sized to the contract
+    DynamicJsonDocument *rootp = doc.reserve(get_json_capacity(mi, mvs));
+    if (!rootp) return;
+    DynamicJsonDocument &root = *rootp;
     root["Name"] = mi.module_name;
     root["Prefix"] = mi.module_prefix;
     //if (some_events) root["Event"] = true; // Avoid this, it causes a temporary fast feedback loop
     JsonObject o = root.createNestedObject("Values");
     for (uint8_t i = 0; i < mvs.get_num_variables(); i++) {
-      const ModuleVariable &v = mvs.get_module_variable(i);
+      const ModuleVariable &v = const_mvs.get_module_variable(i);
       #ifdef MASTER_MULTI_TRANSFER
       if (v.is_initialized())
       #endif
-      mv_to_json(v, o, v.name);
+      mv_to_json(v, o, mvs.get_variable_name(i));
     }
-    serializeJson(root, (char *)buf.get(), buf.length());
+    size_t json_length = measureJson(root) + 1;
+    if (json_length > 0xFFFF || !buf.allocate((uint16_t) json_length)) return;
+    serializeJson(root, buf.chars(), buf.length());
+    #else
+    (void) doc; // Only used for JSON
+    if (!buf.allocate(MIMQTT_VALUE_TEXT_LENGTH)) return;
     #endif
 
     // Build topic
@@ -199,12 +256,18 @@ public:
     // Publish JSON packet to broker
     client.publish(topic.c_str(), buf.chars(), true, 1);
     #else 
-    // Publish each variable by itself
+    // Publish each variable by itself, visiting only the flagged variables. With multiple transfers,
+    // the changed-bit of this transfer can remain after the changed-flag is cleared, so all are visited.
     String t, name;
-    for (uint8_t i = 0; i < mvs.get_num_variables(); i++) {
-      ModuleVariable &v = mvs.get_module_variable(i);
+    uint8_t first = 0, end = mvs.get_num_variables();
+    #ifndef MASTER_MULTI_TRANSFER
+    if (events_only) mvs.get_event_range(first, end);
+    else mvs.get_changed_range(first, end);
+    #endif
+    for (uint8_t i = first; i < end; i++) {
+      const ModuleVariable &v = const_mvs.get_module_variable(i);
       if (is_mv_changed(v, transfer_ix) && (!events_only || v.is_event())) {
-        strncpy(namebuf.chars(), v.name, namebuf.length());
+        mvs.get_variable_name(i, namebuf.chars());
         mi_lowercase(namebuf.chars());
         t = topic; t += "/"; t += namebuf.chars();
         v.get_value_as_text(buf.chars(), (uint8_t)buf.length());
@@ -214,7 +277,13 @@ public:
           printf("TO MQTT topic %s: %s bits:%d changed:%d\n", t.c_str(), buf.chars(), v.change_bits, v.is_changed());
         #endif
         // Do not transfer output again unless changed
-        if (!settings) clear_mv_changed(v, transfer_ix);
+        if (!settings) {
+          #ifdef MASTER_MULTI_TRANSFER
+          clear_mv_changed(mvs.get_module_variable(i), transfer_ix); // Only the bit of this transfer, not counted
+          #else
+          mvs.set_changed(i, false); // Keeps the flag counts valid
+          #endif
+        }
       }
     }
     #endif
@@ -241,7 +310,7 @@ public:
     if (p3) category[p3 - p2] = 0; // "setting/hhtemp" -> "setting"
 
     // Locate the correct ModuleInterface
-    uint8_t module_ix = interfaces.find_interface_by_name_ignorecase(modulename.c_str());
+    mi_module_ix_t module_ix = interfaces.find_interface_by_name_ignorecase(modulename.c_str());
     ModuleInterface *mi = (module_ix == NO_MODULE ? NULL : interfaces[module_ix]);
 
 /* TODO: Investigate this idea
@@ -288,10 +357,18 @@ public:
     if (!mvs) return;
 
     #ifdef MIMQTT_USE_JSON
-    // Parse JSON
-    int capacity = JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(255);
-    DynamicJsonDocument root(capacity);
-    DeserializationError result = deserializeJson(root, data);
+    // Parse JSON into the reused document, sized to the contract and the payload (strings are copied).
+    // If the payload contains more values than the contract, retry once with the full capacity.
+    DynamicJsonDocument *rootp = in_doc.reserve(JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(mvs->get_num_variables()) + len + 1);
+    if (!rootp) return;
+    DeserializationError result = deserializeJson(*rootp, data, len);
+    if (result == DeserializationError::NoMemory) {
+      rootp = in_doc.reserve(JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(255) + len + 1);
+      if (!rootp) return;
+      result = deserializeJson(*rootp, data, len);
+    }
+    if (result) return;
+    DynamicJsonDocument &root = *rootp;
     String name = root["Name"];    if (!mi_compare_ignorecase(name.c_str(), modulename.c_str(), modulename.length())) return; // Payload meant for another module
     bool is_event = root["Event"];
     JsonObject values = root["Values"];
@@ -46,8 +46,10 @@ bool write_settings_to_eeprom(const ModuleInterface &mi, uint16_t eeprom_start_p
     
   // Get serialized settings values and store it
   BinaryBuffer buf;
-  uint8_t length = 0;
-  mi.settings.get_values(buf, length, mcSetSettings);
+  uint16_t value_length = 0;
+  mi.settings.get_values(buf, value_length, mcSetSettings);
+  if (value_length > 255) return false; // The length is stored in one byte
+  uint8_t length = (uint8_t) value_length;
   p += eeprom_update_bytes(&length, sizeof length, p, modified); // Store length explicitly  
   p += eeprom_update_bytes(buf.get(), length, p, modified);
   #ifdef DEBUG_PRINT
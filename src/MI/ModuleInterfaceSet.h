@@ -4,30 +4,117 @@
 #define IS_MASTER      // Can be defined manually if using ModuleInterface directly on master side for one-to-one
 #define USE_MIVARIABLE // Can be defined manually to use this on module side as well
 
-// Value 255 is reserved to mean "no module"
-#define NO_MODULE ((uint8_t)255)
-
 #include <MI/ModuleInterface.h>
 #include <utils/MITime.h>
 #include <utils/MIUtilities.h>
+#ifdef MI_SNAPSHOT
+#include <MI/ModuleInterfaceSnapshot.h>
+#endif
+#ifdef MI_SHARED_MEMORY
+#include <MI/ModuleInterfaceSharedMemory.h>
+#endif
+#ifdef MI_WARM_RESTART
+#include <MI/ModuleInterfaceWarmRestart.h>
+#endif
+#ifdef MI_PROFILE
+#include <MI/MIProfiler.h>
+#else
+#define MI_PROFILE_BEGIN(phase)
+#define MI_PROFILE_BEGIN_TRANSFER(phase, t)
+#define MI_PROFILE_END()
+#endif
 
 class ModuleInterfaceSet {
 protected:
   char moduleset_prefix[MVAR_PREFIX_LENGTH+1]; // A unique lower case prefix, useful if there are multiple masters connected to same db
   bool updated_intermodule_dependencies = false; 
   uint16_t active_contract_count = 0;
+  MINamePool name_pool; // Variable names for all modules, each distinct name stored once
+  #ifdef MI_SNAPSHOT
+  MISnapshotPublisher snapshot_publisher; // Values published for reading from other threads
+  #endif
+  #ifdef MI_SHARED_MEMORY
+  MISharedMemoryPublisher shared_memory_publisher; // Values published for reading from other processes
+  #endif
+  #ifdef MI_WARM_RESTART
+  MIWarmRestart warm_restart; // State saved to a file, restored after a restart
+  #endif
+  #ifndef NO_GLOBAL_VALUES
+  // Outputs used as inputs by at least MI_GLOBAL_MIN_CONSUMERS modules, to be broadcast as global values.
+  // The global value id is the position in these arrays.
+  uint8_t global_count = 0, global_generation = 0;
+  TypedBuffer<mi_module_ix_t> global_source_module_ix;
+  BinaryBuffer global_source_output_ix;
+
+  // Give a global value id to each output used by enough inputs, and register it for the inputs
+  void assign_global_values() {
+    global_count = 0;
+    global_generation++;
+    uint32_t total_inputs = 0;
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) total_inputs += interfaces[i]->inputs.get_num_variables();
+    if (total_inputs == 0) return;
+    if (total_inputs > NO_GLOBAL_ID) total_inputs = NO_GLOBAL_ID; // There cannot be more global values than ids
+    if (!global_source_module_ix.allocate(total_inputs) || !global_source_output_ix.allocate(total_inputs)) {
+      mvs_out_of_memory = true;
+      #ifdef DEBUG_PRINT
+      DPRINTLN(F("MIS::assign_global_values OUT OF MEMORY"));
+      #endif
+      return;
+    }
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
+      ModuleInterface *mi = interfaces[i];
+      if (mi->input_global_id.length() < mi->inputs.get_num_variables()) continue;
+      for (uint8_t j = 0; j < mi->inputs.get_num_variables(); j++) {
+        mi_module_ix_t module_ix = mi->input_source_module_ix[j];
+        uint8_t var_ix = mi->input_source_output_ix[j];
+        if (module_ix == NO_MODULE || var_ix == NO_VARIABLE) continue;
+        // Modules only accept global values of the input size, so other inputs must be sent to each module
+        if (interfaces[module_ix]->outputs.get_size(var_ix) != mi->inputs.get_size(j)) continue;
+        // Use the global value if already registered
+        uint8_t id = 0;
+        while (id < global_count && (global_source_module_ix[id] != module_ix || global_source_output_ix[id] != var_ix)) id++;
+        if (id == global_count) {
+          if (global_count == NO_GLOBAL_ID || count_output_consumers(module_ix, var_ix) < MI_GLOBAL_MIN_CONSUMERS) continue;
+          global_source_module_ix[id] = module_ix;
+          global_source_output_ix[id] = var_ix;
+          global_count++;
+        }
+        mi->input_global_id[j] = id;
+      }
+    }
+  }
+
+  uint8_t count_output_consumers(const mi_module_ix_t module_ix, const uint8_t var_ix) const {
+    uint8_t count = 0;
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
+      const ModuleInterface *mi = interfaces[i];
+      if (mi->input_source_module_ix.length() < mi->inputs.get_num_variables()) continue;
+      for (uint8_t j = 0; j < mi->inputs.get_num_variables(); j++)
+        if (mi->input_source_module_ix[j] == module_ix && mi->input_source_output_ix[j] == var_ix && count < 255) count++;
+    }
+    return count;
+  }
+  #endif
+
+  // Let all variable sets store their names in the shared pool
+  void assign_name_pool() {
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) if (interfaces[i]) interfaces[i]->set_name_pool(&name_pool);
+  }
 public:
-  uint8_t num_interfaces = 0;
+  mi_module_ix_t num_interfaces = 0;
   ModuleInterface **interfaces = NULL;
   
   // Statistics
   uint32_t last_total_usage_ms = 0; // Time for the whole transfer operation to/from all modules and web server
+  #ifdef MI_PROFILE
+  MIProfiler profiler;              // Time spent in each phase of the recent transfer cycles
+  #endif
   
   ModuleInterfaceSet(const char *prefix = NULL) { set_prefix(prefix); }  
-  ModuleInterfaceSet(const uint8_t num_interfaces, const char *prefix = NULL) {
+  ModuleInterfaceSet(const mi_module_ix_t num_interfaces, const char *prefix = NULL) {
     set_prefix(prefix);
     this->num_interfaces = num_interfaces; interfaces = new ModuleInterface*[num_interfaces];
-    for (uint8_t i=0; i < num_interfaces; i++) {
+    for (mi_module_ix_t i=0; i < num_interfaces; i++) {
       interfaces[i] = new ModuleInterface();
       if (interfaces[i] == NULL) {
         mvs_out_of_memory = true;
@@ -36,10 +123,11 @@ public:
         #endif
       }
     }
+    assign_name_pool();
   }
   ~ModuleInterfaceSet() {
     if (interfaces != NULL) {
-      for (int i=0; i < num_interfaces; i++) delete interfaces[i];
+      for (mi_module_ix_t i=0; i < num_interfaces; i++) delete interfaces[i];
       delete interfaces;
     }
   }
@@ -51,22 +139,100 @@ public:
     }
   }
   const char *get_prefix() const { return moduleset_prefix; }
+  const MINamePool &get_name_pool() const { return name_pool; }
+
+  // Rebuild the shared name pool with only the names in use, dropping names left by replaced
+  // contracts. The first pass only fills the new pool, so nothing is changed if it runs out of memory.
+  bool compact_name_pool() {
+    MINamePool compacted;
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++)
+      if (interfaces[i] && !interfaces[i]->copy_names_to(compacted, false)) return false;
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++)
+      if (interfaces[i]) interfaces[i]->copy_names_to(compacted, true);
+    name_pool.swap(compacted);
+    return true;
+  }
+  #ifndef NO_GLOBAL_VALUES
+  uint8_t get_global_value_count() const { return global_count; }
+  #endif
+
+  #ifdef MI_METRICS
+  // Latency histograms and transfer counters of a module
+  const MIMetrics &get_metrics(const mi_module_ix_t ix) const { return interfaces[ix]->metrics; }
+
+  // The sum of the metrics for all modules
+  void get_metrics(MIMetrics &total) const {
+    total.clear();
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) total.add(interfaces[i]->metrics);
+  }
+  // A latency percentile (0-100) in microseconds for a module, or for all modules if ix is NO_MODULE
+  uint32_t get_latency_percentile_us(const mi_module_ix_t ix, const MILatencyType type, const uint8_t percent) const {
+    if (ix != NO_MODULE) return interfaces[ix]->metrics.get_percentile_us(type, percent);
+    MIHistogram total;
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) total.add(interfaces[i]->metrics.latency[type]);
+    return total.get_percentile_us(percent);
+  }
+  void clear_metrics() { for (mi_module_ix_t i = 0; i < num_interfaces; i++) interfaces[i]->metrics.clear(); }
+  #endif
+
+  #ifdef MI_SNAPSHOT
+  // Publish a consistent copy of all values, to be read by other threads with read_snapshot.
+  // This is done after each transfer_all, but can also be called manually from the master loop.
+  bool publish_snapshot() { return snapshot_publisher.publish(interfaces, num_interfaces); }
+
+  // Get the last published values. Can be called from any thread, and never blocks the master loop.
+  bool read_snapshot(MISnapshot &snapshot) const { return snapshot_publisher.read(snapshot); }
+  #endif
+
+  #ifdef MI_SHARED_MEMORY
+  // Create a shared memory segment (like "/mi_master") where the values are published for other processes,
+  // to be read with MISharedMemoryReader. Values are published after each transfer_all, and events at once.
+  bool open_shared_memory(const char *name = MI_SHM_DEFAULT_NAME, const uint32_t max_modules = MI_SHM_MAX_MODULES,
+                          const uint32_t max_variables = MI_SHM_MAX_VARIABLES) {
+    return shared_memory_publisher.open(name, moduleset_prefix, max_modules, max_variables);
+  }
+  void close_shared_memory() { shared_memory_publisher.close(); }
+  bool publish_shared_memory(const bool events_only = false) { return shared_memory_publisher.publish(interfaces, num_interfaces, events_only); }
+  #endif
+
+  #ifdef MI_WARM_RESTART
+  // Restore the contracts, settings and outputs saved in a file by the previous run, and save them to the
+  // file at an interval from then on. Call this when the modules have been set up, before the first update.
+  // Returns true if a saved state was found.
+  bool begin_warm_restart(const char *path, const uint32_t save_interval_ms = MI_WARM_RESTART_INTERVAL_MS,
+                          const uint32_t max_value_age_ms = MI_WARM_RESTART_MAX_AGE_MS) {
+    if (!warm_restart.begin(path, save_interval_ms, max_value_age_ms)) return false;
+    warm_restart.restore(interfaces, num_interfaces);
+    return true;
+  }
+  // Called after each transfer_all, but can also be called manually from the master loop
+  void update_warm_restart() { warm_restart.update(interfaces, num_interfaces); }
+  bool save_warm_restart() { return warm_restart.save(interfaces, num_interfaces); } // Like before a planned stop
+  #endif
   
-  void assign_names(const char *names[]) { for (int i=0; i<num_interfaces; i++) interfaces[i]->set_name(names[i]); }
-  ModuleInterface *operator [] (const uint8_t ix) { return (interfaces[ix]); }
+  void assign_names(const char *names[]) { for (mi_module_ix_t i=0; i<num_interfaces; i++) interfaces[i]->set_name(names[i]); }
+  ModuleInterface *operator [] (const mi_module_ix_t ix) { return (interfaces[ix]); }
   
   void update_intermodule_dependencies() {
 	  uint16_t count = count_active_contracts();
 	  if (count != active_contract_count) updated_intermodule_dependencies = false;
     if (!updated_intermodule_dependencies && count > 0) {
-      for (uint8_t i = 0; i < num_interfaces; i++) {
+      for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
         interfaces[i]->allocate_source_arrays();
         for (int j=0; j<interfaces[i]->inputs.get_num_variables(); j++) {
-          find_output_by_name(interfaces[i]->inputs.get_module_variable(j).name,
+          find_output_by_name(interfaces[i]->inputs.get_variable_name(j),
                               interfaces[i]->input_source_module_ix[j],
                               interfaces[i]->input_source_output_ix[j]);
+          // Let the input use the deadband of its source output, so that noise is not sent as input changes
+          mi_module_ix_t module_ix = interfaces[i]->input_source_module_ix[j];
+          uint8_t var_ix = interfaces[i]->input_source_output_ix[j];
+          interfaces[i]->inputs.inherit_deadband((uint8_t) j, module_ix != NO_MODULE && var_ix != NO_VARIABLE ?
+            interfaces[module_ix]->outputs.get_deadband(var_ix) : 0);
         }
       }
+      #ifndef NO_GLOBAL_VALUES
+      assign_global_values();
+      #endif
       updated_intermodule_dependencies = true;
       active_contract_count = count;
     }
@@ -83,14 +249,15 @@ public:
     update_intermodule_dependencies();	
     if (!updated_intermodule_dependencies) return; // Not updated yet, wait for all contracts
     uint8_t buf[4]; // Largest value possibly encountered
-    for (int i=0; i<num_interfaces; i++) {
+    for (mi_module_ix_t i=0; i<num_interfaces; i++) {
       if (interfaces[i]->input_source_module_ix.length()==0 || interfaces[i]->input_source_output_ix.length() == 0) continue;
       bool all_sources_updated = true, some_set = false;
       for (int j=0; j<interfaces[i]->inputs.get_num_variables(); j++) {
-        uint8_t module_ix = interfaces[i]->input_source_module_ix[j], var_ix = interfaces[i]->input_source_output_ix[j];
+        mi_module_ix_t module_ix = interfaces[i]->input_source_module_ix[j];
+        uint8_t var_ix = interfaces[i]->input_source_output_ix[j];
         if (module_ix != NO_MODULE && var_ix != NO_VARIABLE) {
           if (interfaces[module_ix]->outputs.is_updated()) {     
-            uint8_t size = interfaces[i]->inputs.get_module_variable(j).get_size();
+            uint8_t size = interfaces[i]->inputs.get_size(j);
             memset(buf, 0, 4);
             interfaces[module_ix]->outputs.get_value(var_ix, buf, size);
             interfaces[i]->inputs.set_value(j, buf, size);
@@ -118,19 +285,25 @@ public:
   void transfer_events_from_outputs_to_inputs() {
     if (!updated_intermodule_dependencies) return; // Not updated yet, wait for all contracts
     uint8_t buf[4]; // Largest value possibly encountered
-    for (uint8_t i = 0; i < num_interfaces; i++) {
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
       if (interfaces[i]->input_source_module_ix.length()==0 || interfaces[i]->input_source_output_ix.length() == 0) continue;
       for (uint8_t j = 0; j < interfaces[i]->inputs.get_num_variables(); j++) {
-        uint8_t module_ix = interfaces[i]->input_source_module_ix[j], var_ix = interfaces[i]->input_source_output_ix[j];
+        mi_module_ix_t module_ix = interfaces[i]->input_source_module_ix[j];
+        uint8_t var_ix = interfaces[i]->input_source_output_ix[j];
         if (module_ix != NO_MODULE && var_ix != NO_VARIABLE) {
-          if (interfaces[module_ix]->outputs.get_module_variable(var_ix).is_event()) {
+          if (interfaces[module_ix]->outputs.is_event(var_ix)) {
             // Copy value
-            uint8_t size = interfaces[i]->inputs.get_module_variable(j).get_size();
+            uint8_t size = interfaces[i]->inputs.get_size(j);
             memset(buf, 0, 4);
             interfaces[module_ix]->outputs.get_value(var_ix, buf, size);
             interfaces[i]->inputs.set_value(j, buf, size);
             // Set event flag
             interfaces[i]->inputs.set_event(j);
+            #ifdef MI_METRICS
+            // Measure the event latency from the earliest source event
+            uint32_t &input_us = interfaces[i]->metrics.input_event_us, output_us = interfaces[module_ix]->metrics.output_event_us;
+            if (output_us != 0 && (input_us == 0 || (int32_t) (output_us - input_us) < 0)) input_us = output_us;
+            #endif
           }
         }
       }
@@ -139,14 +312,14 @@ public:
 
   uint16_t count_active_contracts() {
     uint16_t count = 0;  
-    for (uint8_t i = 0; i < num_interfaces; i++) {
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
       if (interfaces[i]->got_contract() && interfaces[i]->is_active()) count++;
     }
     return count;
   }
   
   bool got_all_contracts() {
-    for (uint8_t i = 0; i < num_interfaces; i++) {
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
       if (!interfaces[i]->got_contract() && interfaces[i]->is_active()) {
         updated_intermodule_dependencies = false; // Interconnections no longer valid, must be recomputed
         return false;
@@ -155,63 +328,63 @@ public:
     return true;
   }
   
-  uint8_t get_module_count() const { return num_interfaces; }
+  mi_module_ix_t get_module_count() const { return num_interfaces; }
 
   // If a device gets unplugged or dies, it will register as inactive after a while.
   // Get the count of inactive modules
-  uint8_t get_inactive_module_count() {
-    uint8_t cnt = 0;
-    for (uint8_t i=0; i<num_interfaces; i++) if (!interfaces[i]->is_active()) cnt++;
+  mi_module_ix_t get_inactive_module_count() {
+    mi_module_ix_t cnt = 0;
+    for (mi_module_ix_t i=0; i<num_interfaces; i++) if (!interfaces[i]->is_active()) cnt++;
     return cnt;
   }  
   
   // Register notification callback function common for all interfaces.
   // (Can register individual callback functions instead by calling the associated ModuleInterface function directly.)
   void set_notification_callback(notify_function n) { 
-    for (uint8_t i = 0; i < num_interfaces; i++) interfaces[i]->set_notification_callback(n);
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) interfaces[i]->set_notification_callback(n);
   }
 
   // Locate the interface that has the specified name.
-  uint8_t find_interface_by_name(const char *name) const {
-    for (uint8_t i = 0; i < num_interfaces; i++)
+  mi_module_ix_t find_interface_by_name(const char *name) const {
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++)
       if (strncmp(name, interfaces[i]->module_name, MAX_MODULE_NAME_LENGTH) == 0) return i;
     return NO_MODULE;
   }
 
   // Locate the interface that has the specified name but ignore case
-  uint8_t find_interface_by_name_ignorecase(const char *name) const {
-    for (uint8_t i = 0; i < num_interfaces; i++)
+  mi_module_ix_t find_interface_by_name_ignorecase(const char *name) const {
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++)
       if (mi_compare_ignorecase(name, interfaces[i]->module_name, MAX_MODULE_NAME_LENGTH)) return i;
     return NO_MODULE;
   }
 
   // Locate the interface that has the specified prefix. Only the start of the given string will be checked,
   // so it can be a full prefixed variable name.
-  uint8_t find_interface_by_prefix(const char *prefix) const {
-    for (uint8_t i = 0; i < num_interfaces; i++)
+  mi_module_ix_t find_interface_by_prefix(const char *prefix) const {
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++)
       if (strncmp(prefix, interfaces[i]->get_prefix(), MVAR_PREFIX_LENGTH)==0) return i;
     return NO_MODULE;
   }
 
   // Helper functions for getting a variable set for a specific interface
   ModuleVariableSet *find_settings_by_prefix(const char *prefix) {
-    uint8_t i = find_interface_by_prefix(prefix);
+    mi_module_ix_t i = find_interface_by_prefix(prefix);
     return i == NO_MODULE ? NULL : &(interfaces[i]->settings);
   }
   ModuleVariableSet *find_inputs_by_prefix(const char *prefix) {
-    uint8_t i = find_interface_by_prefix(prefix);
+    mi_module_ix_t i = find_interface_by_prefix(prefix);
     return i == NO_MODULE ? NULL : &(interfaces[i]->inputs);
   }
   ModuleVariableSet *find_outputs_by_prefix(const char *prefix) {
-    uint8_t i = find_interface_by_prefix(prefix);
+    mi_module_ix_t i = find_interface_by_prefix(prefix);
     return i == NO_MODULE ? NULL : &(interfaces[i]->outputs);
   }
 
-  bool find_output_by_name(const char *name, uint8_t &interface_ix, uint8_t &output_ix) const {
+  bool find_output_by_name(const char *name, mi_module_ix_t &interface_ix, uint8_t &output_ix) const {
     char prefixed_name[MVAR_MAX_NAME_LENGTH + MVAR_PREFIX_LENGTH + 1];
-    for (uint8_t i=0; i<num_interfaces; i++) {
+    for (mi_module_ix_t i=0; i<num_interfaces; i++) {
       for (uint8_t j=0; j < interfaces[i]->outputs.get_num_variables(); j++) {
-        interfaces[i]->outputs.get_module_variable(j).get_prefixed_name(interfaces[i]->get_prefix(), prefixed_name, sizeof prefixed_name);
+        interfaces[i]->outputs.get_prefixed_name(j, interfaces[i]->get_prefix(), prefixed_name, sizeof prefixed_name);
         if (strcmp(name, prefixed_name) == 0) {
           interface_ix = i;
           output_ix = j;
@@ -224,7 +397,7 @@ public:
     return false;
   }
 
-  bool find_setting_by_name(const char *name, uint8_t &interface_ix, uint8_t &setting_ix) const {
+  bool find_setting_by_name(const char *name, mi_module_ix_t &interface_ix, uint8_t &setting_ix) const {
     interface_ix = find_interface_by_prefix(name);
     if (interface_ix != NO_MODULE && strlen(name) > MVAR_PREFIX_LENGTH) {
       setting_ix = interfaces[interface_ix]->settings.get_variable_ix(&name[MVAR_PREFIX_LENGTH]);
@@ -235,7 +408,14 @@ public:
     return false;
   }
 
-  void clear_output_events() { for (uint8_t i = 0; i < num_interfaces; i++) ((PJONModuleInterface*) (interfaces[i]))->outputs.clear_events(); }
-  void clear_input_events() { for (uint8_t i = 0; i < num_interfaces; i++) ((PJONModuleInterface*) (interfaces[i]))->inputs.clear_events(); }
-  void clear_setting_events() { for (uint8_t i = 0; i < num_interfaces; i++) ((PJONModuleInterface*) (interfaces[i]))->settings.clear_events(); }
+  void clear_output_events() {
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
+      ((PJONModuleInterface*) (interfaces[i]))->outputs.clear_events();
+      #ifdef MI_METRICS
+      interfaces[i]->metrics.output_event_us = 0;
+      #endif
+    }
+  }
+  void clear_input_events() { for (mi_module_ix_t i = 0; i < num_interfaces; i++) ((PJONModuleInterface*) (interfaces[i]))->inputs.clear_events(); }
+  void clear_setting_events() { for (mi_module_ix_t i = 0; i < num_interfaces; i++) ((PJONModuleInterface*) (interfaces[i]))->settings.clear_events(); }
 };
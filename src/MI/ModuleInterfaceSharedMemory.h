@@ -0,0 +1,219 @@
+#pragma once
+
+// Publishing of the live variable table of a master in a POSIX shared memory segment, letting other
+// processes on the same host read values without going through MQTT or HTTP.
+// Enabled by defining MI_SHARED_MEMORY before including MIMaster.h, and only available on POSIX.
+//
+// The segment is created by ModuleInterfaceSet::open_shared_memory. All values are published after
+// each transfer_all, and values flagged as events are published as soon as they are handled.
+// Only changed values are written, each under its own sequence lock, so readers never block the
+// master loop. The layout of the segment and the reader are in MISharedMemory.h.
+
+#include <MI/ModuleInterface.h>
+#include <utils/MITime.h>
+#include <MI/MISharedMemory.h>
+
+#ifndef MI_POSIX
+  #error "MI_SHARED_MEMORY is only supported on POSIX platforms"
+#endif
+
+// Capacity of the segment, which has a fixed size so that readers never have to map it again
+#ifndef MI_SHM_MAX_MODULES
+  #define MI_SHM_MAX_MODULES 256
+#endif
+#ifndef MI_SHM_MAX_VARIABLES
+  #define MI_SHM_MAX_VARIABLES 8192
+#endif
+
+static_assert(MVAR_MAX_NAME_LENGTH < MI_SHM_NAME_LENGTH, "MVAR_MAX_NAME_LENGTH is too long for the shared memory table");
+static_assert(MAX_MODULE_NAME_LENGTH < MI_SHM_MODULE_NAME_LENGTH, "MAX_MODULE_NAME_LENGTH is too long for the shared memory table");
+static_assert(MI_SHM_KIND_COUNT == 3 && mskSetting == 0 && mskInput == 1 && mskOutput == 2, "Kinds must match the set order");
+static_assert((int) mstFloat32 == (int) mvtFloat32, "MISharedType must match ModuleVariableType");
+
+class MISharedMemoryPublisher {
+  char name[32];
+  int fd = -1;
+  uint8_t *segment = NULL;
+  MISharedHeader *header = NULL;
+  MISharedModule *modules = NULL;
+  MISharedVariable *variables = NULL;
+  MISharedValue *values = NULL;
+  uint32_t max_modules = 0, max_variables = 0;
+
+  static ModuleVariableSet &get_set(ModuleInterface &mi, const uint8_t kind) {
+    return kind == mskSetting ? mi.settings : (kind == mskInput ? mi.inputs : mi.outputs);
+  }
+
+  bool layout_matches(ModuleInterface **interfaces, const mi_module_ix_t count) const {
+    if (header->layout_seq.load(std::memory_order_relaxed) == 0 || header->module_count.load(std::memory_order_relaxed) != MI_min(count, max_modules))
+      return false;
+    for (mi_module_ix_t m = 0; m < count && m < max_modules; m++) {
+      const MISharedModule &sm = modules[m];
+      if (strcmp(sm.name, interfaces[m]->module_name) != 0 || strcmp(sm.prefix, interfaces[m]->module_prefix) != 0) return false;
+      for (uint8_t k = 0; k < MI_SHM_KIND_COUNT; k++) {
+        const ModuleVariableSet &mvs = get_set(*interfaces[m], k);
+        if (sm.contract_id[k] != mvs.get_contract_id() || sm.count[k] != mvs.get_num_variables()) return false;
+      }
+    }
+    return true;
+  }
+
+  // Rebuild the directories, with all values marked as changed in the given change_seq
+  void build_layout(ModuleInterface **interfaces, const mi_module_ix_t count, const uint32_t change_seq) {
+    uint32_t s = header->layout_seq.load(std::memory_order_relaxed);
+    header->layout_seq.store(s | 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    uint32_t pos = 0, dropped = 0;
+    mi_module_ix_t module_count = (mi_module_ix_t) MI_min(count, max_modules);
+    for (mi_module_ix_t m = 0; m < module_count; m++) {
+      MISharedModule &sm = modules[m];
+      strncpy(sm.name, interfaces[m]->module_name, sizeof sm.name);
+      strncpy(sm.prefix, interfaces[m]->module_prefix, sizeof sm.prefix);
+      for (uint8_t k = 0; k < MI_SHM_KIND_COUNT; k++) {
+        const ModuleVariableSet &mvs = get_set(*interfaces[m], k);
+        sm.contract_id[k] = mvs.get_contract_id();
+        sm.count[k] = mvs.get_num_variables();
+        sm.first[k] = pos;
+        if (pos + mvs.get_num_variables() > max_variables) { // No room, the set is left out
+          dropped += mvs.get_num_variables();
+          sm.count[k] = 0;
+          continue;
+        }
+        for (uint8_t i = 0; i < mvs.get_num_variables(); i++, pos++) {
+          MISharedVariable &v = variables[pos];
+          memset(v.name, 0, sizeof v.name);
+          mvs.get_variable_name(i, v.name);
+          v.type = (uint8_t) mvs.get_type(i);
+          v.kind = k;
+          v.module_ix = (uint16_t) m;
+          values[pos].value.store(0, std::memory_order_relaxed);
+          values[pos].change_seq.store(change_seq, std::memory_order_relaxed);
+          values[pos].flags.store(0, std::memory_order_relaxed);
+        }
+      }
+    }
+    for (mi_module_ix_t m = module_count; m < count; m++)
+      for (uint8_t k = 0; k < MI_SHM_KIND_COUNT; k++) dropped += get_set(*interfaces[m], k).get_num_variables();
+    header->module_count.store(module_count, std::memory_order_relaxed);
+    header->variable_count.store(pos, std::memory_order_relaxed);
+    header->dropped_count.store(dropped, std::memory_order_relaxed);
+    #ifdef DEBUG_PRINT
+    if (dropped) { DPRINT(F("MISharedMemoryPublisher: no room for ")); DPRINT(dropped); DPRINTLN(F(" variables")); }
+    #endif
+
+    header->layout_seq.store((s | 1) + 1, std::memory_order_release);
+  }
+
+  // Write a value if it differs from the published value, returning true if written
+  bool publish_value(const uint32_t ix, const uint32_t raw, const uint32_t flags, const uint32_t change_seq) {
+    MISharedValue &v = values[ix];
+    if (v.value.load(std::memory_order_relaxed) == raw && (v.flags.load(std::memory_order_relaxed) & MI_SHM_UPDATED) == (flags & MI_SHM_UPDATED)
+        && !(flags & MI_SHM_EVENT)) return false;
+    uint32_t s = v.seq.load(std::memory_order_relaxed);
+    v.seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    v.value.store(raw, std::memory_order_relaxed);
+    v.change_seq.store(change_seq, std::memory_order_relaxed);
+    v.flags.store(flags, std::memory_order_relaxed);
+    v.seq.store(s + 2, std::memory_order_release);
+    return true;
+  }
+
+public:
+  MISharedMemoryPublisher() { name[0] = 0; }
+  ~MISharedMemoryPublisher() { close(); }
+
+  // Create the segment, replacing a segment left by a previous run. Readers that still have the old
+  // segment mapped see it as closed.
+  bool open(const char *segment_name, const char *master_prefix,
+            const uint32_t module_capacity = MI_SHM_MAX_MODULES, const uint32_t variable_capacity = MI_SHM_MAX_VARIABLES) {
+    close();
+    if (strlen(segment_name) >= sizeof name) return false;
+    strcpy(name, segment_name);
+    shm_unlink(name);
+    fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) { name[0] = 0; return false; }
+    uint32_t size = mi_shm_get_segment_size(module_capacity, variable_capacity);
+    void *p = ftruncate(fd, size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (p == MAP_FAILED) { close(); return false; }
+    segment = (uint8_t*) p; // Zero filled by ftruncate
+    max_modules = module_capacity;
+    max_variables = variable_capacity;
+    header = (MISharedHeader*) segment;
+    header->segment_size = size;
+    header->max_modules = max_modules;
+    header->max_variables = max_variables;
+    header->modules_offset = sizeof(MISharedHeader);
+    header->variables_offset = header->modules_offset + max_modules * sizeof(MISharedModule);
+    header->values_offset = header->variables_offset + max_variables * sizeof(MISharedVariable);
+    header->writer_pid = (int32_t) getpid();
+    strncpy(header->master_prefix, master_prefix, sizeof header->master_prefix - 1);
+    modules = (MISharedModule*) (segment + header->modules_offset);
+    variables = (MISharedVariable*) (segment + header->variables_offset);
+    values = (MISharedValue*) (segment + header->values_offset);
+    header->open.store(1, std::memory_order_relaxed);
+    header->version = MI_SHM_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = MI_SHM_MAGIC; // Set last, to let readers see a complete header
+    return true;
+  }
+
+  // Mark the segment as closed for the readers, and remove it
+  void close() {
+    if (header) {
+      header->open.store(0, std::memory_order_release);
+      munmap(segment, header->segment_size);
+    }
+    if (fd >= 0) ::close(fd);
+    if (name[0]) shm_unlink(name);
+    fd = -1;
+    name[0] = 0;
+    segment = NULL;
+    header = NULL;
+    modules = NULL;
+    variables = NULL;
+    values = NULL;
+  }
+
+  bool is_open() const { return header != NULL; }
+
+  // Called from the master loop. Publishes all changed values, or only the values flagged
+  // as events if events_only is set.
+  bool publish(ModuleInterface **interfaces, const mi_module_ix_t count, const bool events_only = false) {
+    if (header == NULL) return false;
+    uint32_t change_seq = header->change_seq.load(std::memory_order_relaxed) + 1;
+    bool changed = false;
+    if (!layout_matches(interfaces, count)) {
+      if (events_only) return false; // Wait for the next full publish
+      build_layout(interfaces, count, change_seq);
+      changed = true;
+    }
+
+    mi_module_ix_t module_count = (mi_module_ix_t) header->module_count.load(std::memory_order_relaxed);
+    for (mi_module_ix_t m = 0; m < module_count; m++) {
+      ModuleInterface &mi = *interfaces[m];
+      if (!events_only) modules[m].status.store(mi.get_status_bits() | (mi.is_active() ? MI_SHM_ACTIVE : 0), std::memory_order_relaxed);
+      for (uint8_t k = 0; k < MI_SHM_KIND_COUNT; k++) {
+        const ModuleVariableSet &mvs = get_set(mi, k);
+        if (!mvs.got_contract() || (events_only && mvs.get_event_count() == 0)) continue;
+        uint32_t pos = modules[m].first[k];
+        for (uint8_t i = 0; i < modules[m].count[k]; i++) {
+          const ModuleVariable &mv = mvs.get_module_variable(i);
+          if (events_only && !mv.is_event()) continue;
+          uint32_t raw = 0;
+          memcpy(&raw, mv.get_value_pointer(), mv.get_size());
+          uint32_t flags = (mvs.is_updated() ? MI_SHM_UPDATED : 0) | (mv.is_event() ? MI_SHM_EVENT : 0);
+          if (publish_value(pos + i, raw, flags, change_seq)) changed = true;
+        }
+      }
+    }
+
+    if (changed) header->change_seq.store(change_seq, std::memory_order_release);
+    if (!events_only) {
+      header->utc.store(miTime::Get(), std::memory_order_relaxed);
+      header->publish_count.fetch_add(1, std::memory_order_release);
+    }
+    return true;
+  }
+};
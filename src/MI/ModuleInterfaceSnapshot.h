@@ -0,0 +1,337 @@
+#pragma once
+
+// Snapshots of all variable values in a ModuleInterfaceSet, letting other threads (like a local
+// dashboard or a logger) read live values while the master loop is writing them.
+// Enabled by defining MI_SNAPSHOT before including MIMaster.h, and only available on POSIX.
+//
+// The master loop publishes all values after each transfer_all, protected by a sequence lock.
+// A reader copies the values into its own MISnapshot, and retries if a publish happened during
+// the copy. Readers never block the master loop, and never see values from different publishes.
+// The layout (module names, variable names and types) is rebuilt when a contract changes. A reader
+// copies the parts of the layout it needs into its MISnapshot when the layout has changed, so the old
+// layouts are retired and deleted by a later publish. Each read is counted in one of two epochs, and
+// the publisher switches epoch when retiring layouts, deleting them when the old epoch has no reads.
+
+#include <MI/ModuleInterface.h>
+#include <atomic>
+#include <thread>
+
+#ifndef MI_POSIX
+  #error "MI_SNAPSHOT is only supported on POSIX platforms"
+#endif
+
+// Max number of attempts for a reader to get a consistent copy
+#ifndef MI_SNAPSHOT_MAX_RETRIES
+  #define MI_SNAPSHOT_MAX_RETRIES 1000
+#endif
+
+enum MISnapshotSetType { msSettings, msInputs, msOutputs };
+#define MI_SNAPSHOT_SET_COUNT 3
+
+// Immutable description of the modules and variables, plus the values protected by the sequence lock
+struct MISnapshotLayout {
+  struct Module {
+    char name[MAX_MODULE_NAME_LENGTH + 1];
+    char prefix[MVAR_PREFIX_LENGTH + 1];
+    uint32_t contract_id[MI_SNAPSHOT_SET_COUNT];
+    uint32_t first[MI_SNAPSHOT_SET_COUNT]; // Index of the first variable of each set
+    uint8_t count[MI_SNAPSHOT_SET_COUNT];
+  };
+  struct Variable {
+    char name[MVAR_MAX_NAME_LENGTH + 1];
+    uint8_t type;
+  };
+
+  uint32_t id = 0;                  // Unique for each layout built by a publisher, 0 if none
+  mi_module_ix_t module_count = 0;
+  uint32_t variable_count = 0;
+  Module *modules = NULL;
+  Variable *variables = NULL;
+  // All values in module and set order, followed by the updated time of each set
+  std::atomic<uint32_t> *values = NULL;
+  MISnapshotLayout *retired = NULL; // Next in the list of retired layouts
+
+  ~MISnapshotLayout() { deallocate(); }
+
+  void deallocate() {
+    if (modules) delete[] modules;
+    if (variables) delete[] variables;
+    if (values) delete[] values;
+    modules = NULL; variables = NULL; values = NULL;
+    module_count = 0; variable_count = 0; id = 0;
+  }
+
+  // Copy the modules and variables (not the values) of another layout
+  bool copy_directory(const MISnapshotLayout &from) {
+    deallocate();
+    modules = new Module[from.module_count ? from.module_count : 1];
+    variables = new Variable[from.variable_count ? from.variable_count : 1];
+    if (modules == NULL || variables == NULL) { deallocate(); return false; }
+    memcpy(modules, from.modules, from.module_count * sizeof(Module));
+    memcpy(variables, from.variables, from.variable_count * sizeof(Variable));
+    module_count = from.module_count;
+    variable_count = from.variable_count;
+    id = from.id;
+    return true;
+  }
+
+  uint32_t get_value_count() const { return variable_count + (uint32_t) module_count * MI_SNAPSHOT_SET_COUNT; }
+  uint32_t get_updated_time_ix(const mi_module_ix_t module_ix, const uint8_t set) const {
+    return variable_count + (uint32_t) module_ix * MI_SNAPSHOT_SET_COUNT + set;
+  }
+
+  static ModuleVariableSet &get_set(ModuleInterface &mi, const uint8_t set) {
+    return set == msSettings ? mi.settings : (set == msInputs ? mi.inputs : mi.outputs);
+  }
+};
+
+// A consistent copy of all values, owned by a reader thread
+class MISnapshot {
+  friend class MISnapshotPublisher;
+  MISnapshotLayout layout;                // A copy of the modules and variables of the published layout
+  uint32_t *values = NULL;
+  uint32_t capacity = 0;
+  uint32_t sequence = 0;
+
+  bool allocate(const uint32_t count) {
+    if (count <= capacity) return true;
+    if (values) delete[] values;
+    values = new uint32_t[count];
+    capacity = values ? count : 0;
+    return values != NULL;
+  }
+  uint32_t get_ix(const mi_module_ix_t module_ix, const uint8_t set, const uint8_t ix) const {
+    return layout.modules[module_ix].first[set] + ix;
+  }
+public:
+  MISnapshot() { }
+  ~MISnapshot() { if (values) delete[] values; }
+
+  bool is_valid() const { return layout.id != 0; }
+  uint32_t get_sequence() const { return sequence; } // Increases by one for each publish
+
+  mi_module_ix_t get_module_count() const { return layout.module_count; }
+  const char *get_module_name(const mi_module_ix_t module_ix) const { return layout.modules[module_ix].name; }
+  const char *get_module_prefix(const mi_module_ix_t module_ix) const { return layout.modules[module_ix].prefix; }
+  uint32_t get_contract_id(const mi_module_ix_t module_ix, const uint8_t set) const { return layout.modules[module_ix].contract_id[set]; }
+
+  uint8_t get_variable_count(const mi_module_ix_t module_ix, const uint8_t set) const { return layout.modules[module_ix].count[set]; }
+  const char *get_variable_name(const mi_module_ix_t module_ix, const uint8_t set, const uint8_t ix) const {
+    return layout.variables[get_ix(module_ix, set, ix)].name;
+  }
+  ModuleVariableType get_type(const mi_module_ix_t module_ix, const uint8_t set, const uint8_t ix) const {
+    return (ModuleVariableType) layout.variables[get_ix(module_ix, set, ix)].type;
+  }
+
+  // Time (millis) when the values of a set were last updated, or 0 if not updated
+  uint32_t get_updated_time_ms(const mi_module_ix_t module_ix, const uint8_t set) const {
+    return values[layout.get_updated_time_ix(module_ix, set)];
+  }
+  bool is_updated(const mi_module_ix_t module_ix, const uint8_t set) const { return get_updated_time_ms(module_ix, set) != 0; }
+
+  // Raw value (4 bytes holding a value of the variable type)
+  const void *get_value_pointer(const mi_module_ix_t module_ix, const uint8_t set, const uint8_t ix) const {
+    return &values[get_ix(module_ix, set, ix)];
+  }
+  bool     get_bool(const mi_module_ix_t m, const uint8_t set, const uint8_t ix) const { return *(const bool*)get_value_pointer(m, set, ix); }
+  uint8_t  get_uint8(const mi_module_ix_t m, const uint8_t set, const uint8_t ix) const { return *(const uint8_t*)get_value_pointer(m, set, ix); }
+  uint16_t get_uint16(const mi_module_ix_t m, const uint8_t set, const uint8_t ix) const { return *(const uint16_t*)get_value_pointer(m, set, ix); }
+  uint32_t get_uint32(const mi_module_ix_t m, const uint8_t set, const uint8_t ix) const { return *(const uint32_t*)get_value_pointer(m, set, ix); }
+  int8_t   get_int8(const mi_module_ix_t m, const uint8_t set, const uint8_t ix) const { return *(const int8_t*)get_value_pointer(m, set, ix); }
+  int16_t  get_int16(const mi_module_ix_t m, const uint8_t set, const uint8_t ix) const { return *(const int16_t*)get_value_pointer(m, set, ix); }
+  int32_t  get_int32(const mi_module_ix_t m, const uint8_t set, const uint8_t ix) const { return *(const int32_t*)get_value_pointer(m, set, ix); }
+  float    get_float(const mi_module_ix_t m, const uint8_t set, const uint8_t ix) const { return *(const float*)get_value_pointer(m, set, ix); }
+
+  // Value of any type converted to float, convenient for plotting and logging
+  float get_as_float(const mi_module_ix_t m, const uint8_t set, const uint8_t ix) const {
+    switch (get_type(m, set, ix)) {
+    case mvtBoolean: return get_bool(m, set, ix) ? 1.0f : 0.0f;
+    case mvtUint8: return (float) get_uint8(m, set, ix);
+    case mvtInt8: return (float) get_int8(m, set, ix);
+    case mvtUint16: return (float) get_uint16(m, set, ix);
+    case mvtInt16: return (float) get_int16(m, set, ix);
+    case mvtUint32: return (float) get_uint32(m, set, ix);
+    case mvtInt32: return (float) get_int32(m, set, ix);
+    case mvtFloat32: return get_float(m, set, ix);
+    case mvtUnknown: return 0;
+    }
+    return 0;
+  }
+
+  // Locate a variable by module prefix and name, like "tmTemp"
+  bool find_variable(const char *prefixed_name, const uint8_t set, mi_module_ix_t &module_ix, uint8_t &ix) const {
+    for (module_ix = 0; module_ix < get_module_count(); module_ix++) {
+      const MISnapshotLayout::Module &m = layout.modules[module_ix];
+      uint8_t len = (uint8_t) strlen(m.prefix);
+      if (len == 0 || strncmp(prefixed_name, m.prefix, len) != 0) continue;
+      for (ix = 0; ix < m.count[set]; ix++)
+        if (strcmp(&prefixed_name[len], get_variable_name(module_ix, set, ix)) == 0) return true;
+    }
+    module_ix = NO_MODULE;
+    ix = NO_VARIABLE;
+    return false;
+  }
+};
+
+class MISnapshotPublisher {
+  std::atomic<uint32_t> sequence;              // Odd while a publish is in progress
+  std::atomic<MISnapshotLayout*> layout;
+  std::atomic<uint8_t> epoch;
+  mutable std::atomic<uint32_t> readers[2];    // Number of reads in progress in each epoch
+  MISnapshotLayout *retired = NULL;            // Retired in the current epoch, only accessed by the publishing thread
+  MISnapshotLayout *draining = NULL;           // Retired in the previous epoch, deleted when its reads are done
+  uint32_t last_layout_id = 0;
+
+  static bool layout_matches(const MISnapshotLayout *l, ModuleInterface **interfaces, const mi_module_ix_t count) {
+    if (l == NULL || l->module_count != count) return false;
+    for (mi_module_ix_t m = 0; m < count; m++) {
+      const MISnapshotLayout::Module &lm = l->modules[m];
+      if (strcmp(lm.name, interfaces[m]->module_name) != 0 || strcmp(lm.prefix, interfaces[m]->module_prefix) != 0) return false;
+      for (uint8_t s = 0; s < MI_SNAPSHOT_SET_COUNT; s++) {
+        const ModuleVariableSet &mvs = MISnapshotLayout::get_set(*interfaces[m], s);
+        if (lm.contract_id[s] != mvs.get_contract_id() || lm.count[s] != mvs.get_num_variables()) return false;
+      }
+    }
+    return true;
+  }
+
+  static MISnapshotLayout *build_layout(ModuleInterface **interfaces, const mi_module_ix_t count) {
+    MISnapshotLayout *l = new MISnapshotLayout();
+    if (l == NULL) return NULL;
+    l->module_count = count;
+    for (mi_module_ix_t m = 0; m < count; m++)
+      for (uint8_t s = 0; s < MI_SNAPSHOT_SET_COUNT; s++)
+        l->variable_count += MISnapshotLayout::get_set(*interfaces[m], s).get_num_variables();
+    l->modules = new MISnapshotLayout::Module[count ? count : 1];
+    l->variables = new MISnapshotLayout::Variable[l->variable_count ? l->variable_count : 1];
+    l->values = new std::atomic<uint32_t>[l->get_value_count() ? l->get_value_count() : 1];
+    if (l->modules == NULL || l->variables == NULL || l->values == NULL) { delete l; return NULL; }
+    uint32_t pos = 0;
+    for (mi_module_ix_t m = 0; m < count; m++) {
+      MISnapshotLayout::Module &lm = l->modules[m];
+      strcpy(lm.name, interfaces[m]->module_name);
+      strcpy(lm.prefix, interfaces[m]->module_prefix);
+      for (uint8_t s = 0; s < MI_SNAPSHOT_SET_COUNT; s++) {
+        const ModuleVariableSet &mvs = MISnapshotLayout::get_set(*interfaces[m], s);
+        lm.contract_id[s] = mvs.get_contract_id();
+        lm.first[s] = pos;
+        lm.count[s] = mvs.get_num_variables();
+        for (uint8_t i = 0; i < mvs.get_num_variables(); i++, pos++) {
+          mvs.get_variable_name(i, l->variables[pos].name);
+          l->variables[pos].type = (uint8_t) mvs.get_type(i);
+        }
+      }
+    }
+    for (uint32_t i = 0; i < l->get_value_count(); i++) l->values[i].store(0, std::memory_order_relaxed);
+    return l;
+  }
+
+public:
+  MISnapshotPublisher() : sequence(0), layout(NULL), epoch(0) { readers[0] = 0; readers[1] = 0; }
+  ~MISnapshotPublisher() {
+    MISnapshotLayout *l = layout.load(std::memory_order_relaxed);
+    if (l) delete l;
+    delete_layouts(retired);
+    delete_layouts(draining);
+  }
+
+  // Called from the master loop to publish the current values
+  bool publish(ModuleInterface **interfaces, const mi_module_ix_t count) {
+    MISnapshotLayout *l = layout.load(std::memory_order_relaxed), *new_layout = NULL;
+    if (!layout_matches(l, interfaces, count)) {
+      new_layout = build_layout(interfaces, count);
+      if (new_layout != NULL) {
+        new_layout->id = ++last_layout_id;
+        if (new_layout->id == 0) new_layout->id = ++last_layout_id; // 0 means no layout
+      }
+      if (new_layout == NULL) {
+        mvs_out_of_memory = true;
+        #ifdef DEBUG_PRINT
+        DPRINTLN(F("MISnapshotPublisher::publish OUT OF MEMORY"));
+        #endif
+        return false;
+      }
+    }
+
+    // Enter the write section, making the sequence odd
+    uint32_t s = sequence.load(std::memory_order_relaxed);
+    sequence.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if (new_layout) {
+      if (l) { l->retired = retired; retired = l; }
+      l = new_layout;
+      layout.store(l); // Sequentially consistent with the epoch and readers count, see reclaim_layouts
+    }
+    uint32_t pos = 0;
+    uint32_t value;
+    for (mi_module_ix_t m = 0; m < count; m++) {
+      for (uint8_t set = 0; set < MI_SNAPSHOT_SET_COUNT; set++) {
+        const ModuleVariableSet &mvs = MISnapshotLayout::get_set(*interfaces[m], set);
+        for (uint8_t i = 0; i < mvs.get_num_variables(); i++, pos++) {
+          memcpy(&value, mvs.get_value_pointer(i), 4);
+          l->values[pos].store(value, std::memory_order_relaxed);
+        }
+        l->values[l->get_updated_time_ix(m, set)].store(mvs.get_updated_time_ms(), std::memory_order_relaxed);
+      }
+    }
+
+    // Leave the write section, making the values available
+    sequence.store(s + 2, std::memory_order_release);
+
+    reclaim_layouts();
+    return true;
+  }
+
+  // Called from any thread to get a consistent copy of the last published values.
+  // Returns false if nothing has been published yet or no consistent copy could be made.
+  bool read(MISnapshot &snapshot) const {
+    uint8_t e;
+    for (;;) { // Count the read in the current epoch, retrying if it switched meanwhile
+      e = epoch.load();
+      readers[e].fetch_add(1);
+      if (epoch.load() == e) break;
+      readers[e].fetch_sub(1);
+    }
+    bool ok = read_values(snapshot);
+    readers[e].fetch_sub(1);
+    return ok;
+  }
+
+private:
+  static void delete_layouts(MISnapshotLayout *&list) {
+    while (list) { MISnapshotLayout *l = list; list = l->retired; delete l; }
+  }
+
+  // Delete retired layouts that no read can be using. A read counted in the current epoch started
+  // after the layouts retired in the previous epoch were replaced, so it cannot get any of them.
+  void reclaim_layouts() {
+    uint8_t e = epoch.load(std::memory_order_relaxed);
+    if (draining && readers[e ^ 1].load() == 0) delete_layouts(draining);
+    if (retired && draining == NULL) {
+      draining = retired;
+      retired = NULL;
+      epoch.store(e ^ 1);
+      if (readers[e].load() == 0) delete_layouts(draining);
+    }
+  }
+
+  bool read_values(MISnapshot &snapshot) const {
+    for (uint16_t attempt = 0; attempt < MI_SNAPSHOT_MAX_RETRIES; attempt++) {
+      uint32_t s1 = sequence.load(std::memory_order_acquire);
+      if (s1 == 0) return false; // Nothing published yet
+      if (s1 & 1) { std::this_thread::yield(); continue; } // Publish in progress
+      const MISnapshotLayout *l = layout.load();
+      uint32_t count = l->get_value_count();
+      if (!snapshot.allocate(count)) return false;
+      for (uint32_t i = 0; i < count; i++) snapshot.values[i] = l->values[i].load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence.load(std::memory_order_relaxed) == s1) {
+        if (snapshot.layout.id != l->id && !snapshot.layout.copy_directory(*l)) return false;
+        snapshot.sequence = s1 / 2;
+        return true;
+      }
+    }
+    return false;
+  }
+};
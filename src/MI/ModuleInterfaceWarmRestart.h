@@ -0,0 +1,258 @@
+#pragma once
+
+// Saving of the master state to a local file, to be restored when the master is restarted so that the
+// modules get their settings and inputs in the first transfer cycle. Without it, inputs are not flagged
+// as updated until all source modules have delivered outputs again, settings wait for the web server,
+// and the contracts are requested from all modules.
+// Enabled by defining MI_WARM_RESTART before including MIMaster.h, and only available on POSIX.
+//
+// The contracts, the settings and the outputs of each module are saved at an interval, with the age
+// of the settings and outputs. The file is written to a temporary file that is renamed when complete,
+// so a crash while saving leaves the previous file intact, and it has a checksum.
+//
+// The saved state of a module is restored if the module has the same name and prefix, and only for
+// contracts that have not been received yet. The age of the values includes the time the master was
+// down, and values older than the max age are not flagged as updated (by clear_updated_if_too_old).
+// The saved state is kept until the first save, so that modules in a module list received after
+// startup are restored too. A module with a changed contract has its contract requested again as
+// usual when values arrive with another contract id.
+
+#include <MI/ModuleInterface.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef MI_POSIX
+  #error "MI_WARM_RESTART is only supported on POSIX platforms"
+#endif
+
+#ifndef MI_WARM_RESTART_INTERVAL_MS
+  #define MI_WARM_RESTART_INTERVAL_MS 60000
+#endif
+// Values older than this are restored, but not flagged as updated
+#ifndef MI_WARM_RESTART_MAX_AGE_MS
+  #define MI_WARM_RESTART_MAX_AGE_MS 3600000
+#endif
+#ifndef MI_WARM_RESTART_MAX_FILE_SIZE
+  #define MI_WARM_RESTART_MAX_FILE_SIZE 4000000
+#endif
+#define MI_WARM_RESTART_MAGIC 0x52574D49 // "MIWR"
+#define MI_WARM_RESTART_VERSION 1
+#define MI_WARM_RESTART_NOT_UPDATED 0xFFFFFFFF
+#define MI_WARM_RESTART_SET_COUNT 3
+
+// File layout, little-endian:
+//   Header:     magic(4), version(2), module count(2), UTC when saved(4), data length(4), data checksum(4)
+//   Per module: name length(1), name, prefix length(1), prefix, then for settings, inputs and outputs:
+//               contract length(2), contract as sent from the module (contract id, count, variables),
+//               age in ms(4) or MI_WARM_RESTART_NOT_UPDATED, values length(2), values (settings and outputs)
+class MIWarmRestart {
+  struct Header { uint32_t magic; uint16_t version, module_count; uint32_t utc, length, checksum; };
+
+  char path[128];
+  uint32_t interval_ms = MI_WARM_RESTART_INTERVAL_MS, max_age_ms = MI_WARM_RESTART_MAX_AGE_MS,
+           last_save = 0, write_errors = 0;
+  String saved;          // The data of the loaded file, kept until the first save
+  uint32_t saved_utc = 0;
+  uint16_t saved_module_count = 0;
+  BinaryBuffer done;     // Set for each saved module when restored or found with contracts, not to be restored again
+  uint16_t pending = 0;  // Saved modules not done yet
+
+  static ModuleVariableSet &get_set(ModuleInterface &mi, const uint8_t set) {
+    return set == 0 ? mi.settings : (set == 1 ? mi.inputs : mi.outputs);
+  }
+
+  static uint32_t get_checksum(const uint8_t *data, uint32_t length) {
+    uint32_t checksum = 0;
+    while (length > 0) {
+      uint16_t part = (uint16_t) MI_min(length, 0x8000ul);
+      checksum = PJON_crc32::compute(data, part, checksum);
+      data += part;
+      length -= part;
+    }
+    return checksum;
+  }
+
+  // UTC from the system clock, valid at startup before the master time has been set
+  static uint32_t get_utc() { return (uint32_t) time(0); }
+
+  static void append(String &out, const void *data, const uint32_t length) { out.append((const char*) data, length); }
+  static void append_text(String &out, const char *text) {
+    uint8_t len = (uint8_t) strlen(text);
+    out += (char) len;
+    out.append(text, len);
+  }
+
+  static void append_set(String &out, const ModuleVariableSet &mvs, const bool values) {
+    BinaryBuffer buf;
+    uint16_t length = 0;
+    if (mvs.got_contract()) mvs.get_variables(buf, length, 0);
+    uint16_t contract_length = length > 0 ? (uint16_t) (length - 1) : 0; // Without the header byte
+    append(out, &contract_length, 2);
+    if (contract_length > 0) append(out, buf.get() + 1, contract_length);
+    uint32_t age = MI_WARM_RESTART_NOT_UPDATED;
+    if (contract_length > 0 && values && mvs.is_updated()) age = (uint32_t) (millis() - mvs.get_updated_time_ms());
+    append(out, &age, 4);
+    uint16_t value_length = 0;
+    if (contract_length > 0 && values) for (uint8_t i = 0; i < mvs.get_num_variables(); i++) value_length += mvs.get_size(i);
+    append(out, &value_length, 2);
+    if (value_length > 0) for (uint8_t i = 0; i < mvs.get_num_variables(); i++) append(out, mvs.get_value_pointer(i), mvs.get_size(i));
+  }
+
+  // Restore a set from the saved data at p, returning false if the data is not valid
+  bool restore_set(const uint8_t *&p, const uint8_t *end, ModuleVariableSet *mvs, const uint32_t downtime_s) {
+    uint16_t contract_length, value_length;
+    uint32_t age;
+    if (end - p < 2) return false;
+    memcpy(&contract_length, p, 2); p += 2;
+    if (end - p < contract_length + 6) return false;
+    const uint8_t *contract = p;
+    p += contract_length;
+    memcpy(&age, p, 4); p += 4;
+    memcpy(&value_length, p, 2); p += 2;
+    if (end - p < value_length) return false;
+    const uint8_t *values = p;
+    p += value_length;
+    if (mvs == NULL || contract_length < 5 || mvs->got_contract()) return true; // Not to be restored
+
+    uint32_t contract_id;
+    memcpy(&contract_id, contract, 4);
+    mvs->set_variables(contract, contract_length);
+    if (mvs->get_contract_id() != contract_id) return true; // Out of memory
+    uint16_t pos = 0;
+    for (uint8_t i = 0; i < mvs->get_num_variables() && pos + mvs->get_size(i) <= value_length; i++) {
+      mvs->set_value(i, &values[pos], mvs->get_size(i));
+      pos += mvs->get_size(i);
+    }
+    mvs->clear_changed(); // Nothing has changed since the values were saved
+    if (age != MI_WARM_RESTART_NOT_UPDATED && pos == value_length) {
+      uint32_t total_age = (uint32_t) MI_min((uint64_t) age + (uint64_t) downtime_s * 1000, (uint64_t) 0x7FFFFFFF);
+      mvs->set_updated();
+      mvs->set_updated_time_ms((uint32_t) (millis() - total_age));
+      mvs->clear_updated_if_too_old(max_age_ms);
+    }
+    return true;
+  }
+
+public:
+  MIWarmRestart() { path[0] = 0; }
+
+  // Set the file and load it if present, returning true if a valid file was loaded
+  bool begin(const char *file_path, const uint32_t save_interval_ms = MI_WARM_RESTART_INTERVAL_MS,
+             const uint32_t max_value_age_ms = MI_WARM_RESTART_MAX_AGE_MS) {
+    if (strlen(file_path) + 5 > sizeof path) return false; // Room for the .tmp suffix
+    strcpy(path, file_path);
+    interval_ms = save_interval_ms;
+    max_age_ms = max_value_age_ms;
+    last_save = millis();
+    saved = "";
+    pending = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    Header header;
+    bool ok = fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof header && st.st_size <= MI_WARM_RESTART_MAX_FILE_SIZE
+      && read(fd, &header, sizeof header) == (ssize_t) sizeof header && header.magic == MI_WARM_RESTART_MAGIC
+      && header.version == MI_WARM_RESTART_VERSION && header.length == (uint32_t) st.st_size - sizeof header;
+    if (ok) {
+      saved.resize(header.length);
+      ok = read(fd, &saved[0], header.length) == (ssize_t) header.length
+        && get_checksum((const uint8_t*) saved.data(), header.length) == header.checksum;
+    }
+    close(fd);
+    if (!ok) {
+      saved = "";
+      #ifdef DEBUG_PRINT
+      DPRINTLN(F("MIWarmRestart: invalid state file ignored"));
+      #endif
+      return false;
+    }
+    saved_utc = header.utc;
+    saved_module_count = header.module_count;
+    if (!done.allocate(saved_module_count)) { mvs_out_of_memory = true; saved = ""; return false; }
+    memset(done.get(), 0, saved_module_count);
+    pending = saved_module_count;
+    return true;
+  }
+
+  // Restore the saved state of the modules that have not got their contracts yet.
+  // Returns the number of modules with something restored.
+  mi_module_ix_t restore(ModuleInterface **interfaces, const mi_module_ix_t count) {
+    if (saved.empty()) return 0;
+    uint32_t now = get_utc(), downtime_s = now > saved_utc ? now - saved_utc : 0;
+    const uint8_t *p = (const uint8_t*) saved.data(), *end = p + saved.length();
+    mi_module_ix_t restored = 0;
+    for (uint16_t m = 0; m < saved_module_count; m++) {
+      char name[MAX_MODULE_NAME_LENGTH + 1], prefix[MVAR_PREFIX_LENGTH + 1];
+      if (end - p < 1 || p[0] > MAX_MODULE_NAME_LENGTH || end - p < p[0] + 2) { pending = 0; break; }
+      memcpy(name, &p[1], p[0]); name[p[0]] = 0; p += p[0] + 1;
+      if (p[0] > MVAR_PREFIX_LENGTH || end - p < p[0] + 1) { pending = 0; break; }
+      memcpy(prefix, &p[1], p[0]); prefix[p[0]] = 0; p += p[0] + 1;
+      ModuleInterface *mi = NULL;
+      for (mi_module_ix_t i = 0; i < count && mi == NULL && !done.get()[m]; i++)
+        if (strcmp(interfaces[i]->module_name, name) == 0 && strcmp(interfaces[i]->module_prefix, prefix) == 0) mi = interfaces[i];
+      bool missing = mi && !mi->got_contract();
+      if (mi) { done.get()[m] = 1; pending--; }
+      for (uint8_t s = 0; s < MI_WARM_RESTART_SET_COUNT; s++)
+        if (!restore_set(p, end, missing ? &get_set(*mi, s) : NULL, downtime_s)) { pending = 0; return restored; }
+      if (missing) {
+        restored++;
+        #ifdef DEBUG_PRINT
+        DPRINT(F("MIWarmRestart: restored ")); DPRINTLN(name);
+        #endif
+      }
+    }
+    return restored;
+  }
+
+  // Write the state of all modules to the file, replacing it when complete
+  bool save(ModuleInterface **interfaces, const mi_module_ix_t count) {
+    if (path[0] == 0) return false;
+    String data;
+    for (mi_module_ix_t i = 0; i < count; i++) {
+      ModuleInterface &mi = *interfaces[i];
+      append_text(data, mi.module_name);
+      append_text(data, mi.module_prefix);
+      for (uint8_t s = 0; s < MI_WARM_RESTART_SET_COUNT; s++) append_set(data, get_set(mi, s), s != 1);
+    }
+    Header header;
+    header.magic = MI_WARM_RESTART_MAGIC;
+    header.version = MI_WARM_RESTART_VERSION;
+    header.module_count = (uint16_t) count;
+    header.utc = get_utc();
+    header.length = (uint32_t) data.length();
+    header.checksum = get_checksum((const uint8_t*) data.data(), header.length);
+
+    char temp_path[sizeof path + 4];
+    snprintf(temp_path, sizeof temp_path, "%s.tmp", path);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && write(fd, &header, sizeof header) == (ssize_t) sizeof header
+      && write(fd, data.data(), data.length()) == (ssize_t) data.length() && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    ok = ok && rename(temp_path, path) == 0;
+    if (!ok) {
+      write_errors++;
+      unlink(temp_path);
+      #ifdef DEBUG_PRINT
+      DPRINT(F("MIWarmRestart: could not write ")); DPRINTLN(path);
+      #endif
+    }
+    return ok;
+  }
+
+  // Called from the master loop. Restores modules that have appeared since startup, and saves at the interval.
+  void update(ModuleInterface **interfaces, const mi_module_ix_t count) {
+    if (path[0] == 0) return;
+    if (pending) restore(interfaces, count); // Only parse the saved data while some modules may still use it
+    if ((uint32_t) (millis() - last_save) >= interval_ms) {
+      last_save = millis();
+      save(interfaces, count);
+      saved = ""; // The current state has replaced the saved state
+      pending = 0;
+    }
+  }
+
+  uint32_t get_write_errors() const { return write_errors; }
+};
@@ -22,6 +22,19 @@
 // Name including prefix, plus type length
 #define MVAR_COMPOSITE_NAME_LENGTH (MVAR_MAX_NAME_LENGTH + MVAR_TYPE_LENGTH)
 
+// An optional deadband can follow the type in a contract, like "Temp:f4~0.1" for an absolute
+// deadband or "Temp:f4~2%" for a deadband relative to the value. Changes smaller than the deadband
+// are not flagged as changes, neither by the module nor the master. This is the max length including the tilde.
+#ifndef MVAR_DEADBAND_LENGTH
+  #define MVAR_DEADBAND_LENGTH 8
+#endif
+
+// A complete variable declaration in a contract, like "Temp:f4~0.1"
+#define MVAR_CONTRACT_WORD_LENGTH (MVAR_COMPOSITE_NAME_LENGTH + MVAR_DEADBAND_LENGTH)
+
+// Flag in the type byte of a contract packet, telling that a 4 byte deadband follows the name
+#define MVAR_DEADBAND_FLAG 0b01000000
+
 // Suppress strncpy warnings
 #ifdef MI_POSIX
 #pragma warning(disable:4996)
@@ -41,6 +54,10 @@ enum ModuleVariableType {
 
 extern const char * const get_mv_type_names();
 
+// On the master, the variable names are stored in the ModuleVariableSet, separated from the
+// values and flags, to keep this record small (8 bytes) for scans over changed/event flags.
+// Define MI_VARIABLE_NAME_IN_RECORD to also keep a copy of the name in the name member, for
+// code written for earlier versions that reads it. This brings the record back to 20 bytes.
 struct ModuleVariable {
 private:
   union {
@@ -48,11 +65,12 @@ private:
     float f;
     char array[4];   // A 4 byte buffer covers all supported value types, better than using a pointer and allocating memory
   } value;
-  ModuleVariableType type = mvtUnknown; // To save memory we use the uppermost bits for change detection, therefore do not allow direct access
+  uint8_t type = mvtUnknown; // A ModuleVariableType. To save memory we use the uppermost bits for change detection, therefore do not allow direct access
 public:
-  #ifdef IS_MASTER
-  char name[MVAR_MAX_NAME_LENGTH + 1];
-  #ifdef MASTER_MULTI_TRANSFER
+  #if defined(IS_MASTER) && defined(MI_VARIABLE_NAME_IN_RECORD)
+  char name[MVAR_MAX_NAME_LENGTH + 1]; // Read only, use ModuleVariableSet::get_variable_name in new code
+  #endif
+  #if defined(IS_MASTER) && defined(MASTER_MULTI_TRANSFER)
   // Used for managing reverse settings to multiple (max 7) transfers at the same time (HTTP, MQTT, ...)
   uint8_t change_bits = 0;
   bool get_change_bit(uint8_t bit) const { return (change_bits & (1 << bit)) > 0; }
@@ -68,10 +86,9 @@ public:
   void set_initialized() { change_bits |= (1 << 7); }
   bool is_initialized() const { return (change_bits & (1 << 7)) != 0; }
   #endif
-  #endif
 
   ModuleVariable() {
-    #ifdef IS_MASTER
+    #if defined(IS_MASTER) && defined(MI_VARIABLE_NAME_IN_RECORD)
     name[0] = 0;
     #endif
     memset(value.array, 0, 4);
@@ -79,20 +96,21 @@ public:
 
   #ifdef IS_MASTER
   ModuleVariable(const ModuleVariable &source) {
+    #ifdef MI_VARIABLE_NAME_IN_RECORD
     memcpy(name, source.name, sizeof name);
+    #endif
     memcpy(value.array, source.value.array, 4);
-    memcpy(&type, &source.type, sizeof type);
+    type = source.type;
   }
   #endif
 
-  // Setters and getters for serializing (type,length,name)
+  // Setters and getters for serializing (type,length,name). The name is handled by the ModuleVariableSet.
   void set_variable(const uint8_t *name_and_type) {
-    // Read name length byte
-    type = (ModuleVariableType) name_and_type[0];
-    #ifdef IS_MASTER
+    type = (uint8_t) (name_and_type[0] & 0b00111111);
+    #if defined(IS_MASTER) && defined(MI_VARIABLE_NAME_IN_RECORD)
     uint8_t len = (uint8_t) MI_min(name_and_type[1], MVAR_MAX_NAME_LENGTH);
     memcpy(name, &name_and_type[2], len);
-    name[len] = 0; // Null-terminator
+    name[len] = 0;
     #endif
   }
 
@@ -101,29 +119,19 @@ public:
     // Read name length byte
     const char *pos1 = strchr(s, ':'), *pos2 = strchr(s, ' ');
     if (pos1 == NULL || (pos2 != NULL && pos2 < pos1)) { // No colon in this variable declaration, use float as default
-      #ifdef IS_MASTER
-      uint8_t len = (uint8_t) MI_min(pos2 == NULL ? strlen(s) : pos2-s, MVAR_MAX_NAME_LENGTH);
-      memcpy(name, s, len);
-      name[len] = 0; // Null-terminator
-      #endif
       type = mvtFloat32; // Default data type
     } else { // There is a colon in the declaration
-      #ifdef IS_MASTER
-      uint8_t len = (uint8_t) MI_min(pos1 - s, MVAR_MAX_NAME_LENGTH);
-      memcpy(name, s, len);
-      name[len] = 0; // Null-terminate
-      #endif
       type = get_type(&pos1[1]);
     }
   }
 
   #ifdef IS_MASTER
-  // Return whether this variable name has a module prefix (lower case) or is a local name
-  bool has_module_prefix() const { return name[0] >= 'a' && name[0] <= 'z'; }
+  // Return whether a variable name has a module prefix (lower case) or is a local name
+  static bool has_module_prefix(const char *name) { return name[0] >= 'a' && name[0] <= 'z'; }
 
   // Return prefixed name, either prefixed from before, or with a prefix added now
-  void get_prefixed_name(const char *prefix, char *output_name_buf, uint8_t buf_size) const {
-    if (has_module_prefix() || !prefix) strncpy(output_name_buf, name, buf_size); // Already prefixed
+  static void get_prefixed_name(const char *name, const char *prefix, char *output_name_buf, uint8_t buf_size) {
+    if (has_module_prefix(name) || !prefix) strncpy(output_name_buf, name, buf_size); // Already prefixed
     else { // Add the specified prefix
       uint8_t len = (uint8_t) strlen(prefix);
       strncpy(output_name_buf, prefix, MI_min(len, buf_size));
@@ -137,15 +145,15 @@ public:
 
   // Change detection
   void set_changed(bool changed = true) {
-    if (changed) type = (ModuleVariableType)(type | 0b10000000);
-    else type = (ModuleVariableType)(type & 0b01111111);
+    if (changed) type = (uint8_t)(type | 0b10000000);
+    else type = (uint8_t)(type & 0b01111111);
   }
   bool is_changed() const { return (type & 0b10000000) != 0; }
 
   // Event flag
   void set_event(bool event = true) {
-    if (event) type = (ModuleVariableType)(type | 0b01000000);
-    else type = (ModuleVariableType)(type & 0b10111111);
+    if (event) type = (uint8_t)(type | 0b01000000);
+    else type = (uint8_t)(type & 0b10111111);
   }
   bool is_event() const { return (type & 0b01000000) != 0; }
 
@@ -235,6 +243,41 @@ public:
     return false;
   }
 
+  // Value of any type converted to float, used for deadband calculations
+  static float get_as_float(const ModuleVariableType t, const void *v) {
+    switch(t) {
+    case mvtBoolean: return *(const bool*) v ? 1.0f : 0.0f;
+    case mvtUint8: return (float) *(const uint8_t*) v;
+    case mvtInt8: return (float) *(const int8_t*) v;
+    case mvtUint16: return (float) *(const uint16_t*) v;
+    case mvtInt16: return (float) *(const int16_t*) v;
+    case mvtUint32: return (float) *(const uint32_t*) v;
+    case mvtInt32: return (float) *(const int32_t*) v;
+    case mvtFloat32: return *(const float*) v;
+    case mvtUnknown: return 0;
+    }
+    return 0;
+  }
+  float get_as_float() const { return get_as_float(get_type(), value.array); }
+
+  // Read the deadband from a contract word like "Temp:f4~0.1" (absolute) or "Temp:f4~2%" (relative).
+  // A relative deadband is returned as a negative fraction (-0.02 for 2%). Returns 0 if none.
+  static float get_deadband(const char *word) {
+    const char *p = strchr(word, '~');
+    if (p == NULL) return 0;
+    float value = 0, scale = 0;
+    for (p++; *p != 0 && *p != ' '; p++) {
+      if (*p >= '0' && *p <= '9') {
+        if (scale == 0) value = value * 10 + (*p - '0');
+        else { value += (*p - '0') * scale; scale /= 10; }
+      }
+      else if (*p == '.' && scale == 0) scale = 0.1f;
+      else if (*p == '%') return -value / 100;
+      else break;
+    }
+    return value;
+  }
+
   // Memory management
   uint8_t get_size() const {
     switch(get_type()) {
@@ -1,3 +1,8 @@
+#include <stdint.h>
+
 // A flag that should be set if memory allocation fails (can be set and read from all places)
 bool mvs_out_of_memory = false;
 
+
+// Source of variable set generations, each set getting a new unique number whenever its variables change
+uint32_t mvs_generation = 0;
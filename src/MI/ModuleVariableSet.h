@@ -1,6 +1,7 @@
 #pragma once
 
 #include <MI/ModuleVariable.h>
+#include <MI/MINamePool.h>
 #include <utils/MIUtilities.h>
 
 // Value returned by get_variable_ix when variable name not found. Means that max 255 variables may be used.
@@ -13,22 +14,29 @@ typedef char (* MVS_getContractChar)(uint16_t position);
 // A flag that should be set if memory allocation fails (can be set and read from all places)
 extern bool mvs_out_of_memory;
 
+// Source of variable set generations, each set getting a new unique number whenever its variables change
+extern uint32_t mvs_generation;
+
 // This variable object can be used on the master side to handle changing contracts,
 // where a variable index may become invalid if the number of parameters or parameter order changes.
 // It can be used on the module side as well if the extra bytes of storage/RAM usage is acceptable.
+// The variable is bound to a set on first use, caching the index and a pointer to the value.
+// It is only looked up again when the generation of the set changes, meaning a new contract.
 #ifdef USE_MIVARIABLE
 class MIVariable {
-friend class ModuleVariableSet;
+friend struct ModuleVariableSet;
 protected:
   char name[MVAR_MAX_NAME_LENGTH + 1];
-  uint32_t contract_id = 0;
+  uint32_t generation = 0;    // Generation of the set this was bound to, 0 if not bound
+  const void *value = NULL;   // Value of the bound variable, or a zero value if not found
   uint8_t ix = NO_VARIABLE;
 public:
   MIVariable() { name[0] = 0; }
   MIVariable(const char *variable_name) { set_name(variable_name); }
 
   void set_name(const char *variable_name) {
-    contract_id = 0;
+    generation = 0;
+    value = NULL;
     ix = NO_VARIABLE;
     uint8_t len = (uint8_t) MI_min(strlen(variable_name), MVAR_MAX_NAME_LENGTH);
     strncpy(name, variable_name, len);
@@ -42,17 +50,142 @@ struct ModuleVariableSet {
 private:
   uint8_t num_variables = 0;
   ModuleVariable *variables = NULL;
-  uint8_t total_value_length = 0;    // Length of all values serialized after another
+  uint16_t total_value_length = 0;   // Length of all values serialized after another
   uint32_t contract_id = 0;          // Number used for detecting changes in contract
   uint32_t values_received_time = 0; // Set by set_values when setting values
+  uint32_t generation = ++mvs_generation; // Changed when variables change, to rebind MIVariables
+  // Optional deadbands declared in the contract, allocated only if any variable has one.
+  // A positive band is absolute, a negative band is relative to the reference value.
+  // The reference is the last value that was flagged as changed. On the master, an input can
+  // inherit the band of the output it is copied from, and this is not part of its contract.
+  struct Deadband { float band, reference; bool inherited; };
+  Deadband *deadbands = NULL;
+
+  bool set_deadband(const uint8_t ix, const float band, const bool inherited = false) {
+    if (deadbands == NULL) {
+      deadbands = new Deadband[num_variables];
+      if (deadbands == NULL) return false;
+      for (uint8_t i = 0; i < num_variables; i++) { deadbands[i].band = 0; deadbands[i].reference = NAN; deadbands[i].inherited = false; }
+    }
+    deadbands[ix].band = band;
+    deadbands[ix].inherited = inherited;
+    return true;
+  }
+
+  // Return false if a value is within the deadband of a variable, not to be flagged as a change.
+  // A value of another size than the variable is always significant.
+  bool is_significant_change(const uint8_t ix, const void *value, const uint8_t size) const {
+    if (deadbands == NULL || deadbands[ix].band == 0 || size != variables[ix].get_size()) return true;
+    uint32_t aligned = 0; // The value may be unaligned, like when read from a packet
+    memcpy(&aligned, value, size);
+    float reference = deadbands[ix].reference, v = ModuleVariable::get_as_float(variables[ix].get_type(), &aligned);
+    if (isnan(reference) || !isfinite(v)) return true;
+    float band = deadbands[ix].band < 0 ? -deadbands[ix].band * (float) fabs(reference) : deadbands[ix].band;
+    return fabs(v - reference) >= band;
+  }
+  bool has_declared_deadband(const uint8_t ix) const {
+    return deadbands && deadbands[ix].band != 0 && !deadbands[ix].inherited;
+  }
+
+  #ifdef IS_MASTER
+  // The variable names are kept in a name pool, normally shared by all sets in a ModuleInterfaceSet,
+  // separate from the values and flags. Each variable has an offset into the pool and a name hash.
+  struct NameRef { uint16_t offset, hash; };
+  NameRef *names = NULL;
+  MINamePool *name_pool = NULL;
+  bool own_name_pool = false; // Set if the pool was allocated by this set because none was assigned
+
+  static uint8_t get_name_length(const char *name) {
+    uint8_t len = 0;
+    while (len < MVAR_MAX_NAME_LENGTH && name[len] != 0) len++;
+    return len;
+  }
+  #endif
   #ifndef IS_MASTER
   MVS_getContractChar get_contract_callback = NULL;
   #endif
 
+  // Number of variables with the changed-flag and the event-flag set, making "anything to send?"
+  // an O(1) check. These are maintained by the setters in this class. When a variable is modified
+  // directly through a non-const ModuleVariable reference the counts become unknown, and they are
+  // recounted by the next call that needs them.
+  // The flagged variables are all within an index range [first, end), letting loops skip the rest.
+  // The range grows when a flag is set, and is emptied when the count reaches zero.
+  mutable uint8_t changed_count = 0, event_count = 0;
+  mutable uint8_t changed_first = 0, changed_end = 0, event_first = 0, event_end = 0;
+  mutable bool flag_counts_valid = true;
+
+  void count_flags() const {
+    changed_count = event_count = 0;
+    changed_first = changed_end = event_first = event_end = 0;
+    for (uint8_t i = 0; i < num_variables; i++) {
+      if (variables[i].is_changed()) { if (changed_count++ == 0) changed_first = i; changed_end = (uint8_t) (i + 1); }
+      if (variables[i].is_event()) { if (event_count++ == 0) event_first = i; event_end = (uint8_t) (i + 1); }
+    }
+    flag_counts_valid = true;
+  }
+
+  void reset_flag_counts() {
+    changed_count = event_count = 0;
+    changed_first = changed_end = event_first = event_end = 0;
+    flag_counts_valid = true;
+  }
+
+  static void update_flag_range(uint8_t &count, uint8_t &first, uint8_t &end, const uint8_t ix, const bool set) {
+    if (set) {
+      if (count++ == 0) { first = ix; end = (uint8_t) (ix + 1); }
+      else { if (ix < first) first = ix; if (ix >= end) end = (uint8_t) (ix + 1); }
+    } else if (--count == 0) first = end = 0;
+  }
+
+  // The range holding the variables with any of the requested flags (counts must be valid)
+  void get_flag_range(const bool events, const bool changes, uint8_t &first, uint8_t &end) const {
+    first = num_variables; end = 0;
+    if (events && event_count) { first = event_first; end = event_end; }
+    if (changes && changed_count) { if (changed_first < first) first = changed_first; if (changed_end > end) end = changed_end; }
+  }
+
+  // Flag setters maintaining the counts
+  void set_changed_flag(ModuleVariable &v, const bool changed) {
+    if (flag_counts_valid && v.is_changed() != changed)
+      update_flag_range(changed_count, changed_first, changed_end, (uint8_t) (&v - variables), changed);
+    v.set_changed(changed);
+  }
+  void set_event_flag(ModuleVariable &v, const bool event) const {
+    if (flag_counts_valid && v.is_event() != event)
+      update_flag_range(event_count, event_first, event_end, (uint8_t) (&v - variables), event);
+    v.set_event(event);
+  }
+  // Set a value, flagging it as changed if different. Returns false if the change was within
+  // the deadband of the variable, and therefore not flagged.
+  bool set_variable_value(const uint8_t ix, const void *value, const uint8_t size) {
+    ModuleVariable &v = variables[ix];
+    bool was_changed = v.is_changed(), significant = is_significant_change(ix, value, size);
+    v.set_value(value, size);
+    if (deadbands && v.get_size() == size) {
+      if (!significant && !was_changed) v.set_changed(false);
+      else if (significant) deadbands[ix].reference = v.get_as_float();
+    }
+    if (flag_counts_valid && !was_changed && v.is_changed()) update_flag_range(changed_count, changed_first, changed_end, ix, true);
+    return significant;
+  }
+
+  // Let all MIVariables be looked up again on next use
+  void new_generation() {
+    generation = ++mvs_generation;
+    if (generation == 0) generation = ++mvs_generation; // 0 means not bound
+  }
+
   void deallocate() {
+    new_generation();
     #ifndef MI_NO_DYNAMIC_MEM
     if (variables) { delete[] variables; variables = NULL; num_variables = 0; }
     #endif
+    #ifdef IS_MASTER
+    if (names) { delete[] names; names = NULL; }
+    #endif
+    if (deadbands) { delete[] deadbands; deadbands = NULL; }
+    reset_flag_counts();
   }
 
   void calculate_total_value_length() {
@@ -60,14 +193,18 @@ private:
     for (uint8_t i = 0; i < num_variables; i++) total_value_length += variables[i].get_size();
   }
 
+public:
   uint32_t calculate_contract_id() const { // A contract id that can be used to detect a changed contract
     // Calculate CRC32 of names and types
     uint32_t id = num_variables ? 0 : 0x33333333; // Non-zero to be able to accept a contract with no variables
-    char name_buf[MVAR_COMPOSITE_NAME_LENGTH + 1];
+    char name_buf[MVAR_CONTRACT_WORD_LENGTH + 1];
     uint8_t len;
+    #ifndef IS_MASTER
+    uint16_t word_pos = 0;
+    #endif
     for (uint8_t i = 0; i < num_variables; i++) {
       #ifdef IS_MASTER
-      strncpy(name_buf, variables[i].name, MVAR_MAX_NAME_LENGTH);
+      strncpy(name_buf, get_variable_name(i), MVAR_MAX_NAME_LENGTH + 1);
       len = (uint8_t) strlen(name_buf);
       #else
       uint16_t source_pos = 0;
@@ -77,20 +214,78 @@ private:
       id += PJON_crc32::compute((const uint8_t*)name_buf, len, id);
       len = (uint8_t) variables[i].get_type();
       id += PJON_crc32::compute(&len, 1, id);
+      #ifndef IS_MASTER
+      // A deadband is included only if present, leaving the id of contracts without deadbands unchanged
+      if (!get_next_word_from_contract(word_pos, len, name_buf, sizeof name_buf)) return 0;
+      float deadband = ModuleVariable::get_deadband(name_buf);
+      if (deadband != 0) id += PJON_crc32::compute((const uint8_t*)&deadband, sizeof deadband, id);
+      #endif
     }
     return id;
   }
 
-public:
   ModuleVariableSet() { }
-  ~ModuleVariableSet() { deallocate(); }
+  ~ModuleVariableSet() {
+    deallocate();
+    #ifdef IS_MASTER
+    if (own_name_pool && name_pool) delete name_pool;
+    #endif
+  }
 
   #ifdef IS_MASTER
+  // Use a name pool shared with other sets. Names already registered are moved to the new pool.
+  bool set_name_pool(MINamePool *pool) {
+    if (pool == NULL || pool == name_pool) return true;
+    bool ok = true;
+    for (uint8_t i = 0; i < num_variables; i++) {
+      const char *name = get_variable_name(i);
+      uint16_t offset = pool->add(name, (uint8_t) strlen(name), names[i].hash);
+      if (offset == MI_NO_NAME) ok = false;
+      else names[i].offset = offset;
+    }
+    if (!ok) {
+      mvs_out_of_memory = true;
+      #ifdef DEBUG_PRINT
+      DPRINTLN(F("MVS::set_name_pool OUT OF MEMORY"));
+      #endif
+      return false;
+    }
+    if (own_name_pool && name_pool) delete name_pool;
+    name_pool = pool;
+    own_name_pool = false;
+    return true;
+  }
+  MINamePool *get_name_pool() const { return name_pool; }
+
+  // Add all names to another pool. If use_offsets is set, the names are changed to refer to
+  // the other pool, which must then replace the current one. Used for compacting the shared pool.
+  bool copy_names_to(MINamePool &pool, const bool use_offsets) {
+    for (uint8_t i = 0; i < num_variables; i++) {
+      const char *name = get_variable_name(i);
+      uint16_t offset = pool.add(name, (uint8_t) strlen(name), names[i].hash);
+      if (offset == MI_NO_NAME) return false;
+      if (use_offsets) names[i].offset = offset;
+    }
+    return true;
+  }
+
+  // NOTE: The returned pointer is invalidated when a name is added to the pool or the pool is
+  // compacted, so use the copying get_variable_name(ix, name_buf) when keeping the name.
+  const char *get_variable_name(uint8_t ix) const { return name_pool->get(names[ix].offset); }
+
   bool get_variable_name(uint8_t ix, char *name_buf) const {
-    strncpy(name_buf, variables[ix].name, MVAR_MAX_NAME_LENGTH);
+    strncpy(name_buf, get_variable_name(ix), MVAR_MAX_NAME_LENGTH);
     name_buf[MVAR_MAX_NAME_LENGTH] = 0;
     return true;
   }
+
+  // Return whether this variable name has a module prefix (lower case) or is a local name
+  bool has_module_prefix(uint8_t ix) const { return ModuleVariable::has_module_prefix(get_variable_name(ix)); }
+
+  // Return prefixed name, either prefixed from before, or with a prefix added now
+  void get_prefixed_name(uint8_t ix, const char *prefix, char *output_name_buf, uint8_t buf_size) const {
+    ModuleVariable::get_prefixed_name(get_variable_name(ix), prefix, output_name_buf, buf_size);
+  }
   #endif
 
   #ifndef IS_MASTER
@@ -112,9 +307,10 @@ public:
     return false;
   }
 
+  // Remove the type and deadband, leaving only the name
   static void remove_type(char *name_buf, uint8_t &name_len) {
-    char *colon_pos = strchr(name_buf, ':');
-    if (colon_pos != NULL) { *colon_pos = 0; name_len = colon_pos - name_buf; }
+    char *pos = strpbrk(name_buf, ":~");
+    if (pos != NULL) { *pos = 0; name_len = pos - name_buf; }
   }
   #endif
 
@@ -124,11 +320,15 @@ public:
   void set_variables(uint8_t variable_count, ModuleVariable *variable_array) {
     num_variables = variable_count;
     variables = variable_array;
+    flag_counts_valid = false;
+    new_generation();
   }
   #else
   bool preallocate_variables(const uint8_t variable_count) {
     num_variables = variable_count;
     if (variables) { delete[] variables; variables = NULL; }
+    reset_flag_counts();
+    new_generation();
     if (num_variables == 0) { contract_id = calculate_contract_id(); return true; }
     variables = new ModuleVariable[num_variables];
     if (!variables) {
@@ -147,7 +347,7 @@ public:
     get_contract_callback = contract_callback;
 
     // Parse string, count number of variables
-    char name_buf[MVAR_COMPOSITE_NAME_LENGTH + 1];
+    char name_buf[MVAR_CONTRACT_WORD_LENGTH + 1];
     uint16_t source_pos = 0;
     uint8_t len, nvar = 0;
     while (get_next_word_from_contract(source_pos, len, name_buf, sizeof name_buf)) nvar++;
@@ -158,6 +358,8 @@ public:
       if (nvar && !num_variables) variables = new ModuleVariable[nvar];
       num_variables = nvar;
       #endif
+      flag_counts_valid = false; // Existing variables may be reused with their flags
+      if (deadbands) { delete[] deadbands; deadbands = NULL; }
       source_pos = 0;
       for (uint8_t i = 0; i < num_variables; i++) {
         if (!get_next_word_from_contract(source_pos, len, name_buf, sizeof name_buf)) {
@@ -165,15 +367,21 @@ public:
           break;
         }
         variables[i].set_variable(name_buf);
+        #ifndef MI_NO_DYNAMIC_MEM
+        // Apply the deadband here as well, so that small changes are not sent as changes or events
+        float band = ModuleVariable::get_deadband(name_buf);
+        if (band != 0 && !set_deadband(i, band)) mvs_out_of_memory = true;
+        #endif
       }
     } else deallocate();
     calculate_total_value_length();
+    new_generation();
     contract_id = calculate_contract_id();
   }
   #endif
 
   #ifdef IS_MASTER
-  void set_variables(const uint8_t *names_and_types, const uint8_t /*length*/) { // Serialized data coming from worker to master
+  void set_variables(const uint8_t *names_and_types, const uint16_t /*length*/) { // Serialized data coming from worker to master
     const uint8_t *p = names_and_types;
     uint32_t new_contract_id = 0;
     memcpy(&new_contract_id, p, 4); p += 4; // Remember incoming contract id
@@ -183,25 +391,80 @@ public:
       num_variables = *p; p++; // First byte is number of variables
       if (num_variables > 0) {
         variables = new ModuleVariable[num_variables];
-        if (variables == NULL) {
+        names = new NameRef[num_variables];
+        if (name_pool == NULL) { name_pool = new MINamePool(); own_name_pool = true; }
+        if (variables == NULL || names == NULL || name_pool == NULL) {
           mvs_out_of_memory = true;
           #ifdef DEBUG_PRINT
           DPRINT(F("MVS::set_variables OUT OF MEMORY. #var=")); DPRINTLN(num_variables);
           #endif
+          deallocate();
+          num_variables = 0;
           return;
         }
       }
       for (uint8_t i = 0; i < num_variables; i++) {
         variables[i].set_variable(p);
-        p += (2 + p[1]); // type byte + length byte + name length
+        if (p[0] & MVAR_DEADBAND_FLAG) { // A 4 byte deadband follows the name
+          float band;
+          memcpy(&band, &p[2 + p[1]], sizeof band);
+          if (!set_deadband(i, band)) {
+            mvs_out_of_memory = true;
+            deallocate();
+            contract_id = 0;
+            return;
+          }
+        }
+        uint8_t len = (uint8_t) MI_min(p[1], MVAR_MAX_NAME_LENGTH);
+        names[i].hash = MINamePool::get_hash((const char*) &p[2], len);
+        names[i].offset = name_pool->add((const char*) &p[2], len, names[i].hash);
+        if (names[i].offset == MI_NO_NAME) {
+          mvs_out_of_memory = true;
+          #ifdef DEBUG_PRINT
+          DPRINTLN(F("MVS::set_variables OUT OF NAME POOL MEMORY"));
+          #endif
+          deallocate();
+          contract_id = 0;
+          return;
+        }
+        p += (2 + p[1] + (p[0] & MVAR_DEADBAND_FLAG ? 4 : 0)); // type byte + length byte + name length + deadband
       }
       calculate_total_value_length();
+      new_generation();
     }
     #ifdef DEBUG_PRINT
     else { DPRINT(F("IGNORED DUPLICATE CONTRACT ")); DPRINTLN(contract_id); }
     #endif
   }
 
+  // Serialize the contract in the same format as sent from the module, for example to save it
+  void get_variables(BinaryBuffer &names_and_types, uint16_t &length, uint8_t header_byte) const {
+    length = 6; // Header byte plus Contract id plus number of variables byte
+    for (uint8_t i = 0; i < num_variables; i++)
+      length += (uint16_t) (2 + strlen(get_variable_name(i)) + (has_declared_deadband(i) ? 4 : 0));
+    if (!names_and_types.allocate(length)) {
+      mvs_out_of_memory = true;
+      length = 0;
+      #ifdef DEBUG_PRINT
+      DPRINTLN(F("MVS::get_variables OUT OF MEMORY"));
+      #endif
+      return;
+    }
+    uint8_t *p = names_and_types.get();
+    *p = header_byte; p++;
+    memcpy(p, &contract_id, 4); p += 4;
+    *p = num_variables; p++;
+    for (uint8_t i = 0; i < num_variables; i++) {
+      bool deadband = has_declared_deadband(i);
+      const char *name = get_variable_name(i);
+      uint8_t len = (uint8_t) strlen(name);
+      *p = (uint8_t) ((uint8_t) variables[i].get_type() | (deadband ? MVAR_DEADBAND_FLAG : 0)); p++;
+      *p = len; p++;
+      memcpy(p, name, len); p += len;
+      if (deadband) { memcpy(p, &deadbands[i].band, 4); p += 4; }
+    }
+  }
+
   #ifdef MASTER_MULTI_TRANSFER
   bool is_initialized() {
     for (uint8_t i = 0; i < num_variables; i++) if (!variables[i].is_initialized()) return false;
@@ -211,14 +474,15 @@ public:
   #endif
 
   #ifndef IS_MASTER
-  void get_variables(BinaryBuffer &names_and_types, uint8_t &length, uint8_t header_byte) const {
+  void get_variables(BinaryBuffer &names_and_types, uint16_t &length, uint8_t header_byte) const {
     // Calculate total buffer size
     length = 6; // Header byte plus Contract id plus number of variables byte
-    char name_buf[MVAR_COMPOSITE_NAME_LENGTH + 1];
+    char name_buf[MVAR_CONTRACT_WORD_LENGTH + 1];
     uint16_t source_pos = 0;
     uint8_t len;
     for (uint8_t i = 0; i < num_variables; i++) {
       if (!get_next_word_from_contract(source_pos, len, name_buf, sizeof name_buf)) { length = 0; break; }
+      if (ModuleVariable::get_deadband(name_buf) != 0) length += 4; // Deadband after the name
       remove_type(name_buf, len);
       length += 2 + len; // 2 bytes for type, length
     }
@@ -230,12 +494,18 @@ public:
       *p = num_variables; p++; // Add number of variables
       source_pos = 0;
       for (uint8_t i = 0; i < num_variables; i++) { // Add each variable type and name
+        uint8_t *type_pos = p;
         *p = (uint8_t) variables[i].get_type(); p++;
         if (!get_next_word_from_contract(source_pos, len, name_buf, sizeof name_buf)) { length = 0; break; }
+        float deadband = ModuleVariable::get_deadband(name_buf);
         remove_type(name_buf, len);
         *p = len; p++;
         memcpy(p, name_buf, len);
         p += len;
+        if (deadband != 0) {
+          *type_pos |= MVAR_DEADBAND_FLAG;
+          memcpy(p, &deadband, 4); p += 4;
+        }
       }
     } else {
       mvs_out_of_memory = true;
@@ -259,7 +529,7 @@ public:
   uint32_t get_contract_id() const { return contract_id; }
 
   // Returns true if values registered, false if the values do not conform to the current contract id
-  bool set_values(const uint8_t *values, const uint8_t length, uint8_t *read_length = NULL) { // contract_id(4), num_variables(1), <variables>
+  bool set_values(const uint8_t *values, const uint16_t length, uint16_t *read_length = NULL) { // contract_id(4), num_variables(1), <variables>
     // Get number of variables and contract id
     if (read_length) *read_length = 0;
     if (length < 5) return false; // Invalid message
@@ -312,7 +582,7 @@ public:
       // Disallow different values from master as long as the changed-flag is set, and clear the changed-flag
       // when the same value is received from master, indicating that the master has received it.
       if (variables[varpos].is_changed()) {
-        if (variables[varpos].is_equal(p, len)) variables[varpos].set_changed(false);
+        if (variables[varpos].is_equal(p, len)) set_changed_flag(variables[varpos], false);
         else set_value = false; // Ignore new values from master as long as changed-flag on module side is set
       } // else // Not changed on module side, so update with new value from master
       #endif
@@ -320,21 +590,21 @@ public:
         #if defined(IS_MASTER) && defined(MASTER_MULTI_TRANSFER)
         // Detect change
         bool was_changed = variables[varpos].is_changed();
-        variables[varpos].set_changed(false);
+        set_changed_flag(variables[varpos], false);
         #endif
-        variables[varpos].set_value(p, len);
+        bool significant = set_variable_value(varpos, p, len);
         #ifdef IS_MASTER
         #ifdef MASTER_MULTI_TRANSFER
         // Set change-bits if changed now
         if (variables[varpos].is_changed()) variables[varpos].set_change_bits();
-        if (was_changed) variables[varpos].set_changed(true);
+        if (was_changed) set_changed_flag(variables[varpos], true);
         variables[varpos].set_initialized();
         #endif
         #else
-        variables[varpos].set_changed(false); // Normal flow of values shall not set changed-flag
+        set_changed_flag(variables[varpos], false); // Normal flow of values shall not set changed-flag
         #endif
         p += len;
-        if (event) variables[varpos].set_event(); // Set event flag on receiving side
+        if (event && significant) set_event_flag(variables[varpos], true); // Set event flag on receiving side
       }
     }
     if (read_length) *read_length = (p - values);
@@ -351,15 +621,22 @@ public:
   // and/or values marked as changed. If setting both events_only and changes_only,
   // both will be included. The alloc_extra can be specified to make sure that if a buffer
   // has to be allocated, extra space is included to avoid expanding later.
-  void get_values(BinaryBuffer &values, uint8_t &length, uint8_t header_byte,
+  void get_values(BinaryBuffer &values, uint16_t &length, uint8_t header_byte,
                   bool events_only = false, bool changes_only = false, uint8_t alloc_extra = 0) const {
     length = 0;
 
     // Determine the number of variables to be serialized, all or a subset
-    uint8_t numvar = num_variables, total_len = total_value_length;
+    uint8_t numvar = num_variables;
+    uint16_t total_len = total_value_length;
     if (events_only || changes_only) {
+      if (!flag_counts_valid) count_flags();
+      if ((!events_only || event_count == 0) && (!changes_only || changed_count == 0)) return; // Nothing to send
+      // The scan can stop when all flagged variables are found, unless both kinds are requested
+      uint8_t flagged = events_only && changes_only ? num_variables : (events_only ? event_count : changed_count);
+      uint8_t first, end;
+      get_flag_range(events_only, changes_only, first, end);
       numvar = 0; total_len = 0;
-      for (uint8_t i = 0; i < num_variables; i++) {
+      for (uint8_t i = first; i < end && numvar < flagged; i++) {
         if ((events_only && variables[i].is_event()) || (changes_only && variables[i].is_changed())) {
           numvar++;
           total_len +=  variables[i].get_size();
@@ -387,11 +664,14 @@ public:
       p++;
       // Values
       if (numvar != 0) {
-        for (uint8_t i = 0; i < num_variables; i++) {
+        uint8_t count = 0, first = 0, end = num_variables;
+        if (numvar != num_variables) get_flag_range(events_only, changes_only, first, end);
+        for (uint8_t i = first; i < end && count < numvar; i++) {
           if (numvar == num_variables || // include all
             (events_only && variables[i].is_event()) || // event
             (is_updated() && changes_only && variables[i].is_changed())) // changed
           {
+            count++;
             if (numvar != num_variables) { *p = i; p++; } // Variable number if not serializing all
             uint8_t len = variables[i].get_size();
             variables[i].get_value(p, len);
@@ -421,10 +701,11 @@ public:
 
   uint8_t get_variable_ix(const char *variable_name) const {
     #ifdef IS_MASTER
+    uint16_t hash = MINamePool::get_hash(variable_name, get_name_length(variable_name));
     for (uint8_t i = 0; i < num_variables; i++)
-      if (strncmp(variable_name, variables[i].name, MVAR_MAX_NAME_LENGTH) == 0) return i;
+      if (names[i].hash == hash && strncmp(variable_name, get_variable_name(i), MVAR_MAX_NAME_LENGTH) == 0) return i;
     #else
-    char name_buf[MVAR_COMPOSITE_NAME_LENGTH + 1];
+    char name_buf[MVAR_CONTRACT_WORD_LENGTH + 1];
     uint16_t source_pos = 0;
     uint8_t len;
     for (uint8_t i = 0; i < num_variables; i++) {
@@ -440,20 +721,27 @@ public:
 
   #ifdef IS_MASTER
   uint8_t get_variable_ix_ignorecase(const char *variable_name) const {
+    uint16_t hash = MINamePool::get_hash(variable_name, get_name_length(variable_name));
     for (uint8_t i = 0; i < num_variables; i++)
-      if (mi_compare_ignorecase(variable_name, variables[i].name, MVAR_MAX_NAME_LENGTH)) return i;
+      if (names[i].hash == hash && mi_compare_ignorecase(variable_name, get_variable_name(i), MVAR_MAX_NAME_LENGTH)) return i;
     return NO_VARIABLE;
   }
   #endif
 
   const ModuleVariable &get_module_variable(const uint8_t ix) const { return variables[ix]; }
-  ModuleVariable &get_module_variable(const uint8_t ix) { return variables[ix]; }
+  ModuleVariable &get_module_variable(const uint8_t ix) {
+    flag_counts_valid = false; // The flags may be modified through the returned reference
+    return variables[ix];
+  }
 
   ModuleVariableType get_type(const uint8_t ix) const { return variables[ix].get_type(); }
+  uint8_t get_size(const uint8_t ix) const { return variables[ix].get_size(); }
 
   // Low-level setter and getter. Use these on module side where ix is constant.
-  void set_value(const uint8_t ix, const void *value, const uint8_t size) {
-    if (ix < num_variables) variables[ix].set_value(value, size);
+  // The setters return false if the change was within the deadband of the variable, and therefore not
+  // flagged as changed. This can be used to decide whether to flag it as an event.
+  bool set_value(const uint8_t ix, const void *value, const uint8_t size) {
+    return ix < num_variables && set_variable_value(ix, value, size);
   }
   void get_value(const uint8_t ix, void *value, const uint8_t size) const {
     if (ix < num_variables) variables[ix].get_value(value, size);
@@ -467,18 +755,31 @@ public:
   // Change-tolerant higher-level setter and getter. Use these on master side to handle changing contracts
   // when a module is reprogrammed while master is running.
   #ifdef USE_MIVARIABLE
+  // Look up the variable ix and value pointer, keeping them until the variables change
+  bool bind(MIVariable &var) const {
+    var.ix = get_variable_ix(var.name);
+    var.value = get_value_pointer(var.ix);
+    var.generation = generation;
+    return var.ix != NO_VARIABLE;
+  }
+
+  // Bind many variables at once, for example after a contract exchange. Returns the number found.
+  uint8_t bind(MIVariable **vars, const uint8_t count) const {
+    uint8_t found = 0;
+    for (uint8_t i = 0; i < count; i++) if (bind(*vars[i])) found++;
+    return found;
+  }
+
   void verify_mivariable(MIVariable &var) const {
     // Search for the variable ix if first time or contract has changed
-    if (var.ix == NO_VARIABLE || var.contract_id != contract_id || !contract_id) {
-      var.ix = var.name != NULL ? get_variable_ix(var.name) : NO_VARIABLE;
-      var.contract_id = var.ix != NO_VARIABLE ? contract_id : 0;
-    }
+    if (var.generation != generation) bind(var);
   }
-  void set_value(MIVariable &var, const void *value, const uint8_t size) {
+  uint32_t get_generation() const { return generation; }
+  bool set_value(MIVariable &var, const void *value, const uint8_t size) {
     verify_mivariable(var);
 
     // Set the value with the verified ix
-    if (var.ix < num_variables) variables[var.ix].set_value(value, size);
+    return var.ix < num_variables && set_variable_value(var.ix, value, size);
   }
   void get_value(MIVariable &var, void *value, const uint8_t size) const {
     verify_mivariable(var);
@@ -488,18 +789,18 @@ public:
   }
   const void *get_value_pointer(MIVariable &var) const {
     verify_mivariable(var);
-    return get_value_pointer(var.ix);
+    return var.value;
   }
 
   // Specialized convenience setters
-  void set_value(MIVariable &var, const bool &v) { set_value(var, &v, 1); }
-  void set_value(MIVariable &var, const uint8_t &v) { set_value(var, &v, 1); }
-  void set_value(MIVariable &var, const uint16_t &v) { set_value(var, &v, 2); }
-  void set_value(MIVariable &var, const uint32_t &v) { set_value(var, &v, 4); }
-  void set_value(MIVariable &var, const int8_t &v) { set_value(var, &v, 1); }
-  void set_value(MIVariable &var, const int16_t &v) { set_value(var, &v, 2); }
-  void set_value(MIVariable &var, const int32_t &v) { set_value(var, &v, 4); }
-  void set_value(MIVariable &var, const float &v) { set_value(var, &v, 4); }
+  bool set_value(MIVariable &var, const bool &v) { return set_value(var, &v, 1); }
+  bool set_value(MIVariable &var, const uint8_t &v) { return set_value(var, &v, 1); }
+  bool set_value(MIVariable &var, const uint16_t &v) { return set_value(var, &v, 2); }
+  bool set_value(MIVariable &var, const uint32_t &v) { return set_value(var, &v, 4); }
+  bool set_value(MIVariable &var, const int8_t &v) { return set_value(var, &v, 1); }
+  bool set_value(MIVariable &var, const int16_t &v) { return set_value(var, &v, 2); }
+  bool set_value(MIVariable &var, const int32_t &v) { return set_value(var, &v, 4); }
+  bool set_value(MIVariable &var, const float &v) { return set_value(var, &v, 4); }
 
     // Specialized convenience getters
   void get_value(MIVariable &var, bool &v) const { get_value(var, &v, 1); }
@@ -536,19 +837,19 @@ public:
   }
   void set_event(MIVariable &var, const bool event = true) const {
     verify_mivariable(var);
-    if (var.ix < num_variables) variables[var.ix].set_event(event);
+    if (var.ix < num_variables) set_event_flag(variables[var.ix], event);
   }
   #endif
 
   // Specialized convenience setters
-  void set_value(const uint8_t ix, const bool &v) { set_value(ix, &v, 1); }
-  void set_value(const uint8_t ix, const uint8_t &v) { set_value(ix, &v, 1); }
-  void set_value(const uint8_t ix, const uint16_t &v) { set_value(ix, &v, 2); }
-  void set_value(const uint8_t ix, const uint32_t &v) { set_value(ix, &v, 4); }
-  void set_value(const uint8_t ix, const int8_t &v) { set_value(ix, &v, 1); }
-  void set_value(const uint8_t ix, const int16_t &v) { set_value(ix, &v, 2); }
-  void set_value(const uint8_t ix, const int32_t &v) { set_value(ix, &v, 4); }
-  void set_value(const uint8_t ix, const float &v) { set_value(ix, &v, 4); }
+  bool set_value(const uint8_t ix, const bool &v) { return set_value(ix, &v, 1); }
+  bool set_value(const uint8_t ix, const uint8_t &v) { return set_value(ix, &v, 1); }
+  bool set_value(const uint8_t ix, const uint16_t &v) { return set_value(ix, &v, 2); }
+  bool set_value(const uint8_t ix, const uint32_t &v) { return set_value(ix, &v, 4); }
+  bool set_value(const uint8_t ix, const int8_t &v) { return set_value(ix, &v, 1); }
+  bool set_value(const uint8_t ix, const int16_t &v) { return set_value(ix, &v, 2); }
+  bool set_value(const uint8_t ix, const int32_t &v) { return set_value(ix, &v, 4); }
+  bool set_value(const uint8_t ix, const float &v) { return set_value(ix, &v, 4); }
 
   // Specialized convenience getters
   void get_value(const uint8_t ix, bool &v) const { get_value(ix, &v, 1); }
@@ -573,21 +874,54 @@ public:
 
   // Change detection
   bool is_changed() const {
-    for (uint8_t i=0; i<num_variables; i++) if (variables[i].is_changed()) return true;
-    return false;
+    if (!flag_counts_valid) count_flags();
+    return changed_count != 0;
+  }
+  uint8_t get_changed_count() const { if (!flag_counts_valid) count_flags(); return changed_count; }
+  void clear_changed() {
+    if (!flag_counts_valid) count_flags();
+    for (uint8_t i=changed_first; i<changed_end && changed_count; i++) set_changed_flag(variables[i], false);
+  }
+  // Indices [first, end) containing all variables flagged as changed, for loops visiting only those
+  void get_changed_range(uint8_t &first, uint8_t &end) const {
+    if (!flag_counts_valid) count_flags();
+    first = changed_first; end = changed_end;
   }
-  void clear_changed() { for (uint8_t i=0; i<num_variables; i++) variables[i].set_changed(false); }
   bool is_changed(const uint8_t ix) const { if (ix < num_variables) return variables[ix].is_changed(); return false; }
 
 
   // Event support
   bool has_events() const {
-    for (uint8_t i=0; i<num_variables; i++) if (variables[i].is_event()) return true;
-    return false;
+    if (!flag_counts_valid) count_flags();
+    return event_count != 0;
+  }
+  uint8_t get_event_count() const { if (!flag_counts_valid) count_flags(); return event_count; }
+  void clear_events() {
+    if (!flag_counts_valid) count_flags();
+    for (uint8_t i=event_first; i<event_end && event_count; i++) set_event_flag(variables[i], false);
+  }
+  // Indices [first, end) containing all variables flagged as events
+  void get_event_range(uint8_t &first, uint8_t &end) const {
+    if (!flag_counts_valid) count_flags();
+    first = event_first; end = event_end;
   }
-  void clear_events() { for (uint8_t i=0; i<num_variables; i++) variables[i].set_event(false); }
   bool is_event(const uint8_t ix) const { if (ix < num_variables) return variables[ix].is_event(); return false; }
-  void set_event(const uint8_t ix, const bool event = true) { if (ix < num_variables) variables[ix].set_event(event); }
+  void set_event(const uint8_t ix, const bool event = true) { if (ix < num_variables) set_event_flag(variables[ix], event); }
+  void set_changed(const uint8_t ix, const bool changed = true) { if (ix < num_variables) set_changed_flag(variables[ix], changed); }
+
+  // Deadband support
+  float get_deadband(const uint8_t ix) const { return deadbands && ix < num_variables ? deadbands[ix].band : 0; }
+  #ifdef IS_MASTER
+  // Let a variable without a declared deadband use the band of the variable it is copied from,
+  // like an input using the band of its source output
+  bool inherit_deadband(const uint8_t ix, const float band) {
+    if (ix >= num_variables || has_declared_deadband(ix)) return true;
+    if (band == 0 && deadbands == NULL) return true;
+    if (set_deadband(ix, band, true)) return true;
+    mvs_out_of_memory = true;
+    return false;
+  }
+  #endif
 
 
   // These are used for determining when values are ready to be used. If setting values manually, call the set_updated
@@ -605,6 +939,7 @@ public:
     #endif
   }
   uint32_t get_updated_time_ms() const { return values_received_time; }
+  void set_updated_time_ms(uint32_t time_ms) { if (got_contract()) values_received_time = time_ms ? time_ms : 1; } // Like when restoring saved values
   void clear_updated_if_too_old(uint32_t age_limit_ms = 3600000) {
     if ((uint32_t)(millis() - values_received_time) > age_limit_ms)  values_received_time = 0;
   }
@@ -621,12 +956,12 @@ public:
       if (num_variables == 0) DPRINT(F("Empty contract."));
       else {
         DPRINT(num_variables); DPRINT(F(":"));
-        char name_buf[MVAR_COMPOSITE_NAME_LENGTH + 1];
+        char name_buf[MVAR_CONTRACT_WORD_LENGTH + 1];
         uint16_t source_pos = 0;
         uint8_t len;
         for (uint8_t i = 0; i < num_variables; i++) {
           #ifdef IS_MASTER
-          strncpy(name_buf, variables[i].name, MVAR_MAX_NAME_LENGTH);
+          get_variable_name(i, name_buf);
           #else
           if (!get_next_word_from_contract(source_pos, len, name_buf, sizeof name_buf)) break;
           remove_type(name_buf, len);
@@ -643,12 +978,12 @@ public:
     void debug_print_values() const {
       if (num_variables == 0) DPRINT(F("Empty contract."));
       else {
-        char name_buf[MVAR_COMPOSITE_NAME_LENGTH + 1];
+        char name_buf[MVAR_CONTRACT_WORD_LENGTH + 1];
         uint16_t source_pos = 0;
         uint8_t len;
         for (uint8_t i = 0; i < num_variables; i++) {
           #ifdef IS_MASTER
-          strncpy(name_buf, variables[i].name, MVAR_MAX_NAME_LENGTH);
+          get_variable_name(i, name_buf);
           #else
           if (!get_next_word_from_contract(source_pos, len, name_buf, sizeof name_buf)) break;
           remove_type(name_buf, len);
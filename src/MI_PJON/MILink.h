@@ -1,5 +1,26 @@
 #pragma once
 
+// The well-known PJON port number for ModuleInterface packets, used to quickly separate ModuleInterface related messages from others
+#define MI_PJON_MODULE_INTERFACE_PORT 100
+
+// Max PJON overhead of a ModuleInterface packet: header, length, header CRC, device ids, bus ids,
+// packet id, port and CRC32. Used by links that cannot calculate it for their configuration.
+#ifndef MI_PJON_MAX_OVERHEAD
+  #define MI_PJON_MAX_OVERHEAD 22
+#endif
+
+// The max payload of a ModuleInterface packet sent with the given PJON configuration (checked with
+// PJON v13.x). CRC32 is used for all but the shortest packets, so it is always included.
+inline uint16_t mi_pjon_max_payload_length(const uint8_t config) {
+  uint8_t header = (uint8_t) (config | PJON_PORT_BIT | PJON_CRC_BIT);
+  if (PJON_PACKET_MAX_LENGTH > 255) header |= PJON_EXT_LEN_BIT;
+  uint8_t overhead = PJONTools::packet_overhead(header);
+  return (uint16_t) (PJON_PACKET_MAX_LENGTH > overhead ? PJON_PACKET_MAX_LENGTH - overhead : 0);
+}
+
+// Called when a packet sent with send_packet_async has been delivered (PJON_ACK) or given up (PJON_FAIL)
+typedef void (*MISendCallback)(uint16_t status, void *custom_pointer);
+
 struct MILink {
   virtual uint16_t receive() = 0;
   virtual uint16_t receive(uint32_t duration) = 0;
@@ -7,6 +28,21 @@ struct MILink {
   virtual uint8_t update() = 0;
   virtual uint16_t send_packet(uint8_t id, const uint8_t *b_id, const char *string, uint16_t length, uint32_t timeout) = 0;
 
+  // The longest message that can be sent in one packet. Longer messages are split into fragments.
+  virtual uint16_t get_max_payload_length() const { return PJON_PACKET_MAX_LENGTH - MI_PJON_MAX_OVERHEAD; }
+
+  // Queue a packet to be sent by update() without waiting for the ACK, reporting the result through
+  // the callback. Links without a packet queue will send it immediately, waiting up to the timeout.
+  virtual bool send_packet_async(uint8_t id, const uint8_t *b_id, const char *string, uint16_t length, uint32_t timeout,
+                                 MISendCallback callback, void *custom_pointer) {
+    uint16_t status = send_packet(id, b_id, string, length, timeout);
+    if (callback) callback(status, custom_pointer);
+    return true;
+  }
+
+  // Drop the callbacks of queued packets, for example before the receiver of the callbacks is deleted
+  virtual void forget_async_sends(void * /*custom_pointer*/) { }
+
   virtual const PJON_Packet_Info &get_last_packet_info() const = 0;
 
   virtual uint8_t get_id() const = 0;
@@ -17,3 +53,82 @@ struct MILink {
 
   virtual void set_receiver(PJON_Receiver r, void *custom_ptr = NULL) = 0;
 };
+
+// Keeps track of packets queued in the PJON packet buffer by send_packet_async, reporting
+// the result when PJON has removed them from the buffer after an ACK or after giving up.
+// PJON reports failures through its error callback, so this registers its own error callback
+// while updating, passing the errors on to the one given to the link's set_error. Use that
+// instead of setting an error callback directly on the PJON object.
+// PJON_MAX_PACKETS is 0 by default (see MIPlatforms.h), so it must be defined to a higher
+// value before including for packets to be queued. Otherwise they will be sent immediately.
+// NOTE: This reads the state of the PJON packet buffer (packets[ix].state) directly, which
+// has been checked with PJON v13.x. Other PJON versions may need changes here.
+struct MIAsyncSends {
+  struct Pending {
+    uint16_t packet_ix;
+    MISendCallback callback;
+    void *custom_pointer;
+    bool failed;
+  };
+  Pending pending[PJON_MAX_PACKETS > 0 ? PJON_MAX_PACKETS : 1];
+  uint8_t count = 0;
+  PJON_Error user_error = NULL; // Error callback set by the user, called for all errors
+
+  static void ignore_error(uint8_t /*code*/, uint16_t /*data*/, void * /*custom_pointer*/) { }
+
+  // The instance being updated, receiving the errors reported by PJON during update
+  static MIAsyncSends *&get_updating() { static MIAsyncSends *updating = NULL; return updating; }
+
+  static void error_function(uint8_t code, uint16_t data, void *custom_pointer) {
+    MIAsyncSends *updating = get_updating();
+    if (updating == NULL) return;
+    if (code == PJON_CONNECTION_LOST)
+      for (uint8_t i = 0; i < updating->count; i++)
+        if (updating->pending[i].packet_ix == data) updating->pending[i].failed = true;
+    if (updating->user_error) updating->user_error(code, data, custom_pointer);
+  }
+
+  // Set the error callback that PJON will use, also while updating
+  template<typename Bus>
+  void set_error(Bus &bus, PJON_Error e) {
+    user_error = e;
+    bus.set_error(e ? e : ignore_error);
+  }
+
+  template<typename Bus>
+  bool send(Bus &bus, const PJON_Packet_Info &info, const char *string, uint16_t length,
+            MISendCallback callback, void *custom_pointer) {
+    #if PJON_MAX_PACKETS > 0
+    if (count >= PJON_MAX_PACKETS) return false;
+    #else
+    return false;
+    #endif
+    uint16_t ix = bus.send(info, string, length);
+    if (ix == PJON_FAIL) return false;
+    Pending &p = pending[count++];
+    p.packet_ix = ix; p.callback = callback; p.custom_pointer = custom_pointer; p.failed = false;
+    return true;
+  }
+
+  // Let PJON send queued packets, then report the ones that are finished
+  template<typename Bus>
+  uint8_t update(Bus &bus) {
+    if (count == 0) return 0;
+    bus.set_error(error_function);
+    get_updating() = this;
+    uint8_t remaining = bus.update();
+    get_updating() = NULL;
+    bus.set_error(user_error ? user_error : ignore_error);
+    for (uint8_t i = count; i > 0; i--) {
+      Pending p = pending[i - 1];
+      if (bus.packets[p.packet_ix].state != 0) continue; // Still in the buffer
+      pending[i - 1] = pending[--count];
+      if (p.callback) p.callback(p.failed ? PJON_FAIL : PJON_ACK, p.custom_pointer);
+    }
+    return remaining;
+  }
+
+  void forget(void *custom_pointer) {
+    for (uint8_t i = 0; i < count; i++) if (pending[i].custom_pointer == custom_pointer) pending[i].callback = NULL;
+  }
+};
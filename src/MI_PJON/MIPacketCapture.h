@@ -0,0 +1,150 @@
+#pragma once
+
+// Capture of the ModuleInterface packets sent and received by a master or module, enabled by
+// defining MI_PACKET_CAPTURE. Each packet is passed as a record to a capture function, which on
+// POSIX can be a built-in writer to a binary log file. The log can be replayed with tools/Replay.
+//
+// Log file format, all integers little-endian:
+//   Header:  "MICAP"(5), version(1), reserved(2)
+//   Records: time_us(4), flags(1), remote device id(1), remote bus id(4), length(2), payload(length)
+// The time is micros() when the packet was sent or received, wrapping around after about 71 minutes.
+
+#include <platforms/MIPlatforms.h>
+
+#define MI_CAPTURE_MAGIC "MICAP"
+#define MI_CAPTURE_VERSION 1
+#define MI_CAPTURE_FILE_HEADER_LENGTH 8
+#define MI_CAPTURE_RECORD_HEADER_LENGTH 12
+
+enum MICaptureFlags {
+  mcfSent = 1,      // Sent, otherwise received
+  mcfFailed = 2,    // Sent but not ACKed
+  mcfAsync = 4,     // Queued to be sent, the result is not known
+  mcfMaster = 8     // Captured by a master
+};
+
+// Called for each packet with the record header (MI_CAPTURE_RECORD_HEADER_LENGTH bytes) and the payload
+typedef void (*MICaptureFunction)(const uint8_t *header, const uint8_t *payload, uint16_t length, void *custom_pointer);
+
+class MIPacketCapture {
+  MICaptureFunction function = NULL;
+  void *custom_pointer = NULL;
+  #ifdef MI_POSIX
+  FILE *file = NULL;
+
+  static void write_to_file(const uint8_t *header, const uint8_t *payload, uint16_t length, void *custom_pointer) {
+    FILE *f = ((MIPacketCapture*) custom_pointer)->file;
+    if (f == NULL) return;
+    fwrite(header, 1, MI_CAPTURE_RECORD_HEADER_LENGTH, f);
+    fwrite(payload, 1, length, f);
+  }
+  #endif
+
+public:
+  // The capture used by all ModuleInterface objects in the program
+  static MIPacketCapture &get() { static MIPacketCapture capture; return capture; }
+
+  void set_function(MICaptureFunction function, void *custom_pointer = NULL) {
+    this->function = function;
+    this->custom_pointer = custom_pointer;
+  }
+
+  void capture(const uint8_t flags, const uint8_t remote_id, const uint8_t *remote_bus_id,
+               const uint8_t *payload, const uint16_t length) {
+    if (function == NULL) return;
+    uint8_t header[MI_CAPTURE_RECORD_HEADER_LENGTH];
+    uint32_t time = micros();
+    memcpy(header, &time, 4);
+    header[4] = flags;
+    header[5] = remote_id;
+    memcpy(&header[6], remote_bus_id, 4);
+    memcpy(&header[10], &length, 2);
+    function(header, payload, length, custom_pointer);
+  }
+
+  #ifdef MI_POSIX
+  // Write all captured packets to a log file, replacing any existing file
+  bool open_file(const char *path) {
+    close_file();
+    file = fopen(path, "wb");
+    if (file == NULL) return false;
+    uint8_t header[MI_CAPTURE_FILE_HEADER_LENGTH] = { 0 };
+    memcpy(header, MI_CAPTURE_MAGIC, 5);
+    header[5] = MI_CAPTURE_VERSION;
+    fwrite(header, 1, sizeof header, file);
+    set_function(write_to_file, this);
+    return true;
+  }
+
+  void close_file() {
+    if (file == NULL) return;
+    set_function(NULL);
+    fclose(file);
+    file = NULL;
+  }
+
+  void flush() { if (file) fflush(file); }
+  #endif
+};
+
+#ifdef MI_POSIX
+// Reading of a log file written by MIPacketCapture
+class MICaptureReader {
+  FILE *file = NULL;
+  uint32_t last_time = 0;
+  uint64_t time_high = 0;
+public:
+  struct Record {
+    uint64_t time_us;     // With wraparounds removed, relative to the first record
+    uint8_t flags, remote_id, remote_bus_id[4];
+    uint16_t length;
+    uint8_t *payload;     // Owned by the reader, valid until the next read
+  };
+private:
+  uint8_t *payload = NULL;
+  uint32_t payload_size = 0;
+  uint64_t first_time = 0;
+  bool first = true;
+public:
+  ~MICaptureReader() { close(); delete[] payload; }
+
+  bool open(const char *path) {
+    close();
+    file = fopen(path, "rb");
+    if (file == NULL) return false;
+    uint8_t header[MI_CAPTURE_FILE_HEADER_LENGTH];
+    if (fread(header, 1, sizeof header, file) != sizeof header || memcmp(header, MI_CAPTURE_MAGIC, 5) != 0
+      || header[5] != MI_CAPTURE_VERSION) { close(); return false; }
+    first = true;
+    time_high = 0;
+    return true;
+  }
+
+  void close() { if (file) { fclose(file); file = NULL; } }
+
+  // Read the next record, returning false at the end of the file or if the file is truncated
+  bool read(Record &r) {
+    uint8_t header[MI_CAPTURE_RECORD_HEADER_LENGTH];
+    if (file == NULL || fread(header, 1, sizeof header, file) != sizeof header) return false;
+    uint32_t time;
+    memcpy(&time, header, 4);
+    r.flags = header[4];
+    r.remote_id = header[5];
+    memcpy(r.remote_bus_id, &header[6], 4);
+    memcpy(&r.length, &header[10], 2);
+    if (r.length > payload_size) {
+      delete[] payload;
+      payload_size = r.length;
+      payload = new uint8_t[payload_size];
+    }
+    if (r.length && fread(payload, 1, r.length, file) != r.length) return false;
+    r.payload = payload;
+    if (!first && time < last_time) time_high += 1ull << 32; // micros() wrapped around
+    if (first) first_time = time;
+    first = false;
+    last_time = time;
+    r.time_us = time_high + time - first_time;
+    return true;
+  }
+};
+#endif
@@ -2,15 +2,50 @@
 
 #include <MI_PJON/MILink.h>
 #include <MI/ModuleInterface.h>
+#ifdef MI_PACKET_CAPTURE
+#include <MI_PJON/MIPacketCapture.h>
+#ifdef IS_MASTER
+  #define MI_CAPTURE_SIDE mcfMaster
+#else
+  #define MI_CAPTURE_SIDE 0
+#endif
+#endif
 
 // A timeout to make sure a lost request or reply does not stop everything permanently
-#define MI_REQUEST_TIMEOUT 5000000        // (us) How long to wait for an active module to reply to a request
-#define MI_REDUCED_REQUEST_TIMEOUT 20000  // (us) How long to try to contact a module that is marked as inactive
-#define MI_SEND_TIMEOUT 5000000           // (us) How long to wait for an active device to PJON_ACK
-#define MI_REDUCED_SEND_TIMEOUT 20000     // (us) How long to try to contact a module that is marked as inactive
+#ifndef MI_REQUEST_TIMEOUT
+  #define MI_REQUEST_TIMEOUT 5000000        // (us) How long to wait for an active module to reply to a request
+#endif
+#ifndef MI_REDUCED_REQUEST_TIMEOUT
+  #define MI_REDUCED_REQUEST_TIMEOUT 20000  // (us) How long to try to contact a module that is marked as inactive
+#endif
+#ifndef MI_SEND_TIMEOUT
+  #define MI_SEND_TIMEOUT 5000000           // (us) How long to wait for an active device to PJON_ACK
+#endif
+#ifndef MI_REDUCED_SEND_TIMEOUT
+  #define MI_REDUCED_SEND_TIMEOUT 20000     // (us) How long to try to contact a module that is marked as inactive
+#endif
+
+// Max payload of an mcMulti packet, leaving room for the PJON header and CRC
+#ifndef MI_MULTI_MAX_LENGTH
+  #define MI_MULTI_MAX_LENGTH (PJON_PACKET_MAX_LENGTH - 30)
+#endif
+
+#ifdef IS_MASTER
+static_assert(MI_MULTI_MAX_LENGTH > 4, "MI_MULTI_MAX_LENGTH is too small, increase PJON_PACKET_MAX_LENGTH");
+#endif
+
+// Messages longer than the max payload of the link are split into mcFragment packets, each starting
+// with cmd(1), message id(1), fragment ix(1), fragment count(1)
+#define MI_FRAGMENT_HEADER_LENGTH 4
 
-// The well-known PJON port number for ModuleInterface packets, used to quickly separate ModuleInterface related messages from others
-#define MI_PJON_MODULE_INTERFACE_PORT 100
+// Max length of a message reassembled from fragments
+#ifndef MI_MAX_MESSAGE_LENGTH
+  #ifdef IS_MASTER
+    #define MI_MAX_MESSAGE_LENGTH 4096
+  #else
+    #define MI_MAX_MESSAGE_LENGTH 512
+  #endif
+#endif
 
 // Time without requests from the master before sending a presence packet (directed or broadcast)
 // (To establish a new route through the network if routers are involved)
@@ -25,6 +60,15 @@ protected:
   uint8_t remote_id = 0;
   uint8_t remote_bus_id[4];
   uint32_t status_requested_time = 0;
+  // Messages collected between begin_batch and end_batch, to be sent as one mcMulti packet
+  BinaryBuffer batch;
+  uint16_t batch_length = 0;
+  uint8_t batch_count = 0;
+  bool batching = false;
+  #ifdef MI_METRICS
+  uint32_t async_sent_us = 0;     // When the last packet was queued with send_async
+  uint16_t async_sent_length = 0;
+  #endif
   #else
   // Remember the latest master address
   uint8_t master_id = 0;
@@ -32,6 +76,44 @@ protected:
 
   void set_link(MILink &pjon) { this->pjon = &pjon; pjon.set_receiver(default_receiver_function, this); }
   #endif
+  // Reassembly of a message received as mcFragment packets
+  BinaryBuffer fragments;
+  uint16_t fragments_length = 0;
+  uint8_t fragments_message_id = 0, fragments_next_ix = 0, fragments_count = 0;
+  uint8_t sent_message_id = 0; // Id of last message sent as fragments
+
+  // Add a fragment: message id(1), fragment ix(1), fragment count(1), <data>.
+  // Returns true when the message is complete. Fragments must arrive in order.
+  bool add_fragment(const uint8_t *fragment, const uint16_t length) {
+    uint8_t id = fragment[0], ix = fragment[1], count = fragment[2];
+    uint16_t data_length = length - 3;
+    if (ix == 0) {
+      fragments_length = 0;
+      fragments_message_id = id;
+      fragments_next_ix = 0;
+      fragments_count = 0;
+      // The sender decides the fragment length, but no packet received can be longer than PJON_PACKET_MAX_LENGTH
+      uint16_t max_length = (uint16_t) MI_min((uint32_t) count * (PJON_PACKET_MAX_LENGTH - MI_FRAGMENT_HEADER_LENGTH),
+                                              (uint32_t) MI_MAX_MESSAGE_LENGTH);
+      if (!fragments.allocate(max_length)) {
+        mvs_out_of_memory = true;
+        #ifdef DEBUG_PRINT
+        DPRINTLN(F("PMI::add_fragment OUT OF MEMORY"));
+        #endif
+        return false;
+      }
+      fragments_count = count;
+    }
+    if (fragments_count == 0 || id != fragments_message_id || ix != fragments_next_ix || count != fragments_count
+      || fragments_length + data_length > fragments.length()) {
+      fragments_count = 0; // Missing or invalid fragment, drop the message
+      return false;
+    }
+    memcpy(&fragments.get()[fragments_length], &fragment[3], data_length);
+    fragments_length += data_length;
+    fragments_next_ix++;
+    return fragments_next_ix == fragments_count;
+  }
 public:
   // Constructors for Master side
   #ifdef IS_MASTER
@@ -225,11 +307,14 @@ public:
     if (!settings.got_contract() || (!settings.is_updated() && settings.get_num_variables() != 0)) return false;
     notify(ntSampleSettings, this);
     BinaryBuffer response;
-    uint8_t response_length = 0;
+    uint16_t response_length = 0;
     settings.get_values(response, response_length, mcSetSettings);
     outputs.before_requested_time = millis(); // The new scheme where settings are sent and outputs received as response
     bool acked = send(remote_id, remote_bus_id, response.get(), response_length);
     if (acked) status_bits &= ~MISSING_SETTINGS; // Assume they were received until next status saying they were not
+    #ifdef MI_METRICS
+    if (acked) metrics.start_request(mcSetOutputs, mlOutputsRTT);
+    #endif
     return acked;
   }
 
@@ -241,11 +326,120 @@ public:
     #endif
     status_bits &= ~MISSING_INPUTS; // Assume they were received until next status saying they were not
     if (!inputs.got_contract() || !inputs.is_updated() || inputs.get_num_variables() == 0) return;
+    #ifndef NO_GLOBAL_VALUES
+    uint8_t local_count = get_local_input_count();
+    if (local_count == 0) return; // Module gets all inputs from the global values broadcast
+    if (local_count < inputs.get_num_variables()) { // Module gets the rest from the global values broadcast
+      notify(ntSampleInputs, this);
+      send_local_inputs(local_count);
+      return;
+    }
+    #endif
     notify(ntSampleInputs, this);
     BinaryBuffer response;
-    uint8_t response_length = 0;
+    uint16_t response_length = 0;
     inputs.get_values(response, response_length, mcSetInputs);
-    send(remote_id, remote_bus_id, response.get(), response_length);
+    if (!add_to_batch(response.get(), response_length))
+      send_async(remote_id, remote_bus_id, response.get(), response_length); // Send to all modules without waiting
+  }
+
+  #ifndef NO_GLOBAL_VALUES
+  // Return the number of inputs that are not global values, or all if the module has not confirmed the global value map
+  uint8_t get_local_input_count() const {
+    uint8_t num_inputs = inputs.get_num_variables(), count = 0;
+    if (!(status_bits & GLOBAL_VALUES_ACTIVE) || input_global_id.length() < num_inputs) return num_inputs;
+    for (uint8_t i = 0; i < num_inputs; i++) if (input_global_id[i] == NO_GLOBAL_ID) count++;
+    return count;
+  }
+
+  // Send only the inputs that are not global values, with the input number before each value
+  void send_local_inputs(const uint8_t count) {
+    uint8_t num_inputs = inputs.get_num_variables();
+    uint16_t length = 6;
+    for (uint8_t i = 0; i < num_inputs; i++) if (input_global_id[i] == NO_GLOBAL_ID) length += 1 + inputs.get_size(i);
+    BinaryBuffer message;
+    if (!message.allocate(length)) {
+      mvs_out_of_memory = true;
+      #ifdef DEBUG_PRINT
+      DPRINTLN(F("PMI::send_local_inputs OUT OF MEMORY"));
+      #endif
+      return;
+    }
+    uint8_t *p = message.get();
+    uint32_t contract_id = inputs.get_contract_id();
+    *p++ = mcSetInputs;
+    memcpy(p, &contract_id, 4); p += 4;
+    *p++ = count;
+    for (uint8_t i = 0; i < num_inputs; i++) {
+      if (input_global_id[i] != NO_GLOBAL_ID) continue;
+      *p++ = i;
+      inputs.get_value(i, p, inputs.get_size(i));
+      p += inputs.get_size(i);
+    }
+    if (!add_to_batch(message.get(), length)) send_async(remote_id, remote_bus_id, message.get(), length);
+  }
+
+  // Send the map from global value ids to inputs, if any of the inputs are global values
+  void send_global_map(const uint8_t generation) {
+    uint8_t count = 0, num_inputs = inputs.get_num_variables();
+    if (input_global_id.length() < num_inputs) return;
+    for (uint8_t i = 0; i < num_inputs; i++) if (input_global_id[i] != NO_GLOBAL_ID) count++;
+    if (count == 0 || 7 + 2 * (uint16_t) count > 255) return;
+    BinaryBuffer message;
+    if (!message.allocate(7 + 2*count)) {
+      mvs_out_of_memory = true;
+      #ifdef DEBUG_PRINT
+      DPRINTLN(F("PMI::send_global_map OUT OF MEMORY"));
+      #endif
+      return;
+    }
+    uint8_t *p = message.get();
+    uint32_t contract_id = inputs.get_contract_id();
+    *p++ = mcSetGlobalMap;
+    *p++ = generation;
+    memcpy(p, &contract_id, 4); p += 4;
+    *p++ = count;
+    for (uint8_t i = 0; i < num_inputs; i++) {
+      if (input_global_id[i] == NO_GLOBAL_ID) continue;
+      *p++ = i;
+      *p++ = input_global_id[i];
+    }
+    if (!add_to_batch(message.get(), (uint8_t) (p - message.get())))
+      send_async(remote_id, remote_bus_id, message.get(), (uint8_t) (p - message.get()));
+    global_map_generation = generation;
+    global_map_attempts++;
+    global_map_pending = true;
+    status_bits &= ~GLOBAL_VALUES_ACTIVE; // Until confirmed in the next status from the module
+  }
+  #endif
+
+  // Collect the following messages that can be combined into one packet, if the module supports it
+  void begin_batch() {
+    batching = (status_bits & MULTI_MESSAGE_SUPPORT) && batch.allocate(MI_MULTI_MAX_LENGTH);
+    batch_length = batch_count = 0;
+  }
+
+  // Add a message to the current batch. Returns false if not batching, so that it must be sent separately.
+  // Each message has a 1 byte length, so longer messages are always sent separately.
+  bool add_to_batch(const uint8_t *message, const uint16_t length) {
+    if (!batching || length == 0 || length > 255 || length > MI_MULTI_MAX_LENGTH - 2) return false;
+    if (batch_length + 1 + length > MI_MULTI_MAX_LENGTH) end_batch(true); // Full, send what we have
+    if (batch_length == 0) batch.get()[batch_length++] = mcMulti;
+    batch.get()[batch_length++] = (uint8_t) length;
+    memcpy(&batch.get()[batch_length], message, length);
+    batch_length += length;
+    batch_count++;
+    return true;
+  }
+
+  // Send the collected messages, as an mcMulti packet only if more than one
+  bool end_batch(const bool continue_batching = false) {
+    bool queued = true;
+    if (batch_count == 1) queued = send_async(remote_id, remote_bus_id, &batch.get()[2], batch.get()[1]);
+    else if (batch_count > 1) queued = send_async(remote_id, remote_bus_id, batch.get(), batch_length);
+    batch_length = batch_count = 0;
+    batching = continue_batching;
+    return queued;
   }
 
   // Sending of requests
@@ -257,6 +451,12 @@ public:
   }
   bool send_request(const uint8_t &value, uint32_t &requested_time) {
     bool acked = send_cmd(value);
+    #ifdef MI_METRICS
+    // The reply to each request is the corresponding set-command
+    if (acked && value >= mcSendSettingContract && value <= mcSendOutputContract)
+      metrics.start_request(value - mcSendSettingContract + mcSetSettingContract, mlContractRTT);
+    else if (acked && value == mcSendSettings) metrics.start_request(mcSetSettings, mlSettingsRTT);
+    #endif
     requested_time = millis(); // Update time only if successfully sent
     return acked;
   }
@@ -267,7 +467,18 @@ public:
   bool send_status_request() { return send_request(mcSendStatus, status_requested_time); }
   #endif // IS_MASTER
 
+  // If a message too long for one packet can be sent as fragments. Otherwise it is sent as one packet.
+  bool accepts_fragments() const {
+    #ifdef IS_MASTER
+    return (status_bits & MULTI_MESSAGE_SUPPORT) != 0; // Module reports that it can reassemble fragments
+    #else
+    return true; // A master not supporting fragments could not receive the message as one packet either
+    #endif
+  }
+
   bool send(uint8_t remote_id, const uint8_t *remote_bus, const uint8_t *message, uint16_t length) {
+    if (length > pjon->get_max_payload_length() && accepts_fragments())
+      return send_fragments(remote_id, remote_bus, message, length);
     #if defined(DEBUG_MSG) || defined(DEBUG_PRINT)
     dname(); DPRINT("S "); DPRINT(remote_id); DPRINT(" bus ");
     DPRINT(remote_bus[0]); DPRINT("."); DPRINT(remote_bus[1]); DPRINT(".");
@@ -275,8 +486,19 @@ public:
     DPRINT(" len "); DPRINT(length);
     DPRINT(" cmd "); DPRINT(message[0]); DPRINT(" active "); DPRINTLN(is_active());
     #endif
+    #if defined(IS_MASTER) && defined(MI_METRICS)
+    uint32_t start = micros();
+    #endif
     uint16_t status = pjon->send_packet(remote_id, remote_bus, (const char*)message, length,
       is_active() ? MI_SEND_TIMEOUT : MI_REDUCED_SEND_TIMEOUT);
+    #ifdef MI_PACKET_CAPTURE
+    MIPacketCapture::get().capture(MI_CAPTURE_SIDE | mcfSent | (status == PJON_ACK ? 0 : mcfFailed),
+      remote_id, remote_bus, message, length);
+    #endif
+    #if defined(IS_MASTER) && defined(MI_METRICS)
+    metrics.register_sent(length, status == PJON_ACK);
+    if (status == PJON_ACK) metrics.latency[mlSendAck].add((uint32_t) (micros() - start));
+    #endif
 
     #ifdef DEBUG_PRINT
     if (status != PJON_ACK) { dname(); DPRINTLN(F("----> Failed sending.")); }
@@ -290,9 +512,71 @@ public:
     return status == PJON_ACK;
   }
 
-  bool handle_request_message(const uint8_t *payload, const uint8_t length) {
+  #ifdef IS_MASTER
+  // Queue a packet to be sent by the link update without waiting for the ACK
+  bool send_async(uint8_t remote_id, const uint8_t *remote_bus, const uint8_t *message, uint16_t length) {
+    if (length > pjon->get_max_payload_length() && accepts_fragments())
+      return send(remote_id, remote_bus, message, length); // Fragments are sent in sequence
+    #if defined(DEBUG_MSG) || defined(DEBUG_PRINT)
+    dname(); DPRINT("SA "); DPRINT(remote_id); DPRINT(" len "); DPRINT(length);
+    DPRINT(" cmd "); DPRINTLN(message[0]);
+    #endif
+    #ifdef MI_METRICS
+    async_sent_us = micros();
+    async_sent_length = length;
+    #endif
+    #ifdef MI_PACKET_CAPTURE
+    MIPacketCapture::get().capture(MI_CAPTURE_SIDE | mcfSent | mcfAsync, remote_id, remote_bus, message, length);
+    #endif
+    return pjon->send_packet_async(remote_id, remote_bus, (const char*)message, length,
+      is_active() ? MI_SEND_TIMEOUT : MI_REDUCED_SEND_TIMEOUT, send_completed, this);
+  }
+
+  // Result of a packet sent with send_async
+  static void send_completed(uint16_t status, void *custom_pointer) {
+    PJONModuleInterface *mi = (PJONModuleInterface*) custom_pointer;
+    #ifdef MI_METRICS
+    // Time and length of the last queued packet, approximate if several are queued for the module
+    mi->metrics.register_sent(mi->async_sent_length, status == PJON_ACK);
+    if (status == PJON_ACK) mi->metrics.latency[mlSendAck].add((uint32_t) (micros() - mi->async_sent_us));
+    #endif
+    if (status != PJON_ACK) {
+      #ifdef DEBUG_PRINT
+      mi->dname(); DPRINTLN(F("----> Failed sending async."));
+      #endif
+      if (mi->comm_failures < 255) mi->comm_failures++;
+    }
+  }
+  #endif
+
+  // Send a long message as a sequence of mcFragment packets, each as long as the link allows:
+  // cmd(1), message id(1), fragment ix(1), fragment count(1), <data>
+  bool send_fragments(uint8_t remote_id, const uint8_t *remote_bus, const uint8_t *message, uint16_t length) {
+    uint16_t max_payload = pjon->get_max_payload_length();
+    if (max_payload <= MI_FRAGMENT_HEADER_LENGTH) return false;
+    uint16_t fragment_data_length = max_payload - MI_FRAGMENT_HEADER_LENGTH,
+             count = (length + fragment_data_length - 1) / fragment_data_length;
+    BinaryBuffer fragment;
+    if (count > 255 || !fragment.allocate(max_payload)) {
+      #ifdef DEBUG_PRINT
+      dname(); DPRINT(F("Cannot send message as fragments, length ")); DPRINTLN(length);
+      #endif
+      return false;
+    }
+    sent_message_id++;
+    for (uint16_t ix = 0; ix < count; ix++) {
+      uint16_t pos = ix * fragment_data_length, data_length = (uint16_t) MI_min(length - pos, fragment_data_length);
+      uint8_t *p = fragment.get();
+      p[0] = mcFragment; p[1] = sent_message_id; p[2] = (uint8_t) ix; p[3] = (uint8_t) count;
+      memcpy(&p[MI_FRAGMENT_HEADER_LENGTH], &message[pos], data_length);
+      if (!send(remote_id, remote_bus, p, MI_FRAGMENT_HEADER_LENGTH + data_length)) return false;
+    }
+    return true;
+  }
+
+  bool handle_request_message(const uint8_t *payload, const uint16_t length) {
     BinaryBuffer response;
-    uint8_t response_length = 0;
+    uint16_t response_length = 0;
     if (ModuleInterface::handle_request_message(payload, length, response, response_length)) {
       if (response.is_empty()) {
         #ifdef DEBUG_PRINT
@@ -315,18 +599,52 @@ public:
     if (!((packet_info.header & PJON_PORT_BIT) &&
       (packet_info.port == MI_PJON_MODULE_INTERFACE_PORT))) return false; // Message not meant for ModuleInterface use
 
+    #ifdef MI_PACKET_CAPTURE
+    MIPacketCapture::get().capture(MI_CAPTURE_SIDE, packet_info.tx.id, packet_info.tx.bus_id, payload, length);
+    #endif
+    return handle_packet_message(payload, length, packet_info);
+  }
+
+  // Handle a message received in a packet, or contained in an mcMulti packet or in fragments.
+  // A reassembled message is handled directly from the fragments buffer, so fragments inside it
+  // are dropped (in_fragments) instead of overwriting the buffer while it is being read.
+  bool handle_packet_message(const uint8_t *payload, const uint16_t length, const PJON_Packet_Info &packet_info,
+                             const bool in_fragments = false) {
     #if defined(DEBUG_MSG) || defined(DEBUG_PRINT)
     dname(); DPRINT(F("R len ")); DPRINT(length); DPRINT(F(" cmd ")); DPRINTLN(payload[0]);
     #endif
-    if (handle_input_message(payload, (uint8_t) length)) {
+    if (length > 0 && payload[0] == mcFragment) {
+      if (in_fragments || length <= 4) return false; // Nested or invalid fragment
+      if (!add_fragment(&payload[1], length - 1)) return true; // Not complete yet
+      uint16_t message_length = fragments_length;
+      fragments_count = fragments_length = 0;
+      return handle_packet_message(fragments.get(), message_length, packet_info, true);
+    }
+    if (length > 0 && payload[0] == mcMulti) {
+      // Handle each of the contained messages
+      bool handled = false;
+      uint16_t pos = 1;
+      while (pos < length && pos + 1 + payload[pos] <= length) {
+        if (handle_packet_message(&payload[pos + 1], payload[pos], packet_info, in_fragments)) handled = true;
+        pos += 1 + payload[pos];
+      }
+      return handled;
+    }
+    if (handle_input_message(payload, length)) {
       #ifdef IS_MASTER
       last_alive = millis();
       comm_failures = 0;
       if (length > 0) last_incoming_cmd = (ModuleCommand) payload[0];
+      #ifdef MI_METRICS
+      if (length > 0) metrics.register_reply(payload[0]);
+      if (length > 0 && payload[0] == mcSetOutputs && outputs.has_events() && metrics.output_event_us == 0) {
+        metrics.output_event_us = micros(); if (metrics.output_event_us == 0) metrics.output_event_us = 1;
+      }
+      #endif
       #endif
       return true;
     }
-    if (handle_request_message(payload, (uint8_t) length)) {
+    if (handle_request_message(payload, length)) {
       #ifdef IS_MASTER
       last_alive = millis();
       comm_failures = 0;
@@ -341,20 +659,26 @@ public:
   // If any input is flagged as an event, send it immediately to the module from master
   void send_input_events() {
     BinaryBuffer response;
-    uint8_t response_length;
+    uint16_t response_length;
     inputs.get_values(response, response_length, mcSetInputs, true);
     if (response_length > 0) {
       #ifdef DEBUG_PRINT
       dname(); DPRINT("send_input_events, length "); DPRINT(response_length); DPRINT(", module id ");
       DPRINTLN(remote_id);
       #endif
-      if (send(remote_id, remote_bus_id, response.get(), response_length)) inputs.clear_events();
+      if (send(remote_id, remote_bus_id, response.get(), response_length)) {
+        inputs.clear_events();
+        #ifdef MI_METRICS
+        if (metrics.input_event_us != 0) metrics.latency[mlEvent].add((uint32_t) (micros() - metrics.input_event_us));
+        metrics.input_event_us = 0;
+        #endif
+      }
     }
   }
   // If any setting is flagged as an event, send it immediately to the module from master
   void send_setting_events() {
     BinaryBuffer response;
-    uint8_t response_length;
+    uint16_t response_length;
     settings.get_values(response, response_length, mcSetSettings, true);
     if (response_length > 0) {
       #ifdef DEBUG_PRINT
@@ -377,7 +701,7 @@ public:
   // If any output is flagged as an event, send it immediately to the master (breaking the master-slave pattern)
   void send_output_events() {
     BinaryBuffer response;
-    uint8_t response_length;
+    uint16_t response_length;
     outputs.get_values(response, response_length, mcSetOutputs, true);
     if (response_length > 0 && master_id != PJON_NOT_ASSIGNED && master_id != 0) {
       #ifdef DEBUG_PRINT
@@ -392,7 +716,7 @@ public:
   // If any setting is flagged as an event, send it immediately to the master (breaking the master-slave pattern)
   void send_setting_events() {
     BinaryBuffer response;
-    uint8_t response_length;
+    uint16_t response_length;
     settings.get_values(response, response_length, mcSetSettings, true);
     if (response_length > 0) {
 #ifdef DEBUG_PRINT
@@ -415,7 +739,7 @@ public:
       // Send an (unrequested) status packet
       BinaryBuffer response;
       notify(ntSampleStatus, this);
-      uint8_t response_length = 0;
+      uint16_t response_length = 0;
       get_status(response, response_length, response_length);
       if (master_id != PJON_NOT_ASSIGNED && master_id != 0)
         // We know the address of the master, so send directed. This will potentially
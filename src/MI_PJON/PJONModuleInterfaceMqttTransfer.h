@@ -133,7 +133,7 @@ private:
       got_master_settings = ok ? SETTING_ALL : 0;
       // Check if module list was changed and objects recreated
       bool all_empty = true;
-      for (uint8_t m = 0; m < interfaces.get_module_count(); m++) {
+      for (mi_module_ix_t m = 0; m < interfaces.get_module_count(); m++) {
         if (interfaces[m]->settings.get_num_variables() > 0 || interfaces[m]->outputs.get_num_variables() > 0) {
           all_empty = false; break;
         }
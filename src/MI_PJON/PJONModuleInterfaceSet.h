@@ -29,14 +29,44 @@ protected:
     // These settings specify how often to transfer settings, outputs and inputs
   uint16_t sampling_time = 10000;
   uint32_t last_sampled = 0;
+
+  // Open addressing hash table from device address (bus id and device id) to interface ix,
+  // for locating the sending module of each incoming packet without scanning all interfaces.
+  mi_module_ix_t *address_table = NULL;
+  uint32_t address_table_size = 0; // A power of two, at least twice the number of interfaces
+  mutable bool address_table_outdated = false; // Set when a module was only found by scanning, rebuilt in update
+
+  static uint32_t get_address_hash(const uint8_t device_id, const uint8_t *bus_id) {
+    uint32_t h = 2166136261ul; // FNV-1a
+    for (uint8_t i = 0; i < 4; i++) { h ^= bus_id[i]; h *= 16777619ul; }
+    h ^= device_id; h *= 16777619ul;
+    return h ^ (h >> 16);
+  }
+
+  bool has_address(const mi_module_ix_t ix, const uint8_t device_id, const uint8_t *bus_id) const {
+    return ((PJONModuleInterface*) interfaces[ix])->remote_id == device_id &&
+           memcmp(((PJONModuleInterface*) interfaces[ix])->remote_bus_id, bus_id, 4) == 0;
+  }
+
+  // Scan all interfaces, used if the address table is missing or does not have the address
+  mi_module_ix_t scan_for_module(const uint8_t device_id, const uint8_t *bus_id) const {
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) if (has_address(i, device_id, bus_id)) return i;
+    return NO_MODULE;
+  }
+
+  void deallocate_address_table() {
+    if (address_table) { delete[] address_table; address_table = NULL; }
+    address_table_size = 0;
+  }
 public:
   PJONModuleInterfaceSet(const char *prefix = NULL) : ModuleInterfaceSet(prefix) { init(); }
-  PJONModuleInterfaceSet(MILink &bus, const uint8_t num_interfaces, const char *prefix = NULL) : ModuleInterfaceSet(prefix) {
+  PJONModuleInterfaceSet(MILink &bus, const mi_module_ix_t num_interfaces, const char *prefix = NULL) : ModuleInterfaceSet(prefix) {
     init(); 
     this->num_interfaces = num_interfaces; 
     if (num_interfaces > 0) {
       interfaces = new ModuleInterface*[num_interfaces];
-      for (uint8_t i = 0; i < num_interfaces; i++) interfaces[i] = new PJONModuleInterface();
+      for (mi_module_ix_t i = 0; i < num_interfaces; i++) interfaces[i] = new PJONModuleInterface();
+      assign_name_pool();
     }
     pjon = &bus;
     pjon->set_receiver(mis_global_receive_function, this);
@@ -49,6 +79,8 @@ public:
     if (interface_list) set_interface_list(interface_list);
   }
   ~PJONModuleInterfaceSet() {
+    deallocate_address_table();
+    if (pjon) for (mi_module_ix_t i = 0; i < num_interfaces; i++) pjon->forget_async_sends(interfaces[i]);
     #ifdef MI_ALLOW_MODULELIST_CHANGES
     if (module_list != NULL) delete module_list;
     #endif
@@ -62,13 +94,18 @@ public:
       if (module_list != NULL && strcmp(module_list, interface_list)==0) return false; 
 
       // Clear all existing setup
-      for (uint8_t i = 0; i < num_interfaces; i++) {
-        if (interfaces[i] != NULL) delete interfaces[i];
+      for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
+        if (interfaces[i] != NULL) {
+          pjon->forget_async_sends(interfaces[i]);
+          delete interfaces[i];
+        }
       }
       delete[] interfaces;
       num_interfaces = 0;
       last_time_sync = 0;
       updated_intermodule_dependencies = false;
+      name_pool.clear(); // No variable sets are using the names anymore
+      deallocate_address_table();
     }
 
     // Remember module list
@@ -84,17 +121,18 @@ public:
     const char *p = interface_list;
     while (*p != 0) {
       p++; 
-      if (*p == 0 || *p == ' ') num_interfaces++;
+      if ((*p == 0 || *p == ' ') && num_interfaces < NO_MODULE) num_interfaces++;
       while (*p == ' ') p++; // Allow multiple spaces in sequence
     }
 
     // Allocate
     interfaces = new ModuleInterface*[num_interfaces];
-    for (uint8_t i = 0; i < num_interfaces; i++) interfaces[i] = new PJONModuleInterface();
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) interfaces[i] = new PJONModuleInterface();
+    assign_name_pool();
 
     // Set names and ids
     p = interface_list;
-    uint8_t cnt = 0;
+    mi_module_ix_t cnt = 0;
     #ifdef DEBUG_PRINT
     DPRINT("Interface count="); DPRINT(num_interfaces); DPRINT(": ");
     #endif
@@ -111,6 +149,7 @@ public:
     #ifdef DEBUG_PRINT
     DPRINTLN("");
     #endif
+    update_address_table();
     return true;
   }
   MILink *get_link() { return pjon; }
@@ -132,7 +171,8 @@ public:
   uint32_t get_transfer_interval() { return sampling_time; }
 
   void update_contracts() { 
-    for (uint8_t i = 0; i < num_interfaces; i++) {
+    if (name_pool.is_full()) compact_name_pool(); // Make room for contracts that did not fit
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
       ((PJONModuleInterface*) (interfaces[i]))->update_contract(interfaces[i]->is_active() ? 1000 : 20000);
       check_incoming();
     }
@@ -141,14 +181,14 @@ public:
   // This sends settings (can be empty) to each module, and receives a reponse containing 
   // outputs (can be empty) and status.
   void update_settings() { 
-    for (uint8_t i = 0; i < num_interfaces; i++) {
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
       ((PJONModuleInterface*) (interfaces[i]))->update_settings(1); 
       check_incoming();
     }
   }
 
   void send_settings() { 
-    for (uint8_t i = 0; i < num_interfaces; i++) {
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
       // Send settings, then wait for outputs
       if (((PJONModuleInterface*) interfaces[i])->send_settings())
         ((PJONModuleInterface*) interfaces[i])->receive_packet(((PJONModuleInterface*) interfaces[i])->get_request_timeout(), mcSetOutputs);
@@ -156,13 +196,15 @@ public:
     }
   }
   void send_inputs() { 
-    for (uint8_t i = 0; i < num_interfaces; i++) {
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
       ((PJONModuleInterface*) (interfaces[i]))->send_inputs(); 
       check_incoming();
     }
   }
-  void send_input_events() { for (uint8_t i = 0; i < num_interfaces; i++) ((PJONModuleInterface*) (interfaces[i]))->send_input_events(); }
-  void send_setting_events() { for (uint8_t i = 0; i < num_interfaces; i++) ((PJONModuleInterface*) (interfaces[i]))->send_setting_events(); }
+  void begin_batch() { for (mi_module_ix_t i = 0; i < num_interfaces; i++) ((PJONModuleInterface*) (interfaces[i]))->begin_batch(); }
+  void end_batch() { for (mi_module_ix_t i = 0; i < num_interfaces; i++) ((PJONModuleInterface*) (interfaces[i]))->end_batch(); }
+  void send_input_events() { for (mi_module_ix_t i = 0; i < num_interfaces; i++) ((PJONModuleInterface*) (interfaces[i]))->send_input_events(); }
+  void send_setting_events() { for (mi_module_ix_t i = 0; i < num_interfaces; i++) ((PJONModuleInterface*) (interfaces[i]))->send_setting_events(); }
 
   // Check for incoming packets, send events immediately if present
   void check_incoming() {
@@ -173,6 +215,7 @@ public:
 
   void handle_events() {
     if (!got_all_contracts()) return;
+    MI_PROFILE_BEGIN(mpHandleEvents);
 
     if (updated_intermodule_dependencies) {
       // Get inputs and send them to modules
@@ -185,6 +228,9 @@ public:
 
     // Send output and setting events to MITransferBases
     put_events_to_external();   // Send to external
+    #ifdef MI_SHARED_MEMORY
+    publish_shared_memory(true); // Make events available to other processes at once
+    #endif
     clear_output_events();      // Clear after sending
 
    // TODO: Check setting events, must be an event flag for each direction?
@@ -193,6 +239,7 @@ public:
     // Send settings events to modules
     send_setting_events();
     clear_setting_events(); // Clear setting events to modules
+    MI_PROFILE_END();
   }
 
   // Time will be broadcast to all modules unless NO_TIME_SYNC is defined or master itself is not timesynced
@@ -207,7 +254,7 @@ public:
       // Check if any local bus module has reported that is it missing time
       bool broadcast = scheduled_sync;
       if (!scheduled_sync) {
-        for (uint8_t i = 0; i < num_interfaces; i++) { 
+        for (mi_module_ix_t i = 0; i < num_interfaces; i++) { 
           if ((interfaces[i]->status_bits & MISSING_TIME) && has_local_bus(i)) {
             // Same bus, can do broadcast
             broadcast = true;
@@ -227,14 +274,17 @@ public:
 
         // Clear time-missing bit to avoid this triggering continuous broadcasts.
         // If a module did not pick up the broadcast, we will get this information in the next status reply.
-        for (uint8_t i = 0; i < num_interfaces; i++) 
+        for (mi_module_ix_t i = 0; i < num_interfaces; i++) 
           if (has_local_bus(i)) interfaces[i]->status_bits &= ~MISSING_TIME;
       }
       
       // Broadcast will not reach devices on other buses, so send directed time sync to each
-      for (uint8_t i = 0; i < num_interfaces; i++) { 
+      for (mi_module_ix_t i = 0; i < num_interfaces; i++) { 
         if ((scheduled_sync || interfaces[i]->status_bits & MISSING_TIME) && !has_local_bus(i)) {
-          send_timesync(((PJONModuleInterface*)interfaces[i])->remote_id, ((PJONModuleInterface*)interfaces[i])->remote_bus_id);
+          PJONModuleInterface *mi = (PJONModuleInterface*)interfaces[i];
+          uint8_t buf[7];
+          get_timesync(buf);
+          if (!mi->add_to_batch(buf, sizeof buf)) send_timesync(mi->remote_id, mi->remote_bus_id);
           #ifdef DEBUG_PRINT
           if (interfaces[i]->status_bits & MISSING_TIME) DPRINT(F("Module missing time. ")); 
           DPRINT(F("Sending directed sync to "));DPRINT(interfaces[i]->module_name);
@@ -250,19 +300,79 @@ public:
     }
   }
   
-  bool has_local_bus(uint8_t interface_ix) {
+  #ifndef NO_GLOBAL_VALUES
+  // Broadcast values used as inputs by several modules, and make sure the modules know which inputs to use them for.
+  // Only modules on the local bus that support mcMulti are offered a global value map. A map is sent again only
+  // after a status without confirmation, and at most MI_GLOBAL_MAP_MAX_ATTEMPTS times for the same generation,
+  // as a module may be built without global values support. Such a module keeps getting all of its inputs.
+  void send_global_values() {
+    if (global_count == 0 || !updated_intermodule_dependencies) return;
+    broadcast_global_values();
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
+      PJONModuleInterface *mi = (PJONModuleInterface*) interfaces[i];
+      if (!has_local_bus(i) || !(mi->status_bits & MULTI_MESSAGE_SUPPORT)) continue;
+      if (mi->global_map_generation != global_generation) mi->global_map_attempts = 0; // A new map
+      else if (mi->status_bits & GLOBAL_VALUES_ACTIVE) { mi->global_map_attempts = 0; continue; } // Confirmed
+      else if (mi->global_map_pending || mi->global_map_attempts >= MI_GLOBAL_MAP_MAX_ATTEMPTS) continue;
+      mi->send_global_map(global_generation);
+    }
+  }
+
+  // Broadcast the global values on the local bus: generation(1), count(1), <global id, size, value>
+  void broadcast_global_values() {
+    uint8_t buf[MI_MULTI_MAX_LENGTH];
+    uint16_t pos = 3;
+    uint8_t count = 0;
+    for (uint8_t id = 0; id < global_count; id++) {
+      const ModuleVariableSet &outputs = interfaces[global_source_module_ix[id]]->outputs;
+      uint8_t var_ix = global_source_output_ix[id];
+      if (!outputs.is_updated() || var_ix >= outputs.get_num_variables()) continue;
+      uint8_t size = outputs.get_size(var_ix);
+      if ((size_t) (pos + 2 + size) > sizeof buf) { // Full, send and start on a new packet
+        send_global_value_packet(buf, pos, count);
+        pos = 3; count = 0;
+      }
+      buf[pos++] = id;
+      buf[pos++] = size;
+      outputs.get_value(var_ix, &buf[pos], size);
+      pos += size;
+      count++;
+    }
+    if (count) send_global_value_packet(buf, pos, count);
+  }
+
+  void send_global_value_packet(uint8_t *buf, const uint16_t length, const uint8_t count) {
+    buf[0] = mcSetGlobalValues;
+    buf[1] = global_generation;
+    buf[2] = count;
+    pjon->send_packet(PJON_BROADCAST, pjon->get_bus_id(), (const char*)buf, length, MI_REDUCED_SEND_TIMEOUT);
+    #ifdef MI_PACKET_CAPTURE
+    MIPacketCapture::get().capture(mcfMaster | mcfSent, PJON_BROADCAST, pjon->get_bus_id(), buf, length);
+    #endif
+    pjon->receive(); // Just called regularly to be responsive to events
+  }
+  #endif
+
+  bool has_local_bus(mi_module_ix_t interface_ix) {
     // Returns true if device is on the same bus as me (the master). Always returns true in local mode.
     return (memcmp(((PJONModuleInterface*)interfaces[interface_ix])->remote_bus_id, pjon->get_bus_id(), 4)==0);
   }
   
-  void send_timesync(const uint8_t id, const uint8_t bus_id[]) {
-    char buf[5];
-    buf[0] = (char) mcSetTime;
+  static void get_timesync(uint8_t buf[7]) {
+    buf[0] = (uint8_t) mcSetTime;
     uint32_t t = miTime::Get();
     int16_t offset = miTime::GetTimeZoneOffsetMinutes();
     memcpy(&buf[1], &t, 4);
     memcpy(&buf[5], &offset, 2);
-    pjon->send_packet(id, bus_id, buf, 7, MI_REDUCED_SEND_TIMEOUT);
+  }
+
+  void send_timesync(const uint8_t id, const uint8_t bus_id[]) {
+    uint8_t buf[7];
+    get_timesync(buf);
+    pjon->send_packet(id, bus_id, (const char*)buf, sizeof buf, MI_REDUCED_SEND_TIMEOUT);
+    #ifdef MI_PACKET_CAPTURE
+    MIPacketCapture::get().capture(mcfMaster | mcfSent, id, bus_id, buf, sizeof buf);
+    #endif
     pjon->receive(); // Just called regularly to be responsive to events
   }
   #endif
@@ -283,6 +393,7 @@ public:
 
   void update() {
     uint32_t start = millis();
+    if (address_table_outdated) update_address_table();
     update_frequent();
     bool initiated = got_all_contracts();
     if (initiated && external_count && external_transfer) {
@@ -309,7 +420,13 @@ public:
       start = millis();
       // Transfer settings to and from the modules, get outputs and status from the modules,
       // send to subscribing modules
+      #ifdef MI_PROFILE
+      profiler.begin_cycle();
+      #endif
       transfer_all();  // Get outputs and send to subscribing modules
+      #ifdef MI_PROFILE
+      profiler.end_cycle();
+      #endif
       last_total_usage_ms = (uint32_t)(millis()-start);
       #ifdef DEBUG_PRINT_TIMES
       printf("Spent %dms in interval_transfer, %dms since last.\n", last_total_usage_ms, printdiff);
@@ -319,6 +436,7 @@ public:
 
   // This should be called as often as possible, to handle events and other prioritized tasks
   void update_frequent() {
+    MI_PROFILE_BEGIN(mpUpdateFrequent);
     // Do PJON send and receive
     pjon->update();
     pjon->receive();
@@ -331,39 +449,82 @@ public:
 
     // Handle incoming+outgoing events
     handle_events();
+    MI_PROFILE_END();
   }
 
   void transfer_all() {
     // Send settings and get outputs and status from modules
+    MI_PROFILE_BEGIN(mpTransferSettings);
     transfer_settings();
+    MI_PROFILE_END();
     update_frequent();
 
     // Transfer outputs from modules to inputs of other modules
+    MI_PROFILE_BEGIN(mpTransferOutputsToInputs);
     transfer_outputs_to_inputs();
+    MI_PROFILE_END();
     update_frequent();
 
     // Data exchange to web server or other system
+    MI_PROFILE_BEGIN(mpSendToExternal);
     send_to_external();
-
-    // Send updated inputs to all modules
+    MI_PROFILE_END();
+
+    // Send updated inputs to all modules, and broadcast time to all modules with a few minutes interval.
+    // Messages to the same module are combined into one packet if the module supports it.
+    begin_batch();
+    #ifndef NO_GLOBAL_VALUES
+    MI_PROFILE_BEGIN(mpSendGlobalValues);
+    send_global_values();
+    MI_PROFILE_END();
+    #endif
+    MI_PROFILE_BEGIN(mpSendInputs);
     send_inputs();
-    update_frequent();
-
-    // Broadcast time to all modules with a few minutes interval
+    MI_PROFILE_END();
     #ifndef NO_TIME_SYNC
+    MI_PROFILE_BEGIN(mpBroadcastTime);
     broadcast_time();
+    MI_PROFILE_END();
+    #endif
+    MI_PROFILE_BEGIN(mpEndBatch);
+    end_batch();
+    MI_PROFILE_END();
     update_frequent();
+
+    // Make the values available to other threads
+    #ifdef MI_SNAPSHOT
+    MI_PROFILE_BEGIN(mpPublishSnapshot);
+    publish_snapshot();
+    MI_PROFILE_END();
+    #endif
+    #ifdef MI_SHARED_MEMORY
+    MI_PROFILE_BEGIN(mpPublishSharedMemory);
+    publish_shared_memory();
+    MI_PROFILE_END();
+    #endif
+    #ifdef MI_WARM_RESTART
+    MI_PROFILE_BEGIN(mpSaveWarmRestart);
+    update_warm_restart();
+    MI_PROFILE_END();
     #endif
   }
 
   void send_to_external() {
     if (external_count && external_transfer) 
-      for (uint8_t t = 0; t < external_count; t++) external_transfer[t]->put_values();
+      for (uint8_t t = 0; t < external_count; t++) {
+        MI_PROFILE_BEGIN_TRANSFER(mpPutValues, t);
+        external_transfer[t]->put_values();
+        MI_PROFILE_END();
+      }
   }
 
   void update_external() {
     if (external_count && external_transfer) 
-      for (uint8_t t = 0; t < external_count; t++) external_transfer[t]->update();
+      for (uint8_t t = 0; t < external_count; t++) {
+        MI_PROFILE_BEGIN_TRANSFER(mpUpdateExternal, t);
+        external_transfer[t]->update();
+        MI_PROFILE_END();
+      }
   }
 
 //TODO:
@@ -376,9 +537,13 @@ public:
 
   void put_events_to_external() {
     if (external_count && external_transfer) {
-      for (uint8_t t = 0; t < external_count; t++) external_transfer[t]->put_events();
+      for (uint8_t t = 0; t < external_count; t++) {
+        MI_PROFILE_BEGIN_TRANSFER(mpPutEvents, t);
+        external_transfer[t]->put_events();
+        MI_PROFILE_END();
+      }
 /*      
-      for (uint8_t i = 0; i < num_interfaces; i++) {
+      for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
           interfaces[i]->outputs.clear_events();
           interfaces[i]->settings.clear_events();
       }
@@ -388,23 +553,35 @@ public:
 
   void transfer_settings() {
     // Get potentially modified settings from each module
+    MI_PROFILE_BEGIN(mpUpdateSettings);
     update_settings();
+    MI_PROFILE_END();
 
     // Data exchange from and to web server or other system
     if (external_count && external_transfer) {
-      for (uint8_t t = 0; t < external_count; t++) external_transfer[t]->put_settings();
-      for (uint8_t t = 0; t < external_count; t++) external_transfer[t]->get_settings();
+      for (uint8_t t = 0; t < external_count; t++) {
+        MI_PROFILE_BEGIN_TRANSFER(mpPutSettings, t);
+        external_transfer[t]->put_settings();
+        MI_PROFILE_END();
+      }
+      for (uint8_t t = 0; t < external_count; t++) {
+        MI_PROFILE_BEGIN_TRANSFER(mpGetSettings, t);
+        external_transfer[t]->get_settings();
+        MI_PROFILE_END();
+      }
       #ifdef MASTER_MULTI_TRANSFER
       // Clear changed-flag if all transfer targets have received the upward change back down
-      for (uint8_t i = 0; i < num_interfaces; i++) {
-        for (uint8_t v = 0; v < interfaces[i]->settings.get_num_variables(); v++) {
-          ModuleVariable &mv = interfaces[i]->settings.get_module_variable(v);
+      for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
+        ModuleVariableSet &settings = interfaces[i]->settings;
+        const ModuleVariableSet &const_settings = settings; // Read-only access keeps the flag counts valid
+        for (uint8_t v = 0; v < settings.get_num_variables(); v++) {
+          const ModuleVariable &mv = const_settings.get_module_variable(v);
           if (!mv.any_change_bit(external_count)) {
             #ifdef DEBUG_PRINT_SETTINGSYNC
             if (mv.is_changed())
               printf("CLEAR CHANGED VALUE %ld cbits: %d\n", mv.get_uint32(), mv.change_bits);
             #endif
-            mv.set_changed(false);
+            settings.set_changed(v, false);
           }
         }
       }
@@ -412,24 +589,62 @@ public:
     }
 
     // Send settings to each module
+    MI_PROFILE_BEGIN(mpSendSettings);
     send_settings();
+    MI_PROFILE_END();
   }
 
-  uint8_t locate_module(const uint8_t device_id, const uint8_t *bus_id) const {
-    uint8_t ix = NO_MODULE;
-    for (uint8_t i=0; i<num_interfaces; i++) {
-      if (((PJONModuleInterface*) interfaces[i])->remote_id == device_id &&
-          (memcmp(((PJONModuleInterface*) interfaces[i])->remote_bus_id, bus_id, 4) == 0)) {
-        ix = i; break;
+  // Build the table for looking up modules from addresses. This is done by set_interface_list, and
+  // it is done again by update if a module has been found with another address than in the table,
+  // like after set_remote_device. It can also be called directly after changing addresses.
+  bool update_address_table() {
+    deallocate_address_table();
+    address_table_outdated = false;
+    if (num_interfaces == 0) return true;
+    uint32_t size = 4;
+    while (size < 2 * (uint32_t) num_interfaces) size *= 2;
+    address_table = new mi_module_ix_t[size];
+    if (address_table == NULL) {
+      mvs_out_of_memory = true;
+      #ifdef DEBUG_PRINT
+      DPRINTLN(F("MIS::update_address_table OUT OF MEMORY"));
+      #endif
+      return false;
+    }
+    address_table_size = size;
+    for (uint32_t pos = 0; pos < size; pos++) address_table[pos] = NO_MODULE;
+    for (mi_module_ix_t i = 0; i < num_interfaces; i++) {
+      const PJONModuleInterface *mi = (PJONModuleInterface*) interfaces[i];
+      uint32_t pos = get_address_hash(mi->remote_id, mi->remote_bus_id) & (size - 1);
+      while (address_table[pos] != NO_MODULE) {
+        if (has_address(address_table[pos], mi->remote_id, mi->remote_bus_id)) break; // Keep the first
+        pos = (pos + 1) & (size - 1);
       }
+      if (address_table[pos] == NO_MODULE) address_table[pos] = i;
     }
+    return true;
+  }
+
+  mi_module_ix_t locate_module(const uint8_t device_id, const uint8_t *bus_id) const {
+    if (address_table == NULL) return scan_for_module(device_id, bus_id);
+    uint32_t pos = get_address_hash(device_id, bus_id) & (address_table_size - 1);
+    while (address_table[pos] != NO_MODULE) {
+      if (address_table[pos] < num_interfaces && has_address(address_table[pos], device_id, bus_id)) return address_table[pos];
+      pos = (pos + 1) & (address_table_size - 1);
+    }
+    // Not in the table, but the address of a module may have been changed after the table was built
+    mi_module_ix_t ix = scan_for_module(device_id, bus_id);
+    if (ix != NO_MODULE) address_table_outdated = true;
     return ix;
   }
 
   bool handle_message(const uint8_t *payload, const uint16_t length, const PJON_Packet_Info &packet_info) {
     // Locate the relevant module based on packet info (device id and bus id)
-    uint8_t ix = locate_module(packet_info.tx.id, packet_info.tx.bus_id);
+    mi_module_ix_t ix = locate_module(packet_info.tx.id, packet_info.tx.bus_id);
     if (ix == NO_MODULE) return false;
+    #ifdef MI_METRICS
+    interfaces[ix]->metrics.register_received(length);
+    #endif
 
     // Let the interface handle the message
     return ((PJONModuleInterface*) interfaces[ix])->handle_message(payload, length, packet_info);
@@ -442,10 +657,13 @@ void mis_global_receive_function(uint8_t *payload, uint16_t length, const PJON_P
     PJONModuleInterfaceSet *mis = (PJONModuleInterfaceSet*) packet_info.custom_pointer;
 
     // Find out which module is sending
-    uint8_t ix = mis->locate_module(packet_info.tx.id, packet_info.tx.bus_id);
+    mi_module_ix_t ix = mis->locate_module(packet_info.tx.id, packet_info.tx.bus_id);
     PJONModuleInterface *interface = NULL;
     if (ix != NO_MODULE) {
       interface = (PJONModuleInterface*) mis->interfaces[ix];
+      #ifdef MI_METRICS
+      interface->metrics.register_received(length);
+      #endif
 
       // Let interface handle ModuleInterface related message
       if (interface->handle_message(payload, length, packet_info)) return;
@@ -6,6 +6,7 @@
 template<typename Strategy>
 struct PJONPointerLink : public MILink {
   PJON<Strategy> *bus_ptr = NULL;
+  MIAsyncSends async_sends;
 
   PJONPointerLink<Strategy>() { }
   PJONPointerLink<Strategy>(PJON<Strategy> &bus, uint8_t device_id) { this->bus_ptr = &bus; bus_ptr->set_id(device_id); }
@@ -25,12 +26,29 @@ struct PJONPointerLink : public MILink {
   uint16_t receive() { return bus_ptr->receive(); }
   uint16_t receive(uint32_t duration) { return bus_ptr->receive(duration); }
 
-  uint8_t update() { return 0; /*bus.update();*/ }
+  // Packets queued by send_packet_async are sent here
+  uint8_t update() { return async_sends.update(*bus_ptr); }
   uint16_t send_packet(uint8_t id, const uint8_t *b_id, const char *string, uint16_t length, uint32_t timeout) {
     PJON_Packet_Info pi = bus_ptr->fill_info(id, bus_ptr->config | PJON_PORT_BIT, 0, MI_PJON_MODULE_INTERFACE_PORT);
     memcpy(&pi.rx.bus_id, b_id, 4);
     return bus_ptr->send_packet_blocking(pi, (char *)string, length, timeout);
   }
+  uint16_t get_max_payload_length() const {
+    return bus_ptr ? mi_pjon_max_payload_length(bus_ptr->config) : MILink::get_max_payload_length();
+  }
+
+  bool send_packet_async(uint8_t id, const uint8_t *b_id, const char *string, uint16_t length, uint32_t timeout,
+                         MISendCallback callback, void *custom_pointer) {
+    PJON_Packet_Info pi = bus_ptr->fill_info(id, bus_ptr->config | PJON_PORT_BIT, 0, MI_PJON_MODULE_INTERFACE_PORT);
+    memcpy(&pi.rx.bus_id, b_id, 4);
+    if (async_sends.send(*bus_ptr, pi, string, length, callback, custom_pointer)) return true;
+    // Send immediately if the packet buffer is full
+    return MILink::send_packet_async(id, b_id, string, length, timeout, callback, custom_pointer);
+  }
+  void forget_async_sends(void *custom_pointer) { async_sends.forget(custom_pointer); }
+
+  // Set the PJON error callback. It is kept when send_packet_async is used, unlike one set on the bus.
+  void set_error(PJON_Error e) { async_sends.set_error(*bus_ptr, e); }
 
   const PJON_Packet_Info &get_last_packet_info() const { return bus_ptr->last_packet_info; }
   
@@ -0,0 +1,332 @@
+#pragma once
+
+// An in-process bus connecting a master and modules through SimulatedLink objects instead of PJON,
+// for running and benchmarking a system on one computer without hardware.
+//
+// Each device (master or module) has its own SimulatedLink attached to a shared SimulatedBus.
+// A packet travels over the link of the sender and the link of the receiver, like in a star network,
+// so each link can be given its own latency, jitter, loss rate and bandwidth:
+//  - The latency and jitter of both links are added to the delivery time.
+//  - A packet is lost if it is lost on either link. Loss is seen as a failed send after any retries.
+//  - The packet occupies the sending link for the time needed to transfer it at the lowest
+//    bandwidth of the two links, so packets sent in sequence are queued behind each other.
+//
+// Time is virtual. MI_SIMULATED_TIME must be defined before including anything, so that micros()
+// and millis() in the library return the virtual time of the bus (see MIPlatforms.h), and random
+// jitter and loss come from a seeded generator, so that each run with the same seed is identical.
+// Time advances when a blocking send waits for its ACK, and when a receive call finds nothing to
+// receive. It then jumps to the next packet delivery, or at most the idle step, which represents
+// the time used by each poll of the bus.
+//
+// Every due packet is delivered to the receiver of its destination on any call to receive(), as if
+// all devices were running in parallel. This lets the modules reply while the master is waiting.
+//
+// This file does not depend on IS_MASTER, so a bus can be shared between master and module code
+// compiled in separate translation units.
+
+#include <platforms/MIPlatforms.h>
+#include <MI_PJON/MILink.h>
+
+#ifndef MI_SIMULATED_TIME
+  #error "MI_SIMULATED_TIME must be defined before including any ModuleInterface file to use SimulatedLink"
+#endif
+
+// Approximate number of bytes added to each packet by PJON (header, addresses, port, CRC)
+#ifndef MI_SIMULATED_PACKET_OVERHEAD
+  #define MI_SIMULATED_PACKET_OVERHEAD 20
+#endif
+
+// Properties of the connection between one device and the bus
+struct SimulatedLinkConfig {
+  uint32_t latency_us = 0;        // Fixed delay in each direction
+  uint32_t jitter_us = 0;         // Max random extra delay in each direction
+  float loss = 0;                 // Share of packets lost, 0-1
+  uint32_t bytes_per_second = 0;  // Bandwidth, 0 for unlimited
+};
+
+class SimulatedLink;
+
+class SimulatedBus {
+friend class SimulatedLink;
+  struct Packet {
+    Packet *next = NULL;
+    uint64_t time_us = 0;         // When to deliver, or to report the result of an async send
+    SimulatedLink *from = NULL,
+                  *to = NULL;     // NULL for a broadcast to all other links on the bus id
+    uint8_t bus_id[4];            // Bus id of a broadcast
+    uint8_t *payload = NULL;
+    uint16_t length = 0;
+    uint16_t status = PJON_ACK;   // Result of an async send
+    MISendCallback callback = NULL;
+    void *custom_pointer = NULL;
+  };
+  Packet *deliveries = NULL,      // Packets in transit, sorted by delivery time
+         *completions = NULL;     // Results of async sends not reported yet, sorted by time
+  SimulatedLink *links = NULL;
+  uint32_t random_state = 1;
+
+  // Insert sorted by time, after those with the same time to keep the order sent
+  void insert(Packet *&list, Packet *p) {
+    Packet **pp = &list;
+    while (*pp && (*pp)->time_us <= p->time_us) pp = &(*pp)->next;
+    p->next = *pp;
+    *pp = p;
+  }
+
+  static void free_list(Packet *&list) {
+    while (list) { Packet *p = list; list = p->next; delete[] p->payload; delete p; }
+  }
+
+  // Remove the packets from or to a link that is being deleted
+  static void remove_link(Packet *&list, const SimulatedLink *link) {
+    for (Packet **pp = &list; *pp; ) {
+      Packet *p = *pp;
+      if (p->from != link && p->to != link) { pp = &p->next; continue; }
+      *pp = p->next;
+      delete[] p->payload;
+      delete p;
+    }
+  }
+
+  // Pseudo random number in [0, 1), xorshift32
+  float random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return (float) (random_state >> 8) / (float) (1ul << 24);
+  }
+
+  inline SimulatedLink *find(const uint8_t id, const uint8_t *bus_id);
+  inline uint64_t transfer(SimulatedLink &from, SimulatedLink &to, const uint16_t length);
+  inline uint16_t send(SimulatedLink &from, uint8_t id, const uint8_t *bus_id, const char *string, uint16_t length,
+                       uint32_t timeout, const bool async, MISendCallback callback, void *custom_pointer);
+  inline void deliver(const Packet &p, SimulatedLink &l);
+  inline bool deliver(SimulatedLink &receiver);
+  inline uint8_t complete(SimulatedLink &link);
+  inline void idle(const uint64_t limit_us);
+
+public:
+  uint32_t idle_step_us = 10;     // Time used by a receive call finding nothing to receive
+
+  // Totals for all links
+  uint32_t packets_sent = 0, bytes_sent = 0, packets_lost = 0;
+
+  SimulatedBus(const uint32_t seed = 1) { set_seed(seed); }
+  ~SimulatedBus() { free_list(deliveries); free_list(completions); }
+
+  void set_seed(const uint32_t seed) { random_state = seed ? seed : 1; }
+
+  static uint64_t get_time_us() { return mi_simulated_time_us(); }
+  static void advance_time(const uint32_t us) { mi_simulated_time_us() += us; }
+
+  // Let time pass until the given time, delivering packets on the way
+  inline void run_until(const uint64_t time_us);
+
+  // The number of packets in transit
+  uint32_t get_packets_in_transit() const {
+    uint32_t count = 0;
+    for (Packet *p = deliveries; p; p = p->next) count++;
+    return count;
+  }
+};
+
+class SimulatedLink : public MILink {
+friend class SimulatedBus;
+  SimulatedBus *bus = NULL;
+  SimulatedLink *next_link = NULL;
+  uint8_t id = 0, bus_id[4] = {0, 0, 0, 0};
+  PJON_Receiver receiver = NULL;
+  void *custom_pointer = NULL;
+  PJON_Packet_Info last_packet_info;
+  uint64_t busy_until_us = 0;     // When the link has finished transferring the packets sent
+
+public:
+  SimulatedLinkConfig config;
+
+  // Counters for this link
+  uint32_t packets_sent = 0, bytes_sent = 0, packets_received = 0, bytes_received = 0, packets_lost = 0;
+
+  SimulatedLink(SimulatedBus &bus, uint8_t device_id, const uint8_t *bus_id = NULL) {
+    this->bus = &bus;
+    id = device_id;
+    if (bus_id) memcpy(this->bus_id, bus_id, 4);
+    next_link = bus.links;
+    bus.links = this;
+  }
+  ~SimulatedLink() {
+    for (SimulatedLink **pp = &bus->links; *pp; pp = &(*pp)->next_link)
+      if (*pp == this) { *pp = next_link; break; }
+    SimulatedBus::remove_link(bus->deliveries, this);
+    SimulatedBus::remove_link(bus->completions, this);
+  }
+
+  void set_config(const SimulatedLinkConfig &config) { this->config = config; }
+
+  // These functions are required by the base class:
+
+  uint16_t receive() {
+    if (bus->deliver(*this)) return PJON_ACK;
+    bus->idle(bus->get_time_us() + bus->idle_step_us);
+    return PJON_FAIL;
+  }
+  uint16_t receive(uint32_t duration) {
+    uint64_t end = bus->get_time_us() + duration;
+    uint16_t status = PJON_FAIL;
+    do {
+      if (bus->deliver(*this)) status = PJON_ACK;
+      bus->idle(end);
+    } while (bus->get_time_us() < end);
+    if (bus->deliver(*this)) status = PJON_ACK;
+    return status;
+  }
+
+  // Report the results of async sends that are finished
+  uint8_t update() { return bus->complete(*this); }
+
+  uint16_t send_packet(uint8_t id, const uint8_t *b_id, const char *string, uint16_t length, uint32_t timeout) {
+    return bus->send(*this, id, b_id, string, length, timeout, false, NULL, NULL);
+  }
+  bool send_packet_async(uint8_t id, const uint8_t *b_id, const char *string, uint16_t length, uint32_t timeout,
+                         MISendCallback callback, void *custom_pointer) {
+    bus->send(*this, id, b_id, string, length, timeout, true, callback, custom_pointer);
+    return true;
+  }
+  void forget_async_sends(void *custom_pointer) {
+    for (SimulatedBus::Packet *p = bus->completions; p; p = p->next)
+      if (p->from == this && p->custom_pointer == custom_pointer) p->callback = NULL;
+  }
+
+  const PJON_Packet_Info &get_last_packet_info() const { return last_packet_info; }
+
+  uint8_t get_id() const { return id; }
+  const uint8_t *get_bus_id() const { return bus_id; }
+
+  void set_id(uint8_t id) { this->id = id; }
+  void set_bus_id(const uint8_t *bus_id) { memcpy(this->bus_id, bus_id, 4); }
+
+  void set_receiver(PJON_Receiver r, void *custom_pointer = NULL) {
+    receiver = r;
+    this->custom_pointer = custom_pointer;
+  }
+};
+
+SimulatedLink *SimulatedBus::find(const uint8_t id, const uint8_t *bus_id) {
+  for (SimulatedLink *l = links; l; l = l->next_link)
+    if (l->id == id && memcmp(l->bus_id, bus_id, 4) == 0) return l;
+  return NULL;
+}
+
+// Occupy the sending link for the time needed to transfer the packet, returning when it is delivered
+uint64_t SimulatedBus::transfer(SimulatedLink &from, SimulatedLink &to, const uint16_t length) {
+  uint64_t now = get_time_us(), start = from.busy_until_us > now ? from.busy_until_us : now;
+  uint32_t rate = from.config.bytes_per_second;
+  if (rate == 0 || (to.config.bytes_per_second != 0 && to.config.bytes_per_second < rate)) rate = to.config.bytes_per_second;
+  from.busy_until_us = start + (rate ? ((uint64_t) length + MI_SIMULATED_PACKET_OVERHEAD) * 1000000ull / rate : 0);
+  uint64_t time = from.busy_until_us + from.config.latency_us + to.config.latency_us;
+  if (from.config.jitter_us) time += (uint64_t) (random() * from.config.jitter_us);
+  if (to.config.jitter_us) time += (uint64_t) (random() * to.config.jitter_us);
+  return time;
+}
+
+uint16_t SimulatedBus::send(SimulatedLink &from, uint8_t id, const uint8_t *bus_id, const char *string, uint16_t length,
+                            uint32_t timeout, const bool async, MISendCallback callback, void *custom_pointer) {
+  SimulatedLink *to = id == PJON_BROADCAST ? NULL : find(id, bus_id);
+  bool lost = id != PJON_BROADCAST &&
+    (to == NULL || (from.config.loss > 0 && random() < from.config.loss) || (to->config.loss > 0 && random() < to->config.loss));
+  uint64_t delivery = to ? transfer(from, *to, length) : transfer(from, from, length), ack = get_time_us() + timeout;
+  if (lost) { packets_lost++; from.packets_lost++; }
+  else {
+    Packet *p = new Packet;
+    if (p == NULL) return PJON_FAIL;
+    p->payload = new uint8_t[length ? length : 1];
+    if (p->payload == NULL) { delete p; return PJON_FAIL; }
+    memcpy(p->payload, string, length);
+    p->length = length;
+    p->from = &from;
+    p->to = to;
+    memcpy(p->bus_id, bus_id, 4);
+    p->time_us = delivery;
+    insert(deliveries, p);
+    packets_sent++; from.packets_sent++;
+    bytes_sent += length; from.bytes_sent += length;
+    // The ACK travels back over both links. A broadcast is not ACKed.
+    ack = to ? delivery + to->config.latency_us + from.config.latency_us : get_time_us();
+  }
+  uint16_t status = lost ? PJON_FAIL : PJON_ACK;
+  if (async) {
+    Packet *c = new Packet;
+    if (c == NULL) return PJON_FAIL;
+    c->from = &from;
+    c->time_us = ack;
+    c->status = status;
+    c->callback = callback;
+    c->custom_pointer = custom_pointer;
+    insert(completions, c);
+  } else if (ack > get_time_us()) mi_simulated_time_us() = ack; // Wait for the ACK or the timeout
+  return status;
+}
+
+void SimulatedBus::deliver(const Packet &p, SimulatedLink &l) {
+  PJON_Packet_Info &info = l.last_packet_info;
+  info.header = PJON_PORT_BIT;
+  info.port = MI_PJON_MODULE_INTERFACE_PORT;
+  info.tx.id = p.from->id;
+  memcpy(info.tx.bus_id, p.from->bus_id, 4);
+  info.rx.id = p.to ? l.id : PJON_BROADCAST;
+  memcpy(info.rx.bus_id, l.bus_id, 4);
+  info.custom_pointer = l.custom_pointer;
+  l.packets_received++;
+  l.bytes_received += p.length;
+  if (l.receiver) l.receiver(p.payload, p.length, info);
+}
+
+// Deliver all packets that are due, returning true if any were delivered to the given link
+bool SimulatedBus::deliver(SimulatedLink &receiver) {
+  bool received = false;
+  while (deliveries && deliveries->time_us <= get_time_us()) {
+    Packet *p = deliveries;
+    deliveries = p->next;
+    if (p->to) {
+      if (p->to == &receiver) received = true;
+      deliver(*p, *p->to);
+    } else for (SimulatedLink *l = links; l; l = l->next_link) {
+      if (l == p->from || memcmp(l->bus_id, p->bus_id, 4) != 0) continue;
+      if (l == &receiver) received = true;
+      deliver(*p, *l);
+    }
+    delete[] p->payload;
+    delete p;
+  }
+  return received;
+}
+
+// Report the due results of async sends from the link, returning the number still pending
+uint8_t SimulatedBus::complete(SimulatedLink &link) {
+  uint8_t pending = 0;
+  for (Packet **pp = &completions; *pp; ) {
+    Packet *p = *pp;
+    if (p->from != &link) { pp = &p->next; continue; }
+    if (p->time_us > get_time_us()) { if (pending < 255) pending++; pp = &p->next; continue; }
+    *pp = p->next;
+    if (p->callback) p->callback(p->status, p->custom_pointer);
+    delete p;
+  }
+  return pending;
+}
+
+// Let time pass until the next packet is due, but not beyond the limit
+void SimulatedBus::idle(const uint64_t limit_us) {
+  uint64_t next = limit_us;
+  if (deliveries && deliveries->time_us < next) next = deliveries->time_us;
+  if (completions && completions->time_us < next) next = completions->time_us;
+  if (next > get_time_us()) mi_simulated_time_us() = next;
+}
+
+void SimulatedBus::run_until(const uint64_t time_us) {
+  while (get_time_us() < time_us) {
+    if (links) deliver(*links);
+    for (SimulatedLink *l = links; l; l = l->next_link) complete(*l);
+    idle(time_us);
+  }
+  if (links) deliver(*links);
+}
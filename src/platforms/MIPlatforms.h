@@ -16,6 +16,15 @@
 #include <PJON.h>
 #include "platforms/MISystemDefines.h"
 
+// Let the library run on a virtual clock that is advanced by a simulation instead of on the
+// system clock, making simulated runs deterministic (see MI_PJON/SimulatedLink.h).
+// The clock starts at 1s because a time of 0 is used for "never" in some places.
+#ifdef MI_SIMULATED_TIME
+  inline uint64_t &mi_simulated_time_us() { static uint64_t t = 1000000; return t; }
+  #define micros() ((uint32_t) mi_simulated_time_us())
+  #define millis() ((uint32_t) (mi_simulated_time_us() / 1000))
+#endif
+
 #if defined(PJON_ESP) || defined(MI_POSIX)
 #define F(x) (x)
 #endif
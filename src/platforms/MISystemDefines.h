@@ -15,10 +15,10 @@
 	#define ARDUINOJSON_ENABLE_PROGMEM 0
 	typedef std::string String;
 
-	void mi_dprint(const char *s) { printf("%s", s); }
-	void mi_dprint(const int x) { printf("%d", x); }
-	void mi_dprintln(const char *s) { printf("%s\n", s); }
-	void mi_dprintln(const int x) { printf("%d\n", x); }
+	inline void mi_dprint(const char *s) { printf("%s", s); }
+	inline void mi_dprint(const int x) { printf("%d", x); }
+	inline void mi_dprintln(const char *s) { printf("%s\n", s); }
+	inline void mi_dprintln(const int x) { printf("%d\n", x); }
 
 	#define DPRINTLN(x) mi_dprintln(x)
 	#define DPRINT(x) mi_dprint(x)
@@ -32,4 +32,31 @@ public:
   uint16_t length() const { return len; }
   
   void set_all(const uint8_t value) { for (uint16_t i=0; i<len; i++) buffer[i] = value; }
-};
\ No newline at end of file
+};
+// The same for an array of elements of another type, making sure it is freed when object goes out of scope
+
+template<typename T> class TypedBuffer {
+private:
+  T *buffer = NULL;
+  uint16_t len = 0;
+public:
+  TypedBuffer() {}
+  ~TypedBuffer() { deallocate(); }
+  bool allocate(const uint16_t length) {
+    if (len < length) {
+      if (buffer) delete[] buffer;
+      buffer = new T[length];
+      len = length;
+    }
+    return length == 0 || buffer != NULL;
+  }
+  void deallocate() { if (buffer) { delete[] buffer; buffer = NULL; len = 0; } }
+  bool is_empty() const { return buffer == NULL; }
+
+  T operator [] (const uint16_t ix) const { return buffer[ix]; }
+  T &operator [] (const uint16_t ix) { return buffer[ix]; }
+
+  uint16_t length() const { return len; }
+
+  void set_all(const T value) { for (uint16_t i=0; i<len; i++) buffer[i] = value; }
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+// A minimal benchmark runner for the host (Linux/Windows) builds, without external dependencies.
+// Each benchmark is run repeatedly until it has used at least the minimum time, and the result is
+// written as one JSON object per benchmark, in a format close to that of Google Benchmark.
+
+#include <chrono>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef BENCHMARK_MIN_TIME_MS
+  #define BENCHMARK_MIN_TIME_MS 200
+#endif
+
+class BenchmarkRunner {
+  bool first = true;
+  uint32_t min_time_ms = BENCHMARK_MIN_TIME_MS;
+  const char *filter = NULL;
+  FILE *out = stdout;
+
+  static uint64_t now_ns() {
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+public:
+  // Arguments: [--min_time_ms=N] [--filter=substring]
+  BenchmarkRunner(int argc, char *argv[], const char *executable) {
+    for (int i = 1; i < argc; i++) {
+      if (strncmp(argv[i], "--min_time_ms=", 14) == 0) min_time_ms = (uint32_t) atol(&argv[i][14]);
+      else if (strncmp(argv[i], "--filter=", 9) == 0) filter = &argv[i][9];
+    }
+    fprintf(out, "{\n  \"context\": {\"executable\": \"%s\", \"min_time_ms\": %u},\n  \"benchmarks\": [",
+      executable, (unsigned) min_time_ms);
+  }
+  ~BenchmarkRunner() { fprintf(out, "\n  ]\n}\n"); }
+
+  // Run the function until the minimum time has passed, and report the time per call.
+  // The function gets the iteration number, and returns a value that is summed to keep the
+  // compiler from optimizing the work away.
+  template<typename F> void run(const char *name, const uint32_t variables, const uint32_t modules, F function) {
+    if (filter && strstr(name, filter) == NULL) return;
+    uint64_t iterations = 0, checksum = 0, start = now_ns(), elapsed = 0, limit = (uint64_t) min_time_ms * 1000000;
+    uint64_t batch = 1;
+    while (elapsed < limit) {
+      for (uint64_t i = 0; i < batch; i++) checksum += (uint64_t) function(iterations + i);
+      iterations += batch;
+      elapsed = now_ns() - start;
+      if (batch < 1000000) batch *= 2;
+    }
+    fprintf(out, "%s\n    {\"name\": \"%s/%u/%u\", \"variables\": %u, \"modules\": %u, \"iterations\": %llu, "
+      "\"ns_per_op\": %.1f, \"checksum\": %llu}", first ? "" : ",", name, (unsigned) variables, (unsigned) modules,
+      (unsigned) variables, (unsigned) modules, (unsigned long long) iterations,
+      (double) elapsed / (double) iterations, (unsigned long long) checksum);
+    fflush(out);
+    first = false;
+  }
+};
+
+// Variable counts and module counts to run each benchmark with
+static const uint8_t benchmark_variable_counts[] = { 4, 16, 64, 255 };
+static const uint16_t benchmark_module_counts[] = { 2, 16, 64 };
+static const uint8_t benchmark_module_variable_counts[] = { 4, 16, 64 }; // Per module, when varying the module count
+#define BENCHMARK_COUNT(a) (sizeof(a) / sizeof(a[0]))
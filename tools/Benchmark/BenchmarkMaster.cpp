@@ -0,0 +1,291 @@
+/* Benchmarks of the master side data path: contract parsing, value serialization,
+   variable lookup, transfer between modules and JSON conversion.
+   The results are written as JSON to stdout. See README.md in this directory.
+*/
+
+#define MI_USE_SYSTEMTIME
+
+#include "Benchmark.h"
+#include <MIMaster.h>
+#include <MI/MITimeSeriesCodec.h>
+
+// Build a serialized contract as sent from a module: contract id(4), count(1), <type(1), name length(1), name>.
+// Variable names are like "O12", and inputs are named with the prefix of the module they get their value from.
+static uint16_t build_contract(uint8_t *buf, const uint8_t count, const uint32_t contract_id,
+                               const char *name_prefix = "", const char *format = "O%d") {
+  uint8_t *p = buf;
+  memcpy(p, &contract_id, 4); p += 4;
+  *p++ = count;
+  for (uint8_t i = 0; i < count; i++) {
+    char name[MVAR_MAX_NAME_LENGTH + MVAR_PREFIX_LENGTH + 1];
+    size_t prefix_length = strlen(name_prefix);
+    memcpy(name, name_prefix, prefix_length);
+    snprintf(&name[prefix_length], sizeof name - prefix_length, format, i);
+    *p++ = (uint8_t) (i % 2 ? mvtFloat32 : mvtUint16);
+    *p++ = (uint8_t) strlen(name);
+    memcpy(p, name, strlen(name)); p += strlen(name);
+  }
+  return (uint16_t) (p - buf);
+}
+
+static void get_prefix(const uint16_t module_ix, char *prefix) {
+  prefix[0] = (char) ('a' + module_ix / 26);
+  prefix[1] = (char) ('a' + module_ix % 26);
+  prefix[2] = 0;
+}
+
+// A set of modules where each module uses all outputs of the next module as inputs
+static ModuleInterfaceSet *create_module_set(const uint16_t module_count, const uint8_t variable_count) {
+  ModuleInterfaceSet *set = new ModuleInterfaceSet((mi_module_ix_t) module_count, "bm");
+  static uint8_t buf[5 + 255 * (2 + MVAR_MAX_NAME_LENGTH + MVAR_PREFIX_LENGTH)];
+  for (uint16_t m = 0; m < module_count; m++) {
+    ModuleInterface *mi = set->interfaces[m];
+    char name[MAX_MODULE_NAME_LENGTH + 1], prefix[3], source_prefix[3];
+    snprintf(name, sizeof name, "M%d", m);
+    get_prefix(m, prefix);
+    get_prefix((uint16_t) ((m + 1) % module_count), source_prefix);
+    mi->set_name(name);
+    mi->set_prefix(prefix);
+    mi->settings.set_variables(buf, build_contract(buf, 0, 1));
+    mi->inputs.set_variables(buf, build_contract(buf, variable_count, 2, source_prefix));
+    mi->outputs.set_variables(buf, build_contract(buf, variable_count, 3));
+    mi->last_alive = millis() ? millis() : 1;
+    for (uint8_t i = 0; i < variable_count; i++) mi->outputs.set_value(i, (float) i);
+    mi->outputs.set_updated();
+  }
+  return set;
+}
+
+static void benchmark_variable_set(BenchmarkRunner &runner, const uint8_t count) {
+  static uint8_t contract[5 + 255 * (2 + MVAR_MAX_NAME_LENGTH)];
+  uint16_t contract_length = build_contract(contract, count, 1);
+
+  // Parsing of a contract received from a module (a new contract id each time to avoid it being ignored)
+  ModuleVariableSet parsed;
+  runner.run("master_set_variables", count, 1, [&](uint64_t i) {
+    uint32_t id = (uint32_t) i + 1;
+    memcpy(contract, &id, 4);
+    parsed.set_variables(contract, contract_length);
+    return parsed.get_num_variables();
+  });
+
+  ModuleVariableSet mvs;
+  mvs.set_variables(contract, contract_length);
+  for (uint8_t i = 0; i < count; i++) mvs.set_value(i, (uint16_t) i);
+  mvs.set_updated();
+
+  runner.run("master_calculate_contract_id", count, 1, [&](uint64_t) { return mvs.calculate_contract_id(); });
+
+  // Serialization of all values, and of a quarter of them flagged as changed or events
+  BinaryBuffer values;
+  uint16_t length = 0;
+  runner.run("master_get_values_full", count, 1, [&](uint64_t) {
+    mvs.get_values(values, length, mcSetInputs);
+    return length;
+  });
+  for (uint16_t i = 0; i < count; i += 4) { mvs.set_changed((uint8_t) i); mvs.set_event((uint8_t) i); }
+  runner.run("master_get_values_changes", count, 1, [&](uint64_t) {
+    mvs.get_values(values, length, mcSetInputs, false, true);
+    return length;
+  });
+  runner.run("master_get_values_events", count, 1, [&](uint64_t) {
+    mvs.get_values(values, length, mcSetInputs, true);
+    return length;
+  });
+  mvs.clear_events();
+
+  // Deserialization of all values, as outputs received from a module
+  mvs.get_values(values, length, mcSetOutputs);
+  runner.run("master_set_values", count, 1, [&](uint64_t) {
+    return mvs.set_values(values.get() + 1, length - 1);
+  });
+
+  // Lookup of the last variable by name
+  char name[MVAR_MAX_NAME_LENGTH + 1];
+  snprintf(name, sizeof name, "O%d", count - 1);
+  runner.run("master_get_variable_ix", count, 1, [&](uint64_t) { return mvs.get_variable_ix(name); });
+
+  // Text conversion of all values
+  char text[20];
+  runner.run("master_get_value_as_text", count, 1, [&](uint64_t) {
+    uint32_t sum = 0;
+    for (uint8_t i = 0; i < count; i++) {
+      mvs.get_module_variable(i).get_value_as_text(text, sizeof text);
+      sum += (uint8_t) text[0];
+    }
+    return sum;
+  });
+
+  // JSON conversion of all values, as done when transferring to and from the web server
+  DynamicJsonDocument root(JSON_OBJECT_SIZE(255) + 255 * (MVAR_MAX_NAME_LENGTH + 1));
+  runner.run("master_mv_to_json", count, 1, [&](uint64_t) {
+    root.clear();
+    uint32_t sum = 0;
+    for (uint8_t i = 0; i < count; i++) sum += mv_to_json(mvs.get_module_variable(i), root, mvs.get_variable_name(i));
+    return sum;
+  });
+  runner.run("master_json_to_mv", count, 1, [&](uint64_t) {
+    uint32_t sum = 0;
+    for (uint8_t i = 0; i < count; i++) sum += json_to_mv(mvs.get_module_variable(i), root, mvs.get_variable_name(i));
+    return sum;
+  });
+}
+
+static void benchmark_module_set(BenchmarkRunner &runner, const uint16_t module_count, const uint8_t count) {
+  ModuleInterfaceSet *set = create_module_set(module_count, count);
+
+  // Lookup of an output in the last module, as done for each input when contracts change
+  char name[MVAR_MAX_NAME_LENGTH + MVAR_PREFIX_LENGTH + 1];
+  get_prefix((uint16_t) (module_count - 1), name);
+  snprintf(&name[2], sizeof name - 2, "O%d", count - 1);
+  mi_module_ix_t module_ix;
+  uint8_t output_ix;
+  runner.run("master_find_output_by_name", count, module_count, [&](uint64_t) {
+    set->find_output_by_name(name, module_ix, output_ix);
+    return output_ix;
+  });
+
+  // Copy all outputs to the inputs using them
+  set->update_intermodule_dependencies();
+  runner.run("master_transfer_outputs_to_inputs", count, module_count, [&](uint64_t) {
+    set->transfer_outputs_to_inputs();
+    return set->interfaces[0]->inputs.is_updated();
+  });
+  delete set;
+}
+
+// Compressed time series as used for the raw history and the binary /history reply, compared with
+// the same samples as JSON arrays. The samples are a slowly varying temperature sampled every 10s.
+// The value expected back from the decoder: integers with the size of their type, and booleans as 0 or 1
+static uint32_t get_stored_raw(const ModuleVariableType type, const uint32_t raw) {
+  switch (type) {
+  case mvtBoolean: return (raw & 0xFF) ? 1 : 0;
+  case mvtUint8: case mvtInt8: return raw & 0xFF;
+  case mvtUint16: case mvtInt16: return raw & 0xFFFF;
+  default: return raw;
+  }
+}
+
+// Encode the samples into a buffer of the given size, and check that the ones that fit are decoded
+// unchanged. A sample that does not fit must leave the encoder as it was, so that later samples can be added.
+static void check_round_trip(const ModuleVariableType type, const uint32_t *times, const uint32_t *raws,
+                             const uint8_t count, const uint16_t buffer_size) {
+  static uint8_t buf[255 * 10];
+  uint32_t added_times[255], added_raws[255];
+  uint8_t added = 0;
+  MITimeSeriesEncoder encoder(buf, buffer_size, type);
+  for (uint8_t i = 0; i < count; i++)
+    if (encoder.add(times[i], raws[i])) { added_times[added] = times[i]; added_raws[added++] = raws[i]; }
+  if (added != encoder.get_count() || (buffer_size >= count * 10 && added != count)) {
+    fprintf(stderr, "Time series encoding of type %u kept %u of %u samples in %u bytes\n",
+            (unsigned) type, added, count, buffer_size);
+    exit(1);
+  }
+  MITimeSeriesDecoder decoder(buf, encoder.get_length(), type, added);
+  uint32_t time, raw;
+  for (uint8_t i = 0; i < added; i++)
+    if (!decoder.next(time, raw) || time != added_times[i] || raw != get_stored_raw(type, added_raws[i])) {
+      fprintf(stderr, "Time series round trip of type %u failed at sample %u of %u in %u bytes\n",
+              (unsigned) type, i, added, buffer_size);
+      exit(1);
+    }
+}
+
+// Check the round trip of each variable type with extreme values, and of timestamps with
+// delta-of-delta values at the limits of each encoding size, and in full buffers
+static void check_time_series_codec() {
+  static const int32_t dods[] = { 0, 64, -63, 65, -64, 256, -255, 257, -256, 2048, -2047, 2049, -2048,
+                                  1000000000, -2000000000, 0 };
+  const uint8_t count = BENCHMARK_COUNT(dods) + 1;
+  uint32_t times[count], delta = 10;
+  times[0] = 0xFFFFFF00ul; // Wrapping around
+  for (uint8_t i = 0; i < BENCHMARK_COUNT(dods); i++) {
+    delta += (uint32_t) dods[i];
+    times[i + 1] = times[i] + delta;
+  }
+  struct { ModuleVariableType type; uint32_t values[8]; } cases[] = {
+    { mvtBoolean, { 0, 1, 1, 0, 2, 0xFF, 0, 1 } },
+    { mvtUint8, { 0, 0xFF, 0, 0xFF, 1, 0xFE, 0x80, 0x7F } },
+    { mvtInt8, { 0x80, 0x7F, 0x80, 0, 0xFF, 1, 0x7F, 0x80 } },
+    { mvtUint16, { 0, 0xFFFF, 0, 0xFFFF, 1, 0x8000, 0x7FFF, 0 } },
+    { mvtInt16, { 0x8000, 0x7FFF, 0x8000, 0, 0xFFFF, 1, 0x7FFF, 0x8000 } },
+    { mvtUint32, { 0, 0xFFFFFFFF, 0, 0xFFFFFFFF, 1, 0x80000000, 0x7FFFFFFF, 0 } },
+    { mvtInt32, { 0x80000000, 0x7FFFFFFF, 0x80000000, 0, 0xFFFFFFFF, 1, 0x7FFFFFFF, 0x80000000 } },
+    // NaN, signalling NaN, negative NaN with payload, infinity, -0, smallest denormal, largest float, 21.5
+    { mvtFloat32, { 0x7FC00000, 0x7F800001, 0xFFC00001, 0x7F800000, 0x80000000, 0x00000001, 0x7F7FFFFF, 0x41AC0000 } }
+  };
+  uint32_t raws[count];
+  for (uint8_t c = 0; c < BENCHMARK_COUNT(cases); c++) {
+    for (uint8_t i = 0; i < count; i++) raws[i] = cases[c].values[i % 8];
+    check_round_trip(cases[c].type, times, raws, count, sizeof(uint32_t) * 10 * count);
+    for (uint16_t size = 4; size <= 40; size += 3) check_round_trip(cases[c].type, times, raws, count, size);
+  }
+}
+
+static void benchmark_time_series(BenchmarkRunner &runner, const uint8_t count) {
+  uint32_t times[255], raws[255];
+  for (uint8_t i = 0; i < count; i++) {
+    float value = 21.5f + (float) ((i * 7) % 13) * 0.1f;
+    times[i] = 1700000000ul + i * 10ul;
+    memcpy(&raws[i], &value, 4);
+  }
+  static uint8_t buf[255 * 10];
+  uint16_t length = 0;
+  auto encode = [&]() {
+    MITimeSeriesEncoder encoder(buf, sizeof buf, mvtFloat32);
+    for (uint8_t i = 0; i < count; i++) encoder.add(times[i], raws[i]);
+    length = encoder.get_length();
+    return encoder.get_count();
+  };
+
+  // Check the round trip before measuring
+  check_round_trip(mvtFloat32, times, raws, count, sizeof buf);
+  encode();
+
+  runner.run("master_encode_time_series", count, 1, [&](uint64_t) { return encode(); });
+  runner.run("master_decode_time_series", count, 1, [&](uint64_t) {
+    MITimeSeriesDecoder decoder(buf, length, mvtFloat32, count);
+    uint32_t time, raw, sum = 0;
+    while (decoder.next(time, raw)) sum += raw;
+    return sum;
+  });
+
+  // Compared with sending the current values as JSON for each sample, like the HTTP transfer does
+  ModuleInterface mi;
+  mi.set_prefix("aa");
+  uint8_t contract[16], *p = contract;
+  uint32_t contract_id = 1;
+  memcpy(p, &contract_id, 4); p += 4;
+  *p++ = 1; *p++ = mvtFloat32; *p++ = 4; memcpy(p, "Temp", 4); p += 4;
+  mi.outputs.set_variables(contract, (uint16_t) (p - contract));
+  mi.outputs.set_updated();
+  DynamicJsonDocument root(1024);
+  static char json[1024];
+  uint32_t json_length = 0;
+  runner.run("master_json_time_series", count, 1, [&](uint64_t) {
+    json_length = 0;
+    for (uint8_t i = 0; i < count; i++) {
+      float value;
+      memcpy(&value, &raws[i], 4);
+      mi.outputs.set_value(0, value);
+      root.clear();
+      add_json_values(&mi, root);
+      json_length += (uint32_t) serializeJson(root, json, sizeof json);
+    }
+    return json_length;
+  });
+  fprintf(stderr, "Time series of %u samples: %u bytes encoded, %u bytes as JSON\n", count, length, json_length);
+}
+
+int main(int argc, char *argv[]) {
+  BenchmarkRunner runner(argc, argv, "BenchmarkMaster");
+  check_time_series_codec();
+  for (uint8_t v = 0; v < BENCHMARK_COUNT(benchmark_variable_counts); v++)
+    benchmark_variable_set(runner, benchmark_variable_counts[v]);
+  for (uint8_t v = 0; v < BENCHMARK_COUNT(benchmark_variable_counts); v++)
+    benchmark_time_series(runner, benchmark_variable_counts[v]);
+  for (uint8_t m = 0; m < BENCHMARK_COUNT(benchmark_module_counts); m++)
+    for (uint8_t v = 0; v < BENCHMARK_COUNT(benchmark_module_variable_counts); v++)
+      benchmark_module_set(runner, benchmark_module_counts[m], benchmark_module_variable_counts[v]);
+  return 0;
+}
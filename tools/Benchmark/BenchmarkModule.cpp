@@ -0,0 +1,75 @@
+/* Benchmarks of the module side data path: contract parsing and value serialization.
+   The results are written as JSON to stdout. See README.md in this directory.
+*/
+
+#define MI_USE_SYSTEMTIME
+
+#include "Benchmark.h"
+#include <MIModule.h>
+
+// The contract being parsed, like "O0:u2 O1:f4 O2:u2"
+static char contract[255 * (MVAR_MAX_NAME_LENGTH + 4)];
+static char get_contract_char(uint16_t position) { return contract[position]; }
+
+static void build_contract(const uint8_t count) {
+  char *p = contract;
+  for (uint8_t i = 0; i < count; i++)
+    p += sprintf(p, "%sO%d:%s", i ? " " : "", i, i % 2 ? "f4" : "u2");
+}
+
+static void benchmark_variable_set(BenchmarkRunner &runner, const uint8_t count) {
+  build_contract(count);
+
+  // Parsing of the contract, done at startup and when the master asks for the contract
+  ModuleVariableSet parsed;
+  runner.run("module_set_variables_by_callback", count, 1, [&](uint64_t) {
+    parsed.set_variables_by_callback(get_contract_char);
+    return parsed.get_contract_id();
+  });
+
+  ModuleVariableSet mvs;
+  mvs.set_variables_by_callback(get_contract_char);
+  for (uint8_t i = 0; i < count; i++) mvs.set_value(i, (uint16_t) i);
+  mvs.set_updated();
+
+  runner.run("module_calculate_contract_id", count, 1, [&](uint64_t) { return mvs.calculate_contract_id(); });
+
+  // Serialization of the contract, as sent to the master
+  BinaryBuffer buf;
+  uint16_t length = 0;
+  runner.run("module_get_variables", count, 1, [&](uint64_t) {
+    mvs.get_variables(buf, length, mcSetOutputContract);
+    return length;
+  });
+
+  // Serialization of all values, and of a quarter of them flagged as changed or events
+  BinaryBuffer values;
+  runner.run("module_get_values_full", count, 1, [&](uint64_t) {
+    mvs.get_values(values, length, mcSetOutputs);
+    return length;
+  });
+  for (uint16_t i = 0; i < count; i += 4) { mvs.set_changed((uint8_t) i); mvs.set_event((uint8_t) i); }
+  runner.run("module_get_values_changes", count, 1, [&](uint64_t) {
+    mvs.get_values(values, length, mcSetOutputs, false, true);
+    return length;
+  });
+  runner.run("module_get_values_events", count, 1, [&](uint64_t) {
+    mvs.get_values(values, length, mcSetOutputs, true);
+    return length;
+  });
+  mvs.clear_events();
+  for (uint16_t i = 0; i < count; i += 4) mvs.set_changed((uint8_t) i, false);
+
+  // Deserialization of all values, as settings or inputs received from the master
+  mvs.get_values(values, length, mcSetInputs);
+  runner.run("module_set_values", count, 1, [&](uint64_t) {
+    return mvs.set_values(values.get() + 1, length - 1);
+  });
+}
+
+int main(int argc, char *argv[]) {
+  BenchmarkRunner runner(argc, argv, "BenchmarkModule");
+  for (uint8_t v = 0; v < BENCHMARK_COUNT(benchmark_variable_counts); v++)
+    benchmark_variable_set(runner, benchmark_variable_counts[v]);
+  return 0;
+}
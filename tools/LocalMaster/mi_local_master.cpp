@@ -0,0 +1,133 @@
+/* mi_local_master: a master for modules on a DualUDP network that keeps everything on the host it runs
+   on, without a web server and database. It serves the values with MIHttpServer, keeps their history
+   with MIHistoryStore, publishes them in shared memory for other processes, saves its state for a warm
+   restart, and can log the outputs from a separate thread using snapshots. See README.md in this directory.
+*/
+
+#define MI_USE_SYSTEMTIME
+#define MI_SNAPSHOT       // For the --log thread
+#define MI_SHARED_MEMORY  // For mi_shm and other local consumers
+#define MI_WARM_RESTART   // For --state
+
+// We have memory enough, so allow the maximum amount of nodes
+#define DUDP_MAX_REMOTE_NODES 255
+
+#include <MIMaster.h>
+#include <PJONDualUDP.h>
+#include <MI/MIHttpServer.h>
+#include <MI/MIHistoryStore.h>
+#include <atomic>
+#include <thread>
+#include <signal.h>
+
+PJONLink<DualUDP> bus(1); // PJON device id 1
+PJONModuleInterfaceSet *interfaces = NULL;
+std::atomic<bool> stopping(false);
+
+static void stop(int) { stopping = true; }
+
+// Print the outputs of all modules at an interval, reading snapshots without disturbing the master loop
+static void log_outputs(const uint32_t interval_s) {
+  MISnapshot snapshot;
+  uint32_t last_sequence = 0;
+  while (!stopping) {
+    for (uint32_t i = 0; i < interval_s * 10 && !stopping; i++) delay(100);
+    if (!interfaces->read_snapshot(snapshot) || snapshot.get_sequence() == last_sequence) continue;
+    last_sequence = snapshot.get_sequence();
+    for (mi_module_ix_t m = 0; m < snapshot.get_module_count(); m++) {
+      if (!snapshot.is_updated(m, msOutputs)) continue;
+      printf("%s", snapshot.get_module_name(m));
+      for (uint8_t i = 0; i < snapshot.get_variable_count(m, msOutputs); i++)
+        printf(" %s%s=%g", snapshot.get_module_prefix(m), snapshot.get_variable_name(m, msOutputs, i),
+          snapshot.get_as_float(m, msOutputs, i));
+      printf("\n");
+    }
+    fflush(stdout);
+  }
+}
+
+static void print_usage() {
+  printf("Usage: mi_local_master --modules=\"Name:pf:id Name2:p2:id2\" [options]\n"
+    "  --prefix=m1                  Master prefix\n"
+    "  --port=8080                  HTTP server port, 0 to not serve HTTP\n"
+    "  --bind=127.0.0.1             Address to listen on\n"
+    "  --token=<token>              Token required for POST /settings\n"
+    "  --allowed_hosts=mypi,mypi.local  Host names accepted in addition to localhost and the bind address\n"
+    "  --history=<directory>        Keep the history of all outputs in this directory\n"
+    "  --shm=/mi_master             Shared memory segment name, empty to not publish\n"
+    "  --state=<file>               Save the state to this file, and restore it at startup\n"
+    "  --log=0                      Print all outputs at this interval in seconds, 0 to not print\n"
+    "  --interval=10000             Transfer interval in ms\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *modules = NULL, *prefix = "m1", *bind_address = "127.0.0.1", *token = NULL, *allowed_hosts = NULL,
+             *history_directory = NULL, *shm_name = MI_SHM_DEFAULT_NAME, *state_path = NULL;
+  uint16_t port = 8080;
+  uint32_t log_interval_s = 0, transfer_interval_ms = 10000;
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i], *v = strchr(a, '=');
+    v = v ? v + 1 : "";
+    if (strncmp(a, "--modules=", 10) == 0) modules = v;
+    else if (strncmp(a, "--prefix=", 9) == 0) prefix = v;
+    else if (strncmp(a, "--port=", 7) == 0) port = (uint16_t) atoi(v);
+    else if (strncmp(a, "--bind=", 7) == 0) bind_address = v;
+    else if (strncmp(a, "--token=", 8) == 0) token = v;
+    else if (strncmp(a, "--allowed_hosts=", 16) == 0) allowed_hosts = v;
+    else if (strncmp(a, "--history=", 10) == 0) history_directory = v;
+    else if (strncmp(a, "--shm=", 6) == 0) shm_name = v;
+    else if (strncmp(a, "--state=", 8) == 0) state_path = v;
+    else if (strncmp(a, "--log=", 6) == 0) log_interval_s = (uint32_t) atol(v);
+    else if (strncmp(a, "--interval=", 11) == 0) transfer_interval_ms = (uint32_t) atol(v);
+    else { print_usage(); return 1; }
+  }
+  if (modules == NULL || strlen(prefix) != 2) { print_usage(); return 1; }
+
+  bus.bus.begin();
+  interfaces = new PJONModuleInterfaceSet(bus, modules, prefix);
+  interfaces->set_transfer_interval(transfer_interval_ms);
+  if (state_path && interfaces->begin_warm_restart(state_path)) printf("Restored the state from %s.\n", state_path);
+  if (*shm_name && !interfaces->open_shared_memory(shm_name)) printf("Could not open shared memory %s.\n", shm_name);
+
+  MITransferBase *transfers[2];
+  uint8_t transfer_count = 0;
+  MIHistoryStore *history = NULL;
+  if (history_directory) {
+    history = new MIHistoryStore(*interfaces, history_directory);
+    if (!history->begin()) { printf("ERROR: Could not use the history directory %s.\n", history_directory); return 2; }
+    transfers[transfer_count++] = history;
+  }
+  MIHttpServer *http_server = NULL;
+  if (port) {
+    http_server = new MIHttpServer(*interfaces, port);
+    http_server->set_bind_address(bind_address);
+    if (token) http_server->set_token(token);
+    if (allowed_hosts) http_server->set_allowed_hosts(allowed_hosts);
+    if (history) http_server->set_history(history);
+    if (!http_server->begin()) { printf("ERROR: Could not listen on %s port %u.\n", bind_address, port); return 3; }
+    printf("Serving values on http://%s:%u/values\n", bind_address, port);
+    transfers[transfer_count++] = http_server;
+  }
+  interfaces->set_external_transfer(transfer_count, transfers);
+
+  std::thread logger;
+  if (log_interval_s) logger = std::thread(log_outputs, log_interval_s);
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  while (!stopping) {
+    // There is no web server with the settings. They are 0 unless restored from the saved state, until
+    // they are changed with POST /settings.
+    for (mi_module_ix_t i = 0; i < interfaces->get_module_count(); i++)
+      if (interfaces->interfaces[i]->settings.got_contract() && !interfaces->interfaces[i]->settings.is_updated())
+        interfaces->interfaces[i]->settings.set_updated();
+    interfaces->update();
+    delay(1);
+  }
+  if (logger.joinable()) logger.join();
+  if (state_path) interfaces->save_warm_restart();
+  if (http_server) delete http_server;
+  if (history) delete history;
+  delete interfaces; // Removes the shared memory segment
+  return 0;
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+// Declarations shared by the master and module parts of the replay tool, which are compiled
+// as separate translation units because the master and module code cannot be compiled together.
+
+#define MI_SIMULATED_TIME
+
+#include <platforms/MIPlatforms.h>
+#include <MI_PJON/MILink.h>
+#include <MI_PJON/MIPacketCapture.h>
+#include <chrono>
+
+// Time used by each call to receive when there are no more packets, letting timeouts pass
+#define REPLAY_IDLE_STEP_US 10
+
+// A log file read into memory, so that reading the file is not part of the measurements
+class ReplayLog {
+public:
+  struct Record {
+    uint64_t time_us;
+    uint8_t flags, remote_id, remote_bus_id[4];
+    uint16_t length;
+    uint32_t offset;  // Of the payload in the payload buffer
+  };
+  Record *records = NULL;
+  uint32_t count = 0;
+  uint8_t *payloads = NULL;
+  uint32_t payload_length = 0;
+
+  ~ReplayLog() { delete[] records; delete[] payloads; }
+
+  bool load(const char *path) {
+    MICaptureReader reader;
+    MICaptureReader::Record r;
+    uint32_t record_capacity = 0, payload_capacity = 0;
+    if (!reader.open(path)) return false;
+    while (reader.read(r)) {
+      if (count == record_capacity) grow(records, count, record_capacity = record_capacity ? 2 * record_capacity : 1024);
+      if (payload_length + r.length > payload_capacity) {
+        uint32_t capacity = payload_capacity ? 2 * payload_capacity : 65536;
+        while (capacity < payload_length + r.length) capacity *= 2;
+        grow(payloads, payload_length, payload_capacity = capacity);
+      }
+      Record &record = records[count++];
+      record.time_us = r.time_us;
+      record.flags = r.flags;
+      record.remote_id = r.remote_id;
+      memcpy(record.remote_bus_id, r.remote_bus_id, 4);
+      record.length = r.length;
+      record.offset = payload_length;
+      memcpy(&payloads[payload_length], r.payload, r.length);
+      payload_length += r.length;
+    }
+    return true;
+  }
+
+  const uint8_t *get_payload(const Record &r) const { return &payloads[r.offset]; }
+  uint64_t get_duration_us() const { return count ? records[count - 1].time_us : 0; }
+  bool is_master() const { return count > 0 && (records[0].flags & mcfMaster); }
+
+private:
+  template<typename T> static void grow(T *&array, const uint32_t used, const uint32_t capacity) {
+    T *a = new T[capacity];
+    if (used) memcpy(a, array, used * sizeof(T));
+    delete[] array;
+    array = a;
+  }
+};
+
+// A link delivering the received packets of a log, one packet for each call to receive, with the
+// virtual clock set to the recorded time of the packet. Sent packets are counted and ACKed.
+class ReplayLink : public MILink {
+  const ReplayLog &log;
+  uint32_t next = 0, pass = 0, passes = 1;
+  uint64_t start_us = 0;
+  uint8_t id = 0, bus_id[4] = {0, 0, 0, 0};
+  PJON_Receiver receiver = NULL;
+  void *custom_pointer = NULL;
+  PJON_Packet_Info last_packet_info;
+
+  // Find the next received packet, starting a new pass through the log if requested
+  bool find_next() {
+    while (true) {
+      while (next < log.count && (log.records[next].flags & mcfSent)) next++;
+      if (next < log.count) return true;
+      if (pass + 1 >= passes) return false;
+      pass++;
+      next = 0;
+      start_us = mi_simulated_time_us() + 1000000; // The next pass follows a second later
+    }
+  }
+
+public:
+  uint32_t packets_received = 0, bytes_received = 0, packets_sent = 0, bytes_sent = 0;
+
+  ReplayLink(const ReplayLog &replay_log, const uint32_t repeat = 1) : log(replay_log) {
+    passes = repeat ? repeat : 1;
+    start_us = mi_simulated_time_us();
+  }
+
+  bool is_done() { return !find_next(); }
+
+  // Deliver the next received packet, returning false if there are no more
+  bool deliver() {
+    if (!find_next()) return false;
+    const ReplayLog::Record &r = log.records[next++];
+    if (start_us + r.time_us > mi_simulated_time_us()) mi_simulated_time_us() = start_us + r.time_us;
+    last_packet_info.header = PJON_PORT_BIT;
+    last_packet_info.port = MI_PJON_MODULE_INTERFACE_PORT;
+    last_packet_info.tx.id = r.remote_id;
+    memcpy(last_packet_info.tx.bus_id, r.remote_bus_id, 4);
+    last_packet_info.rx.id = id;
+    memcpy(last_packet_info.rx.bus_id, bus_id, 4);
+    last_packet_info.custom_pointer = custom_pointer;
+    packets_received++;
+    bytes_received += r.length;
+    if (receiver) receiver((uint8_t*) log.get_payload(r), r.length, last_packet_info);
+    return true;
+  }
+
+  // These functions are required by the base class:
+
+  uint16_t receive() {
+    if (deliver()) return PJON_ACK;
+    mi_simulated_time_us() += REPLAY_IDLE_STEP_US;
+    return PJON_FAIL;
+  }
+  uint16_t receive(uint32_t) { return receive(); }
+
+  uint8_t update() { return 0; }
+  uint16_t send_packet(uint8_t, const uint8_t *, const char *, uint16_t length, uint32_t) {
+    packets_sent++;
+    bytes_sent += length;
+    return PJON_ACK;
+  }
+
+  const PJON_Packet_Info &get_last_packet_info() const { return last_packet_info; }
+
+  uint8_t get_id() const { return id; }
+  const uint8_t *get_bus_id() const { return bus_id; }
+
+  void set_id(uint8_t id) { this->id = id; }
+  void set_bus_id(const uint8_t *bus_id) { memcpy(this->bus_id, bus_id, 4); }
+
+  void set_receiver(PJON_Receiver r, void *custom_pointer = NULL) {
+    receiver = r;
+    this->custom_pointer = custom_pointer;
+  }
+};
+
+struct ReplayOptions {
+  uint32_t repeat = 1;        // Number of passes through the log
+  bool parse_only = false;    // Only let the stack handle the packets, without running its update
+  const char *modules = NULL; // Module list for the master, like "name:prefix:id:bus ..."
+};
+
+struct ReplayResult {
+  uint32_t packets = 0, bytes = 0, packets_sent = 0, bytes_sent = 0, contract_count = 0;
+  uint64_t wall_ns = 0, simulated_us = 0;
+};
+
+inline uint64_t replay_wall_ns() {
+  return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Module side, in ReplayModule.cpp. Returns false if the module contracts could not be found in the log.
+bool replay_module(const ReplayLog &log, const ReplayOptions &options, ReplayResult &result);
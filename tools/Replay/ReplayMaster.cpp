@@ -0,0 +1,122 @@
+/* mi_replay: feeds the packets received in a log captured with MI_PACKET_CAPTURE into a master or
+   module stack, as fast as possible, and reports the throughput. See README.md in this directory.
+*/
+
+#define MI_INDEX_BITS 16  // Allow logs from masters with more than 255 modules
+#include "Replay.h"
+#include <MIMaster.h>
+
+#define REPLAY_PREFIX_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+#define REPLAY_MAX_MODULES (26 * 62)
+
+// Make a module list like "M0:aa:10:0.0.0.1 M1:ab:11:0.0.0.1" from the senders of the received packets
+static char *create_module_list(const ReplayLog &log, uint8_t *master_bus_id) {
+  struct Address { uint8_t id, bus_id[4]; };
+  Address *addresses = new Address[REPLAY_MAX_MODULES];
+  uint16_t count = 0;
+  for (uint32_t i = 0; i < log.count && count < REPLAY_MAX_MODULES; i++) {
+    const ReplayLog::Record &r = log.records[i];
+    if ((r.flags & mcfSent) || r.remote_id == PJON_BROADCAST) continue;
+    uint16_t a = 0;
+    while (a < count && (addresses[a].id != r.remote_id || memcmp(addresses[a].bus_id, r.remote_bus_id, 4) != 0)) a++;
+    if (a < count) continue;
+    addresses[count].id = r.remote_id;
+    memcpy(addresses[count++].bus_id, r.remote_bus_id, 4);
+  }
+  if (count) memcpy(master_bus_id, addresses[0].bus_id, 4); // The master is placed on the bus of the first module
+  char *list = new char[(uint32_t) count * 32 + 1], *p = list;
+  const char *chars = REPLAY_PREFIX_CHARS;
+  *p = 0;
+  for (uint16_t m = 0; m < count; m++)
+    p += sprintf(p, "%sM%d:%c%c:%d:%d.%d.%d.%d", m ? " " : "", m, chars[m / 62], chars[m % 62], addresses[m].id,
+      addresses[m].bus_id[0], addresses[m].bus_id[1], addresses[m].bus_id[2], addresses[m].bus_id[3]);
+  delete[] addresses;
+  return list;
+}
+
+static bool replay_master(const ReplayLog &log, const ReplayOptions &options, ReplayResult &result) {
+  uint8_t bus_id[4] = { 0, 0, 0, 0 };
+  char *list = create_module_list(log, bus_id);
+  ReplayLink link(log, options.repeat);
+  link.set_id(1);
+  link.set_bus_id(bus_id);
+  PJONModuleInterfaceSet *set = new PJONModuleInterfaceSet(link, options.modules ? options.modules : list, "ms");
+  delete[] list;
+  if (set->get_module_count() == 0) {
+    fprintf(stderr, "No modules found in the log\n");
+    delete set;
+    return false;
+  }
+  set->set_transfer_interval(0); // A transfer cycle in each update
+
+  uint64_t start = replay_wall_ns(), start_us = mi_simulated_time_us();
+  if (options.parse_only) while (link.deliver()) ;
+  else while (!link.is_done()) {
+    for (mi_module_ix_t i = 0; i < set->get_module_count(); i++)
+      if (set->interfaces[i]->settings.got_contract()) set->interfaces[i]->settings.set_updated();
+    set->update();
+  }
+  result.wall_ns = replay_wall_ns() - start;
+  result.simulated_us = mi_simulated_time_us() - start_us;
+  result.packets = link.packets_received;
+  result.bytes = link.bytes_received;
+  result.packets_sent = link.packets_sent;
+  result.bytes_sent = link.bytes_sent;
+  for (mi_module_ix_t i = 0; i < set->get_module_count(); i++) if (set->interfaces[i]->got_contract()) result.contract_count++;
+
+  delete set;
+  return true;
+}
+
+static void print_usage() {
+  printf("Usage: mi_replay <log file> [options]\n"
+    "  --repeat=1               Number of passes through the log\n"
+    "  --parse                  Only let the stack parse the packets, without its update function\n"
+    "  --modules=\"M0:aa:10:0.0.0.1 ...\"  Module list for a master log, default generated from the log\n"
+    "  --json                   Write results as JSON\n");
+}
+
+int main(int argc, char *argv[]) {
+  ReplayOptions options;
+  const char *path = NULL;
+  bool json = false;
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i], *v = strchr(a, '=');
+    v = v ? v + 1 : "";
+    if (strncmp(a, "--repeat=", 9) == 0) options.repeat = (uint32_t) atol(v);
+    else if (strcmp(a, "--parse") == 0) options.parse_only = true;
+    else if (strncmp(a, "--modules=", 10) == 0) options.modules = v;
+    else if (strcmp(a, "--json") == 0) json = true;
+    else if (a[0] != '-' && path == NULL) path = a;
+    else { print_usage(); return 1; }
+  }
+  if (path == NULL) { print_usage(); return 1; }
+
+  ReplayLog log;
+  if (!log.load(path)) {
+    fprintf(stderr, "Could not read the log file %s\n", path);
+    return 1;
+  }
+  bool master = log.is_master();
+  ReplayResult r;
+  if (!(master ? replay_master(log, options, r) : replay_module(log, options, r))) return 1;
+
+  double wall_s = r.wall_ns / 1e9, recorded_s = (double) log.get_duration_us() * (options.repeat ? options.repeat : 1) / 1e6;
+  if (wall_s <= 0) wall_s = 1e-9;
+  if (json)
+    printf("{\"side\": \"%s\", \"mode\": \"%s\", \"records\": %u, \"packets\": %u, \"bytes\": %u, \"packets_sent\": %u, "
+      "\"bytes_sent\": %u, \"contracts\": %u, \"wall_ms\": %.3f, \"packets_per_s\": %.0f, \"mb_per_s\": %.3f, "
+      "\"recorded_s\": %.3f, \"simulated_s\": %.3f, \"speedup\": %.1f}\n",
+      master ? "master" : "module", options.parse_only ? "parse" : "full", log.count, r.packets, r.bytes, r.packets_sent,
+      r.bytes_sent, r.contract_count, wall_s * 1000, r.packets / wall_s, r.bytes / wall_s / 1e6,
+      recorded_s, r.simulated_us / 1e6, recorded_s / wall_s);
+  else {
+    printf("Replayed %u packets (%u bytes) of %u records into a %s stack, %s\n", r.packets, r.bytes, log.count,
+      master ? "master" : "module", options.parse_only ? "parsing only" : "with update");
+    printf("Sent %u packets (%u bytes), %u %s with contracts\n", r.packets_sent, r.bytes_sent, r.contract_count,
+      master ? "modules" : "sets");
+    printf("Wall time %.3f ms, %.0f packets/s, %.3f MB/s\n", wall_s * 1000, r.packets / wall_s, r.bytes / wall_s / 1e6);
+    printf("Recorded %.3f s, simulated %.3f s, speedup %.1fx\n", recorded_s, r.simulated_us / 1e6, recorded_s / wall_s);
+  }
+  return 0;
+}
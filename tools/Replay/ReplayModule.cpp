@@ -0,0 +1,106 @@
+/* Replay of a log captured by a module.
+   The module code is placed in its own namespace to keep it apart from the master code in the same program.
+   Everything it includes from outside the library must be included before the namespace.
+*/
+
+#include "Replay.h"
+
+namespace sim_module {
+#include <MIModule.h>
+}
+using namespace sim_module;
+
+#define REPLAY_MAX_CONTRACT_LENGTH 4096
+
+// The contracts of the module, rebuilt from the contracts it sent to the master
+struct ReplayContracts {
+  char text[3][REPLAY_MAX_CONTRACT_LENGTH];
+  uint32_t id[3];
+  bool found[3];
+  ReplayContracts() { for (uint8_t i = 0; i < 3; i++) { text[i][0] = 0; id[i] = 0; found[i] = false; } }
+  bool is_complete() const { return found[0] && found[1] && found[2]; }
+};
+
+// Convert an mcSet*Contract message to a contract string like "Temp:f4~0.1 Count:u2"
+static void add_contract(const uint8_t *message, const uint16_t length, ReplayContracts &contracts) {
+  uint8_t ix = message[0] - mcSetSettingContract;
+  if (length < 6 || contracts.found[ix]) return;
+  char *text = contracts.text[ix], *end = text + REPLAY_MAX_CONTRACT_LENGTH - 32;
+  memcpy(&contracts.id[ix], &message[1], 4);
+  const uint8_t *p = &message[6], *message_end = message + length;
+  for (uint8_t i = 0; i < message[5] && p + 2 <= message_end && text < end; i++) {
+    uint8_t type = p[0] & ~MVAR_DEADBAND_FLAG, len = (uint8_t) MI_min(p[1], MVAR_MAX_NAME_LENGTH);
+    bool has_deadband = (p[0] & MVAR_DEADBAND_FLAG) != 0;
+    if (type > mvtFloat32 || p + 2 + p[1] > message_end) break;
+    text += sprintf(text, "%s%.*s:%c%c", i ? " " : "", len, (const char*) &p[2],
+      pgm_read_byte(&ModuleVariableTypeNames[2 * type]), pgm_read_byte(&ModuleVariableTypeNames[2 * type + 1]));
+    p += 2 + p[1];
+    if (has_deadband) { // Deadband after the name, negative for a percentage
+      float band;
+      memcpy(&band, p, 4);
+      text += band < 0 ? sprintf(text, "~%g%%", -band * 100) : sprintf(text, "~%g", band);
+      p += 4;
+    }
+  }
+  contracts.found[ix] = true;
+}
+
+// Look for contracts in a sent message, also within mcMulti packets
+static void find_contracts(const uint8_t *message, const uint16_t length, ReplayContracts &contracts) {
+  if (length == 0) return;
+  if (message[0] >= mcSetSettingContract && message[0] <= mcSetOutputContract) add_contract(message, length, contracts);
+  else if (message[0] == mcMulti)
+    for (uint16_t pos = 1; pos < length && pos + 1 + message[pos] <= length; pos += 1 + message[pos])
+      find_contracts(&message[pos + 1], message[pos], contracts);
+}
+
+// Find the contracts sent by the module, reassembling contracts sent as mcFragment packets
+static bool find_contracts(const ReplayLog &log, ReplayContracts &contracts) {
+  uint8_t message[MI_MAX_MESSAGE_LENGTH];
+  uint16_t message_length = 0;
+  uint8_t next_ix = 0;
+  for (uint32_t i = 0; i < log.count && !contracts.is_complete(); i++) {
+    const ReplayLog::Record &r = log.records[i];
+    const uint8_t *p = log.get_payload(r);
+    if (!(r.flags & mcfSent) || (r.flags & mcfFailed) || r.length == 0) continue;
+    if (p[0] != mcFragment || r.length <= 4) { find_contracts(p, r.length, contracts); continue; }
+    if (p[2] == 0) { message_length = 0; next_ix = 0; }
+    if (p[2] != next_ix || message_length + r.length - 4 > (uint16_t) sizeof message) { next_ix = 0; continue; }
+    memcpy(&message[message_length], &p[4], r.length - 4);
+    message_length += r.length - 4;
+    if (++next_ix == p[3]) { find_contracts(message, message_length, contracts); next_ix = 0; }
+  }
+  return contracts.is_complete();
+}
+
+bool replay_module(const ReplayLog &log, const ReplayOptions &options, ReplayResult &result) {
+  ReplayContracts *contracts = new ReplayContracts();
+  if (!find_contracts(log, *contracts)) {
+    fprintf(stderr, "The contracts of the module were not found in the log, it must be captured from startup\n");
+    delete contracts;
+    return false;
+  }
+  ReplayLink link(log, options.repeat);
+  link.set_id(PJON_NOT_ASSIGNED);
+  PJONModuleInterface *mi = new PJONModuleInterface("Replay", link, contracts->text[0], contracts->text[1], contracts->text[2]);
+  ModuleVariableSet *sets[3] = { &mi->settings, &mi->inputs, &mi->outputs };
+  for (uint8_t i = 0; i < 3; i++) {
+    if (sets[i]->get_contract_id() != contracts->id[i])
+      fprintf(stderr, "Warning: the rebuilt contract \"%s\" has another id than the original\n", contracts->text[i]);
+    result.contract_count++;
+  }
+
+  uint64_t start = replay_wall_ns(), start_us = mi_simulated_time_us();
+  if (options.parse_only) while (link.deliver()) ;
+  else while (!link.is_done()) mi->update();
+  result.wall_ns = replay_wall_ns() - start;
+  result.simulated_us = mi_simulated_time_us() - start_us;
+  result.packets = link.packets_received;
+  result.bytes = link.bytes_received;
+  result.packets_sent = link.packets_sent;
+  result.bytes_sent = link.bytes_sent;
+
+  delete mi;
+  delete contracts;
+  return true;
+}
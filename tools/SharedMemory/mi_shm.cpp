@@ -0,0 +1,87 @@
+/* mi_shm: lists the live values that a master publishes in shared memory (MI_SHARED_MEMORY),
+   or prints the values as they change. It only needs MISharedMemory.h, like any other consumer.
+   See README.md in this directory.
+*/
+
+#include <MI/MISharedMemory.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const char *kind_names[MI_SHM_KIND_COUNT] = { "setting", "input", "output" };
+
+static void print_value(const MISharedMemoryReader &reader, const uint32_t ix, const MISharedReading &r) {
+  uint32_t m = reader.get_module_ix(ix);
+  char name[MI_SHM_NAME_LENGTH + 8];
+  snprintf(name, sizeof name, reader.get_kind(ix) == mskInput ? "%s.%s" : "%s%s", reader.get_module_prefix(m), reader.get_variable_name(ix));
+  if (!r.is_updated()) printf("%-7s %-20s -\n", kind_names[reader.get_kind(ix)], name);
+  else if (reader.get_type(ix) == mstFloat32) printf("%-7s %-20s %g%s\n", kind_names[reader.get_kind(ix)], name, r.get_float(), r.is_event() ? " (event)" : "");
+  else if (reader.get_type(ix) == mstInt32) printf("%-7s %-20s %d%s\n", kind_names[reader.get_kind(ix)], name, r.get_int32(), r.is_event() ? " (event)" : "");
+  else printf("%-7s %-20s %.0f%s\n", kind_names[reader.get_kind(ix)], name, r.get_as_float(reader.get_type(ix)), r.is_event() ? " (event)" : "");
+}
+
+static void list(const MISharedMemoryReader &reader) {
+  const MISharedHeader *h = reader.get_header();
+  printf("Master %s (pid %d), %u modules, %u variables, change %u, publish %u\n", h->master_prefix, h->writer_pid,
+    reader.get_module_count(), reader.get_variable_count(), reader.get_change_seq(), reader.get_publish_count());
+  if (h->dropped_count.load()) printf("%u variables did not fit in the segment\n", h->dropped_count.load());
+  MISharedReading r;
+  for (uint32_t m = 0; m < reader.get_module_count(); m++) {
+    printf("%s %s%s\n", reader.get_module_prefix(m), reader.get_module_name(m), reader.is_module_active(m) ? "" : " (inactive)");
+    for (uint8_t k = 0; k < MI_SHM_KIND_COUNT; k++)
+      for (uint8_t i = 0; i < reader.get_variable_count(m, k); i++) {
+        uint32_t ix = reader.get_variable_ix(m, k, i);
+        if (reader.read_value(ix, r)) print_value(reader, ix, r);
+      }
+  }
+}
+
+// Poll the change counter and print the values that have changed
+static void watch(MISharedMemoryReader &reader, const uint32_t interval_us) {
+  uint32_t seen = reader.get_change_seq();
+  MISharedReading r;
+  while (reader.is_writer_open()) {
+    usleep(interval_us);
+    uint32_t change_seq = reader.get_change_seq();
+    if (change_seq == seen) continue;
+    if (!reader.update_layout()) continue;
+    for (uint32_t ix = 0; ix < reader.get_variable_count(); ix++)
+      if (reader.read_value(ix, r) && MISharedMemoryReader::is_newer(r.change_seq, seen)) print_value(reader, ix, r);
+    seen = change_seq;
+    fflush(stdout);
+  }
+  printf("The master has closed the segment\n");
+}
+
+static void print_usage() {
+  printf("Usage: mi_shm [options]\n"
+    "  --name=/mi_master        Name of the shared memory segment\n"
+    "  --watch                  Print values as they change, until the master exits\n"
+    "  --interval_us=1000       Polling interval for --watch\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *name = MI_SHM_DEFAULT_NAME;
+  bool watching = false;
+  uint32_t interval_us = 1000;
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    if (strncmp(a, "--name=", 7) == 0) name = a + 7;
+    else if (strcmp(a, "--watch") == 0) watching = true;
+    else if (strncmp(a, "--interval_us=", 14) == 0) interval_us = (uint32_t) atol(a + 14);
+    else { print_usage(); return 1; }
+  }
+
+  MISharedMemoryReader reader;
+  if (!reader.open(name)) {
+    fprintf(stderr, "Could not open the shared memory segment %s\n", name);
+    return 1;
+  }
+  if (!reader.update_layout()) {
+    fprintf(stderr, "No values have been published yet\n");
+    return 1;
+  }
+  if (watching) watch(reader, interval_us);
+  else list(reader);
+  return 0;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+// Declarations shared by the master and module parts of the simulator, which are compiled
+// as separate translation units because the master and module code cannot be compiled together.
+
+#define MI_SIMULATED_TIME
+
+#include <MI_PJON/SimulatedLink.h>
+#include <time.h>
+
+// Modules are given device ids from this on, on bus ids 0.0.0.1 and up with this many modules on each
+#define SIMULATE_FIRST_ID 10
+#define SIMULATE_MODULES_PER_BUS 200
+
+// Module prefixes are a lowercase letter followed by a letter or digit
+#define SIMULATE_PREFIX_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+#define SIMULATE_MAX_MODULES (26 * 62)
+
+struct SimulationConfig {
+  uint16_t modules = 10;
+  uint8_t settings = 2, inputs = 4, outputs = 4;
+  float change_rate = 0.1f,   // Chance of each output changing in each cycle
+        event_rate = 0.01f;   // Chance of each module having an output event in each cycle
+  uint32_t seed = 1;
+  SimulatedLinkConfig module_link, master_link;
+};
+
+inline void simulate_get_address(const uint16_t module_ix, uint8_t &id, uint8_t bus_id[4]) {
+  id = (uint8_t) (SIMULATE_FIRST_ID + module_ix % SIMULATE_MODULES_PER_BUS);
+  bus_id[0] = bus_id[1] = bus_id[2] = 0;
+  bus_id[3] = (uint8_t) (1 + module_ix / SIMULATE_MODULES_PER_BUS);
+}
+
+inline void simulate_get_prefix(const uint16_t module_ix, char prefix[3]) {
+  prefix[0] = SIMULATE_PREFIX_CHARS[module_ix / 62];
+  prefix[1] = SIMULATE_PREFIX_CHARS[module_ix % 62];
+  prefix[2] = 0;
+}
+
+// Pseudo random number in [0, 1), xorshift32
+inline float simulate_random(uint32_t &state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return (float) (state >> 8) / (float) (1ul << 24);
+}
+
+// CPU time used by this thread
+inline uint64_t simulate_cpu_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return (uint64_t) t.tv_sec * 1000000000ull + (uint64_t) t.tv_nsec;
+}
+
+// Module side, in SimulateModules.cpp.
+// Each module uses all outputs of the next module as inputs (up to the input count).
+void simulate_create_modules(SimulatedBus &bus, const SimulationConfig &config);
+void simulate_delete_modules();
+void simulate_update_modules();          // Change outputs, add events and let each module do its update
+uint64_t simulate_get_module_cpu_ns();   // CPU time spent in module code so far
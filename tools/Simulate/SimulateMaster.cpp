@@ -0,0 +1,194 @@
+/* mi_simulate: runs a master against a number of virtual modules on a SimulatedBus, reporting
+   how the transfer cycle scales with the module count. See README.md in this directory.
+*/
+
+#define MI_INDEX_BITS 16  // Allow more than 255 modules
+#define MI_METRICS        // For event latencies
+#include "Simulate.h"
+#include <MIMaster.h>
+#include <malloc.h>
+
+#define SIMULATE_MAX_WARMUP_S 3600 // Give up if the contracts of all modules have not been received by then
+
+struct SimulationResult {
+  uint16_t modules = 0;
+  uint32_t warmup_ms = 0, cycles = 0;
+  uint64_t cycle_us_total = 0, cycle_us_max = 0, cpu_ns = 0, module_cpu_ns = 0;
+  uint32_t packets = 0, bytes = 0, lost = 0;
+  uint32_t event_p50_us = 0, event_p99_us = 0, event_count = 0, outputs_rtt_p99_us = 0;
+  int64_t master_heap = 0, module_heap = 0;
+};
+
+static size_t get_heap_used() { return mallinfo2().uordblks; }
+
+// The master gets settings from an external source in a real system, here they are just marked as updated
+static void update_master(PJONModuleInterfaceSet &set) {
+  for (mi_module_ix_t i = 0; i < set.get_module_count(); i++)
+    if (set.interfaces[i]->settings.got_contract()) set.interfaces[i]->settings.set_updated();
+  set.update();
+}
+
+// Let the modules run, without letting their polling of the bus count as time passing
+static void update_modules(SimulatedBus &bus) {
+  uint32_t idle_step = bus.idle_step_us;
+  bus.idle_step_us = 0;
+  simulate_update_modules();
+  bus.idle_step_us = idle_step;
+}
+
+static bool simulate(const SimulationConfig &config, const uint32_t cycles, SimulationResult &result) {
+  result = SimulationResult();
+  result.modules = config.modules;
+  SimulatedBus bus(config.seed);
+  size_t heap_start = get_heap_used();
+  simulate_create_modules(bus, config);
+  size_t heap_modules = get_heap_used();
+  result.module_heap = (int64_t) heap_modules - (int64_t) heap_start;
+
+  // The master is on the bus of the first modules
+  uint8_t id, bus_id[4];
+  simulate_get_address(0, id, bus_id);
+  SimulatedLink link(bus, 1, bus_id);
+  link.set_config(config.master_link);
+
+  // Module list like "M0:aa:10:0.0.0.1 M1:ab:11:0.0.0.1"
+  char *list = new char[(uint32_t) config.modules * 32 + 1], *p = list;
+  *p = 0;
+  for (uint16_t m = 0; m < config.modules; m++) {
+    char prefix[3];
+    simulate_get_prefix(m, prefix);
+    simulate_get_address(m, id, bus_id);
+    p += sprintf(p, "%sM%d:%s:%d:%d.%d.%d.%d", m ? " " : "", m, prefix, id, bus_id[0], bus_id[1], bus_id[2], bus_id[3]);
+  }
+  PJONModuleInterfaceSet *set = new PJONModuleInterfaceSet(link, list, "ms");
+  delete[] list;
+  set->set_transfer_interval(0); // A transfer cycle in each update
+
+  // Run until all contracts are received and values have been transferred a few times
+  uint64_t start_us = bus.get_time_us();
+  uint8_t complete_cycles = 0;
+  while (complete_cycles < 3) {
+    if (bus.get_time_us() - start_us > SIMULATE_MAX_WARMUP_S * 1000000ull) break;
+    update_modules(bus);
+    update_master(*set);
+    if (set->got_all_contracts()) complete_cycles++;
+  }
+  result.warmup_ms = (uint32_t) ((bus.get_time_us() - start_us) / 1000);
+  result.master_heap = (int64_t) get_heap_used() - (int64_t) heap_modules;
+  bool ok = complete_cycles >= 3;
+
+  // Measure the cycles
+  set->clear_metrics();
+  uint32_t packets = bus.packets_sent, bytes = bus.bytes_sent, lost = bus.packets_lost;
+  for (uint32_t c = 0; ok && c < cycles; c++) {
+    update_modules(bus);
+    uint64_t cycle_start = bus.get_time_us(), cpu_start = simulate_cpu_ns(), module_cpu_start = simulate_get_module_cpu_ns();
+    update_master(*set);
+    uint64_t duration = bus.get_time_us() - cycle_start, module_cpu = simulate_get_module_cpu_ns() - module_cpu_start;
+    result.cycle_us_total += duration;
+    if (duration > result.cycle_us_max) result.cycle_us_max = duration;
+    result.cpu_ns += simulate_cpu_ns() - cpu_start - module_cpu;
+    result.module_cpu_ns += module_cpu;
+    result.cycles++;
+  }
+  result.packets = bus.packets_sent - packets;
+  result.bytes = bus.bytes_sent - bytes;
+  result.lost = bus.packets_lost - lost;
+  MIMetrics total;
+  set->get_metrics(total);
+  result.event_count = total.latency[mlEvent].get_count();
+  result.event_p50_us = total.get_percentile_us(mlEvent, 50);
+  result.event_p99_us = total.get_percentile_us(mlEvent, 99);
+  result.outputs_rtt_p99_us = total.get_percentile_us(mlOutputsRTT, 99);
+
+  delete set;
+  simulate_delete_modules();
+  return ok;
+}
+
+static void print_result(const SimulationResult &r, const bool json, const bool first) {
+  uint32_t cycles = r.cycles ? r.cycles : 1;
+  double cycle_ms = (double) r.cycle_us_total / cycles / 1000.0;
+  if (json)
+    printf("%s\n    {\"modules\": %u, \"warmup_ms\": %u, \"cycles\": %u, \"cycle_ms\": %.3f, \"cycle_ms_max\": %.3f, "
+      "\"packets_per_cycle\": %.1f, \"bytes_per_cycle\": %.1f, \"lost_per_cycle\": %.2f, "
+      "\"events\": %u, \"event_p50_ms\": %.3f, \"event_p99_ms\": %.3f, \"outputs_rtt_p99_ms\": %.3f, "
+      "\"master_heap_kb\": %.1f, \"module_heap_kb\": %.1f, \"master_cpu_us_per_cycle\": %.1f, \"module_cpu_us_per_cycle\": %.1f}",
+      first ? "" : ",", r.modules, r.warmup_ms, r.cycles, cycle_ms, r.cycle_us_max / 1000.0,
+      (double) r.packets / cycles, (double) r.bytes / cycles, (double) r.lost / cycles,
+      r.event_count, r.event_p50_us / 1000.0, r.event_p99_us / 1000.0, r.outputs_rtt_p99_us / 1000.0,
+      r.master_heap / 1024.0, r.module_heap / 1024.0, r.cpu_ns / 1000.0 / cycles, r.module_cpu_ns / 1000.0 / cycles);
+  else {
+    if (first)
+      printf("%7s %9s %9s %9s %8s %9s %6s %9s %9s %9s %9s %9s\n", "modules", "cycle_ms", "max_ms", "pkt/cyc", "B/cyc",
+        "lost/cyc", "events", "evt_p50", "evt_p99", "heap_kb", "cpu_us", "mod_cpu");
+    printf("%7u %9.2f %9.2f %9.1f %8.0f %9.2f %6u %9.2f %9.2f %9.1f %9.1f %9.1f\n", r.modules, cycle_ms, r.cycle_us_max / 1000.0,
+      (double) r.packets / cycles, (double) r.bytes / cycles, (double) r.lost / cycles, r.event_count,
+      r.event_p50_us / 1000.0, r.event_p99_us / 1000.0, r.master_heap / 1024.0, r.cpu_ns / 1000.0 / cycles,
+      r.module_cpu_ns / 1000.0 / cycles);
+  }
+  fflush(stdout);
+}
+
+static void print_usage() {
+  printf("Usage: mi_simulate [options]\n"
+    "  --modules=10,100,1000    Module counts to simulate, each in a separate run\n"
+    "  --settings=2 --inputs=4 --outputs=4  Variables per module\n"
+    "  --change_rate=0.1        Chance of each output changing in each cycle\n"
+    "  --event_rate=0.01        Chance of each module having an output event in each cycle\n"
+    "  --cycles=20              Transfer cycles to measure for each module count\n"
+    "  --latency_us=1000 --jitter_us=200 --loss=0  Module links, in each direction\n"
+    "  --bytes_per_second=0     Bandwidth of the master link, 0 for unlimited\n"
+    "  --seed=1                 Seed for changes, events, jitter and loss\n"
+    "  --json                   Write results as JSON\n");
+}
+
+int main(int argc, char *argv[]) {
+  SimulationConfig config;
+  config.module_link.latency_us = 1000;
+  config.module_link.jitter_us = 200;
+  uint32_t cycles = 20;
+  bool json = false;
+  const char *module_counts = "10,100,1000";
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i], *v = strchr(a, '=');
+    v = v ? v + 1 : "";
+    if (strncmp(a, "--modules=", 10) == 0) module_counts = v;
+    else if (strncmp(a, "--settings=", 11) == 0) config.settings = (uint8_t) atoi(v);
+    else if (strncmp(a, "--inputs=", 9) == 0) config.inputs = (uint8_t) atoi(v);
+    else if (strncmp(a, "--outputs=", 10) == 0) config.outputs = (uint8_t) atoi(v);
+    else if (strncmp(a, "--change_rate=", 14) == 0) config.change_rate = (float) atof(v);
+    else if (strncmp(a, "--event_rate=", 13) == 0) config.event_rate = (float) atof(v);
+    else if (strncmp(a, "--cycles=", 9) == 0) cycles = (uint32_t) atol(v);
+    else if (strncmp(a, "--latency_us=", 13) == 0) config.module_link.latency_us = (uint32_t) atol(v);
+    else if (strncmp(a, "--jitter_us=", 12) == 0) config.module_link.jitter_us = (uint32_t) atol(v);
+    else if (strncmp(a, "--loss=", 7) == 0) config.module_link.loss = (float) atof(v);
+    else if (strncmp(a, "--bytes_per_second=", 19) == 0) config.master_link.bytes_per_second = (uint32_t) atol(v);
+    else if (strncmp(a, "--seed=", 7) == 0) config.seed = (uint32_t) atol(v);
+    else if (strcmp(a, "--json") == 0) json = true;
+    else { print_usage(); return 1; }
+  }
+
+  if (json) printf("{\n  \"results\": [");
+  bool first = true, ok = true;
+  for (const char *p = module_counts; *p; ) {
+    long count = atol(p);
+    if (count < 1 || count > SIMULATE_MAX_MODULES) {
+      fprintf(stderr, "Module count must be 1-%d\n", SIMULATE_MAX_MODULES);
+      return 1;
+    }
+    config.modules = (uint16_t) count;
+    SimulationResult result;
+    if (!simulate(config, cycles, result)) {
+      fprintf(stderr, "%u modules: contracts not received within %ds\n", (unsigned) config.modules, SIMULATE_MAX_WARMUP_S);
+      ok = false;
+    }
+    print_result(result, json, first);
+    first = false;
+    p = strchr(p, ',');
+    if (!p) break;
+    p++;
+  }
+  if (json) printf("\n  ]\n}\n");
+  return ok ? 0 : 1;
+}
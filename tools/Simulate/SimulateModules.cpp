@@ -0,0 +1,128 @@
+/* The virtual modules of the simulator.
+   The module code is placed in its own namespace to keep it apart from the master code in the same program.
+   Everything it includes from outside the library must be included before the namespace.
+*/
+
+#include "Simulate.h"
+
+namespace sim_module {
+#include <MIModule.h>
+}
+using namespace sim_module;
+
+struct VirtualModule {
+  SimulatedLink link;
+  char *settings_contract = NULL, *inputs_contract = NULL, *outputs_contract = NULL;
+  PJONModuleInterface *mi = NULL;
+
+  VirtualModule(SimulatedBus &bus, const uint8_t id, const uint8_t *bus_id) : link(bus, id, bus_id) { }
+  ~VirtualModule() {
+    delete mi;
+    delete[] settings_contract;
+    delete[] inputs_contract;
+    delete[] outputs_contract;
+  }
+
+  // All modules share the library's pointers to the contract strings, so they must be set to
+  // those of the module before running any code of the module
+  void select() {
+    mi_settings_contract = settings_contract;
+    mi_inputs_contract = inputs_contract;
+    mi_outputs_contract = outputs_contract;
+  }
+};
+
+static VirtualModule **modules = NULL;
+static uint16_t module_count = 0;
+static SimulationConfig config;
+static uint32_t random_state = 1;
+static uint64_t module_cpu_ns = 0;
+static uint8_t depth = 0; // Module code is entered recursively when a module receives during a send
+
+// Variables are named like "S0" and "O0", and inputs like "abO0" with the prefix of the source module.
+// The types alternate between uint16 and float.
+static char *create_contract(const char *name_prefix, const char name, const uint8_t count) {
+  char *contract = new char[(uint16_t) count * (MVAR_MAX_NAME_LENGTH + 5) + 1], *p = contract;
+  *p = 0;
+  for (uint8_t i = 0; i < count; i++)
+    p += sprintf(p, "%s%s%c%d:%s", i ? " " : "", name_prefix, name, i, i % 2 ? "f4" : "u2");
+  return contract;
+}
+
+static void set_output(PJONModuleInterface &mi, const uint8_t ix) {
+  if (ix % 2) {
+    float value = simulate_random(random_state) * 1000.0f;
+    mi.outputs.set_value(ix, &value, 4);
+  } else {
+    uint16_t value = (uint16_t) (simulate_random(random_state) * 65535.0f);
+    mi.outputs.set_value(ix, &value, 2);
+  }
+}
+
+// Handle received packets, measuring the time spent in module code
+static void receiver_function(uint8_t *payload, uint16_t length, const PJON_Packet_Info &packet_info) {
+  VirtualModule *vm = (VirtualModule*) packet_info.custom_pointer;
+  uint64_t start = depth == 0 ? simulate_cpu_ns() : 0;
+  depth++;
+  // Restore the contracts of the module running when this was called afterwards
+  const char *settings = mi_settings_contract, *inputs = mi_inputs_contract, *outputs = mi_outputs_contract;
+  vm->select();
+  vm->mi->handle_message(payload, length, packet_info);
+  mi_settings_contract = settings;
+  mi_inputs_contract = inputs;
+  mi_outputs_contract = outputs;
+  depth--;
+  if (depth == 0) module_cpu_ns += simulate_cpu_ns() - start;
+}
+
+void simulate_create_modules(SimulatedBus &bus, const SimulationConfig &simulation_config) {
+  config = simulation_config;
+  random_state = config.seed ? config.seed : 1;
+  module_cpu_ns = 0;
+  module_count = config.modules;
+  modules = new VirtualModule*[module_count];
+  for (uint16_t m = 0; m < module_count; m++) {
+    uint8_t id, bus_id[4];
+    char name[MAX_MODULE_NAME_LENGTH + 1], source_prefix[3];
+    simulate_get_address(m, id, bus_id);
+    simulate_get_prefix((uint16_t) ((m + 1) % module_count), source_prefix);
+    snprintf(name, sizeof name, "M%d", m);
+    VirtualModule *vm = modules[m] = new VirtualModule(bus, id, bus_id);
+    vm->link.set_config(config.module_link);
+    vm->settings_contract = create_contract("", 'S', config.settings);
+    vm->inputs_contract = create_contract(source_prefix, 'O', MI_min(config.inputs, config.outputs));
+    vm->outputs_contract = create_contract("", 'O', config.outputs);
+    vm->mi = new PJONModuleInterface(name, vm->link, vm->settings_contract, vm->inputs_contract, vm->outputs_contract);
+    vm->link.set_receiver(receiver_function, vm);
+    for (uint8_t o = 0; o < config.outputs; o++) set_output(*vm->mi, o);
+    vm->mi->outputs.set_updated();
+  }
+}
+
+void simulate_delete_modules() {
+  for (uint16_t m = 0; m < module_count; m++) delete modules[m];
+  delete[] modules;
+  modules = NULL;
+  module_count = 0;
+}
+
+void simulate_update_modules() {
+  uint64_t start = simulate_cpu_ns();
+  depth++;
+  for (uint16_t m = 0; m < module_count; m++) {
+    VirtualModule *vm = modules[m];
+    vm->select();
+    for (uint8_t o = 0; o < config.outputs; o++)
+      if (simulate_random(random_state) < config.change_rate) set_output(*vm->mi, o);
+    if (config.outputs > 0 && simulate_random(random_state) < config.event_rate) {
+      uint8_t o = (uint8_t) (simulate_random(random_state) * config.outputs);
+      set_output(*vm->mi, o);
+      vm->mi->outputs.set_event(o);
+    }
+    vm->mi->update();
+  }
+  depth--;
+  module_cpu_ns += simulate_cpu_ns() - start;
+}
+
+uint64_t simulate_get_module_cpu_ns() { return module_cpu_ns; }